@@ -0,0 +1,215 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <unordered_set>
+#include <algorithm>
+#include <bitset>
+#include <functional>
+#include <cstring>
+#include <windows.h>
+
+#include "Benchmark.h"
+#include "BenchmarkHarness.h"
+#include "FloppyImage.h"
+#include "FatTable.h"
+#include "ClusterAllocator.h"
+#include "DirectoryIndex.h"
+#include "Smf.h"
+#include "MidiImage.h"
+#include "TextFile.h"
+#include "WinHelp.h"
+
+// A full root directory: every entry but the volume label
+const int BENCH_MANY_FILES = (int)FLOPPY_ROOT_DIR_ENTRIES - 1;
+const DWORD BENCH_SMALL_FILE_SIZE = 4 * 1024;
+const DWORD BENCH_LARGE_FILE_SIZE = 1024 * 1024;
+
+bool CreateWorkloadFiles(const std::wstring& dir, const std::vector<std::wstring>& names, DWORD size, std::vector<std::wstring>& paths);
+void DeleteWorkloadFiles(const std::vector<std::wstring>& paths);
+
+bool RunBenchmarks(const std::wstring& resultsPath, bool overwrite)
+{
+	// Scratch MIDI files for the builder to read
+	wchar_t tempPath[MAX_PATH];
+	if (0 == GetTempPathW(MAX_PATH, tempPath))
+	{
+		std::wcerr << L"Failed to find the temporary directory." << std::endl;
+		ReportError(GetLastError());
+		return false;
+	}
+	std::wstring workDir = std::wstring(tempPath) + L"PianoDiscBench" + std::to_wstring(GetCurrentProcessId());
+	if (!CreateDirectoryW(workDir.c_str(), NULL))
+	{
+		std::wcerr << L"Failed to create directory: " << workDir << std::endl;
+		ReportError(GetLastError());
+		return false;
+	}
+
+	// Distinct names, and names that all shorten to the same 8.3 name
+	std::vector<std::wstring> distinctNames;
+	std::vector<std::wstring> collidingNames;
+	for (int i = 0; i < BENCH_MANY_FILES; ++i)
+	{
+		wchar_t number[8];
+		swprintf(number, 8, L"%03d", i);
+		distinctNames.push_back(std::wstring(L"S") + number + L".mid");
+		collidingNames.push_back(std::wstring(L"Rhapsody in Blue (Take ") + number + L").mid");
+	}
+
+	std::vector<std::wstring> largePaths, distinctPaths, collidingPaths;
+	bool result = CreateWorkloadFiles(workDir, { L"Large.mid" }, BENCH_LARGE_FILE_SIZE, largePaths)
+		&& CreateWorkloadFiles(workDir, distinctNames, BENCH_SMALL_FILE_SIZE, distinctPaths)
+		&& CreateWorkloadFiles(workDir, collidingNames, BENCH_SMALL_FILE_SIZE, collidingPaths);
+
+	LPBYTE pImage = (LPBYTE)VirtualAlloc(NULL, FLOPPY_IMAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+	// Check that every build works before timing it
+	if (result)
+	{
+		result = MidiToImage(largePaths, pImage) && MidiToImage(distinctPaths, pImage) && MidiToImage(collidingPaths, pImage);
+		if (!result)
+		{
+			std::wcerr << L"Failed to build the benchmark images." << std::endl;
+		}
+	}
+
+	std::vector<BenchResult> results;
+	if (result)
+	{
+		ReportHeader();
+
+		results.push_back(Measure(L"FormatImage", L"image", 1, [&]() {
+			FormatImage(pImage);
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"MidiToImage/1 file of 1 MB", L"file", 1, [&]() {
+			MidiToImage(largePaths, pImage);
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"MidiToImage/223 files of 4 KB", L"file", BENCH_MANY_FILES, [&]() {
+			MidiToImage(distinctPaths, pImage);
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"MidiToImage/223 files of 4 KB, colliding names", L"file", BENCH_MANY_FILES, [&]() {
+			MidiToImage(collidingPaths, pImage);
+		}));
+		ReportResult(results.back());
+
+		// Every name but one is taken: the worst case for making a name unique
+		DirectoryIndex collidingIndex;
+		collidingIndex.Load(pImage);
+		char baseName[11];
+		To8dot3Filename(collidingNames.back().c_str(), baseName);
+		results.push_back(Measure(L"Uniquify8dot3Filename/222 collisions", L"name", 1, [&]() {
+			char filename[11];
+			memcpy(filename, baseName, sizeof(filename));
+			Uniquify8dot3Filename(filename, collidingIndex);
+			benchSink += (unsigned char)filename[7];
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"Uniquify8dot3Filename/no collision", L"name", 1, [&]() {
+			char filename[11];
+			memcpy(filename, "NOTTAKENMID", sizeof(filename));
+			Uniquify8dot3Filename(filename, collidingIndex);
+			benchSink += (unsigned char)filename[7];
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"To8dot3Filename", L"name", collidingPaths.size(), [&]() {
+			char filename[11];
+			for (const auto& path : collidingPaths)
+			{
+				To8dot3Filename(path.c_str(), filename);
+				benchSink += (unsigned char)filename[0];
+			}
+		}));
+		ReportResult(results.back());
+
+		// Two files whose clusters alternate across the whole disk
+		FormatImage(pImage);
+		FragmentFat(pImage);
+		const unsigned int dataAus = (unsigned int)FLOPPY_DATA_AU_PER_DISK;
+		results.push_back(Measure(L"GetFAT/fragmented FAT", L"entry", dataAus, [&]() {
+			unsigned int sum = 0;
+			for (unsigned int au = FLOPPY_FIRST_DATA_AU; au < FLOPPY_END_DATA_AU; ++au)
+				sum += GetFAT(pImage, au);
+			benchSink += sum;
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"PutFAT/fragmented FAT", L"entry", dataAus, [&]() {
+			FragmentFat(pImage);
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"ClusterAllocator.Load/fragmented FAT", L"image", 1, [&]() {
+			ClusterAllocator allocator;
+			allocator.Load(pImage);
+			benchSink += allocator.FreeCount();
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"HasFloppyImageHeader", L"image", 1, [&]() {
+			benchSink += HasFloppyImageHeader(pImage) ? 1 : 0;
+		}));
+		ReportResult(results.back());
+	}
+
+	VirtualFree(pImage, 0, MEM_RELEASE);
+	DeleteWorkloadFiles(largePaths);
+	DeleteWorkloadFiles(distinctPaths);
+	DeleteWorkloadFiles(collidingPaths);
+	RemoveDirectoryW(workDir.c_str());
+
+	if (!result)
+	{
+		return false;
+	}
+	std::wcout << L"Saving results to: " << resultsPath << std::endl;
+	return TextFileWrite(resultsPath, ResultsToJson(results, L"  \"builderVersion\": " + std::to_wstring(BUILDER_VERSION) + L",\n"), overwrite);
+}
+
+bool CreateWorkloadFiles(const std::wstring& dir, const std::vector<std::wstring>& names, DWORD size, std::vector<std::wstring>& paths)
+{
+	// Content doesn't matter to the builder; a MIDI header and non-zero filler will do
+	std::vector<BYTE> content(size);
+	for (DWORD i = 0; i < size; ++i)
+		content[i] = (BYTE)(i * 7 + 1);
+	memcpy(content.data(), "MThd", 4);
+
+	for (const auto& name : names)
+	{
+		std::wstring path = dir + L"\\" + name;
+		HANDLE hFile = CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+		{
+			std::wcerr << L"Failed to create file: " << path << std::endl;
+			ReportError(GetLastError());
+			return false;
+		}
+		paths.push_back(path);
+		DWORD bytesWritten;
+		if (!WriteFile(hFile, content.data(), size, &bytesWritten, NULL) || bytesWritten != size)
+		{
+			DWORD hResult = GetLastError();
+			CloseHandle(hFile);
+			std::wcerr << L"Failed to write file: " << path << std::endl;
+			ReportError(hResult);
+			return false;
+		}
+		CloseHandle(hFile);
+	}
+	return true;
+}
+
+void DeleteWorkloadFiles(const std::vector<std::wstring>& paths)
+{
+	for (const auto& path : paths)
+		DeleteFileW(path.c_str());
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Time the image builder's inner loops on synthetic workloads and print the results.
+// They are also saved as JSON to resultsPath so that runs can be compared.
+extern bool RunBenchmarks(const std::wstring& resultsPath, bool overwrite);
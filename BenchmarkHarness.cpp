@@ -0,0 +1,92 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+
+#include "WinTypes.h"
+#include "BenchmarkHarness.h"
+#include "FloppyImage.h"
+#include "FatTable.h"
+#include "CpuFeatures.h"
+
+volatile unsigned int benchSink = 0;
+
+BenchResult Measure(const wchar_t* name, const wchar_t* unit, uint64_t operationsPerCall, const std::function<void()>& body)
+{
+	auto timeCalls = [&](uint64_t calls) -> double
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < calls; ++i)
+			body();
+		auto end = std::chrono::steady_clock::now();
+		return std::chrono::duration<double>(end - start).count();
+	};
+
+	// Warm up, then double the calls until a sample is long enough to time reliably
+	body();
+	uint64_t calls = 1;
+	while (timeCalls(calls) < BENCH_MIN_SAMPLE_SECONDS)
+		calls *= 2;
+
+	std::vector<double> samples;
+	for (int i = 0; i < BENCH_SAMPLES; ++i)
+		samples.push_back(timeCalls(calls) * 1e9 / (double)(calls * operationsPerCall));
+	std::sort(samples.begin(), samples.end());
+
+	BenchResult result;
+	result.name = name;
+	result.unit = unit;
+	result.operations = calls * operationsPerCall;
+	result.medianNs = samples[samples.size() / 2];
+	result.minNs = samples.front();
+	return result;
+}
+
+void ReportHeader()
+{
+	std::wcout << std::left << std::setw(48) << L"Benchmark" << std::right << std::setw(14) << L"Median ns/op" << std::setw(14) << L"Min ns/op" << L"  Per" << std::endl;
+}
+
+void ReportResult(const BenchResult& result)
+{
+	std::wcout << std::left << std::setw(48) << result.name << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(14) << result.medianNs << std::setw(14) << result.minNs << L"  " << result.unit << std::endl;
+}
+
+void FragmentFat(LPBYTE pImage)
+{
+	for (unsigned int au = FLOPPY_FIRST_DATA_AU; au < FLOPPY_END_DATA_AU; ++au)
+		PutFAT(pImage, au, (au + 2 < FLOPPY_END_DATA_AU) ? au + 2 : 0xFFF);
+}
+
+std::wstring ResultsToJson(const std::vector<BenchResult>& results, const std::wstring& fields)
+{
+	std::wostringstream json;
+	json << std::fixed << std::setprecision(1);
+	json << L"{\n";
+	json << fields;
+#if defined(CPU_X86)
+	json << L"  \"cpu\": { \"ssse3\": " << (CpuHasSsse3() ? L"true" : L"false")
+		<< L", \"sse42\": " << (CpuHasSse42() ? L"true" : L"false")
+		<< L", \"avx2\": " << (CpuHasAvx2() ? L"true" : L"false") << L" },\n";
+#elif defined(CPU_ARM64)
+	json << L"  \"cpu\": { \"crc32\": " << (CpuHasCrc32() ? L"true" : L"false") << L" },\n";
+#endif
+	json << L"  \"samples\": " << BENCH_SAMPLES << L",\n";
+	json << L"  \"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const BenchResult& result = results[i];
+		json << L"    { \"name\": \"" << result.name << L"\", \"unit\": \"" << result.unit
+			<< L"\", \"operations\": " << result.operations
+			<< L", \"medianNs\": " << result.medianNs << L", \"minNs\": " << result.minNs << L" }"
+			<< (i + 1 < results.size() ? L"," : L"") << L"\n";
+	}
+	json << L"  ]\n";
+	json << L"}\n";
+	return json.str();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Timing shared by -bench (Benchmark.cpp) and the standalone kernel benchmark
+// (KernelBenchmark.cpp). Each benchmark is repeated until a sample takes at least
+// BENCH_MIN_SAMPLE_SECONDS, and BENCH_SAMPLES samples are taken. The median is the figure
+// to compare between runs; the minimum shows how noisy the machine was.
+const double BENCH_MIN_SAMPLE_SECONDS = 0.05;
+const int BENCH_SAMPLES = 7;
+
+struct BenchResult
+{
+	std::wstring name;
+	std::wstring unit; // What one operation is
+	uint64_t operations; // Per sample
+	double medianNs; // Per operation
+	double minNs;
+};
+
+// Keeps the compiler from discarding results that are otherwise unused
+extern volatile unsigned int benchSink;
+
+// Time body, which does operationsPerCall operations each time it's called
+extern BenchResult Measure(const wchar_t* name, const wchar_t* unit, uint64_t operationsPerCall, const std::function<void()>& body);
+
+// Print a table of results as they come, headed by ReportHeader
+extern void ReportHeader();
+extern void ReportResult(const BenchResult& result);
+
+// Workload for the FAT: link every data cluster of a 1.44 MB image into one of two chains
+// that alternate cluster by cluster
+extern void FragmentFat(LPBYTE pImage);
+
+// The results as JSON, along with the SIMD features used. fields are lines of JSON to put
+// first, each ending in a comma and a newline.
+extern std::wstring ResultsToJson(const std::vector<BenchResult>& results, const std::wstring& fields);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Raw, unbuffered access to a thumb drive or to a file laid out like one.
+// Offsets and lengths must be multiples of the 512-byte block size and buffers page
+// aligned (VirtualAlloc on Windows, posix_memalign elsewhere).
+// The tool builds only on Windows and uses BlockDeviceWin32.cpp. BlockDevicePosix.cpp is
+// built for Linux by CMakeLists.txt, into the kernel benchmark, whose -drive option times it.
+class BlockDevice
+{
+public:
+	virtual ~BlockDevice() {}
+
+	// Positional I/O. Safe to call from several threads at once.
+	virtual bool Read(uint64_t offset, size_t length, void* pBuffer) = 0;
+	virtual bool Write(uint64_t offset, size_t length, const void* pBuffer) = 0;
+	virtual bool Flush() = 0;
+
+	// Make the next reads of a range come from the device rather than from a cache of what
+	// was written to it, so that they check what it really holds. Nothing to do when I/O
+	// bypasses the cache. Returns false (reported) if it can't be done.
+	virtual bool DropCache(uint64_t offset, uint64_t length) = 0;
+
+	// Whether the device is a file that can hold holes. Reads of a hole cost nothing and
+	// WriteZeros deallocates rather than writes, so runs of zeros are best left to it.
+	virtual bool IsSparse() = 0;
+
+	// Zero a range: punched out of a sparse file, written elsewhere
+	virtual bool WriteZeros(uint64_t offset, uint64_t length) = 0;
+
+	// Size in bytes, or 0 if it can't be determined
+	virtual uint64_t Size() = 0;
+};
+
+// How a drive is opened. Only a drive opened for writing is changed in any way (an image
+// file made sparse, a volume locked). With exclusive, nothing else may use the drive until
+// it is closed: On Windows a volume is locked and dismounted; elsewhere the device is
+// opened O_EXCL, or a file flock'ed.
+enum BlockDeviceAccess
+{
+	BLOCK_DEVICE_READ,
+	BLOCK_DEVICE_WRITE,
+	BLOCK_DEVICE_WRITE_EXCLUSIVE
+};
+
+// Open a drive by name: a drive letter alone (Windows), or the path of a device such as
+// /dev/sdb or \\.\PhysicalDrive2, or of a whole-drive image file.
+// Errors are reported here. Returns NULL on failure; delete the device to close it.
+extern BlockDevice* BlockDeviceOpen(const std::wstring& name, BlockDeviceAccess access);
+
+#if !defined(_WIN32)
+// Paths are passed to POSIX calls as UTF-8. Bytes that aren't valid UTF-8 decode as U+FFFD.
+extern std::string ToUtf8(const std::wstring& text);
+extern std::wstring FromUtf8(const std::string& text);
+#endif
@@ -0,0 +1,328 @@
+#if !defined(_WIN32)
+
+#include <iostream>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#endif
+
+#include "BlockDevice.h"
+#include "RunStats.h"
+
+const size_t ZERO_BUFFER_SIZE = 0x10000;
+
+class PosixBlockDevice : public BlockDevice
+{
+public:
+	PosixBlockDevice(int fd, bool direct, bool sparse) : m_fd(fd), m_direct(direct), m_sparse(sparse) {}
+
+	~PosixBlockDevice() override
+	{
+		close(m_fd); // Also releases any flock
+	}
+
+	bool Read(uint64_t offset, size_t length, void* pBuffer) override
+	{
+		StatTimer timer(STAGE_DEVICE_IO);
+#if defined(SEEK_DATA)
+		// Only read the parts of a file that hold data; holes are zeros
+		if (m_sparse)
+		{
+			uint64_t end = offset + length;
+			uint64_t position = offset;
+			while (position < end)
+			{
+				StatAdd(STAT_IO_CALLS);
+				off_t data = lseek(m_fd, (off_t)position, SEEK_DATA);
+				if (data < 0)
+				{
+					// ENXIO: Nothing but a hole (or the end of the file) follows. Anything
+					// else: Holes can't be found here. Either way read what remains.
+					return ReadRange(position, (size_t)(end - position), (char*)pBuffer + (position - offset));
+				}
+				uint64_t dataStart = std::min<uint64_t>((uint64_t)data, end);
+				memset((char*)pBuffer + (position - offset), 0, (size_t)(dataStart - position));
+				if (dataStart == end) break;
+
+				StatAdd(STAT_IO_CALLS);
+				off_t hole = lseek(m_fd, data, SEEK_HOLE);
+				uint64_t dataEnd = (hole < 0) ? end : std::min<uint64_t>((uint64_t)hole, end);
+				if (!ReadRange(dataStart, (size_t)(dataEnd - dataStart), (char*)pBuffer + (dataStart - offset)))
+				{
+					return false;
+				}
+				position = dataEnd;
+			}
+			return true;
+		}
+#endif
+		return ReadRange(offset, length, pBuffer);
+	}
+
+	bool Write(uint64_t offset, size_t length, const void* pBuffer) override
+	{
+		StatTimer timer(STAGE_DEVICE_IO);
+		size_t done = 0;
+		while (done < length)
+		{
+			StatAdd(STAT_IO_CALLS);
+			bool direct = m_direct;
+			ssize_t count = pwrite(m_fd, (const char*)pBuffer + done, length - done, (off_t)(offset + done));
+			if (count < 0 && errno == EINTR) continue;
+			if (count < 0 && errno == EINVAL && DropDirect(direct)) continue;
+			if (count <= 0)
+			{
+				std::wcerr << L"Failed to write to drive: " << strerror(count < 0 ? errno : EIO) << std::endl;
+				return false;
+			}
+			StatAdd(STAT_BYTES_WRITTEN, (uint64_t)count);
+			done += (size_t)count;
+		}
+		return true;
+	}
+
+	bool IsSparse() override
+	{
+		return m_sparse;
+	}
+
+	bool WriteZeros(uint64_t offset, uint64_t length) override
+	{
+#if defined(FALLOC_FL_PUNCH_HOLE)
+		// Falls through to writing zeros where the file system can't punch holes
+		if (m_sparse)
+		{
+			StatTimer timer(STAGE_DEVICE_IO);
+			StatAdd(STAT_IO_CALLS);
+			if (fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)length) == 0)
+			{
+				return true;
+			}
+		}
+#endif
+		alignas(4096) static const char zeros[ZERO_BUFFER_SIZE] = {};
+		for (uint64_t done = 0; done < length; )
+		{
+			size_t chunk = (size_t)std::min<uint64_t>(ZERO_BUFFER_SIZE, length - done);
+			if (!Write(offset + done, chunk, zeros))
+			{
+				return false;
+			}
+			done += chunk;
+		}
+		return true;
+	}
+
+	bool Flush() override
+	{
+		StatTimer timer(STAGE_DEVICE_IO);
+		StatAdd(STAT_IO_CALLS);
+		if (fsync(m_fd) != 0)
+		{
+			std::wcerr << L"Failed to flush drive: " << strerror(errno) << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	bool DropCache(uint64_t offset, uint64_t length) override
+	{
+		if (m_direct) return true;
+#if defined(POSIX_FADV_DONTNEED)
+		// Buffered since DropDirect, or since open. Only clean pages can be dropped, so
+		// write back the dirty ones first.
+		StatTimer timer(STAGE_DEVICE_IO);
+		StatAdd(STAT_IO_CALLS, 2);
+		if (fsync(m_fd) != 0)
+		{
+			std::wcerr << L"Failed to flush drive: " << strerror(errno) << std::endl;
+			return false;
+		}
+		int error = posix_fadvise(m_fd, (off_t)offset, (off_t)length, POSIX_FADV_DONTNEED);
+		if (error != 0)
+		{
+			std::wcerr << L"Failed to drop cached blocks of drive: " << strerror(error) << std::endl;
+			return false;
+		}
+		return true;
+#else
+		(void)offset;
+		(void)length;
+		std::wcerr << L"Drive is read through the cache, so what was written to it can't be checked." << std::endl;
+		return false;
+#endif
+	}
+
+	uint64_t Size() override
+	{
+		struct stat info;
+		if (fstat(m_fd, &info) != 0)
+		{
+			std::wcerr << L"Failed to get drive size: " << strerror(errno) << std::endl;
+			return 0;
+		}
+#if defined(BLKGETSIZE64)
+		if (S_ISBLK(info.st_mode))
+		{
+			uint64_t size;
+			if (ioctl(m_fd, BLKGETSIZE64, &size) != 0)
+			{
+				std::wcerr << L"Failed to get drive size: " << strerror(errno) << std::endl;
+				return 0;
+			}
+			return size;
+		}
+#endif
+		return (uint64_t)info.st_size;
+	}
+
+private:
+	bool ReadRange(uint64_t offset, size_t length, void* pBuffer)
+	{
+		size_t done = 0;
+		while (done < length)
+		{
+			StatAdd(STAT_IO_CALLS);
+			bool direct = m_direct;
+			ssize_t count = pread(m_fd, (char*)pBuffer + done, length - done, (off_t)(offset + done));
+			if (count < 0 && errno == EINTR) continue;
+			if (count < 0 && errno == EINVAL && DropDirect(direct)) continue;
+			if (count < 0)
+			{
+				std::wcerr << L"Failed to read from drive: " << strerror(errno) << std::endl;
+				return false;
+			}
+			if (count == 0)
+			{
+				std::wcerr << L"Failed to read full blocks from drive." << std::endl;
+				return false;
+			}
+			StatAdd(STAT_BYTES_READ, (uint64_t)count);
+			done += (size_t)count;
+		}
+		return true;
+	}
+
+	// Some file systems refuse O_DIRECT, or need larger alignment than a request has.
+	// Fall back to buffered I/O rather than fail. Returns whether a request that failed is
+	// worth trying again: it was made while direct. Threads may get here at once (e.g. the
+	// verifier's reads with the writer's writes), so only the first to clear m_direct
+	// changes the fd's flags; the others just try again.
+	bool DropDirect(bool wasDirect)
+	{
+#if defined(O_DIRECT)
+		if (!wasDirect) return false;
+		if (!m_direct.exchange(false)) return true; // Another thread dropped it
+		return fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT) == 0;
+#else
+		(void)wasDirect;
+		return false;
+#endif
+	}
+
+	int m_fd;
+	std::atomic<bool> m_direct;
+	bool m_sparse;
+};
+
+// Encoded directly rather than with wcstombs, which depends on the locale
+std::string ToUtf8(const std::wstring& text)
+{
+	std::string result;
+	for (wchar_t c : text)
+	{
+		uint32_t code = (uint32_t)c;
+		if (code < 0x80)
+			result += (char)code;
+		else if (code < 0x800)
+			result += { (char)(0xC0 | (code >> 6)), (char)(0x80 | (code & 0x3F)) };
+		else if (code < 0x10000)
+			result += { (char)(0xE0 | (code >> 12)), (char)(0x80 | ((code >> 6) & 0x3F)), (char)(0x80 | (code & 0x3F)) };
+		else
+			result += { (char)(0xF0 | (code >> 18)), (char)(0x80 | ((code >> 12) & 0x3F)), (char)(0x80 | ((code >> 6) & 0x3F)), (char)(0x80 | (code & 0x3F)) };
+	}
+	return result;
+}
+
+std::wstring FromUtf8(const std::string& text)
+{
+	std::wstring result;
+	size_t i = 0;
+	while (i < text.length())
+	{
+		uint8_t lead = (uint8_t)text[i];
+		size_t length = (lead < 0x80) ? 1 : (lead >= 0xC2 && lead < 0xE0) ? 2 : (lead >= 0xE0 && lead < 0xF0) ? 3 : (lead >= 0xF0 && lead < 0xF5) ? 4 : 0;
+		uint32_t code = (length == 1) ? lead : (length == 2) ? (lead & 0x1F) : (length == 3) ? (lead & 0x0F) : (lead & 0x07);
+		size_t n = 1;
+		for (; n < length && i + n < text.length() && ((uint8_t)text[i + n] & 0xC0) == 0x80; ++n)
+		{
+			code = (code << 6) | ((uint8_t)text[i + n] & 0x3F);
+		}
+
+		// Overlong forms, surrogates and values past U+10FFFF are as invalid as a bad lead byte
+		bool valid = (length != 0 && n == length) &&
+			!(length == 3 && (code < 0x800 || (code >= 0xD800 && code < 0xE000))) &&
+			!(length == 4 && (code < 0x10000 || code > 0x10FFFF));
+		result += valid ? (wchar_t)code : L'\xFFFD';
+		i += (length == 0) ? 1 : n;
+	}
+	return result;
+}
+
+BlockDevice* BlockDeviceOpen(const std::wstring& name, BlockDeviceAccess access)
+{
+	std::string path = ToUtf8(name);
+
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+	{
+		std::wcerr << L"Failed to open drive: " << name << L": " << strerror(errno) << std::endl;
+		return NULL;
+	}
+
+	// O_EXCL on a block device fails if it's mounted or open elsewhere exclusively
+	bool exclusive = (access == BLOCK_DEVICE_WRITE_EXCLUSIVE);
+	int flags = ((access == BLOCK_DEVICE_READ) ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+	if (exclusive && S_ISBLK(info.st_mode)) flags |= O_EXCL;
+
+	bool direct = false;
+	int fd = -1;
+#if defined(O_DIRECT)
+	fd = open(path.c_str(), flags | O_DIRECT);
+	direct = (fd >= 0);
+#endif
+	if (fd < 0)
+	{
+		fd = open(path.c_str(), flags);
+	}
+	if (fd < 0)
+	{
+		std::wcerr << L"Failed to open drive: " << name << L": " << strerror(errno) << std::endl;
+		return NULL;
+	}
+#if defined(F_NOCACHE)
+	direct = (fcntl(fd, F_NOCACHE, 1) != -1); // macOS has no O_DIRECT
+#endif
+
+	if (exclusive && !S_ISBLK(info.st_mode) && flock(fd, LOCK_EX | LOCK_NB) != 0)
+	{
+		std::wcerr << L"Drive is in use: " << name << std::endl;
+		close(fd);
+		return NULL;
+	}
+
+	return new PosixBlockDevice(fd, direct, S_ISREG(info.st_mode));
+}
+
+#endif
@@ -0,0 +1,266 @@
+#if defined(_WIN32)
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <windows.h>
+
+#include "BlockDevice.h"
+#include "WinHelp.h"
+#include "RunStats.h"
+
+const size_t ZERO_BUFFER_SIZE = 0x10000;
+const DWORD MAX_ALLOCATED_RANGES = 64;
+
+class Win32BlockDevice : public BlockDevice
+{
+public:
+	Win32BlockDevice(HANDLE hDevice, bool locked, bool sparse) : m_hDevice(hDevice), m_locked(locked), m_sparse(sparse) {}
+
+	~Win32BlockDevice() override
+	{
+		if (m_locked)
+		{
+			DWORD bytesReturned;
+			if (!DeviceIoControl(m_hDevice, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &bytesReturned, NULL))
+			{
+				std::wcerr << L"Failed to unlock volume." << std::endl;
+				ReportError(GetLastError());
+			}
+		}
+		CloseHandle(m_hDevice);
+	}
+
+	bool Read(uint64_t offset, size_t length, void* pBuffer) override
+	{
+		StatTimer timer(STAGE_DEVICE_IO);
+
+		// Only read the parts of a sparse file that are allocated; the rest is zeros
+		if (m_sparse)
+		{
+			FILE_ALLOCATED_RANGE_BUFFER query;
+			query.FileOffset.QuadPart = (LONGLONG)offset;
+			query.Length.QuadPart = (LONGLONG)length;
+			FILE_ALLOCATED_RANGE_BUFFER ranges[MAX_ALLOCATED_RANGES];
+			DWORD bytesReturned;
+
+			// Too fragmented to be worth it (ERROR_MORE_DATA) or unsupported: read it all
+			StatAdd(STAT_IO_CALLS);
+			if (DeviceIoControl(m_hDevice, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges, sizeof(ranges), &bytesReturned, NULL))
+			{
+				memset(pBuffer, 0, length);
+				for (DWORD i = 0; i < bytesReturned / sizeof(ranges[0]); ++i)
+				{
+					uint64_t start = (std::max)((uint64_t)ranges[i].FileOffset.QuadPart, offset);
+					uint64_t end = (std::min)((uint64_t)(ranges[i].FileOffset.QuadPart + ranges[i].Length.QuadPart), offset + length);
+					if (start < end && !ReadRange(start, (size_t)(end - start), (char*)pBuffer + (start - offset)))
+					{
+						return false;
+					}
+				}
+				return true;
+			}
+		}
+		return ReadRange(offset, length, pBuffer);
+	}
+
+	bool Write(uint64_t offset, size_t length, const void* pBuffer) override
+	{
+		StatTimer timer(STAGE_DEVICE_IO);
+		StatAdd(STAT_IO_CALLS);
+		OVERLAPPED position = {};
+		position.Offset = (DWORD)offset;
+		position.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD bytesWritten;
+		if (!WriteFile(m_hDevice, pBuffer, (DWORD)length, &bytesWritten, &position))
+		{
+			std::wcerr << L"Failed to write to drive." << std::endl;
+			ReportError(GetLastError());
+			return false;
+		}
+		if (bytesWritten != length)
+		{
+			std::wcerr << L"Failed to write full blocks to drive." << std::endl;
+			return false;
+		}
+		StatAdd(STAT_BYTES_WRITTEN, bytesWritten);
+		return true;
+	}
+
+	bool IsSparse() override
+	{
+		return m_sparse;
+	}
+
+	bool WriteZeros(uint64_t offset, uint64_t length) override
+	{
+		// Deallocates the range of a sparse file
+		if (m_sparse)
+		{
+			StatTimer timer(STAGE_DEVICE_IO);
+			StatAdd(STAT_IO_CALLS);
+			FILE_ZERO_DATA_INFORMATION zeroData;
+			zeroData.FileOffset.QuadPart = (LONGLONG)offset;
+			zeroData.BeyondFinalZero.QuadPart = (LONGLONG)(offset + length);
+			DWORD bytesReturned;
+			if (DeviceIoControl(m_hDevice, FSCTL_SET_ZERO_DATA, &zeroData, sizeof(zeroData), NULL, 0, &bytesReturned, NULL))
+			{
+				return true;
+			}
+		}
+
+		// Unbuffered writes need a sector-aligned buffer
+		alignas(4096) static const char zeros[ZERO_BUFFER_SIZE] = {};
+		for (uint64_t done = 0; done < length; )
+		{
+			size_t chunk = (size_t)(std::min)((uint64_t)ZERO_BUFFER_SIZE, length - done);
+			if (!Write(offset + done, chunk, zeros))
+			{
+				return false;
+			}
+			done += chunk;
+		}
+		return true;
+	}
+
+	bool Flush() override
+	{
+		StatTimer timer(STAGE_DEVICE_IO);
+		StatAdd(STAT_IO_CALLS);
+		if (!FlushFileBuffers(m_hDevice))
+		{
+			std::wcerr << L"Failed to flush drive." << std::endl;
+			ReportError(GetLastError());
+			return false;
+		}
+		return true;
+	}
+
+	bool DropCache(uint64_t offset, uint64_t length) override
+	{
+		// Always opened with FILE_FLAG_NO_BUFFERING
+		(void)offset;
+		(void)length;
+		return true;
+	}
+
+	uint64_t Size() override
+	{
+		// Volumes and disks report their length; files their size
+		GET_LENGTH_INFORMATION lengthInfo;
+		DWORD bytesReturned;
+		if (DeviceIoControl(m_hDevice, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &lengthInfo, sizeof(lengthInfo), &bytesReturned, NULL))
+		{
+			return (uint64_t)lengthInfo.Length.QuadPart;
+		}
+		LARGE_INTEGER fileSize;
+		if (GetFileSizeEx(m_hDevice, &fileSize))
+		{
+			return (uint64_t)fileSize.QuadPart;
+		}
+		std::wcerr << L"Failed to get drive size." << std::endl;
+		ReportError(GetLastError());
+		return 0;
+	}
+
+private:
+	bool ReadRange(uint64_t offset, size_t length, void* pBuffer)
+	{
+		StatAdd(STAT_IO_CALLS);
+		OVERLAPPED position = {};
+		position.Offset = (DWORD)offset;
+		position.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD bytesRead;
+		if (!ReadFile(m_hDevice, pBuffer, (DWORD)length, &bytesRead, &position))
+		{
+			std::wcerr << L"Failed to read from drive." << std::endl;
+			ReportError(GetLastError());
+			return false;
+		}
+		if (bytesRead != length)
+		{
+			std::wcerr << L"Failed to read full blocks from drive." << std::endl;
+			return false;
+		}
+		StatAdd(STAT_BYTES_READ, bytesRead);
+		return true;
+	}
+
+	HANDLE m_hDevice;
+	bool m_locked;
+	bool m_sparse;
+};
+
+BlockDevice* BlockDeviceOpen(const std::wstring& name, BlockDeviceAccess access)
+{
+	// A drive letter alone is a volume
+	bool isVolume = (name.length() == 1);
+	std::wstring path = isVolume ? L"\\\\.\\" + name + L":" : name;
+
+	bool write = (access != BLOCK_DEVICE_READ);
+	bool exclusive = (access == BLOCK_DEVICE_WRITE_EXCLUSIVE);
+	DWORD desiredAccess = write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+	DWORD shareMode = (exclusive && !isVolume) ? 0 : FILE_SHARE_READ | FILE_SHARE_WRITE;
+	HANDLE hDevice = CreateFileW(path.c_str(), desiredAccess, shareMode, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+	if (hDevice == INVALID_HANDLE_VALUE)
+	{
+		std::wcerr << L"Failed to open drive: " << name << (isVolume ? L":" : L"") << std::endl;
+		ReportError(GetLastError());
+		return NULL;
+	}
+	DWORD bytesReturned;
+	if (!isVolume)
+	{
+		// A whole-drive image file being written is made sparse so that runs of zeros can
+		// be holes. Disks (\\.\PhysicalDriveN) and file systems without sparse files refuse.
+		// One only being read is left as it is, and its holes used if it already has them.
+		bool sparse;
+		if (write)
+		{
+			sparse = DeviceIoControl(hDevice, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytesReturned, NULL) != FALSE;
+		}
+		else
+		{
+			BY_HANDLE_FILE_INFORMATION info;
+			sparse = GetFileInformationByHandle(hDevice, &info) && (info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0;
+		}
+		return new Win32BlockDevice(hDevice, false, sparse);
+	}
+
+	// Allow reading and writing beyond the first virtual floppy
+	if (!DeviceIoControl(hDevice, FSCTL_ALLOW_EXTENDED_DASD_IO, NULL, 0, NULL, 0, &bytesReturned, NULL))
+	{
+		std::wcerr << L"Failed to set extended access on drive: " << name << L":" << std::endl;
+		ReportError(GetLastError());
+		CloseHandle(hDevice);
+		return NULL;
+	}
+
+	// Writing a volume's boot sector requires that it be locked and force dismounted
+	if (exclusive)
+	{
+		if (!DeviceIoControl(hDevice, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &bytesReturned, NULL))
+		{
+			std::wcerr << L"Failed to lock volume." << std::endl;
+			ReportError(GetLastError());
+			CloseHandle(hDevice);
+			return NULL;
+		}
+
+		// Unlocked when the device is deleted
+		BlockDevice* pDevice = new Win32BlockDevice(hDevice, true, false);
+		if (!DeviceIoControl(hDevice, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &bytesReturned, NULL))
+		{
+			std::wcerr << L"Failed to dismount volume." << std::endl;
+			ReportError(GetLastError());
+			delete pDevice;
+			return NULL;
+		}
+		return pDevice;
+	}
+
+	return new Win32BlockDevice(hDevice, false, false);
+}
+
+#endif
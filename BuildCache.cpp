@@ -0,0 +1,230 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <bitset>
+#include <algorithm>
+#include <windows.h>
+
+#include "FloppyImage.h"
+#include "Smf.h"
+#include "BuildCache.h"
+#include "Checksum.h"
+#include "ImageFile.h"
+#include "MidiImage.h"
+#include "WinHelp.h"
+
+const size_t CACHE_READ_SIZE = 0x10000;
+
+// Sources read to be hashed are kept for a build on a miss while they total no more than this.
+// Any more couldn't fit on a floppy, even minimized.
+const ULONGLONG CACHE_KEEP_SIZE = 4 * FLOPPY_MAX_IMAGE_SIZE;
+
+bool ComputeCacheKey(const std::vector<std::wstring>& midiPaths, const SmfMinimizeOptions* pMinimize, SmfValidation validation, ULONGLONG* pKey, std::vector<MidiFileData>& files);
+bool HashSourceFile(const std::wstring& path, LPBYTE pBuffer, SmfValidation validation, ULONGLONG* pHash, MidiFileData* pFile);
+bool ReadCacheEntry(const std::wstring& cacheDir, const std::wstring& keyName, LPBYTE pImage);
+
+bool MidiToImageCached(const std::vector<std::wstring>& midiPaths, LPBYTE pImage, const std::wstring& cacheDir, const SmfMinimizeOptions* pMinimize, SmfValidation validation, bool* pCacheHit)
+{
+	*pCacheHit = false;
+
+	ULONGLONG key;
+	std::vector<MidiFileData> files;
+	if (!ComputeCacheKey(midiPaths, pMinimize, validation, &key, files))
+	{
+		return false; // Error already reported
+	}
+	std::wostringstream keyName;
+	keyName << std::hex << std::uppercase << std::setw(16) << std::setfill(L'0') << key;
+
+	// Hit
+	if (ReadCacheEntry(cacheDir, keyName.str(), pImage))
+	{
+		*pCacheHit = true;
+		return true;
+	}
+
+	// Miss: Build it and save it for next time. The files have been validated already, and
+	// unless there was too much to keep, are built from as they were read.
+	bool built = (files.size() == midiPaths.size())
+		? MidiDataToImage(files, pImage, true, pMinimize)
+		: MidiToImage(midiPaths, pImage, true, pMinimize);
+	if (!built)
+	{
+		return false; // Error already reported
+	}
+	if (!CreateDirectoryW(cacheDir.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+	{
+		std::wcerr << L"Failed to create cache directory: " << cacheDir << std::endl;
+		ReportError(GetLastError());
+		return true; // The image itself is fine
+	}
+
+	// Entries are named by key and CRC-32C so that a damaged one is found out when it's read.
+	// Write under a temporary name and rename so that a partial file is never taken for a hit.
+	// Builders on other threads, or in other processes sharing the cache, may be saving the
+	// same image at once, so each writes a name of its own.
+	std::wostringstream entryName;
+	entryName << keyName.str() << L"." << std::hex << std::uppercase << std::setw(8) << std::setfill(L'0') << Crc32c(pImage, FLOPPY_IMAGE_SIZE) << L".img";
+	std::wstring cachePath = cacheDir + L"\\" + entryName.str();
+	std::wstring tempPath = cachePath + L"." + std::to_wstring(GetCurrentProcessId()) + L"." + std::to_wstring(GetCurrentThreadId()) + L".tmp";
+	if (ImageFileWrite(tempPath, pImage, true) && !MoveFileExW(tempPath.c_str(), cachePath.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		// The rename fails if another builder's copy is open for reading. That copy is the
+		// same image, so it's as good as this one.
+		DWORD hResult = GetLastError();
+		DeleteFileW(tempPath.c_str());
+		if (GetFileAttributesW(cachePath.c_str()) == INVALID_FILE_ATTRIBUTES)
+		{
+			std::wcerr << L"Failed to save image to cache: " << cachePath << std::endl;
+			ReportError(hResult);
+		}
+	}
+	return true;
+}
+
+// Look for an entry named <key>.<CRC-32C>.img and check it against its CRC. A damaged
+// entry is a miss, and is deleted so that the rebuilt image replaces it.
+bool ReadCacheEntry(const std::wstring& cacheDir, const std::wstring& keyName, LPBYTE pImage)
+{
+	WIN32_FIND_DATAW found;
+	HANDLE hFind = FindFirstFileW((cacheDir + L"\\" + keyName + L".*.img").c_str(), &found);
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	FindClose(hFind);
+
+	std::wstring entryPath = cacheDir + L"\\" + found.cFileName;
+	wchar_t* end;
+	DWORD checksum = wcstoul(found.cFileName + keyName.length() + 1, &end, 16);
+	if (_wcsicmp(end, L".img") == 0 && ImageFileRead(entryPath, pImage) && Crc32c(pImage, FLOPPY_IMAGE_SIZE) == checksum)
+	{
+		return true;
+	}
+
+	std::wcerr << L"Cached image is damaged and will be rebuilt: " << entryPath << std::endl;
+	DeleteFileW(entryPath.c_str());
+	return false;
+}
+
+// Files are kept in files as they're read, while they total no more than CACHE_KEEP_SIZE
+bool ComputeCacheKey(const std::vector<std::wstring>& midiPaths, const SmfMinimizeOptions* pMinimize, SmfValidation validation, ULONGLONG* pKey, std::vector<MidiFileData>& files)
+{
+	LPBYTE pBuffer = (LPBYTE)VirtualAlloc(NULL, CACHE_READ_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (pBuffer == NULL)
+	{
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
+		return false;
+	}
+
+	DWORD version = BUILDER_VERSION;
+	ULONGLONG key = Fnv1a64((const BYTE*)&version, sizeof(version));
+
+	// Without minimizing the key is as it always was, so existing caches stay good
+	if (pMinimize != NULL)
+	{
+		BYTE options[1 + 128 / 8] = { (BYTE)(pMinimize->keepSysex ? 0x81 : 0x80) };
+		for (size_t type = 0; type < pMinimize->keepMeta.size(); ++type)
+		{
+			if (pMinimize->keepMeta[type]) options[1 + type / 8] |= (BYTE)(1 << (type % 8));
+		}
+		key = Fnv1a64(options, sizeof(options), key);
+	}
+	ULONGLONG kept = 0;
+	bool keep = true;
+	for (const auto& path : midiPaths)
+	{
+		// Only the filename reaches the image so the directory isn't part of the key
+		size_t slash = path.find_last_of(L'\\');
+		std::wstring filename = (slash == std::wstring::npos) ? path : path.substr(slash + 1);
+		key = Fnv1a64((const BYTE*)filename.c_str(), (filename.length() + 1) * sizeof(wchar_t), key);
+
+		// Size, date modified and content
+		ULONGLONG hash;
+		MidiFileData file;
+		if (!HashSourceFile(path, pBuffer, validation, &hash, keep ? &file : NULL))
+		{
+			VirtualFree(pBuffer, 0, MEM_RELEASE);
+			return false; // Error already reported
+		}
+		key = Fnv1a64((const BYTE*)&hash, sizeof(hash), key);
+
+		if (keep)
+		{
+			kept += file.data.size();
+			keep = (kept <= CACHE_KEEP_SIZE);
+			if (keep)
+				files.push_back(std::move(file));
+			else
+				files.clear();
+		}
+	}
+
+	VirtualFree(pBuffer, 0, MEM_RELEASE);
+	*pKey = key;
+	return true;
+}
+
+// With pFile, the file's data and date modified are kept there
+bool HashSourceFile(const std::wstring& path, LPBYTE pBuffer, SmfValidation validation, ULONGLONG* pHash, MidiFileData* pFile)
+{
+	HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		std::wcerr << L"Failed to open source file: " << path << std::endl;
+		ReportError(GetLastError());
+		return false;
+	}
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(hFile, &info))
+	{
+		DWORD hResult = GetLastError();
+		CloseHandle(hFile);
+		std::wcerr << L"Failed to get source file information: " << path << std::endl;
+		ReportError(hResult);
+		return false;
+	}
+	ULONGLONG hash = Fnv1a64((const BYTE*)&info.nFileSizeHigh, sizeof(info.nFileSizeHigh));
+	hash = Fnv1a64((const BYTE*)&info.nFileSizeLow, sizeof(info.nFileSizeLow), hash);
+	hash = Fnv1a64((const BYTE*)&info.ftLastWriteTime, sizeof(info.ftLastWriteTime), hash);
+
+	ULONGLONG fileSize = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	if (pFile != NULL)
+	{
+		pFile->path = path;
+		pFile->lastWriteTime = info.ftLastWriteTime;
+		pFile->data.reserve((size_t)std::min<ULONGLONG>(fileSize, CACHE_KEEP_SIZE + 1));
+	}
+
+	SmfValidator validator(fileSize);
+	for (;;)
+	{
+		DWORD bytesRead;
+		if (!ReadFile(hFile, pBuffer, CACHE_READ_SIZE, &bytesRead, NULL))
+		{
+			DWORD hResult = GetLastError();
+			CloseHandle(hFile);
+			std::wcerr << L"Failed to read source file: " << path << std::endl;
+			ReportError(hResult);
+			return false;
+		}
+		if (bytesRead == 0) break;
+		hash = Fnv1a64(pBuffer, bytesRead, hash);
+		if (pFile != NULL && pFile->data.size() <= CACHE_KEEP_SIZE)
+		{
+			pFile->data.insert(pFile->data.end(), pBuffer, pBuffer + bytesRead);
+		}
+		if (validation != SMF_VALIDATE_NONE)
+		{
+			validator.Add(pBuffer, bytesRead);
+		}
+	}
+
+	CloseHandle(hFile);
+	*pHash = hash;
+	return validation == SMF_VALIDATE_NONE || CheckSmfVerdict(validator, path, validation);
+}
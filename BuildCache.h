@@ -0,0 +1,11 @@
+#pragma once
+
+// Build an image from MIDI files through a content-addressed cache of deterministic images.
+// The key covers each file's name, size, date modified and content, in order, plus
+// BUILDER_VERSION, and the minimize options when the files are minimized (see MidiToImage).
+// On a hit the cached image is read back and the files aren't ingested. With validation, the
+// files are validated as they're read to be hashed, so a hit is checked as a miss is.
+// Each image is saved with its CRC-32C, and one that doesn't match is a miss, and replaced.
+// On a miss the image is built from the files as they were read to be hashed.
+struct SmfMinimizeOptions;
+extern bool MidiToImageCached(const std::vector<std::wstring>& midiPaths, LPBYTE pImage, const std::wstring& cacheDir, const SmfMinimizeOptions* pMinimize, SmfValidation validation, bool* pCacheHit);
@@ -0,0 +1,317 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cwctype>
+#include <windows.h>
+
+#include "FloppyImage.h"
+#include "Catalog.h"
+#include "Checksum.h"
+#include "ImageExtract.h"
+#include "TextFile.h"
+#include "ThumbDriveImage.h"
+#include "WinHelp.h"
+
+// Catalog file format
+// * UTF-8 text, one record per line, fields separated by tabs.
+// * An image record is followed by a record for each of its files.
+//     I <imageNum> <fingerprint> <serial> <label>
+//     F <name> <size> <date/time>
+//   Fingerprint, serial and date/time are hexadecimal. The date/time is the raw
+//   FAT directory entry value.
+//   The fingerprint is FNV-1a over the boot sector, the whole of FAT0 and the root
+//   directory, in that order. FAT1 is left out as it mirrors FAT0. A file renamed,
+//   resized, rewritten (which changes its date) or moved to other clusters changes it.
+// * Lines beginning with '#' are ignored.
+
+const size_t CATALOG_DIR_SIZE = FLOPPY_BLOCKS_IN_DIR * FLOPPY_BLOCK_SIZE;
+const size_t CATALOG_READ_SIZE = FLOPPY_ROOT_DIR_OFFSET + CATALOG_DIR_SIZE; // Boot sector through the root directory
+
+bool ParseCatalogLine(const std::wstring& line, std::vector<CatalogImage>& images);
+void SplitFields(const std::wstring& line, std::vector<std::wstring>& fields);
+bool ParseHex(const std::wstring& text, DWORD* pValue);
+std::wstring ToHex(DWORD value);
+void ReadBootSector(LPBYTE pBootSector, CatalogImage& image);
+void ReadRootDirectory(LPBYTE pRootDir, CatalogImage& image);
+std::wstring FloppyTimeToWString(const FloppyDateTime& dateTime);
+
+bool CatalogRead(std::wstring filename, std::vector<CatalogImage>& images)
+{
+	images.clear();
+	if (GetFileAttributesW(filename.c_str()) == INVALID_FILE_ATTRIBUTES)
+	{
+		return true; // Not created yet
+	}
+
+	std::wstring wtext;
+	if (!TextFileRead(filename, wtext))
+	{
+		return false; // Error already reported
+	}
+
+	int lineNum = 0;
+	size_t pos = 0;
+	while (pos < wtext.length())
+	{
+		size_t eol = wtext.find(L'\n', pos);
+		if (eol == std::wstring::npos) eol = wtext.length();
+		++lineNum;
+		if (!ParseCatalogLine(wtext.substr(pos, eol - pos), images))
+		{
+			std::wcerr << L"Catalog: " << filename << L" line " << lineNum << std::endl;
+			return false;
+		}
+		pos = eol + 1;
+	}
+	return true;
+}
+
+bool ParseCatalogLine(const std::wstring& line, std::vector<CatalogImage>& images)
+{
+	std::vector<std::wstring> fields;
+	SplitFields(line, fields);
+	if (fields.empty() || fields[0].empty() || fields[0][0] == L'#') return true;
+
+	if (fields[0] == L"I" && fields.size() == 5)
+	{
+		CatalogImage image;
+		image.imageNum = (int)wcstoul(fields[1].c_str(), NULL, 10);
+		image.label = fields[4];
+		if (ParseHex(fields[2], &image.fingerprint) && ParseHex(fields[3], &image.serial))
+		{
+			images.push_back(image);
+			return true;
+		}
+	}
+	else if (fields[0] == L"F" && fields.size() == 4 && !images.empty())
+	{
+		CatalogFile file;
+		DWORD dateTime;
+		file.name = fields[1];
+		file.size = (DWORD)wcstoul(fields[2].c_str(), NULL, 10);
+		if (ParseHex(fields[3], &dateTime))
+		{
+			memcpy(&file.dateTime, &dateTime, sizeof(file.dateTime));
+			images.back().files.push_back(file);
+			return true;
+		}
+	}
+
+	std::wcerr << L"Unrecognized catalog record." << std::endl;
+	return false;
+}
+
+bool CatalogWrite(std::wstring filename, const std::vector<CatalogImage>& images)
+{
+	std::wstring wtext = L"# PianoDiscThumbDrive catalog\r\n";
+	for (const auto& image : images)
+	{
+		wtext += L"I\t" + std::to_wstring(image.imageNum) + L"\t" + ToHex(image.fingerprint) + L"\t" + ToHex(image.serial) + L"\t" + image.label + L"\r\n";
+		for (const auto& file : image.files)
+		{
+			DWORD dateTime;
+			memcpy(&dateTime, &file.dateTime, sizeof(dateTime));
+			wtext += L"F\t" + file.name + L"\t" + std::to_wstring(file.size) + L"\t" + ToHex(dateTime) + L"\r\n";
+		}
+	}
+	return TextFileWrite(filename, wtext, true);
+}
+
+bool CatalogScan(const std::wstring& drive, int firstImageNum, int lastImageNum, std::vector<CatalogImage>& images)
+{
+	BlockDevice* pDrive = ThumbDriveOpen(drive, BLOCK_DEVICE_READ);
+	if (pDrive == NULL)
+	{
+		return false; // Error already reported
+	}
+
+	int imageCount = ThumbDriveImageCount(pDrive);
+	if (lastImageNum < 0 || lastImageNum >= imageCount)
+	{
+		lastImageNum = imageCount - 1;
+	}
+
+	LPBYTE pBuffer = (LPBYTE)VirtualAlloc(NULL, CATALOG_READ_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (pBuffer == NULL)
+	{
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
+		ThumbDriveClose(pDrive);
+		return false;
+	}
+	LPBYTE pRootDir = pBuffer + FLOPPY_ROOT_DIR_OFFSET;
+
+	// Index the existing records so that the scanned range can be merged in
+	std::map<int, CatalogImage> byImageNum;
+	for (auto& image : images)
+	{
+		byImageNum[image.imageNum] = std::move(image);
+	}
+
+	int unchangedCount = 0;
+	int changedCount = 0;
+	bool result = true;
+	for (int imageNum = firstImageNum; imageNum <= lastImageNum; ++imageNum)
+	{
+		// One read covers everything the fingerprint is taken over
+		if (!ThumbDriveReadBlocks(pDrive, imageNum, 0, CATALOG_READ_SIZE, pBuffer))
+		{
+			std::wcerr << L"Failed to read image " << imageNum << L"." << std::endl;
+			result = false;
+			break;
+		}
+
+		// Slots that don't hold a floppy image aren't cataloged
+		if (FLOPPY_MAGIC_NUMBER != *(WORD*)(pBuffer + 0x01FE) || FLOPPY_BLOCKS_PER_DISK != *(WORD*)(pBuffer + 0x13))
+		{
+			byImageNum.erase(imageNum);
+			continue;
+		}
+
+		DWORD fingerprint = Fnv1a(pRootDir, CATALOG_DIR_SIZE, Fnv1a(pBuffer, FLOPPY_FAT1_OFFSET));
+		auto found = byImageNum.find(imageNum);
+		if (found != byImageNum.end() && found->second.fingerprint == fingerprint)
+		{
+			++unchangedCount;
+			continue;
+		}
+
+		CatalogImage& image = byImageNum[imageNum];
+		image.imageNum = imageNum;
+		image.fingerprint = fingerprint;
+		ReadBootSector(pBuffer, image);
+		ReadRootDirectory(pRootDir, image);
+		++changedCount;
+	}
+
+	VirtualFree(pBuffer, 0, MEM_RELEASE);
+	ThumbDriveClose(pDrive);
+
+	images.clear();
+	for (auto& entry : byImageNum)
+	{
+		images.push_back(std::move(entry.second));
+	}
+
+	std::wcout << L"Cataloged " << (changedCount + unchangedCount) << L" images: " << changedCount << L" read, " << unchangedCount << L" unchanged." << std::endl;
+	return result;
+}
+
+void ReadBootSector(LPBYTE pBootSector, CatalogImage& image)
+{
+	memcpy(&image.serial, pBootSector + BOOTSECTOR_SERIALNUM_OFFSET, BOOTSECTOR_SERIALNUM_LEN);
+
+	image.label.clear();
+	for (size_t i = 0; i < BOOTSECTOR_LABEL_LEN; ++i)
+	{
+		BYTE c = pBootSector[BOOTSECTOR_LABEL_OFFSET + i];
+		image.label += (c < 0x20) ? L'?' : (wchar_t)c;
+	}
+	size_t end = image.label.find_last_not_of(L' ');
+	image.label.erase(end == std::wstring::npos ? 0 : end + 1);
+}
+
+void ReadRootDirectory(LPBYTE pRootDir, CatalogImage& image)
+{
+	image.files.clear();
+	const FloppyDirectoryEntry* pEntry = (const FloppyDirectoryEntry*)pRootDir;
+	const FloppyDirectoryEntry* pEnd = pEntry + FLOPPY_ROOT_DIR_ENTRIES;
+	for (; pEntry < pEnd; ++pEntry)
+	{
+		if (pEntry->Filename[0] == '\0') break; // No more used entries
+		if (pEntry->Filename[0] == '\xE5') continue; // Deleted
+		if (pEntry->Attributes == ATTR_LONG_NAME) continue;
+		if ((pEntry->Attributes & (ATTR_VOLUME_LABEL | ATTR_DIRECTORY)) != 0) continue;
+
+		CatalogFile file;
+		file.name = FloppyFilenameToWString(pEntry->Filename);
+		file.size = pEntry->FileSize;
+		file.dateTime = pEntry->DateTime;
+		image.files.push_back(file);
+	}
+}
+
+int CatalogFind(const std::vector<CatalogImage>& images, const std::wstring& text)
+{
+	std::wstring lowerText = text;
+	std::transform(lowerText.begin(), lowerText.end(), lowerText.begin(), towlower);
+
+	int matchCount = 0;
+	for (const auto& image : images)
+	{
+		for (const auto& file : image.files)
+		{
+			std::wstring lowerName = file.name;
+			std::transform(lowerName.begin(), lowerName.end(), lowerName.begin(), towlower);
+			if (lowerName.find(lowerText) == std::wstring::npos) continue;
+
+			std::wcout << std::setw(4) << image.imageNum << L"  " << std::left << std::setw(12) << file.name << std::right
+				<< std::setw(9) << file.size << L"  " << FloppyTimeToWString(file.dateTime) << std::endl;
+			++matchCount;
+		}
+	}
+	return matchCount;
+}
+
+void CatalogList(const std::vector<CatalogImage>& images)
+{
+	for (const auto& image : images)
+	{
+		std::wcout << L"Image " << image.imageNum << L"  " << image.label << L"  Serial " << ToHex(image.serial)
+			<< L"  " << image.files.size() << L" files" << std::endl;
+		for (const auto& file : image.files)
+		{
+			std::wcout << L"    " << std::left << std::setw(12) << file.name << std::right
+				<< std::setw(9) << file.size << L"  " << FloppyTimeToWString(file.dateTime) << std::endl;
+		}
+	}
+}
+
+void SplitFields(const std::wstring& line, std::vector<std::wstring>& fields)
+{
+	size_t end = line.find_last_not_of(L"\r");
+	if (end == std::wstring::npos) return;
+	size_t pos = 0;
+	for (;;)
+	{
+		size_t tab = line.find(L'\t', pos);
+		if (tab == std::wstring::npos || tab > end)
+		{
+			fields.push_back(line.substr(pos, end + 1 - pos));
+			return;
+		}
+		fields.push_back(line.substr(pos, tab - pos));
+		pos = tab + 1;
+	}
+}
+
+bool ParseHex(const std::wstring& text, DWORD* pValue)
+{
+	if (text.empty() || text.length() > 8) return false;
+	DWORD value = 0;
+	for (wchar_t c : text)
+	{
+		if (!iswxdigit(c)) return false;
+		value = (value << 4) | (DWORD)(iswdigit(c) ? c - L'0' : (towupper(c) - L'A' + 10));
+	}
+	*pValue = value;
+	return true;
+}
+
+std::wstring ToHex(DWORD value)
+{
+	std::wostringstream text;
+	text << std::hex << std::uppercase << std::setw(8) << std::setfill(L'0') << value;
+	return text.str();
+}
+
+std::wstring FloppyTimeToWString(const FloppyDateTime& dateTime)
+{
+	std::wostringstream text;
+	text << std::setfill(L'0') << std::setw(4) << (dateTime.year + 1980) << L'-' << std::setw(2) << dateTime.month << L'-' << std::setw(2) << dateTime.day
+		<< L' ' << std::setw(2) << dateTime.hour << L':' << std::setw(2) << dateTime.minute;
+	return text.str();
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+// A catalog records the label, serial number and root directory of every image on a
+// thumb drive so that songs can be found without reading the images again.
+// Each image is keyed by a fingerprint of its boot sector, FAT and root directory, so
+// that changes made by other tools or through the OS are seen too. A rescan reads those
+// 16.5 KB per image in one read and only rebuilds the records of images whose
+// fingerprint changed.
+
+struct CatalogFile
+{
+	std::wstring name;
+	DWORD size;
+	FloppyDateTime dateTime;
+};
+
+struct CatalogImage
+{
+	int imageNum;
+	DWORD fingerprint;
+	DWORD serial;
+	std::wstring label;
+	std::vector<CatalogFile> files;
+};
+
+// A missing catalog file is not an error; it yields an empty catalog.
+extern bool CatalogRead(std::wstring filename, std::vector<CatalogImage>& images);
+extern bool CatalogWrite(std::wstring filename, const std::vector<CatalogImage>& images);
+
+// Bring the catalog up to date for the given range of images on a drive.
+// Pass a lastImageNum of -1 for every image on the drive. Images that aren't
+// valid floppy images are dropped. Images outside the range are left as they are.
+extern bool CatalogScan(const std::wstring& drive, int firstImageNum, int lastImageNum, std::vector<CatalogImage>& images);
+
+// Print each file whose name contains the text (ignoring case), or every image if text is empty
+extern int CatalogFind(const std::vector<CatalogImage>& images, const std::wstring& text);
+extern void CatalogList(const std::vector<CatalogImage>& images);
@@ -0,0 +1,126 @@
+#include <cstring>
+
+#include "WinTypes.h"
+#include "Checksum.h"
+#include "CpuFeatures.h"
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#elif defined(CPU_ARM64) && defined(_MSC_VER)
+#include <arm64intr.h>
+#elif defined(CPU_ARM64)
+#include <arm_acle.h>
+#endif
+
+const DWORD CRC32C_POLYNOMIAL = 0x82F63B78; // Reflected
+
+typedef DWORD(*Crc32cKernel)(const BYTE* pData, size_t length, DWORD crc);
+
+static Crc32cKernel SelectCrc32cKernel();
+
+DWORD Fnv1a(const BYTE* pData, size_t length, DWORD basis)
+{
+	DWORD hash = basis;
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash ^= pData[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+ULONGLONG Fnv1a64(const BYTE* pData, size_t length, ULONGLONG basis)
+{
+	ULONGLONG hash = basis;
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash ^= pData[i];
+		hash *= 0x00000100000001B3ULL;
+	}
+	return hash;
+}
+
+DWORD Crc32c(const BYTE* pData, size_t length, DWORD crc)
+{
+	static const Crc32cKernel kernel = SelectCrc32cKernel();
+	return ~kernel(pData, length, ~crc);
+}
+
+// === CRC-32C kernels ===
+// Each takes and returns the CRC register, without the initial and final inversion.
+
+static DWORD Crc32cTable(const BYTE* pData, size_t length, DWORD crc)
+{
+	static DWORD table[256];
+	static bool tableReady = []()
+	{
+		for (DWORD i = 0; i < 256; ++i)
+		{
+			DWORD entry = i;
+			for (int bit = 0; bit < 8; ++bit)
+				entry = (entry >> 1) ^ ((entry & 1) ? CRC32C_POLYNOMIAL : 0);
+			table[i] = entry;
+		}
+		return true;
+	}();
+	(void)tableReady;
+
+	for (size_t i = 0; i < length; ++i)
+		crc = table[(crc ^ pData[i]) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(CPU_X86)
+CPU_TARGET("sse4.2")
+static DWORD Crc32cSse42(const BYTE* pData, size_t length, DWORD crc)
+{
+	size_t i = 0;
+#if defined(_M_X64) || defined(__x86_64__)
+	unsigned long long crc64 = crc;
+	for (; i + 8 <= length; i += 8)
+	{
+		unsigned long long chunk;
+		memcpy(&chunk, pData + i, sizeof(chunk));
+		crc64 = _mm_crc32_u64(crc64, chunk);
+	}
+	crc = (DWORD)crc64;
+#else
+	for (; i + 4 <= length; i += 4)
+	{
+		unsigned int chunk;
+		memcpy(&chunk, pData + i, sizeof(chunk));
+		crc = _mm_crc32_u32(crc, chunk);
+	}
+#endif
+	for (; i < length; ++i)
+		crc = _mm_crc32_u8(crc, pData[i]);
+	return crc;
+}
+#endif
+
+#if defined(CPU_ARM64)
+CPU_TARGET("+crc")
+static DWORD Crc32cArm64(const BYTE* pData, size_t length, DWORD crc)
+{
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8)
+	{
+		unsigned long long chunk;
+		memcpy(&chunk, pData + i, sizeof(chunk));
+		crc = __crc32cd(crc, chunk);
+	}
+	for (; i < length; ++i)
+		crc = __crc32cb(crc, pData[i]);
+	return crc;
+}
+#endif
+
+static Crc32cKernel SelectCrc32cKernel()
+{
+#if defined(CPU_X86)
+	if (CpuHasSse42()) return Crc32cSse42;
+#elif defined(CPU_ARM64)
+	if (CpuHasCrc32()) return Crc32cArm64;
+#endif
+	return Crc32cTable;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// FNV-1a: A fast, non-cryptographic hash for spotting changed data.
+// Pass a previous result as the basis to hash discontiguous pieces as one.
+const DWORD FNV1A_BASIS = 0x811C9DC5;
+extern DWORD Fnv1a(const BYTE* pData, size_t length, DWORD basis = FNV1A_BASIS);
+
+// 64-bit FNV-1a, for keys where collisions must be vanishingly rare
+const ULONGLONG FNV1A64_BASIS = 0xCBF29CE484222325ULL;
+extern ULONGLONG Fnv1a64(const BYTE* pData, size_t length, ULONGLONG basis = FNV1A64_BASIS);
+
+// CRC-32C (Castagnoli), using the SSE4.2 or ARMv8 CRC instructions where available.
+// Pass a previous result as crc to continue it over the next piece of data.
+extern DWORD Crc32c(const BYTE* pData, size_t length, DWORD crc = 0);
@@ -0,0 +1,131 @@
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#include "WinTypes.h"
+#include "FloppyImage.h"
+#include "FatTable.h"
+#include "ClusterAllocator.h"
+
+template <class Geometry>
+void ClusterAllocator::Load(LPBYTE pImage)
+{
+	m_runsByFirst.clear();
+	m_runsBySize.clear();
+	m_freeCount = 0;
+
+	WORD fat[Geometry::END_DATA_AU];
+	FatDecode<Geometry>(pImage, 0, Geometry::END_DATA_AU, fat);
+
+	unsigned int runFirst = 0;
+	unsigned int runCount = 0;
+	for (unsigned int au = Geometry::FIRST_DATA_AU; au < Geometry::END_DATA_AU; ++au)
+	{
+		if (fat[au] == 0)
+		{
+			if (runCount == 0) runFirst = au;
+			++runCount;
+		}
+		else if (runCount > 0)
+		{
+			InsertRun(runFirst, runCount);
+			runCount = 0;
+		}
+	}
+	if (runCount > 0)
+		InsertRun(runFirst, runCount);
+}
+
+template void ClusterAllocator::Load<Floppy720K>(LPBYTE pImage);
+template void ClusterAllocator::Load<Floppy1200K>(LPBYTE pImage);
+template void ClusterAllocator::Load<Floppy1440K>(LPBYTE pImage);
+template void ClusterAllocator::Load<Floppy2880K>(LPBYTE pImage);
+
+bool ClusterAllocator::Allocate(unsigned int count, std::vector<ClusterRun>& runs)
+{
+	runs.clear();
+	if (count == 0) return true;
+	if (count > m_freeCount) return false;
+
+	// Best fit: smallest run that holds the whole allocation
+	auto fit = m_runsBySize.lower_bound(std::make_pair(count, 0u));
+	if (fit != m_runsBySize.end())
+	{
+		unsigned int first = fit->second;
+		unsigned int runCount = fit->first;
+		EraseRun(m_runsByFirst.find(first));
+		if (runCount > count)
+			InsertRun(first + count, runCount - count);
+		runs.push_back({ first, count });
+		return true;
+	}
+
+	// Fragmented: take the largest runs until satisfied
+	unsigned int remaining = count;
+	while (remaining > 0)
+	{
+		auto largest = std::prev(m_runsBySize.end());
+		unsigned int first = largest->second;
+		unsigned int runCount = largest->first;
+		EraseRun(m_runsByFirst.find(first));
+		if (runCount > remaining)
+		{
+			InsertRun(first + remaining, runCount - remaining);
+			runCount = remaining;
+		}
+		runs.push_back({ first, runCount });
+		remaining -= runCount;
+	}
+
+	// Chain the pieces in disk order
+	std::sort(runs.begin(), runs.end(), [](const ClusterRun& a, const ClusterRun& b) { return a.first < b.first; });
+	return true;
+}
+
+void ClusterAllocator::Free(const std::vector<ClusterRun>& runs)
+{
+	for (const auto& run : runs)
+	{
+		if (run.count == 0) continue;
+		unsigned int first = run.first;
+		unsigned int count = run.count;
+
+		// Merge with the following run
+		auto next = m_runsByFirst.find(first + count);
+		if (next != m_runsByFirst.end())
+		{
+			count += next->second;
+			EraseRun(next);
+		}
+
+		// Merge with the preceding run
+		auto prev = m_runsByFirst.lower_bound(first);
+		if (prev != m_runsByFirst.begin())
+		{
+			--prev;
+			if (prev->first + prev->second == first)
+			{
+				first = prev->first;
+				count += prev->second;
+				EraseRun(prev);
+			}
+		}
+
+		InsertRun(first, count);
+	}
+}
+
+void ClusterAllocator::InsertRun(unsigned int first, unsigned int count)
+{
+	m_runsByFirst[first] = count;
+	m_runsBySize.insert(std::make_pair(count, first));
+	m_freeCount += count;
+}
+
+void ClusterAllocator::EraseRun(std::map<unsigned int, unsigned int>::iterator it)
+{
+	m_runsBySize.erase(std::make_pair(it->second, it->first));
+	m_freeCount -= it->second;
+	m_runsByFirst.erase(it);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// Tracks the free clusters of an image as a set of free runs indexed both by
+// position and by size so that allocations don't have to scan the FAT.
+class ClusterAllocator
+{
+public:
+	// Build the free runs from the FAT of a formatted or loaded image of the given format.
+	template <class Geometry = Floppy1440K>
+	void Load(LPBYTE pImage);
+
+	// Allocate count clusters. The smallest free run that holds them all is used (lowest
+	// numbered on a tie). Only when no single run is big enough is the allocation split
+	// across the largest runs. Returns false, allocating nothing, if there's not enough space.
+	bool Allocate(unsigned int count, std::vector<ClusterRun>& runs);
+
+	// Return clusters to the free pool.
+	void Free(const std::vector<ClusterRun>& runs);
+
+	unsigned int FreeCount() const { return m_freeCount; }
+
+private:
+	void InsertRun(unsigned int first, unsigned int count);
+	void EraseRun(std::map<unsigned int, unsigned int>::iterator it);
+
+	std::map<unsigned int, unsigned int> m_runsByFirst; // first -> count
+	std::set<std::pair<unsigned int, unsigned int>> m_runsBySize; // (count, first)
+	unsigned int m_freeCount = 0;
+};
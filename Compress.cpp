@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <cstring>
+#include <windows.h>
+
+#include "Compress.h"
+
+// Each sequence is a token, whose high nibble is the number of literals and low nibble the
+// copy length less LZ_MIN_MATCH (15 in either meaning more follows in bytes of up to 255),
+// the literals, a 16-bit little-endian offset back to the copy and the rest of its length.
+// The last sequence has literals alone.
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_MAX_OFFSET = 0xFFFF;
+const int LZ_HASH_BITS = 12;
+
+BYTE* WriteSequence(BYTE* pOut, const BYTE* pLiterals, size_t literals, size_t offset, size_t matchLength);
+BYTE* WriteLength(BYTE* pOut, size_t length);
+bool ReadLength(const BYTE*& p, const BYTE* end, size_t& length);
+
+size_t LzCompress(const BYTE* pData, size_t length, BYTE* pOut)
+{
+	// Where each hash of four bytes was last seen. Candidates are checked, so a stale or
+	// colliding entry only costs a miss.
+	DWORD table[1 << LZ_HASH_BITS] = {};
+
+	const BYTE* p = pData;
+	const BYTE* end = pData + length;
+	const BYTE* literals = pData; // Not yet written
+	BYTE* pNext = pOut;
+	while (p < end && (size_t)(end - p) >= LZ_MIN_MATCH)
+	{
+		DWORD sequence;
+		memcpy(&sequence, p, sizeof(sequence));
+		DWORD hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+		const BYTE* candidate = pData + table[hash];
+		table[hash] = (DWORD)(p - pData);
+		if (candidate >= p || (size_t)(p - candidate) > LZ_MAX_OFFSET || memcmp(candidate, p, LZ_MIN_MATCH) != 0)
+		{
+			// Step further the longer nothing matches, so incompressible data goes quickly
+			p += (std::min)((size_t)(end - p), (size_t)1 + ((p - literals) >> 6));
+			continue;
+		}
+
+		const BYTE* matchEnd = p + LZ_MIN_MATCH;
+		for (const BYTE* q = candidate + LZ_MIN_MATCH; matchEnd < end && *matchEnd == *q; ++q)
+		{
+			++matchEnd;
+		}
+		pNext = WriteSequence(pNext, literals, p - literals, p - candidate, matchEnd - p);
+		p = matchEnd;
+		literals = p;
+	}
+	pNext = WriteSequence(pNext, literals, end - literals, 0, 0);
+	return pNext - pOut;
+}
+
+bool LzDecompress(const BYTE* pData, size_t length, BYTE* pOut, size_t outLength)
+{
+	const BYTE* p = pData;
+	const BYTE* end = pData + length;
+	BYTE* pNext = pOut;
+	BYTE* outEnd = pOut + outLength;
+	while (p < end)
+	{
+		BYTE token = *p++;
+		size_t literals = token >> 4;
+		if (literals == 15 && !ReadLength(p, end, literals))
+		{
+			return false;
+		}
+		if (literals > (size_t)(end - p) || literals > (size_t)(outEnd - pNext))
+		{
+			return false;
+		}
+		memcpy(pNext, p, literals);
+		pNext += literals;
+		p += literals;
+		if (p == end)
+		{
+			return pNext == outEnd; // The last sequence
+		}
+
+		if (end - p < 2)
+		{
+			return false;
+		}
+		size_t offset = p[0] | (p[1] << 8);
+		p += 2;
+		size_t matchLength = token & 15;
+		if (matchLength == 15 && !ReadLength(p, end, matchLength))
+		{
+			return false;
+		}
+		matchLength += LZ_MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(pNext - pOut) || matchLength > (size_t)(outEnd - pNext))
+		{
+			return false;
+		}
+
+		// A copy may overlap what it's making, repeating the last offset bytes
+		const BYTE* pMatch = pNext - offset;
+		if (offset >= matchLength)
+		{
+			memcpy(pNext, pMatch, matchLength);
+			pNext += matchLength;
+		}
+		else
+		{
+			for (size_t i = 0; i < matchLength; ++i)
+			{
+				*pNext++ = *pMatch++;
+			}
+		}
+	}
+	return false;
+}
+
+// Without a match (matchLength 0), the last sequence
+BYTE* WriteSequence(BYTE* pOut, const BYTE* pLiterals, size_t literals, size_t offset, size_t matchLength)
+{
+	size_t extra = (matchLength == 0) ? 0 : matchLength - LZ_MIN_MATCH;
+	*pOut++ = (BYTE)(((literals < 15) ? literals : 15) << 4 | ((extra < 15) ? extra : 15));
+	if (literals >= 15)
+	{
+		pOut = WriteLength(pOut, literals);
+	}
+	memcpy(pOut, pLiterals, literals);
+	pOut += literals;
+	if (matchLength == 0)
+	{
+		return pOut;
+	}
+	*pOut++ = (BYTE)offset;
+	*pOut++ = (BYTE)(offset >> 8);
+	if (extra >= 15)
+	{
+		pOut = WriteLength(pOut, extra);
+	}
+	return pOut;
+}
+
+// The part of a length past the 15 in its token
+BYTE* WriteLength(BYTE* pOut, size_t length)
+{
+	for (length -= 15; length >= 255; length -= 255)
+	{
+		*pOut++ = 255;
+	}
+	*pOut++ = (BYTE)length;
+	return pOut;
+}
+
+bool ReadLength(const BYTE*& p, const BYTE* end, size_t& length)
+{
+	for (;;)
+	{
+		if (p >= end)
+		{
+			return false;
+		}
+		BYTE b = *p++;
+		length += b;
+		if (b != 255)
+		{
+			return true;
+		}
+	}
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+// A fast LZ77 compressor in the manner of LZ4: runs of literal bytes and copies of 4 or more
+// bytes from the last 64 KB, with no entropy coding, so that both directions run at close to
+// memory speed. Meant for blocks of up to 64 KB.
+
+// The most LzCompress can write for length bytes
+inline size_t LzMaxCompressedSize(size_t length) { return length + length / 255 + 16; }
+
+// Compress length bytes into pOut, which must hold LzMaxCompressedSize(length).
+// Returns the compressed size.
+extern size_t LzCompress(const BYTE* pData, size_t length, BYTE* pOut);
+
+// Decompress into exactly outLength bytes. Returns false if the data is corrupt.
+extern bool LzDecompress(const BYTE* pData, size_t length, BYTE* pOut, size_t outLength);
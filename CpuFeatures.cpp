@@ -0,0 +1,105 @@
+#include "CpuFeatures.h"
+
+#if defined(CPU_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(CPU_ARM64) && defined(_WIN32)
+#include <windows.h>
+#elif defined(CPU_ARM64) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#if defined(CPU_X86)
+
+struct CpuFeatures
+{
+	bool ssse3 = false;
+	bool sse42 = false;
+	bool avx2 = false;
+	bool crc32 = false;
+
+	CpuFeatures()
+	{
+		int info[4] = { 0 };
+		Cpuid(info, 0, 0);
+		int maxLeaf = info[0];
+		if (maxLeaf < 1) return;
+
+		Cpuid(info, 1, 0);
+		ssse3 = (info[2] & (1 << 9)) != 0;
+		sse42 = (info[2] & (1 << 20)) != 0;
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+
+		// AVX2 also requires that the OS saves the YMM registers
+		if (maxLeaf >= 7 && osxsave && avx && (Xgetbv() & 0x06) == 0x06)
+		{
+			Cpuid(info, 7, 0);
+			avx2 = (info[1] & (1 << 5)) != 0;
+		}
+	}
+
+	static void Cpuid(int info[4], int leaf, int subleaf)
+	{
+#if defined(_MSC_VER)
+		__cpuidex(info, leaf, subleaf);
+#else
+		__cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+#endif
+	}
+
+	static unsigned long long Xgetbv()
+	{
+#if defined(_MSC_VER)
+		return _xgetbv(0);
+#else
+		unsigned int eax, edx;
+		__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		return ((unsigned long long)edx << 32) | eax;
+#endif
+	}
+};
+#elif defined(CPU_ARM64)
+struct CpuFeatures
+{
+	bool ssse3 = false;
+	bool sse42 = false;
+	bool avx2 = false;
+	bool crc32 = false;
+
+	// The CRC32 instructions are optional before ARMv8.1, and Linux runs on such CPUs
+	CpuFeatures()
+	{
+#if defined(_WIN32)
+		crc32 = IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE) != 0;
+#elif defined(__linux__)
+		crc32 = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#elif defined(__APPLE__)
+		crc32 = true; // Every Apple ARM64 CPU has them
+#endif
+	}
+};
+#else
+struct CpuFeatures
+{
+	bool ssse3 = false;
+	bool sse42 = false;
+	bool avx2 = false;
+	bool crc32 = false;
+};
+#endif
+
+static const CpuFeatures& Features()
+{
+	static const CpuFeatures features;
+	return features;
+}
+
+bool CpuHasSsse3() { return Features().ssse3; }
+bool CpuHasSse42() { return Features().sse42; }
+bool CpuHasAvx2() { return Features().avx2; }
+bool CpuHasCrc32() { return Features().crc32; }
@@ -0,0 +1,25 @@
+#pragma once
+
+// Runtime detection of the instruction set extensions used by the SIMD kernels.
+// Each kernel has a plain C++ fallback so these only choose the fastest path.
+extern bool CpuHasSsse3();
+extern bool CpuHasSse42();
+extern bool CpuHasAvx2();
+extern bool CpuHasCrc32(); // ARM64
+
+// SIMD kernels are compiled for their instruction set individually and only called
+// after the matching check above. MSVC allows intrinsics anywhere; GCC and Clang
+// need the target named on the function.
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CPU_X86 1
+#endif
+
+#if defined(_M_ARM64) || defined(__aarch64__)
+#define CPU_ARM64 1
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define CPU_TARGET(isa)
+#else
+#define CPU_TARGET(isa) __attribute__((target(isa)))
+#endif
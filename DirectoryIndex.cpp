@@ -0,0 +1,65 @@
+#include <vector>
+#include <string>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <windows.h>
+
+#include "FloppyImage.h"
+#include "DirectoryIndex.h"
+
+const size_t FILENAME_LEN = sizeof(FloppyDirectoryEntry::Filename);
+
+template <class Geometry>
+void DirectoryIndex::Load(LPBYTE pImage)
+{
+	m_pDir = (FloppyDirectoryEntry*)(pImage + Geometry::ROOT_DIR_OFFSET);
+	m_names.clear();
+	m_freeEntries.clear();
+
+	bool end = false;
+	for (unsigned int i = 0; i < Geometry::ROOT_DIR_ENTRIES; ++i)
+	{
+		const char* name = m_pDir[i].Filename;
+
+		// No more used entries after the first that begins with '\0'
+		// (a used but freed entry has 0xE5 in the first byte)
+		if (name[0] == '\0') end = true;
+		if (end || name[0] == '\xE5')
+		{
+			m_freeEntries.push_back(i);
+		}
+		else
+		{
+			// Includes the volume label, same as the names it would be compared against in a scan
+			m_names.insert(std::string(name, FILENAME_LEN));
+		}
+	}
+	std::reverse(m_freeEntries.begin(), m_freeEntries.end());
+}
+
+template void DirectoryIndex::Load<Floppy720K>(LPBYTE pImage);
+template void DirectoryIndex::Load<Floppy1200K>(LPBYTE pImage);
+template void DirectoryIndex::Load<Floppy1440K>(LPBYTE pImage);
+template void DirectoryIndex::Load<Floppy2880K>(LPBYTE pImage);
+
+bool DirectoryIndex::Contains(const char* filename) const
+{
+	return m_names.find(std::string(filename, FILENAME_LEN)) != m_names.end();
+}
+
+FloppyDirectoryEntry* DirectoryIndex::AllocateEntry(const char* filename)
+{
+	if (m_freeEntries.empty()) return NULL;
+	unsigned int i = m_freeEntries.back();
+	m_freeEntries.pop_back();
+	m_names.insert(std::string(filename, FILENAME_LEN));
+	return m_pDir + i;
+}
+
+void DirectoryIndex::FreeEntry(FloppyDirectoryEntry* pEntry)
+{
+	m_names.erase(std::string(pEntry->Filename, FILENAME_LEN));
+	unsigned int i = (unsigned int)(pEntry - m_pDir);
+	m_freeEntries.insert(std::lower_bound(m_freeEntries.begin(), m_freeEntries.end(), i, std::greater<unsigned int>()), i);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// An in-memory index of an image's root directory: a hash set of the 8.3 names
+// in use and a list of free entries. Lets AddFile generate unique names and
+// find a free entry without rescanning the directory.
+class DirectoryIndex
+{
+public:
+	// Build the index from the root directory of a formatted or loaded image of the given format.
+	template <class Geometry = Floppy1440K>
+	void Load(LPBYTE pImage);
+
+	// Whether an 11-byte (8.3, space padded, no dot) name is in use
+	bool Contains(const char* filename) const;
+
+	bool HasFreeEntry() const { return !m_freeEntries.empty(); }
+
+	// Take the lowest-numbered free entry and record the name that will be written to it.
+	// Returns NULL if the directory is full.
+	FloppyDirectoryEntry* AllocateEntry(const char* filename);
+
+	// Return an entry to the free list and forget its name. The caller marks the entry deleted.
+	void FreeEntry(FloppyDirectoryEntry* pEntry);
+
+private:
+	FloppyDirectoryEntry* m_pDir = NULL;
+	std::unordered_set<std::string> m_names;
+	std::vector<unsigned int> m_freeEntries; // Descending so that the lowest is at the back
+};
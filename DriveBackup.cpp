@@ -0,0 +1,719 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <windows.h>
+
+#include "FloppyImage.h"
+#include "DriveBackup.h"
+#include "BlockDevice.h"
+#include "ThumbDriveImage.h"
+#include "ImagePool.h"
+#include "Compress.h"
+#include "Checksum.h"
+#include "ZeroScan.h"
+#include "RunStats.h"
+#include "WinHelp.h"
+
+// A backup file, all little-endian:
+//   BackupHeader
+//   The blocks: each a BackupBlockHeader followed by its sectors, compressed unless that
+//     made them no smaller. Every block but the last holds BACKUP_BLOCK_SECTORS.
+//   The block index: the file offset of each block, as ULONGLONGs
+//   The map: BackupRuns covering every sector of the drive in order
+//   BackupFooter
+// Sectors are numbered in the order they're first seen on the drive, so a restore reads the
+// blocks in order, going back only for sectors it has seen before.
+const char BACKUP_MAGIC[8] = { 'P', 'D', 'T', 'D', 'B', 'A', 'K', '1' };
+const DWORD BACKUP_VERSION = 1;
+const size_t BACKUP_SECTOR_SIZE = FLOPPY_BLOCK_SIZE;
+const size_t BACKUP_BLOCK_SECTORS = 128; // 64 KB, as far back as LzCompress looks
+const size_t BACKUP_BLOCK_SIZE = BACKUP_BLOCK_SECTORS * BACKUP_SECTOR_SIZE;
+const DWORD BACKUP_ZERO_SECTOR = 0xFFFFFFFF; // In a run, for zeros
+const size_t BACKUP_IO_SIZE = 0x400000; // Per device read or write
+const size_t BACKUP_IO_BUFFERS = 4;
+const size_t BACKUP_CACHED_BLOCKS = 16; // Decompressed, for sectors seen before
+
+struct BackupHeader
+{
+	char magic[8];
+	DWORD version;
+	DWORD sectorSize;
+	ULONGLONG driveSize;
+};
+
+struct BackupBlockHeader
+{
+	DWORD sectors;
+	DWORD storedSize; // The size of the sectors if they're stored as they are
+	DWORD crc; // CRC-32C of the sectors
+};
+
+// count sectors of the drive: sector first of the backup, and then either the same sector
+// again (step 0) or the ones after it (step 1)
+struct BackupRun
+{
+	ULONGLONG count;
+	DWORD first;
+	DWORD step;
+};
+
+struct BackupFooter
+{
+	ULONGLONG indexOffset;
+	ULONGLONG runCount;
+	ULONGLONG uniqueSectors;
+	DWORD blockCount;
+	DWORD driveCrc; // CRC-32C of the whole drive
+	DWORD indexCrc; // CRC-32C of the block index and the map
+	DWORD reserved;
+	char magic[8];
+};
+
+static_assert(sizeof(BackupHeader) == 24 && sizeof(BackupBlockHeader) == 12 && sizeof(BackupRun) == 16 && sizeof(BackupFooter) == 48,
+	"Backup file structures must have no padding");
+
+// A sector is known by two independent hashes, 96 bits in all, as the build cache knows
+// files by a hash
+struct SectorKey
+{
+	ULONGLONG fnv;
+	DWORD crc;
+
+	bool operator==(const SectorKey& other) const { return fnv == other.fnv && crc == other.crc; }
+};
+
+struct SectorKeyHash
+{
+	size_t operator()(const SectorKey& key) const { return (size_t)key.fnv; }
+};
+
+// A backup being written
+struct BackupWriter
+{
+	HANDLE hFile;
+	std::wstring path;
+	ULONGLONG offset = 0; // Of the end of the file
+	std::unordered_map<SectorKey, DWORD, SectorKeyHash> sectors; // To their numbers in the backup
+	ULONGLONG uniqueSectors = 0;
+	ULONGLONG zeroSectors = 0;
+	std::vector<BYTE> block; // Sectors not yet written
+	std::vector<BYTE> compressed;
+	std::vector<ULONGLONG> blockOffsets;
+	std::vector<BackupRun> runs;
+	DWORD driveCrc = 0;
+};
+
+// A decompressed block kept for sectors that are needed again
+struct CachedBlock
+{
+	DWORD block;
+	ULONGLONG lastUse;
+	std::vector<BYTE> data;
+};
+
+// A backup being restored
+struct BackupReader
+{
+	HANDLE hFile;
+	std::wstring path;
+	BackupHeader header;
+	BackupFooter footer;
+	std::vector<ULONGLONG> blockOffsets; // Followed by the index offset, where the last block ends
+	std::vector<BackupRun> runs;
+	std::vector<BYTE> stored; // A block as it is in the file
+	std::vector<CachedBlock> cache;
+	ULONGLONG uses = 0;
+};
+
+// A piece of the drive on its way from or to the device
+struct DrivePiece
+{
+	ULONGLONG offset;
+	size_t length;
+	LPBYTE pBuffer;
+	bool read;
+};
+
+bool BackupSectors(BackupWriter& writer, const BYTE* pData, size_t length);
+void AddToMap(std::vector<BackupRun>& runs, DWORD sector);
+bool WriteBlock(BackupWriter& writer);
+bool WriteBackup(BackupWriter& writer, const void* pData, size_t length);
+bool OpenBackup(const std::wstring& path, BackupReader& reader);
+bool CheckBackupIndex(const BackupReader& reader);
+const BYTE* FindSector(BackupReader& reader, DWORD sector);
+bool ReadBlock(BackupReader& reader, DWORD block, BYTE* pData);
+bool ReadBackup(BackupReader& reader, ULONGLONG offset, void* pData, size_t length);
+bool WritePiece(BlockDevice* pDrive, const DrivePiece& piece, ULONGLONG driveSize);
+
+bool DriveBackup(const std::wstring& drive, const std::wstring& backupPath, bool overwrite, DriveBackupStats* pStats)
+{
+	BlockDevice* pDrive = ThumbDriveOpen(drive, BLOCK_DEVICE_READ);
+	if (pDrive == NULL)
+	{
+		return false; // Error already reported
+	}
+	ULONGLONG driveSize = pDrive->Size() / BACKUP_SECTOR_SIZE * BACKUP_SECTOR_SIZE;
+	if (driveSize == 0)
+	{
+		std::wcerr << L"Failed to get the size of drive: " << drive << std::endl;
+		ThumbDriveClose(pDrive);
+		return false;
+	}
+	ImagePool pool(BACKUP_IO_BUFFERS, BACKUP_IO_SIZE);
+	if (pool.Size() < BACKUP_IO_BUFFERS)
+	{
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
+		ThumbDriveClose(pDrive);
+		return false;
+	}
+
+	StatAdd(STAT_IO_CALLS);
+	HANDLE hFile = CreateFileW(backupPath.c_str(), GENERIC_WRITE, 0, NULL, overwrite ? CREATE_ALWAYS : CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		DWORD hResult = GetLastError();
+		ThumbDriveClose(pDrive);
+		std::wcerr << L"Failed to open destination file: " << backupPath << std::endl;
+		ReportError(hResult);
+		return false;
+	}
+
+	BackupWriter writer;
+	writer.hFile = hFile;
+	writer.path = backupPath;
+	writer.block.reserve(BACKUP_BLOCK_SIZE);
+	writer.compressed.resize(LzMaxCompressedSize(BACKUP_BLOCK_SIZE));
+	BackupHeader header = {};
+	memcpy(header.magic, BACKUP_MAGIC, sizeof(header.magic));
+	header.version = BACKUP_VERSION;
+	header.sectorSize = (DWORD)BACKUP_SECTOR_SIZE;
+	header.driveSize = driveSize;
+	bool result = WriteBackup(writer, &header, sizeof(header));
+
+	// The drive is read ahead on another thread while what has been read is sorted out here
+	WorkQueue<DrivePiece> pieces;
+	std::atomic<bool> stop(!result);
+	std::thread reader([&]()
+	{
+		for (ULONGLONG offset = 0; offset < driveSize && !stop; offset += BACKUP_IO_SIZE)
+		{
+			DrivePiece piece = { offset, (size_t)std::min<ULONGLONG>(BACKUP_IO_SIZE, driveSize - offset), pool.Acquire(), false };
+			piece.read = pDrive->Read(piece.offset, piece.length, piece.pBuffer);
+			pieces.Push(piece);
+			if (!piece.read) break;
+		}
+		pieces.Close();
+	});
+	DrivePiece piece;
+	while (pieces.Pop(piece))
+	{
+		// Read errors have been reported
+		result = result && piece.read && BackupSectors(writer, piece.pBuffer, piece.length);
+		pool.Release(piece.pBuffer);
+		stop = !result;
+	}
+	reader.join();
+	ThumbDriveClose(pDrive);
+
+	// The last block, then the index, the map and the footer that finds them
+	if (result && !writer.block.empty())
+	{
+		result = WriteBlock(writer);
+	}
+	if (result)
+	{
+		size_t indexSize = writer.blockOffsets.size() * sizeof(ULONGLONG);
+		size_t mapSize = writer.runs.size() * sizeof(BackupRun);
+		BackupFooter footer = {};
+		footer.indexOffset = writer.offset;
+		footer.runCount = writer.runs.size();
+		footer.uniqueSectors = writer.uniqueSectors;
+		footer.blockCount = (DWORD)writer.blockOffsets.size();
+		footer.driveCrc = writer.driveCrc;
+		footer.indexCrc = Crc32c((const BYTE*)writer.runs.data(), mapSize, Crc32c((const BYTE*)writer.blockOffsets.data(), indexSize));
+		memcpy(footer.magic, BACKUP_MAGIC, sizeof(footer.magic));
+		result = WriteBackup(writer, writer.blockOffsets.data(), indexSize)
+			&& WriteBackup(writer, writer.runs.data(), mapSize)
+			&& WriteBackup(writer, &footer, sizeof(footer));
+	}
+
+	// Half a backup is no use to anyone
+	StatAdd(STAT_IO_CALLS);
+	CloseHandle(hFile);
+	if (!result)
+	{
+		DeleteFileW(backupPath.c_str());
+		return false;
+	}
+
+	pStats->driveSize = driveSize;
+	pStats->backupSize = writer.offset;
+	pStats->uniqueSectors = writer.uniqueSectors;
+	pStats->zeroSectors = writer.zeroSectors;
+	return true;
+}
+
+bool DriveRestore(const std::wstring& backupPath, const std::wstring& drive, bool overwrite, DriveBackupStats* pStats)
+{
+	BackupReader reader;
+	if (!OpenBackup(backupPath, reader))
+	{
+		return false; // Error already reported
+	}
+	ULONGLONG driveSize = reader.header.driveSize;
+	ImagePool pool(BACKUP_IO_BUFFERS, BACKUP_IO_SIZE);
+	if (pool.Size() < BACKUP_IO_BUFFERS)
+	{
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
+		CloseHandle(reader.hFile);
+		return false;
+	}
+
+	// The volume is locked throughout, as image 0 is written
+	BlockDevice* pDrive = overwrite ? BlockDeviceOpen(drive, BLOCK_DEVICE_WRITE_EXCLUSIVE) : ThumbDriveOpen(drive, BLOCK_DEVICE_WRITE_EXCLUSIVE);
+	if (pDrive == NULL)
+	{
+		CloseHandle(reader.hFile);
+		return false; // Error already reported
+	}
+	ULONGLONG deviceSize = pDrive->Size();
+	if (!pDrive->IsSparse() && deviceSize != 0 && deviceSize < driveSize)
+	{
+		std::wcerr << L"Drive: " << drive << L" is smaller than the drive that was backed up." << std::endl;
+		ThumbDriveClose(pDrive);
+		CloseHandle(reader.hFile);
+		return false;
+	}
+
+	// Pieces of the drive are put together here while another thread writes the ones before
+	WorkQueue<DrivePiece> pieces;
+	std::atomic<bool> failed(false);
+	DWORD writtenCrc = 0;
+	std::thread writer([&]()
+	{
+		DrivePiece piece;
+		while (pieces.Pop(piece))
+		{
+			if (!failed)
+			{
+				writtenCrc = Crc32c(piece.pBuffer, piece.length, writtenCrc);
+				failed = !WritePiece(pDrive, piece, driveSize);
+			}
+			pool.Release(piece.pBuffer);
+		}
+	});
+
+	bool result = true;
+	ULONGLONG offset = 0;
+	size_t filled = 0;
+	LPBYTE pBuffer = pool.Acquire();
+	for (auto run = reader.runs.begin(); result && run != reader.runs.end(); ++run)
+	{
+		for (ULONGLONG done = 0; result && done < run->count; )
+		{
+			// As much of the run as fits in the piece, and for a step of 1, is in one block
+			size_t span = (size_t)std::min<ULONGLONG>(run->count - done, (BACKUP_IO_SIZE - filled) / BACKUP_SECTOR_SIZE);
+			LPBYTE pOut = pBuffer + filled;
+			if (run->first == BACKUP_ZERO_SECTOR)
+			{
+				memset(pOut, 0, span * BACKUP_SECTOR_SIZE);
+			}
+			else if (run->step == 0)
+			{
+				const BYTE* pSector = FindSector(reader, run->first);
+				for (size_t i = 0; pSector != NULL && i < span; ++i)
+				{
+					memcpy(pOut + i * BACKUP_SECTOR_SIZE, pSector, BACKUP_SECTOR_SIZE);
+				}
+				result = (pSector != NULL);
+			}
+			else
+			{
+				DWORD sector = run->first + (DWORD)done;
+				span = (std::min)(span, BACKUP_BLOCK_SECTORS - sector % BACKUP_BLOCK_SECTORS);
+				const BYTE* pSector = FindSector(reader, sector);
+				if (pSector != NULL)
+				{
+					memcpy(pOut, pSector, span * BACKUP_SECTOR_SIZE);
+				}
+				result = (pSector != NULL);
+			}
+			done += span;
+			filled += span * BACKUP_SECTOR_SIZE;
+
+			if (result && (filled == BACKUP_IO_SIZE || offset + filled == driveSize))
+			{
+				DrivePiece piece = { offset, filled, pBuffer, true };
+				pieces.Push(piece);
+				offset += filled;
+				filled = 0;
+				pBuffer = (offset < driveSize) ? pool.Acquire() : NULL;
+			}
+			result = result && !failed;
+		}
+	}
+	if (pBuffer != NULL)
+	{
+		pool.Release(pBuffer);
+	}
+	pieces.Close();
+	writer.join();
+	CloseHandle(reader.hFile);
+
+	// Write errors have been reported
+	result = result && !failed;
+	if (result && writtenCrc != reader.footer.driveCrc)
+	{
+		std::wcerr << L"What was restored doesn't match the drive that was backed up." << std::endl;
+		result = false;
+	}
+	if (result && !pDrive->Flush())
+	{
+		result = false;
+	}
+	ThumbDriveClose(pDrive);
+	if (!result)
+	{
+		return false;
+	}
+
+	pStats->driveSize = driveSize;
+	pStats->backupSize = reader.footer.indexOffset + reader.footer.blockCount * sizeof(ULONGLONG) + reader.footer.runCount * sizeof(BackupRun) + sizeof(BackupFooter);
+	pStats->uniqueSectors = reader.footer.uniqueSectors;
+	pStats->zeroSectors = 0;
+	for (const auto& run : reader.runs)
+	{
+		if (run.first == BACKUP_ZERO_SECTOR) pStats->zeroSectors += run.count;
+	}
+	return true;
+}
+
+// Find each sector among those already kept, or keep it
+bool BackupSectors(BackupWriter& writer, const BYTE* pData, size_t length)
+{
+	writer.driveCrc = Crc32c(pData, length, writer.driveCrc);
+	for (const BYTE* pSector = pData; pSector < pData + length; pSector += BACKUP_SECTOR_SIZE)
+	{
+		DWORD sector = BACKUP_ZERO_SECTOR;
+		if (IsAllZero(pSector, BACKUP_SECTOR_SIZE))
+		{
+			++writer.zeroSectors;
+		}
+		else
+		{
+			SectorKey key = { Fnv1a64(pSector, BACKUP_SECTOR_SIZE), Crc32c(pSector, BACKUP_SECTOR_SIZE) };
+			auto found = writer.sectors.find(key);
+			if (found != writer.sectors.end())
+			{
+				sector = found->second;
+			}
+			else
+			{
+				if (writer.uniqueSectors == BACKUP_ZERO_SECTOR)
+				{
+					std::wcerr << L"Too many different sectors to back up." << std::endl;
+					return false;
+				}
+				sector = (DWORD)writer.uniqueSectors++;
+				writer.sectors.emplace(key, sector);
+				writer.block.insert(writer.block.end(), pSector, pSector + BACKUP_SECTOR_SIZE);
+				if (writer.block.size() == BACKUP_BLOCK_SIZE && !WriteBlock(writer))
+				{
+					return false; // Error already reported
+				}
+			}
+		}
+		AddToMap(writer.runs, sector);
+	}
+	return true;
+}
+
+// Carry on the last run if the sector follows from it, or start another
+void AddToMap(std::vector<BackupRun>& runs, DWORD sector)
+{
+	if (!runs.empty())
+	{
+		BackupRun& run = runs.back();
+		if (run.count == 1 && run.first != BACKUP_ZERO_SECTOR && sector == run.first + 1)
+		{
+			run.step = 1;
+		}
+		if (sector == run.first + run.step * run.count)
+		{
+			++run.count;
+			return;
+		}
+	}
+	BackupRun run = { 1, sector, 0 };
+	runs.push_back(run);
+}
+
+bool WriteBlock(BackupWriter& writer)
+{
+	BackupBlockHeader header;
+	header.sectors = (DWORD)(writer.block.size() / BACKUP_SECTOR_SIZE);
+	header.crc = Crc32c(writer.block.data(), writer.block.size());
+	size_t compressedSize = LzCompress(writer.block.data(), writer.block.size(), writer.compressed.data());
+	bool compressed = compressedSize < writer.block.size();
+	header.storedSize = (DWORD)(compressed ? compressedSize : writer.block.size());
+
+	writer.blockOffsets.push_back(writer.offset);
+	bool result = WriteBackup(writer, &header, sizeof(header))
+		&& WriteBackup(writer, compressed ? writer.compressed.data() : writer.block.data(), header.storedSize);
+	writer.block.clear();
+	return result;
+}
+
+bool WriteBackup(BackupWriter& writer, const void* pData, size_t length)
+{
+	StatAdd(STAT_IO_CALLS);
+	DWORD bytesWritten;
+	if (!WriteFile(writer.hFile, pData, (DWORD)length, &bytesWritten, NULL) || bytesWritten != length)
+	{
+		std::wcerr << L"Failed to write destination file: " << writer.path << std::endl;
+		ReportError(GetLastError());
+		return false;
+	}
+	StatAdd(STAT_BYTES_WRITTEN, bytesWritten);
+	writer.offset += bytesWritten;
+	return true;
+}
+
+// Open a backup and read what's needed to restore it: the header, and from the end of the
+// file the footer, block index and map
+bool OpenBackup(const std::wstring& path, BackupReader& reader)
+{
+	StatAdd(STAT_IO_CALLS, 2);
+	reader.path = path;
+	reader.hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (reader.hFile == INVALID_HANDLE_VALUE)
+	{
+		std::wcerr << L"Failed to open source file: " << path << std::endl;
+		ReportError(GetLastError());
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(reader.hFile, &fileSize))
+	{
+		DWORD hResult = GetLastError();
+		CloseHandle(reader.hFile);
+		std::wcerr << L"Failed to get source file size." << std::endl;
+		ReportError(hResult);
+		return false;
+	}
+
+	ULONGLONG size = (ULONGLONG)fileSize.QuadPart;
+	if (size < sizeof(BackupHeader) + sizeof(BackupFooter)
+		|| !ReadBackup(reader, 0, &reader.header, sizeof(reader.header))
+		|| !ReadBackup(reader, size - sizeof(BackupFooter), &reader.footer, sizeof(reader.footer))
+		|| memcmp(reader.header.magic, BACKUP_MAGIC, sizeof(BACKUP_MAGIC)) != 0
+		|| memcmp(reader.footer.magic, BACKUP_MAGIC, sizeof(BACKUP_MAGIC)) != 0
+		|| reader.header.version != BACKUP_VERSION
+		|| reader.header.sectorSize != BACKUP_SECTOR_SIZE)
+	{
+		std::wcerr << L"Not a drive backup made by this version: " << path << std::endl;
+		CloseHandle(reader.hFile);
+		return false;
+	}
+
+	// The index and map fill the space between the blocks and the footer
+	const BackupFooter& footer = reader.footer;
+	ULONGLONG indexSize = (ULONGLONG)footer.blockCount * sizeof(ULONGLONG);
+	ULONGLONG mapSize = footer.runCount * sizeof(BackupRun);
+	bool result = footer.indexOffset >= sizeof(BackupHeader)
+		&& footer.runCount <= size / sizeof(BackupRun)
+		&& footer.indexOffset + indexSize + mapSize + sizeof(BackupFooter) == size;
+	if (result)
+	{
+		reader.blockOffsets.resize(footer.blockCount + 1);
+		reader.runs.resize((size_t)footer.runCount);
+		result = ReadBackup(reader, footer.indexOffset, reader.blockOffsets.data(), (size_t)indexSize)
+			&& ReadBackup(reader, footer.indexOffset + indexSize, reader.runs.data(), (size_t)mapSize)
+			&& Crc32c((const BYTE*)reader.runs.data(), (size_t)mapSize, Crc32c((const BYTE*)reader.blockOffsets.data(), (size_t)indexSize)) == footer.indexCrc;
+		reader.blockOffsets.back() = footer.indexOffset;
+	}
+	if (!result || !CheckBackupIndex(reader))
+	{
+		std::wcerr << L"Backup file is damaged: " << path << std::endl;
+		CloseHandle(reader.hFile);
+		return false;
+	}
+
+	reader.stored.resize(sizeof(BackupBlockHeader) + LzMaxCompressedSize(BACKUP_BLOCK_SIZE));
+	reader.cache.resize(BACKUP_CACHED_BLOCKS);
+	for (auto& cached : reader.cache)
+	{
+		cached.block = BACKUP_ZERO_SECTOR; // None
+		cached.lastUse = 0;
+		cached.data.resize(BACKUP_BLOCK_SIZE);
+	}
+
+	// Every block is checked before the drive is touched, rather than leaving it half
+	// restored. The backup is small beside the drive, so this is quick.
+	for (DWORD block = 0; block < footer.blockCount; ++block)
+	{
+		if (!ReadBlock(reader, block, reader.cache[0].data.data()))
+		{
+			CloseHandle(reader.hFile);
+			return false; // Error already reported
+		}
+	}
+	return true;
+}
+
+// That the blocks are in order within the file, and the map covers the drive with sectors
+// that are in the backup, so that nothing read later can lead outside it
+bool CheckBackupIndex(const BackupReader& reader)
+{
+	const BackupFooter& footer = reader.footer;
+	if (footer.blockCount != (footer.uniqueSectors + BACKUP_BLOCK_SECTORS - 1) / BACKUP_BLOCK_SECTORS
+		|| reader.header.driveSize % BACKUP_SECTOR_SIZE != 0)
+	{
+		return false;
+	}
+	ULONGLONG previous = sizeof(BackupHeader);
+	for (ULONGLONG blockOffset : reader.blockOffsets)
+	{
+		if (blockOffset < previous) return false;
+		previous = blockOffset + sizeof(BackupBlockHeader);
+	}
+
+	ULONGLONG sectors = 0;
+	for (const auto& run : reader.runs)
+	{
+		if (run.count == 0 || run.step > 1 || run.count > reader.header.driveSize / BACKUP_SECTOR_SIZE) return false;
+		if (run.first != BACKUP_ZERO_SECTOR && run.first + run.step * (run.count - 1) >= footer.uniqueSectors) return false;
+		sectors += run.count;
+	}
+	return sectors == reader.header.driveSize / BACKUP_SECTOR_SIZE;
+}
+
+// Where a sector is, reading and decompressing its block in place of the least recently
+// used if it isn't cached. Returns NULL on an error (already reported).
+const BYTE* FindSector(BackupReader& reader, DWORD sector)
+{
+	DWORD block = (DWORD)(sector / BACKUP_BLOCK_SECTORS);
+	CachedBlock* pOldest = NULL;
+	for (auto& cached : reader.cache)
+	{
+		if (cached.block == block)
+		{
+			pOldest = &cached;
+			break;
+		}
+		if (pOldest == NULL || cached.lastUse < pOldest->lastUse)
+		{
+			pOldest = &cached;
+		}
+	}
+	if (pOldest->block != block)
+	{
+		pOldest->block = BACKUP_ZERO_SECTOR;
+		if (!ReadBlock(reader, block, pOldest->data.data()))
+		{
+			return NULL;
+		}
+		pOldest->block = block;
+	}
+	pOldest->lastUse = ++reader.uses;
+	return pOldest->data.data() + (sector % BACKUP_BLOCK_SECTORS) * BACKUP_SECTOR_SIZE;
+}
+
+bool ReadBlock(BackupReader& reader, DWORD block, BYTE* pData)
+{
+	// A block runs to the start of the next, or of the index
+	ULONGLONG offset = reader.blockOffsets[block];
+	ULONGLONG storedLength = reader.blockOffsets[block + 1] - offset;
+	size_t sectors = (size_t)std::min<ULONGLONG>(BACKUP_BLOCK_SECTORS, reader.footer.uniqueSectors - (ULONGLONG)block * BACKUP_BLOCK_SECTORS);
+	size_t length = sectors * BACKUP_SECTOR_SIZE;
+	if (storedLength > reader.stored.size() || !ReadBackup(reader, offset, reader.stored.data(), (size_t)storedLength))
+	{
+		if (storedLength > reader.stored.size())
+		{
+			std::wcerr << L"Backup file is damaged: " << reader.path << std::endl;
+		}
+		return false;
+	}
+
+	BackupBlockHeader header;
+	memcpy(&header, reader.stored.data(), sizeof(header));
+	const BYTE* pStored = reader.stored.data() + sizeof(header);
+	bool result = header.sectors == sectors && header.storedSize == storedLength - sizeof(header);
+	if (result && header.storedSize == length)
+	{
+		memcpy(pData, pStored, length);
+	}
+	else if (result)
+	{
+		result = LzDecompress(pStored, header.storedSize, pData, length);
+	}
+	if (!result || Crc32c(pData, length) != header.crc)
+	{
+		std::wcerr << L"Backup file is damaged: " << reader.path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool ReadBackup(BackupReader& reader, ULONGLONG offset, void* pData, size_t length)
+{
+	OVERLAPPED position = {};
+	position.Offset = (DWORD)offset;
+	position.OffsetHigh = (DWORD)(offset >> 32);
+	DWORD bytesRead;
+	StatAdd(STAT_IO_CALLS);
+	if (!ReadFile(reader.hFile, pData, (DWORD)length, &bytesRead, &position))
+	{
+		std::wcerr << L"Failed to read source file: " << reader.path << std::endl;
+		ReportError(GetLastError());
+		return false;
+	}
+	if (bytesRead != length)
+	{
+		std::wcerr << L"Failed to read entire source file:" << reader.path << std::endl;
+		return false;
+	}
+	StatAdd(STAT_BYTES_READ, bytesRead);
+	return true;
+}
+
+// Zeros in a sparse drive image file are left as holes, except at the very end so that the
+// file is as long as the drive
+bool WritePiece(BlockDevice* pDrive, const DrivePiece& piece, ULONGLONG driveSize)
+{
+	if (!pDrive->IsSparse())
+	{
+		return pDrive->Write(piece.offset, piece.length, piece.pBuffer);
+	}
+
+	auto isHole = [&](size_t start)
+	{
+		size_t length = (std::min)(ZERO_CHUNK_SIZE, piece.length - start);
+		return piece.offset + start + length != driveSize && IsAllZero(piece.pBuffer + start, length);
+	};
+	for (size_t start = 0; start < piece.length; )
+	{
+		// The run of chunks that are all holes or all data
+		bool hole = isHole(start);
+		size_t end = start;
+		do
+		{
+			end += (std::min)(ZERO_CHUNK_SIZE, piece.length - end);
+		} while (end < piece.length && isHole(end) == hole);
+
+		bool written = hole
+			? pDrive->WriteZeros(piece.offset + start, end - start)
+			: pDrive->Write(piece.offset + start, end - start, piece.pBuffer + start);
+		if (!written)
+		{
+			return false; // Error already reported
+		}
+		start = end;
+	}
+	return true;
+}
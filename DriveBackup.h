@@ -0,0 +1,25 @@
+#pragma once
+
+// Whole-drive backups that keep each distinct 512-byte sector once. Most of a drive of floppy
+// images is zeros, boot sectors, FATs much like each other and songs that are on several
+// images, so a backup is a small part of the size of the drive. The sectors kept are
+// compressed (see LzCompress) 64 KB at a time, and a map of runs says which of them goes
+// where on the drive. The drive is read, or written, front to back in large aligned pieces
+// on a thread of its own, so the device is kept busy while the rest is done.
+
+struct DriveBackupStats
+{
+	ULONGLONG driveSize;
+	ULONGLONG backupSize;
+	ULONGLONG uniqueSectors; // Kept in the backup
+	ULONGLONG zeroSectors; // Not kept; they're zeros again on restore
+};
+
+// Back up a whole drive (see BlockDeviceOpen) to a new backup file
+extern bool DriveBackup(const std::wstring& drive, const std::wstring& backupPath, bool overwrite, DriveBackupStats* pStats);
+
+// Restore a backup onto a whole drive. Without overwrite the drive must already hold floppy
+// images, so that a drive named by mistake isn't wiped. A drive image file grows to fit, and
+// the zeros in it are left as holes. What's written is checked against a CRC-32C of the
+// drive that was backed up.
+extern bool DriveRestore(const std::wstring& backupPath, const std::wstring& drive, bool overwrite, DriveBackupStats* pStats);
@@ -0,0 +1,149 @@
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <windows.h>
+
+#include "FloppyImage.h"
+#include "ThumbDriveImage.h"
+#include "WorkQueue.h"
+#include "ImagePool.h"
+#include "DriveWriter.h"
+#include "Checksum.h"
+#include "RunStats.h"
+
+ThumbDriveImageWriter::ThumbDriveImageWriter(BlockDevice* pDrive, ImagePool* pPool, DeltaStats* pDeltaStats, bool verify, VerifyStats* pVerifyStats, bool verbose)
+	: m_pDrive(pDrive), m_pPool(pPool), m_pDeltaStats(pDeltaStats), m_pVerifyStats(pVerifyStats), m_verbose(verbose)
+{
+	// Failure is reported by the first write
+	if (pDeltaStats != NULL)
+	{
+		m_pDeltaBuffer = (LPBYTE)VirtualAlloc(NULL, FLOPPY_IMAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	}
+
+	// The verifier reads back each image once the writer has flushed it. Both threads use the
+	// one device (a locked volume allows no other handle) with positional I/O.
+	if (verify)
+	{
+		m_verifier = std::thread(&ThumbDriveImageWriter::VerifyImages, this);
+	}
+}
+
+ThumbDriveImageWriter::~ThumbDriveImageWriter()
+{
+	Finish();
+	if (m_pDeltaBuffer != NULL)
+	{
+		VirtualFree(m_pDeltaBuffer, 0, MEM_RELEASE);
+	}
+}
+
+bool ThumbDriveImageWriter::Write(int imageNum, LPBYTE pImage, DWORD checksum)
+{
+	if (m_verbose) {
+		std::wcout << L"Writing image " << imageNum << std::endl;
+	}
+	TraceSpan span(L"write", imageNum);
+	bool success;
+	if (m_pDeltaStats == NULL)
+	{
+		success = ThumbDriveWriteImage(m_pDrive, imageNum, pImage);
+	}
+	else if (m_pDeltaBuffer == NULL)
+	{
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
+		success = false;
+	}
+	else
+	{
+		success = ThumbDriveWriteImageDelta(m_pDrive, imageNum, pImage, m_pDeltaBuffer, m_pDeltaStats);
+	}
+	if (!success)
+	{
+		std::wcerr << L"Failed to write image " << imageNum << L"." << std::endl;
+		m_failed = true;
+		ReleaseImage(pImage);
+		return false;
+	}
+
+	if (m_verifier.joinable())
+	{
+		ThumbDriveFlush(m_pDrive); // A failure shows up as a mismatch
+		m_written.Push({ imageNum, pImage, checksum });
+	}
+	else
+	{
+		ReleaseImage(pImage);
+	}
+	return true;
+}
+
+bool ThumbDriveImageWriter::Finish()
+{
+	m_written.Close();
+	if (m_verifier.joinable())
+	{
+		m_verifier.join();
+	}
+	return !m_failed && (m_pVerifyStats == NULL || m_pVerifyStats->failedImageNums.empty());
+}
+
+void ThumbDriveImageWriter::VerifyImages()
+{
+	LPBYTE pBuffer = (LPBYTE)VirtualAlloc(NULL, FLOPPY_IMAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	WrittenImage image;
+	while (m_written.Pop(image))
+	{
+		if (pBuffer == NULL)
+		{
+			m_pVerifyStats->failedImageNums.push_back(image.imageNum);
+			ReleaseImage(image.pImage);
+			continue;
+		}
+
+		TraceSpan span(L"verify", image.imageNum);
+		StatTimer timer(STAGE_VERIFY);
+		bool verified = false;
+		for (int attempt = 1; attempt <= VERIFY_ATTEMPTS; ++attempt)
+		{
+			if (attempt > 1)
+			{
+				std::wcerr << L"Image " << image.imageNum << L" did not read back correctly. Rewriting." << std::endl;
+				++m_pVerifyStats->rewriteCount;
+				if (!ThumbDriveWriteImage(m_pDrive, image.imageNum, image.pImage) || !ThumbDriveFlush(m_pDrive))
+				{
+					continue;
+				}
+			}
+
+			// Without reading past the cache there's no check to be made
+			if (!ThumbDriveDropCache(m_pDrive, image.imageNum))
+			{
+				break;
+			}
+
+			// Read errors are reported but count the same as a mismatch
+			if (ThumbDriveReadBlocks(m_pDrive, image.imageNum, 0, FLOPPY_IMAGE_SIZE, pBuffer) &&
+				Crc32c(pBuffer, FLOPPY_IMAGE_SIZE) == image.checksum)
+			{
+				verified = true;
+				break;
+			}
+		}
+
+		if (verified)
+			++m_pVerifyStats->verifiedCount;
+		else
+			m_pVerifyStats->failedImageNums.push_back(image.imageNum);
+		ReleaseImage(image.pImage);
+	}
+
+	if (pBuffer != NULL)
+		VirtualFree(pBuffer, 0, MEM_RELEASE);
+	else
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
+}
+
+void ThumbDriveImageWriter::ReleaseImage(LPBYTE pImage)
+{
+	if (m_pPool != NULL) m_pPool->Release(pImage);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+struct VerifyStats
+{
+	int verifiedCount;
+	int rewriteCount;
+	std::vector<int> failedImageNums;
+};
+
+class ImagePool;
+
+// Writes images to an open thumb drive as they're handed to it, in ascending order.
+// With pDeltaStats, only the changed parts of each image are written (see ThumbDriveWriteImageDelta),
+// each read back into the one buffer the writer keeps for it.
+// With verify, each image is flushed and then read back on a second thread while the next one is
+// written, and compared with the CRC-32C given for it. An image that doesn't match is rewritten and
+// checked again, up to VERIFY_ATTEMPTS times in all.
+// With pPool, each buffer is released to it once it's no longer needed: once written or, with
+// verify, once checked.
+const int VERIFY_ATTEMPTS = 3;
+class ThumbDriveImageWriter
+{
+public:
+	ThumbDriveImageWriter(BlockDevice* pDrive, ImagePool* pPool, DeltaStats* pDeltaStats, bool verify, VerifyStats* pVerifyStats, bool verbose);
+	~ThumbDriveImageWriter();
+
+	// Returns false on a write error, after which nothing more should be written
+	bool Write(int imageNum, LPBYTE pImage, DWORD checksum);
+
+	// Wait for the images written to be checked.
+	// Returns false on a write error or if any image failed verification.
+	bool Finish();
+
+private:
+	struct WrittenImage
+	{
+		int imageNum;
+		LPBYTE pImage;
+		DWORD checksum;
+	};
+
+	void VerifyImages();
+	void ReleaseImage(LPBYTE pImage);
+
+	BlockDevice* m_pDrive;
+	ImagePool* m_pPool;
+	DeltaStats* m_pDeltaStats;
+	LPBYTE m_pDeltaBuffer = NULL; // What's on the drive, for each delta write in turn
+	VerifyStats* m_pVerifyStats;
+	bool m_verbose;
+	bool m_failed = false;
+	WorkQueue<WrittenImage> m_written;
+	std::thread m_verifier;
+};
@@ -0,0 +1,419 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <cstring>
+
+#include "WinTypes.h"
+#include "FloppyImage.h"
+#include "FatTable.h"
+#include "CpuFeatures.h"
+#include "RunStats.h"
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#endif
+
+// FAT12 packs two 12-bit entries into three bytes:
+//   byte 0 = even entry bits 0-7
+//   byte 1 = even entry bits 8-11 (low nibble) | odd entry bits 0-3 (high nibble)
+//   byte 2 = odd entry bits 4-11
+// The bulk kernels below work on whole pairs. Unpaired entries at either end of
+// a range are handled one at a time.
+
+const unsigned int FAT_END_OF_CHAIN = 0xFFF;
+
+typedef void (*FatPairsDecoder)(LPBYTE pSrc, WORD* pDst, size_t pairs);
+typedef void (*FatPairsEncoder)(const WORD* pSrc, LPBYTE pDst, size_t pairs);
+
+struct FatKernels
+{
+	const wchar_t* name;
+	FatPairsDecoder decodePairs;
+	FatPairsEncoder encodePairs;
+};
+
+// Those this CPU can run, slowest (scalar) first
+static std::vector<FatKernels> ListKernels();
+static const std::vector<FatKernels>& Kernels();
+
+// Set by FatSelfTest to run each kernel in turn in place of the fastest
+static const FatKernels* g_pForcedKernels = NULL;
+
+template <class Geometry>
+bool FatSelfTestFormat(const FatKernels& kernels, const wchar_t* format);
+
+template <class Geometry>
+unsigned int GetFAT(LPBYTE pImage, unsigned int au)
+{
+	if (au < Geometry::FIRST_DATA_AU || au >= Geometry::END_DATA_AU) return 0xFFF; // Out of range
+	DWORD* pEntry = (DWORD*)(pImage + Geometry::FAT0_OFFSET + (au >> 1) * 3);
+	return (int)(((au & 0x01) == 0) ? *pEntry & 0x0FFF : (*pEntry >> 12) & 0xFFF);
+}
+
+template <class Geometry>
+void PutFAT(LPBYTE pImage, unsigned int au, unsigned int value)
+{
+	if (au < Geometry::FIRST_DATA_AU || au >= Geometry::END_DATA_AU) return; // Out of range
+	DWORD* pEntry0 = (DWORD*)(pImage + Geometry::FAT0_OFFSET + (au >> 1) * 3);
+	DWORD* pEntry1 = (DWORD*)(((BYTE*)pEntry0) + Geometry::FAT_SIZE);
+	DWORD newEntry;
+	if ((au & 0x01) == 0)
+	{
+		newEntry = (*pEntry0 & 0xFFFFF000) | (((DWORD)value) & 0x00000FFF);
+	}
+	else {
+		newEntry = (*pEntry0 & 0xFF000FFF) | ((((DWORD)value) << 12) & 0x00FFF000);
+	}
+	*pEntry0 = newEntry;
+	*pEntry1 = newEntry;
+}
+
+template <class Geometry>
+void PutFATChain(LPBYTE pImage, const std::vector<ClusterRun>& runs)
+{
+	std::vector<WORD> links;
+	for (size_t r = 0; r < runs.size(); ++r)
+	{
+		const ClusterRun& run = runs[r];
+		links.resize(run.count);
+		for (unsigned int i = 0; i + 1 < run.count; ++i)
+			links[i] = (WORD)(run.first + i + 1);
+		links[run.count - 1] = (WORD)((r + 1 < runs.size()) ? runs[r + 1].first : FAT_END_OF_CHAIN);
+		FatEncode<Geometry>(pImage, run.first, run.count, links.data());
+	}
+}
+
+// === Single entries at byte level (no unaligned DWORD access) ===
+
+static inline WORD DecodeEntry(LPBYTE pFat, unsigned int i)
+{
+	LPBYTE p = pFat + (i >> 1) * 3;
+	return (i & 1) == 0
+		? (WORD)(p[0] | ((p[1] & 0x0F) << 8))
+		: (WORD)((p[1] >> 4) | (p[2] << 4));
+}
+
+static inline void EncodeEntry(LPBYTE pFat, unsigned int i, WORD value)
+{
+	LPBYTE p = pFat + (i >> 1) * 3;
+	if ((i & 1) == 0)
+	{
+		p[0] = (BYTE)value;
+		p[1] = (BYTE)((p[1] & 0xF0) | ((value >> 8) & 0x0F));
+	}
+	else
+	{
+		p[1] = (BYTE)((p[1] & 0x0F) | ((value & 0x0F) << 4));
+		p[2] = (BYTE)(value >> 4);
+	}
+}
+
+// === Bulk decode/encode ===
+
+template <class Geometry>
+void FatDecode(LPBYTE pImage, unsigned int first, unsigned int count, WORD* pEntries)
+{
+	static const FatKernels& selected = Kernels().back();
+	FatPairsDecoder decodePairs = (g_pForcedKernels != NULL) ? g_pForcedKernels->decodePairs : selected.decodePairs;
+	StatAdd(STAT_FAT_ENTRIES, count);
+	LPBYTE pFat = pImage + Geometry::FAT0_OFFSET;
+	unsigned int i = first;
+	unsigned int end = first + count;
+	if (i < end && (i & 1) != 0)
+		*pEntries++ = DecodeEntry(pFat, i++);
+	size_t pairs = (end - i) / 2;
+	decodePairs(pFat + (i >> 1) * 3, pEntries, pairs);
+	pEntries += pairs * 2;
+	i += (unsigned int)(pairs * 2);
+	if (i < end)
+		*pEntries = DecodeEntry(pFat, i);
+}
+
+template <class Geometry>
+void FatEncode(LPBYTE pImage, unsigned int first, unsigned int count, const WORD* pEntries)
+{
+	if (count == 0) return;
+	static const FatKernels& selected = Kernels().back();
+	FatPairsEncoder encodePairs = (g_pForcedKernels != NULL) ? g_pForcedKernels->encodePairs : selected.encodePairs;
+	StatAdd(STAT_FAT_ENTRIES, count);
+	LPBYTE pFat = pImage + Geometry::FAT0_OFFSET;
+	unsigned int i = first;
+	unsigned int end = first + count;
+	if ((i & 1) != 0)
+		EncodeEntry(pFat, i++, *pEntries++);
+	size_t pairs = (end - i) / 2;
+	encodePairs(pEntries, pFat + (i >> 1) * 3, pairs);
+	pEntries += pairs * 2;
+	i += (unsigned int)(pairs * 2);
+	if (i < end)
+		EncodeEntry(pFat, i, *pEntries);
+
+	// Mirror the bytes touched into FAT1
+	size_t byteFirst = (first >> 1) * 3;
+	size_t byteEnd = ((end - 1) >> 1) * 3 + 3;
+	memcpy(pFat + Geometry::FAT_SIZE + byteFirst, pFat + byteFirst, byteEnd - byteFirst);
+}
+
+#define INSTANTIATE_FAT_TABLE(Geometry) \
+	template unsigned int GetFAT<Geometry>(LPBYTE pImage, unsigned int au); \
+	template void PutFAT<Geometry>(LPBYTE pImage, unsigned int au, unsigned int value); \
+	template void PutFATChain<Geometry>(LPBYTE pImage, const std::vector<ClusterRun>& runs); \
+	template void FatDecode<Geometry>(LPBYTE pImage, unsigned int first, unsigned int count, WORD* pEntries); \
+	template void FatEncode<Geometry>(LPBYTE pImage, unsigned int first, unsigned int count, const WORD* pEntries);
+
+INSTANTIATE_FAT_TABLE(Floppy720K)
+INSTANTIATE_FAT_TABLE(Floppy1200K)
+INSTANTIATE_FAT_TABLE(Floppy1440K)
+INSTANTIATE_FAT_TABLE(Floppy2880K)
+
+// --- Scalar ---
+
+static void DecodePairsScalar(LPBYTE pSrc, WORD* pDst, size_t pairs)
+{
+	for (size_t n = 0; n < pairs; ++n, pSrc += 3, pDst += 2)
+	{
+		pDst[0] = (WORD)(pSrc[0] | ((pSrc[1] & 0x0F) << 8));
+		pDst[1] = (WORD)((pSrc[1] >> 4) | (pSrc[2] << 4));
+	}
+}
+
+static void EncodePairsScalar(const WORD* pSrc, LPBYTE pDst, size_t pairs)
+{
+	for (size_t n = 0; n < pairs; ++n, pSrc += 2, pDst += 3)
+	{
+		pDst[0] = (BYTE)pSrc[0];
+		pDst[1] = (BYTE)(((pSrc[0] >> 8) & 0x0F) | ((pSrc[1] & 0x0F) << 4));
+		pDst[2] = (BYTE)(pSrc[1] >> 4);
+	}
+}
+
+#if defined(CPU_X86)
+
+// --- SSSE3: 8 entries (12 bytes) per step ---
+// Decode gathers the two bytes holding each entry into a 16-bit lane, shifts the even
+// lanes left 4 (by multiplying by 16) and then every lane right 4, which leaves the
+// low 12 bits of an even entry and the high 12 bits of an odd one.
+// Encode combines each pair into 24 bits (even + odd * 4096) and packs 3 bytes per pair.
+// The 16-byte loads read up to 4 bytes past the last pair. That's safe because FAT0 is
+// followed by FAT1 and FAT1 by the root directory, so only whole-step stores are done.
+
+CPU_TARGET("ssse3")
+static void DecodePairsSsse3(LPBYTE pSrc, WORD* pDst, size_t pairs)
+{
+	const __m128i gather = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+	const __m128i evenShift = _mm_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1);
+	size_t n = 0;
+	for (; n + 4 <= pairs; n += 4, pSrc += 12, pDst += 8)
+	{
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)pSrc), gather);
+		v = _mm_srli_epi16(_mm_mullo_epi16(v, evenShift), 4);
+		_mm_storeu_si128((__m128i*)pDst, v);
+	}
+	DecodePairsScalar(pSrc, pDst, pairs - n);
+}
+
+CPU_TARGET("ssse3")
+static void EncodePairsSsse3(const WORD* pSrc, LPBYTE pDst, size_t pairs)
+{
+	const __m128i mask12 = _mm_set1_epi16(0x0FFF);
+	const __m128i combine = _mm_setr_epi16(1, 4096, 1, 4096, 1, 4096, 1, 4096);
+	const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	size_t n = 0;
+	for (; n + 4 <= pairs; n += 4, pSrc += 8, pDst += 12)
+	{
+		__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)pSrc), mask12);
+		v = _mm_shuffle_epi8(_mm_madd_epi16(v, combine), pack);
+		_mm_storel_epi64((__m128i*)pDst, v);
+		int high = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+		memcpy(pDst + 8, &high, 4);
+	}
+	EncodePairsScalar(pSrc, pDst, pairs - n);
+}
+
+// --- AVX2: 16 entries (24 bytes) per step, 12 bytes in each 128-bit lane ---
+
+CPU_TARGET("avx2")
+static void DecodePairsAvx2(LPBYTE pSrc, WORD* pDst, size_t pairs)
+{
+	const __m256i gather = _mm256_setr_epi8(
+		0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11,
+		0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+	const __m256i evenShift = _mm256_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1);
+	size_t n = 0;
+	for (; n + 8 <= pairs; n += 8, pSrc += 24, pDst += 16)
+	{
+		__m256i v = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)pSrc)),
+			_mm_loadu_si128((const __m128i*)(pSrc + 12)), 1);
+		v = _mm256_shuffle_epi8(v, gather);
+		v = _mm256_srli_epi16(_mm256_mullo_epi16(v, evenShift), 4);
+		_mm256_storeu_si256((__m256i*)pDst, v);
+	}
+	DecodePairsSsse3(pSrc, pDst, pairs - n);
+}
+
+CPU_TARGET("avx2")
+static void EncodePairsAvx2(const WORD* pSrc, LPBYTE pDst, size_t pairs)
+{
+	const __m256i mask12 = _mm256_set1_epi16(0x0FFF);
+	const __m256i combine = _mm256_setr_epi16(1, 4096, 1, 4096, 1, 4096, 1, 4096, 1, 4096, 1, 4096, 1, 4096, 1, 4096);
+	const __m256i pack = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	size_t n = 0;
+	for (; n + 8 <= pairs; n += 8, pSrc += 16, pDst += 24)
+	{
+		__m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)pSrc), mask12);
+		v = _mm256_shuffle_epi8(_mm256_madd_epi16(v, combine), pack);
+		__m128i lo = _mm256_castsi256_si128(v);
+		__m128i hi = _mm256_extracti128_si256(v, 1);
+		// Lane 0 may spill 4 zero bytes into lane 1's spot; lane 1 then overwrites them
+		_mm_storeu_si128((__m128i*)pDst, lo);
+		_mm_storel_epi64((__m128i*)(pDst + 12), hi);
+		int high = _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+		memcpy(pDst + 20, &high, 4);
+	}
+	EncodePairsSsse3(pSrc, pDst, pairs - n);
+}
+
+static std::vector<FatKernels> ListKernels()
+{
+	std::vector<FatKernels> kernels = { { L"scalar", DecodePairsScalar, EncodePairsScalar } };
+	if (CpuHasSsse3()) kernels.push_back({ L"ssse3", DecodePairsSsse3, EncodePairsSsse3 });
+	if (CpuHasAvx2()) kernels.push_back({ L"avx2", DecodePairsAvx2, EncodePairsAvx2 });
+	return kernels;
+}
+
+#else
+
+static std::vector<FatKernels> ListKernels()
+{
+	return { { L"scalar", DecodePairsScalar, EncodePairsScalar } };
+}
+
+#endif
+
+static const std::vector<FatKernels>& Kernels()
+{
+	static const std::vector<FatKernels> kernels = ListKernels();
+	return kernels;
+}
+
+// === Self-test ===
+
+bool FatSelfTest()
+{
+	bool result = true;
+	for (const FatKernels& kernels : Kernels())
+	{
+		g_pForcedKernels = &kernels;
+		bool passed = FatSelfTestFormat<Floppy720K>(kernels, L"720K")
+			&& FatSelfTestFormat<Floppy1200K>(kernels, L"1.2M")
+			&& FatSelfTestFormat<Floppy1440K>(kernels, L"1.44M")
+			&& FatSelfTestFormat<Floppy2880K>(kernels, L"2.88M");
+		std::wcout << L"FAT kernels (" << kernels.name << L"): " << (passed ? L"passed" : L"FAILED") << std::endl;
+		result = result && passed;
+	}
+	g_pForcedKernels = NULL;
+	return result;
+}
+
+// Compare FatDecode and FatEncode with GetFAT and PutFAT over random FATs. Ranges start and
+// end on both odd and even entries, and run from none to the whole FAT, so that the bulk
+// kernels, the single entries at either end and the tails the kernels leave are all covered.
+// Entries 0 and 1, which GetFAT and PutFAT won't touch, are checked a byte at a time.
+template <class Geometry>
+bool FatSelfTestFormat(const FatKernels& kernels, const wchar_t* format)
+{
+	const int ITERATIONS = 400;
+	const unsigned int entryCount = (unsigned int)Geometry::END_DATA_AU;
+	std::mt19937 random(12345); // The same cases every run, so a failure can be repeated
+	std::vector<BYTE> original(Geometry::DATA_OFFSET);
+	std::vector<BYTE> expected(Geometry::DATA_OFFSET);
+	std::vector<BYTE> actual(Geometry::DATA_OFFSET);
+	std::vector<WORD> entries(entryCount);
+	for (int iteration = 0; iteration < ITERATIONS; ++iteration)
+	{
+		// Every other case, the FATs differ so that what FatEncode mirrors can be seen
+		for (auto& b : original) b = (BYTE)random();
+		bool sameFats = (iteration & 1) == 0;
+		if (sameFats)
+		{
+			memcpy(&original[Geometry::FAT1_OFFSET], &original[Geometry::FAT0_OFFSET], Geometry::FAT_SIZE);
+		}
+
+		// Short ranges are the likelier to go wrong at the edges, so most are short
+		unsigned int first;
+		unsigned int count;
+		switch (iteration % 4)
+		{
+		case 0: first = 0; count = entryCount - (unsigned int)(random() % 2); break;
+		case 1: first = (unsigned int)(random() % entryCount); count = (unsigned int)(random() % (entryCount - first + 1)); break;
+		default: first = (unsigned int)(random() % entryCount); count = (std::min)((unsigned int)(random() % 40), entryCount - first); break;
+		}
+		std::wstring where = std::wstring(L" (") + kernels.name + L", " + format + L", first " + std::to_wstring(first) + L", count " + std::to_wstring(count) + L")";
+
+		memcpy(actual.data(), original.data(), actual.size());
+		FatDecode<Geometry>(actual.data(), first, count, entries.data());
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			unsigned int au = first + i;
+			unsigned int value = (au < Geometry::FIRST_DATA_AU) ? DecodeEntry(&original[Geometry::FAT0_OFFSET], au) : GetFAT<Geometry>(original.data(), au);
+			if (entries[i] != value)
+			{
+				std::wcerr << L"FatDecode differs from GetFAT at entry " << au << where << std::endl;
+				return false;
+			}
+		}
+		if (memcmp(actual.data(), original.data(), actual.size()) != 0)
+		{
+			std::wcerr << L"FatDecode changed the image" << where << std::endl;
+			return false;
+		}
+
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			entries[i] = (WORD)(random() & 0x0FFF);
+		}
+		memcpy(expected.data(), original.data(), expected.size());
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			unsigned int au = first + i;
+			if (au < Geometry::FIRST_DATA_AU)
+			{
+				EncodeEntry(&expected[Geometry::FAT0_OFFSET], au, entries[i]);
+				EncodeEntry(&expected[Geometry::FAT1_OFFSET], au, entries[i]);
+			}
+			else
+			{
+				PutFAT<Geometry>(expected.data(), au, entries[i]);
+			}
+		}
+		FatEncode<Geometry>(actual.data(), first, count, entries.data());
+		if (memcmp(&actual[0], &expected[0], Geometry::FAT1_OFFSET) != 0
+			|| memcmp(&actual[Geometry::ROOT_DIR_OFFSET], &expected[Geometry::ROOT_DIR_OFFSET], Geometry::DATA_OFFSET - Geometry::ROOT_DIR_OFFSET) != 0)
+		{
+			std::wcerr << L"FatEncode differs from PutFAT" << where << std::endl;
+			return false;
+		}
+
+		// FAT1 must hold FAT0's bytes where entries were written and be untouched elsewhere.
+		// PutFAT writes a whole DWORD to FAT1, so only with the FATs the same can it be compared.
+		size_t byteFirst = (first >> 1) * 3;
+		size_t byteEnd = (count == 0) ? byteFirst : ((first + count - 1) >> 1) * 3 + 3;
+		for (size_t offset = 0; offset < Geometry::FAT_SIZE; ++offset)
+		{
+			bool written = offset >= byteFirst && offset < byteEnd;
+			BYTE mirror = actual[Geometry::FAT1_OFFSET + offset];
+			if (mirror != (written ? actual[Geometry::FAT0_OFFSET + offset] : original[Geometry::FAT1_OFFSET + offset])
+				|| (sameFats && mirror != expected[Geometry::FAT1_OFFSET + offset]))
+			{
+				std::wcerr << L"FatEncode mirrored FAT1 wrongly at byte " << offset << where << std::endl;
+				return false;
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+// A run of consecutive allocation units (clusters)
+struct ClusterRun
+{
+	unsigned int first;
+	unsigned int count;
+};
+
+const unsigned int FLOPPY_FAT_ENTRIES = (unsigned int)(FLOPPY_FAT_SIZE * 2 / 3);
+
+// Each function is specialized for a floppy format, 1.44 MB unless specified
+template <class Geometry = Floppy1440K>
+unsigned int GetFAT(LPBYTE pImage, unsigned int au);
+template <class Geometry = Floppy1440K>
+void PutFAT(LPBYTE pImage, unsigned int au, unsigned int value);
+
+// Bulk access to a range of FAT entries. Entries 0 and 1 (the media descriptor) may be
+// included. first + count must not exceed the number of entries in the FAT.
+// FatDecode reads FAT0. FatEncode writes FAT0 and mirrors the bytes it changed into FAT1.
+template <class Geometry = Floppy1440K>
+void FatDecode(LPBYTE pImage, unsigned int first, unsigned int count, WORD* pEntries);
+template <class Geometry = Floppy1440K>
+void FatEncode(LPBYTE pImage, unsigned int first, unsigned int count, const WORD* pEntries);
+
+// Check FatDecode and FatEncode against GetFAT and PutFAT on random FATs of every format, with
+// each of the kernels (scalar, SSSE3, AVX2) this CPU can run in turn. Prints the outcome for
+// each kernel and any difference found. Returns false if there was one.
+extern bool FatSelfTest();
+
+// Write the FAT entries linking a chain made of one or more runs and terminate it.
+template <class Geometry = Floppy1440K>
+void PutFATChain(LPBYTE pImage, const std::vector<ClusterRun>& runs);
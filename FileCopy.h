@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// File copies done by the operating system rather than through a buffer in this process.
+// Where the file system supports it the data is cloned (ReFS block cloning, btrfs/XFS
+// reflinks) so that nothing is copied at all.
+
+// Copy a whole file. Errors are reported. Falls back to an ordinary copy where needed.
+extern bool FileCopyWhole(const std::wstring& srcPath, const std::wstring& dstPath, bool overwrite);
+
+// Copy the first length bytes of a file into an existing file at dstOffset.
+// Returns false, without reporting, if the system can't do it; the caller should
+// then copy the data itself.
+extern bool FileCopyRange(const std::wstring& srcPath, const std::wstring& dstPath, uint64_t dstOffset, uint64_t length);
@@ -0,0 +1,150 @@
+#if !defined(_WIN32)
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+#include "FileCopy.h"
+#include "BlockDevice.h"
+#include "ZeroScan.h"
+
+const size_t FILE_COPY_BUFFER_SIZE = 0x40000;
+
+bool CopyInKernel(int srcFd, int dstFd, uint64_t dstOffset, uint64_t length);
+bool CopyBuffered(int srcFd, int dstFd, uint64_t length);
+
+bool FileCopyWhole(const std::wstring& srcPath, const std::wstring& dstPath, bool overwrite)
+{
+	int srcFd = open(ToUtf8(srcPath).c_str(), O_RDONLY | O_CLOEXEC);
+	if (srcFd < 0)
+	{
+		std::wcerr << L"Failed to open source file: " << srcPath << L": " << strerror(errno) << std::endl;
+		return false;
+	}
+	struct stat info;
+	if (fstat(srcFd, &info) != 0)
+	{
+		std::wcerr << L"Failed to get source file size: " << srcPath << L": " << strerror(errno) << std::endl;
+		close(srcFd);
+		return false;
+	}
+
+	int dstFd = open(ToUtf8(dstPath).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (overwrite ? O_TRUNC : O_EXCL), 0644);
+	if (dstFd < 0)
+	{
+		std::wcerr << L"Failed to open destination file: " << dstPath << L": " << strerror(errno) << std::endl;
+		close(srcFd);
+		return false;
+	}
+
+	// Clone, else copy in the kernel, else copy through a buffer
+	bool result = true;
+#if defined(FICLONE)
+	if (ioctl(dstFd, FICLONE, srcFd) != 0)
+#endif
+	{
+		if (!CopyInKernel(srcFd, dstFd, 0, (uint64_t)info.st_size))
+		{
+			result = CopyBuffered(srcFd, dstFd, (uint64_t)info.st_size);
+		}
+	}
+	if (!result)
+	{
+		std::wcerr << L"Failed to copy " << srcPath << L" to " << dstPath << L": " << strerror(errno) << std::endl;
+	}
+
+	close(dstFd);
+	close(srcFd);
+	return result;
+}
+
+bool FileCopyRange(const std::wstring& srcPath, const std::wstring& dstPath, uint64_t dstOffset, uint64_t length)
+{
+	int srcFd = open(ToUtf8(srcPath).c_str(), O_RDONLY | O_CLOEXEC);
+	if (srcFd < 0)
+	{
+		return false;
+	}
+	int dstFd = open(ToUtf8(dstPath).c_str(), O_WRONLY | O_CLOEXEC);
+	if (dstFd < 0)
+	{
+		close(srcFd);
+		return false;
+	}
+
+	bool result = false;
+#if defined(FICLONERANGE)
+	struct file_clone_range range = {};
+	range.src_fd = srcFd;
+	range.src_offset = 0;
+	range.src_length = length;
+	range.dest_offset = dstOffset;
+	result = (ioctl(dstFd, FICLONERANGE, &range) == 0);
+#endif
+	if (!result)
+	{
+		result = CopyInKernel(srcFd, dstFd, dstOffset, length);
+	}
+
+	close(dstFd);
+	close(srcFd);
+	return result;
+}
+
+bool CopyInKernel(int srcFd, int dstFd, uint64_t dstOffset, uint64_t length)
+{
+#if defined(__linux__)
+	loff_t srcPos = 0;
+	loff_t dstPos = (loff_t)dstOffset;
+	while ((uint64_t)srcPos < length)
+	{
+		ssize_t count = copy_file_range(srcFd, &srcPos, dstFd, &dstPos, (size_t)(length - srcPos), 0);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return false; // Unsupported (ENOSYS, EXDEV, EINVAL, ...), failed or short source
+	}
+	return true;
+#else
+	(void)srcFd; (void)dstFd; (void)dstOffset; (void)length;
+	return false;
+#endif
+}
+
+// The destination must be new or truncated: chunks of zeros are skipped, leaving holes
+bool CopyBuffered(int srcFd, int dstFd, uint64_t length)
+{
+	std::vector<char> buffer(FILE_COPY_BUFFER_SIZE);
+	uint64_t done = 0;
+	while (done < length)
+	{
+		size_t chunk = (size_t)std::min<uint64_t>(buffer.size(), length - done);
+		ssize_t count = pread(srcFd, buffer.data(), chunk, (off_t)done);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return false;
+		if (IsAllZero(buffer.data(), (size_t)count))
+		{
+			done += (uint64_t)count;
+			continue;
+		}
+		for (ssize_t written = 0; written < count; )
+		{
+			ssize_t n = pwrite(dstFd, buffer.data() + written, (size_t)(count - written), (off_t)(done + written));
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			written += n;
+		}
+		done += (uint64_t)count;
+	}
+	return ftruncate(dstFd, (off_t)length) == 0; // Over any zeros skipped at the end
+}
+
+#endif
@@ -0,0 +1,50 @@
+#if defined(_WIN32)
+
+#include <iostream>
+#include <string>
+#include <windows.h>
+
+#include "FileCopy.h"
+#include "WinHelp.h"
+
+bool FileCopyWhole(const std::wstring& srcPath, const std::wstring& dstPath, bool overwrite)
+{
+	// CopyFileEx copies in the kernel and uses block cloning on volumes that support it
+	if (!CopyFileExW(srcPath.c_str(), dstPath.c_str(), NULL, NULL, NULL, overwrite ? 0 : COPY_FILE_FAIL_IF_EXISTS))
+	{
+		std::wcerr << L"Failed to copy " << srcPath << L" to " << dstPath << std::endl;
+		ReportError(GetLastError());
+		return false;
+	}
+	return true;
+}
+
+bool FileCopyRange(const std::wstring& srcPath, const std::wstring& dstPath, uint64_t dstOffset, uint64_t length)
+{
+	// Windows only copies part of a file in the kernel by cloning it, which needs ReFS
+	HANDLE hSrc = CreateFileW(srcPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hSrc == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	HANDLE hDst = CreateFileW(dstPath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hDst == INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hSrc);
+		return false;
+	}
+
+	DUPLICATE_EXTENTS_DATA extents = {};
+	extents.FileHandle = hSrc;
+	extents.SourceFileOffset.QuadPart = 0;
+	extents.TargetFileOffset.QuadPart = (LONGLONG)dstOffset;
+	extents.ByteCount.QuadPart = (LONGLONG)length;
+	DWORD bytesReturned;
+	bool result = DeviceIoControl(hDst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), NULL, 0, &bytesReturned, NULL) != FALSE;
+
+	CloseHandle(hDst);
+	CloseHandle(hSrc);
+	return result;
+}
+
+#endif
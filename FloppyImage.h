@@ -1,30 +1,105 @@
 #pragma once
 
 const WORD FLOPPY_MAGIC_NUMBER = 0xAA55;
-const size_t FLOPPY_BLOCK_SIZE = 512; // 0x0200
-const size_t FLOPPY_BLOCKS_PER_AU = 1; // AU = Allocation Unit
-const size_t FLOPPY_AU_SIZE = FLOPPY_BLOCKS_PER_AU * FLOPPY_BLOCK_SIZE;
-const size_t FLOPPY_BLOCKS_PER_DISK = 2880;
-const size_t FLOPPY_IMAGE_SIZE = FLOPPY_BLOCKS_PER_DISK * FLOPPY_BLOCK_SIZE;
-const size_t FLOPPY_IMAGE_INTERVAL = 0x180000; // Interval, in bytes, between beginnings of images on the thumb drive
-const size_t FLOPPY_FAT0_OFFSET = FLOPPY_BLOCK_SIZE;
-const size_t FLOPPY_BLOCKS_PER_FAT = 9;
-const size_t FLOPPY_FAT_SIZE = FLOPPY_BLOCK_SIZE * FLOPPY_BLOCKS_PER_FAT;
-const size_t FLOPPY_FAT1_OFFSET = FLOPPY_FAT0_OFFSET + FLOPPY_FAT_SIZE;
-const size_t FLOPPY_BLOCKS_IN_DIR = 14;
-const size_t FLOPPY_FIRST_DATA_AU = 2;
-const size_t FLOPPY_DATA_AU_PER_DISK = (FLOPPY_BLOCKS_PER_DISK - (1 + FLOPPY_BLOCKS_PER_FAT*2 + FLOPPY_BLOCKS_IN_DIR)) / FLOPPY_BLOCKS_PER_AU;
-const size_t FLOPPY_ROOT_DIR_OFFSET = FLOPPY_FAT0_OFFSET + (FLOPPY_FAT_SIZE * 2);
-const size_t FLOPPY_ROOT_DIR_ENTRIES = 224;
-const size_t FLOPPY_DATA_OFFSET = FLOPPY_ROOT_DIR_OFFSET + FLOPPY_BLOCKS_IN_DIR * FLOPPY_BLOCK_SIZE;
+
+// The layout of a FAT12 floppy: 512-byte blocks, the boot sector, two FATs, the root
+// directory and then the data area. Each format is its own type so that code working on
+// images can be specialized for it at compile time. Interval is the distance, in bytes,
+// between the beginnings of images on a thumb drive.
+template <size_t BlocksPerDisk, size_t BlocksPerAu, size_t BlocksPerFat, size_t RootDirEntries, BYTE MediaDescriptor, size_t BlocksPerTrack, size_t Interval>
+struct FloppyGeometry
+{
+	static constexpr size_t BLOCK_SIZE = 512; // 0x0200
+	static constexpr size_t BLOCKS_PER_AU = BlocksPerAu; // AU = Allocation Unit
+	static constexpr size_t AU_SIZE = BLOCKS_PER_AU * BLOCK_SIZE;
+	static constexpr size_t BLOCKS_PER_DISK = BlocksPerDisk;
+	static constexpr size_t BLOCKS_PER_TRACK = BlocksPerTrack;
+	static constexpr BYTE MEDIA_DESCRIPTOR = MediaDescriptor;
+	static constexpr size_t IMAGE_SIZE = BLOCKS_PER_DISK * BLOCK_SIZE;
+	static constexpr size_t IMAGE_INTERVAL = Interval;
+	static constexpr size_t FAT0_OFFSET = BLOCK_SIZE;
+	static constexpr size_t BLOCKS_PER_FAT = BlocksPerFat;
+	static constexpr size_t FAT_SIZE = BLOCK_SIZE * BLOCKS_PER_FAT;
+	static constexpr size_t FAT1_OFFSET = FAT0_OFFSET + FAT_SIZE;
+	static constexpr size_t ROOT_DIR_ENTRIES = RootDirEntries;
+	static constexpr size_t BLOCKS_IN_DIR = ROOT_DIR_ENTRIES * 32 / BLOCK_SIZE;
+	static constexpr size_t FIRST_DATA_AU = 2;
+	static constexpr size_t DATA_AU_PER_DISK = (BLOCKS_PER_DISK - (1 + BLOCKS_PER_FAT*2 + BLOCKS_IN_DIR)) / BLOCKS_PER_AU;
+	static constexpr size_t END_DATA_AU = FIRST_DATA_AU + DATA_AU_PER_DISK; // One past the last data AU
+	static constexpr size_t ROOT_DIR_OFFSET = FAT0_OFFSET + (FAT_SIZE * 2);
+	static constexpr size_t DATA_OFFSET = ROOT_DIR_OFFSET + BLOCKS_IN_DIR * BLOCK_SIZE;
+
+	static_assert(IMAGE_INTERVAL >= IMAGE_SIZE, "Images on a thumb drive can't overlap");
+	static_assert(END_DATA_AU <= FAT_SIZE * 2 / 3, "The FAT must have an entry for every AU");
+};
+
+typedef FloppyGeometry<1440, 2, 3, 112, 0xF9, 9, 0xC0000> Floppy720K;
+typedef FloppyGeometry<2400, 1, 7, 224, 0xF9, 15, 0x140000> Floppy1200K;
+typedef FloppyGeometry<2880, 1, 9, 224, 0xF0, 18, 0x180000> Floppy1440K;
+typedef FloppyGeometry<5760, 2, 9, 240, 0xF0, 36, 0x300000> Floppy2880K;
+
+// 1.44 MB is the format of the PianoDisc drives and the default throughout
+const size_t FLOPPY_BLOCK_SIZE = Floppy1440K::BLOCK_SIZE;
+const size_t FLOPPY_BLOCKS_PER_AU = Floppy1440K::BLOCKS_PER_AU;
+const size_t FLOPPY_AU_SIZE = Floppy1440K::AU_SIZE;
+const size_t FLOPPY_BLOCKS_PER_DISK = Floppy1440K::BLOCKS_PER_DISK;
+const size_t FLOPPY_IMAGE_SIZE = Floppy1440K::IMAGE_SIZE;
+const size_t FLOPPY_IMAGE_INTERVAL = Floppy1440K::IMAGE_INTERVAL;
+const size_t FLOPPY_FAT0_OFFSET = Floppy1440K::FAT0_OFFSET;
+const size_t FLOPPY_BLOCKS_PER_FAT = Floppy1440K::BLOCKS_PER_FAT;
+const size_t FLOPPY_FAT_SIZE = Floppy1440K::FAT_SIZE;
+const size_t FLOPPY_FAT1_OFFSET = Floppy1440K::FAT1_OFFSET;
+const size_t FLOPPY_BLOCKS_IN_DIR = Floppy1440K::BLOCKS_IN_DIR;
+const size_t FLOPPY_FIRST_DATA_AU = Floppy1440K::FIRST_DATA_AU;
+const size_t FLOPPY_DATA_AU_PER_DISK = Floppy1440K::DATA_AU_PER_DISK;
+const size_t FLOPPY_END_DATA_AU = Floppy1440K::END_DATA_AU;
+const size_t FLOPPY_ROOT_DIR_OFFSET = Floppy1440K::ROOT_DIR_OFFSET;
+const size_t FLOPPY_ROOT_DIR_ENTRIES = Floppy1440K::ROOT_DIR_ENTRIES;
+const size_t FLOPPY_DATA_OFFSET = Floppy1440K::DATA_OFFSET;
+
+// The largest image of any format, for buffers that may hold any of them
+const size_t FLOPPY_MAX_IMAGE_SIZE = Floppy2880K::IMAGE_SIZE;
+
+enum FloppyFormat
+{
+	FLOPPY_FORMAT_UNKNOWN,
+	FLOPPY_FORMAT_720K,
+	FLOPPY_FORMAT_1200K,
+	FLOPPY_FORMAT_1440K,
+	FLOPPY_FORMAT_2880K,
+};
+
+// BIOS Parameter Block fields of the boot sector
+const size_t BPB_BLOCK_SIZE_OFFSET = 0x0B;
+const size_t BPB_BLOCKS_PER_AU_OFFSET = 0x0D;
+const size_t BPB_RESERVED_BLOCKS_OFFSET = 0x0E;
+const size_t BPB_FAT_COUNT_OFFSET = 0x10;
+const size_t BPB_ROOT_DIR_ENTRIES_OFFSET = 0x11;
+const size_t BPB_BLOCKS_PER_DISK_OFFSET = 0x13;
+const size_t BPB_MEDIA_DESCRIPTOR_OFFSET = 0x15;
+const size_t BPB_BLOCKS_PER_FAT_OFFSET = 0x16;
+const size_t BPB_BLOCKS_PER_TRACK_OFFSET = 0x18;
 
 const size_t BOOTSECTOR_SERIALNUM_OFFSET = 0x27;
 const size_t BOOTSECTOR_SERIALNUM_LEN = 0x04;
 const size_t BOOTSECTOR_LABEL_OFFSET = 0x2B;
 const size_t BOOTSECTOR_LABEL_LEN = 0x0B;
 
+const BYTE ATTR_VOLUME_LABEL = 0x08;
+const BYTE ATTR_DIRECTORY = 0x10;
+const BYTE ATTR_LONG_NAME = 0x0F;
+
 extern BYTE BootSector[512];
 
+// Whether a boot sector's BPB describes the given format (1.44 MB unless specified)
+template <class Geometry = Floppy1440K>
+bool HasFloppyImageHeader(LPBYTE pBootSector);
+
+// The format described by a boot sector's BPB, so that images of any format can be read
+extern FloppyFormat GetFloppyFormat(LPBYTE pBootSector);
+extern size_t GetFloppyImageSize(FloppyFormat format);
+extern const wchar_t* GetFloppyFormatName(FloppyFormat format);
+
 #pragma pack( push, 1)
 struct FloppyDateTime
 {
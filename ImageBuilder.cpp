@@ -0,0 +1,168 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <bitset>
+#include <windows.h>
+
+#include "FloppyImage.h"
+#include "Smf.h"
+#include "WorkQueue.h"
+#include "ImagePool.h"
+#include "ImageBuilder.h"
+#include "MidiImage.h"
+#include "BuildCache.h"
+#include "ImageFile.h"
+#include "ThumbDriveImage.h"
+#include "Checksum.h"
+#include "RunStats.h"
+
+bool BuildMidiImage(const std::vector<std::wstring>& midiPaths, LPBYTE pImage, const BuildOptions& options)
+{
+	const SmfMinimizeOptions* pMinimize = options.minimize ? &options.minimizeOptions : NULL;
+	switch (options.format)
+	{
+	case FLOPPY_FORMAT_720K: return MidiToImage<Floppy720K>(midiPaths, pImage, options.deterministic, pMinimize, options.validation);
+	case FLOPPY_FORMAT_1200K: return MidiToImage<Floppy1200K>(midiPaths, pImage, options.deterministic, pMinimize, options.validation);
+	case FLOPPY_FORMAT_2880K: return MidiToImage<Floppy2880K>(midiPaths, pImage, options.deterministic, pMinimize, options.validation);
+	default: break;
+	}
+	if (options.cacheDir.length() == 0)
+	{
+		return MidiToImage(midiPaths, pImage, options.deterministic, pMinimize, options.validation);
+	}
+	bool cacheHit;
+	if (!MidiToImageCached(midiPaths, pImage, options.cacheDir, pMinimize, options.validation, &cacheHit))
+	{
+		return false;
+	}
+	if (options.verbose)
+	{
+		// One write per line so that lines from different builders don't interleave
+		std::wcout << (cacheHit ? L"Cache hit\n" : L"Cache miss\n");
+	}
+	return true;
+}
+
+bool BuildImage(const ImageSource& source, LPBYTE pImage, const BuildOptions& options)
+{
+	if (source.midiPaths.size() > 0)
+	{
+		return BuildMidiImage(source.midiPaths, pImage, options);
+	}
+
+	return (source.srcImageNum >= 0)
+		? ThumbDriveRead(source.srcImg, source.srcImageNum, pImage)
+		: ImageFileRead(source.srcImg, pImage);
+}
+
+struct BuiltImage
+{
+	int imageNum;
+	LPBYTE pImage;
+	DWORD checksum;
+	bool built;
+};
+
+bool BuildImages(const std::map<int, ImageSource>& sources, const BuildOptions& options, ImagePool& pool, const ImageConsumer& consume)
+{
+	WorkQueue<int> jobs;
+	WorkQueue<BuiltImage> built;
+	std::atomic<bool> stop(false);
+
+	// A builder takes a buffer before it takes an image to build. The lowest image not yet
+	// consumed is then always either built or being built, whatever the size of the pool.
+	unsigned int workerCount = (std::max)(1u, std::thread::hardware_concurrency());
+	std::vector<std::thread> workers;
+	for (unsigned int i = 0; i < workerCount; ++i)
+	{
+		workers.emplace_back([&]()
+		{
+			for (;;)
+			{
+				LPBYTE pImage = pool.Acquire();
+				int imageNum;
+				if (!jobs.Pop(imageNum))
+				{
+					pool.Release(pImage);
+					break;
+				}
+
+				// After a failure the rest are passed through unbuilt
+				BuiltImage image = { imageNum, pImage, 0, false };
+				if (!stop)
+				{
+					if (options.verbose)
+					{
+						std::wcout << (L"Building image " + std::to_wstring(imageNum) + L"\n");
+					}
+					TraceSpan span(L"build", imageNum);
+					image.built = BuildImage(sources.at(imageNum), pImage, options);
+					if (!image.built)
+					{
+						std::wcerr << (L"Failed to build image " + std::to_wstring(imageNum) + L".\n");
+					}
+					else if (options.checksum)
+					{
+						// While it's still in the cache
+						image.checksum = Crc32c(pImage, FLOPPY_IMAGE_SIZE);
+					}
+				}
+				built.Push(image);
+			}
+		});
+	}
+	for (const auto& source : sources)
+	{
+		jobs.Push(source.first);
+	}
+	jobs.Close();
+
+	// Hand over the images in order as they're finished, holding back any that finish early
+	bool result = true;
+	std::map<int, BuiltImage> finished;
+	auto next = sources.begin();
+	BuiltImage image;
+	while (next != sources.end() && built.Pop(image))
+	{
+		finished[image.imageNum] = image;
+		for (auto it = finished.find(next->first); it != finished.end(); it = finished.find(next->first))
+		{
+			if (result && it->second.built)
+			{
+				// The consumer takes the buffer, whether or not it succeeds
+				result = consume(it->second.imageNum, it->second.pImage, it->second.checksum);
+			}
+			else
+			{
+				result = false;
+				pool.Release(it->second.pImage);
+			}
+			stop = !result;
+			finished.erase(it);
+			if (++next == sources.end()) break;
+		}
+	}
+
+	for (auto& worker : workers)
+		worker.join();
+	return result;
+}
+
+bool CheckImages(const std::map<int, ImageSource>& sources, const BuildOptions& options, ImagePool& pool)
+{
+	// Each image is built again when it's written
+	BuildOptions checkOptions = options;
+	checkOptions.checksum = false;
+	checkOptions.verbose = false;
+	return BuildImages(sources, checkOptions, pool, [&](int, LPBYTE pImage, DWORD)
+	{
+		pool.Release(pImage);
+		return true;
+	});
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+class ImagePool;
+
+// How images are built, the same for every image in a run
+struct BuildOptions
+{
+	FloppyFormat format; // Of images built from MIDI files. Only 1.44 MB images use the cache.
+	bool deterministic; // See MidiToImage
+	std::wstring cacheDir; // Empty for no cache. See MidiToImageCached.
+	bool checksum; // Take the CRC-32C of each image built by BuildImages, for -verify
+	bool verbose;
+	bool minimize; // Store each MIDI file as minimizeOptions has MinimizeSmf rewrite it
+	SmfMinimizeOptions minimizeOptions;
+	SmfValidation validation; // Of each MIDI file as it's read
+};
+
+// The sources of one image: MIDI files, or an image to copy. The image is a file, or with
+// srcImageNum not -1, a numbered image on the drive srcImg.
+struct ImageSource
+{
+	std::vector<std::wstring> midiPaths;
+	std::wstring srcImg;
+	int srcImageNum = -1;
+};
+
+// Build an image from MIDI files, through the cache when there is one
+extern bool BuildMidiImage(const std::vector<std::wstring>& midiPaths, LPBYTE pImage, const BuildOptions& options);
+
+// Build, or read, one 1.44 MB image
+extern bool BuildImage(const ImageSource& source, LPBYTE pImage, const BuildOptions& options);
+
+// Build images on a worker thread per core, each into a buffer taken from pool, while consume
+// is called on this thread with each image in ascending image number order. consume takes the
+// buffer and must release it to the pool once it's done with it, so the pool bounds both how far
+// the builders can get ahead and how much memory is used. Building stops once an image fails
+// to build or consume fails. Returns false if that happened.
+typedef std::function<bool(int imageNum, LPBYTE pImage, DWORD checksum)> ImageConsumer;
+extern bool BuildImages(const std::map<int, ImageSource>& sources, const BuildOptions& options, ImagePool& pool, const ImageConsumer& consume);
+
+// Build every image and throw it away, so that a source that fails to build is found before
+// anything is written. Returns false, with the failure reported, if one does.
+extern bool CheckImages(const std::map<int, ImageSource>& sources, const BuildOptions& options, ImagePool& pool);
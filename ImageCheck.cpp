@@ -0,0 +1,248 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <windows.h>
+
+#include "FloppyImage.h"
+#include "FatTable.h"
+#include "ImageCheck.h"
+#include "ImageExtract.h"
+#include "ThumbDriveImage.h"
+#include "WorkQueue.h"
+#include "RunStats.h"
+
+const unsigned int FAT_BAD_CLUSTER = 0xFF7;
+const unsigned int FAT_FIRST_END_OF_CHAIN = 0xFF8;
+
+template <class Geometry>
+bool CheckImage(LPBYTE pImage, std::vector<std::wstring>& problems);
+template <class Geometry>
+void CheckChain(const WORD* fat, WORD* owners, const std::vector<std::wstring>& names, WORD entryNum,
+	const FloppyDirectoryEntry* pEntry, std::vector<std::wstring>& problems);
+
+bool ImageCheck(LPBYTE pImage, std::vector<std::wstring>& problems)
+{
+	// Nothing else can be trusted without a known layout
+	switch (GetFloppyFormat(pImage))
+	{
+	case FLOPPY_FORMAT_720K: return CheckImage<Floppy720K>(pImage, problems);
+	case FLOPPY_FORMAT_1200K: return CheckImage<Floppy1200K>(pImage, problems);
+	case FLOPPY_FORMAT_1440K: return CheckImage<Floppy1440K>(pImage, problems);
+	case FLOPPY_FORMAT_2880K: return CheckImage<Floppy2880K>(pImage, problems);
+	default:
+		problems.push_back(L"Boot sector is not that of a known floppy format.");
+		return false;
+	}
+}
+
+template <class Geometry>
+bool CheckImage(LPBYTE pImage, std::vector<std::wstring>& problems)
+{
+	size_t problemCount = problems.size();
+
+	if (memcmp(pImage + Geometry::FAT0_OFFSET, pImage + Geometry::FAT1_OFFSET, Geometry::FAT_SIZE) != 0)
+	{
+		problems.push_back(L"FAT0 and FAT1 differ.");
+	}
+
+	WORD fat[Geometry::END_DATA_AU];
+	FatDecode<Geometry>(pImage, 0, Geometry::END_DATA_AU, fat);
+
+	// The directory entry (numbered from 1) whose chain holds each cluster, or 0
+	WORD owners[Geometry::END_DATA_AU] = {};
+	std::vector<std::wstring> names;
+
+	const FloppyDirectoryEntry* pEntry = (const FloppyDirectoryEntry*)(pImage + Geometry::ROOT_DIR_OFFSET);
+	const FloppyDirectoryEntry* pEnd = pEntry + Geometry::ROOT_DIR_ENTRIES;
+	for (; pEntry < pEnd; ++pEntry)
+	{
+		if (pEntry->Filename[0] == '\0') break; // No more used entries
+		if (pEntry->Filename[0] == '\xE5') continue; // Deleted
+		if (pEntry->Attributes == ATTR_LONG_NAME) continue;
+		if ((pEntry->Attributes & ATTR_VOLUME_LABEL) != 0) continue;
+
+		names.push_back(FloppyFilenameToWString(pEntry->Filename));
+		CheckChain<Geometry>(fat, owners, names, (WORD)names.size(), pEntry, problems);
+	}
+
+	// Clusters in use by no chain are only wasted space, but a sign that something went wrong
+	size_t lostCount = 0;
+	for (unsigned int au = Geometry::FIRST_DATA_AU; au < Geometry::END_DATA_AU; ++au)
+	{
+		if (fat[au] != 0 && fat[au] != FAT_BAD_CLUSTER && owners[au] == 0) ++lostCount;
+	}
+	if (lostCount > 0)
+	{
+		problems.push_back(std::to_wstring(lostCount) + L" clusters are allocated but not part of any file.");
+	}
+
+	return problems.size() == problemCount;
+}
+
+template <class Geometry>
+void CheckChain(const WORD* fat, WORD* owners, const std::vector<std::wstring>& names, WORD entryNum,
+	const FloppyDirectoryEntry* pEntry, std::vector<std::wstring>& problems)
+{
+	const std::wstring& name = names[entryNum - 1];
+	bool isDirectory = (pEntry->Attributes & ATTR_DIRECTORY) != 0;
+	std::wostringstream problem;
+
+	unsigned int au = pEntry->StartCluster;
+	if (au == 0)
+	{
+		if (!isDirectory && pEntry->FileSize > 0)
+		{
+			problem << name << L": Has a size of " << pEntry->FileSize << L" bytes but no clusters.";
+			problems.push_back(problem.str());
+		}
+		return;
+	}
+
+	// Every cluster is claimed as it's followed, so a chain can't be followed further
+	// than the data area is long: it loops or crosses another chain first.
+	size_t length = 0;
+	for (;;)
+	{
+		if (au < Geometry::FIRST_DATA_AU || au >= Geometry::END_DATA_AU)
+		{
+			problem << name << L": Chain reaches cluster " << au << L", outside the data area.";
+			break;
+		}
+		if (owners[au] == entryNum)
+		{
+			problem << name << L": Chain loops back to cluster " << au << L".";
+			break;
+		}
+		if (owners[au] != 0)
+		{
+			problem << name << L": Chain is cross-linked with " << names[owners[au] - 1] << L" at cluster " << au << L".";
+			break;
+		}
+		owners[au] = entryNum;
+		++length;
+		if (fat[au] >= FAT_FIRST_END_OF_CHAIN) break;
+		au = fat[au];
+	}
+
+	// Directories record no size
+	if (problem.tellp() == 0 && !isDirectory)
+	{
+		size_t needed = (pEntry->FileSize + Geometry::AU_SIZE - 1) / Geometry::AU_SIZE;
+		if (length != needed)
+		{
+			problem << name << L": Chain has " << length << L" clusters but a size of " << pEntry->FileSize << L" bytes needs " << needed << L".";
+		}
+	}
+
+	if (problem.tellp() != 0)
+	{
+		problems.push_back(problem.str());
+	}
+}
+
+// === Whole-drive checking ===
+
+struct CheckJob
+{
+	int imageNum;
+	LPBYTE pImage;
+};
+
+bool ThumbDriveCheck(const std::wstring& drive, int firstImageNum, int lastImageNum)
+{
+	BlockDevice* pDrive = ThumbDriveOpen(drive, BLOCK_DEVICE_READ);
+	if (pDrive == NULL)
+	{
+		return false; // Error already reported
+	}
+
+	int imageCount = ThumbDriveImageCount(pDrive);
+	if (lastImageNum < 0 || lastImageNum >= imageCount)
+	{
+		lastImageNum = imageCount - 1;
+	}
+	if (firstImageNum > lastImageNum)
+	{
+		std::wcerr << L"No images to check." << std::endl;
+		ThumbDriveClose(pDrive);
+		return false;
+	}
+
+	// A fixed set of buffers circulates between the reader and the workers
+	unsigned int workerCount = (std::max)(1u, std::thread::hardware_concurrency());
+	size_t bufferCount = workerCount + 2;
+	WorkQueue<LPBYTE> freeBuffers;
+	WorkQueue<CheckJob> jobs;
+	std::vector<LPBYTE> buffers;
+	for (size_t i = 0; i < bufferCount; ++i)
+	{
+		LPBYTE pBuffer = (LPBYTE)VirtualAlloc(NULL, FLOPPY_IMAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (pBuffer == NULL) break;
+		buffers.push_back(pBuffer);
+		freeBuffers.Push(pBuffer);
+	}
+	if (buffers.empty())
+	{
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
+		ThumbDriveClose(pDrive);
+		return false;
+	}
+
+	// Each worker fills in the problems for its own images so they can be printed in order
+	std::vector<std::vector<std::wstring>> problems(lastImageNum - firstImageNum + 1);
+	std::vector<std::thread> workers;
+	for (unsigned int i = 0; i < workerCount; ++i)
+	{
+		workers.emplace_back([&]()
+		{
+			CheckJob job;
+			while (jobs.Pop(job))
+			{
+				TraceSpan span(L"check", job.imageNum);
+				ImageCheck(job.pImage, problems[job.imageNum - firstImageNum]);
+				freeBuffers.Push(job.pImage);
+			}
+		});
+	}
+
+	// Read the images off the drive in order. Whole images are read, whatever their
+	// boot sector says, so that the check can report on it.
+	for (int imageNum = firstImageNum; imageNum <= lastImageNum; ++imageNum)
+	{
+		LPBYTE pImage;
+		freeBuffers.Pop(pImage);
+		TraceSpan span(L"read", imageNum);
+		if (!ThumbDriveReadBlocks(pDrive, imageNum, 0, FLOPPY_IMAGE_SIZE, pImage))
+		{
+			problems[imageNum - firstImageNum].push_back(L"Failed to read the image.");
+			freeBuffers.Push(pImage);
+			continue;
+		}
+		jobs.Push({ imageNum, pImage });
+	}
+	jobs.Close();
+	for (auto& worker : workers)
+		worker.join();
+	ThumbDriveClose(pDrive);
+
+	for (LPBYTE pBuffer : buffers)
+		VirtualFree(pBuffer, 0, MEM_RELEASE);
+
+	int badCount = 0;
+	for (size_t i = 0; i < problems.size(); ++i)
+	{
+		if (problems[i].empty()) continue;
+		++badCount;
+		for (const auto& problem : problems[i])
+		{
+			std::wcout << L"Image " << (firstImageNum + (int)i) << L": " << problem << std::endl;
+		}
+	}
+	std::wcout << L"Checked " << problems.size() << L" images: " << badCount << L" with problems." << std::endl;
+	return badCount == 0;
+}
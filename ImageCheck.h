@@ -0,0 +1,13 @@
+#pragma once
+
+// Check the file system of an image of any format: a known boot sector, two identical FATs, and a
+// well-formed cluster chain for each entry in the root directory. A chain must stay within
+// the data area, not loop, not share a cluster with another chain, and have just enough
+// clusters for the file's size. Each problem found is added to problems.
+// Returns true if there were none.
+extern bool ImageCheck(LPBYTE pImage, std::vector<std::wstring>& problems);
+
+// Check a range of images on a thumb drive, printing the problems found in each.
+// One thread reads the images off the drive in order while a pool of workers checks them.
+// Pass a lastImageNum of -1 for every image on the drive.
+extern bool ThumbDriveCheck(const std::wstring& drive, int firstImageNum, int lastImageNum);
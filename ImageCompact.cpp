@@ -0,0 +1,156 @@
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <windows.h>
+
+#include "FloppyImage.h"
+#include "FatTable.h"
+#include "ImageCompact.h"
+
+const unsigned int FAT_BAD_CLUSTER = 0xFF7;
+
+template <class Geometry>
+int CompactImage(LPBYTE pImage);
+
+int ImageCompact(LPBYTE pImage)
+{
+	switch (GetFloppyFormat(pImage))
+	{
+	case FLOPPY_FORMAT_720K: return CompactImage<Floppy720K>(pImage);
+	case FLOPPY_FORMAT_1200K: return CompactImage<Floppy1200K>(pImage);
+	case FLOPPY_FORMAT_1440K: return CompactImage<Floppy1440K>(pImage);
+	case FLOPPY_FORMAT_2880K: return CompactImage<Floppy2880K>(pImage);
+	default:
+		std::wcerr << L"Invalid header on floppy image." << std::endl;
+		return -1;
+	}
+}
+
+template <class Geometry>
+int CompactImage(LPBYTE pImage)
+{
+	std::vector<ClusterMove> moves;
+	if (!PlanCompaction<Geometry>(pImage, moves))
+	{
+		return -1; // Error already reported
+	}
+	ApplyCompaction<Geometry>(pImage, moves);
+	return (int)moves.size();
+}
+
+template <class Geometry>
+bool PlanCompaction(LPBYTE pImage, std::vector<ClusterMove>& moves)
+{
+	moves.clear();
+
+	WORD fat[Geometry::END_DATA_AU];
+	FatDecode<Geometry>(pImage, 0, Geometry::END_DATA_AU, fat);
+
+	// Pair the lowest free clusters with the highest allocated ones until they meet. Each
+	// allocated cluster past that point has to move for the free space to be in one run, and
+	// there are just enough free clusters before it. Bad clusters stay where they are.
+	std::vector<unsigned int> holes;
+	std::vector<bool> moving(Geometry::END_DATA_AU, false);
+	unsigned int lo = Geometry::FIRST_DATA_AU;
+	unsigned int hi = Geometry::END_DATA_AU - 1;
+	for (;;)
+	{
+		while (lo < hi && fat[lo] != 0) ++lo;
+		while (lo < hi && (fat[hi] == 0 || fat[hi] == FAT_BAD_CLUSTER)) --hi;
+		if (lo >= hi) break;
+		holes.push_back(lo++);
+		moving[hi--] = true;
+	}
+	if (holes.empty()) return true;
+
+	// Order the clusters that move by file and then by place in the chain
+	std::vector<unsigned int> sources;
+	std::vector<bool> visited(Geometry::END_DATA_AU, false);
+	const FloppyDirectoryEntry* pEntry = (const FloppyDirectoryEntry*)(pImage + Geometry::ROOT_DIR_OFFSET);
+	const FloppyDirectoryEntry* pEnd = pEntry + Geometry::ROOT_DIR_ENTRIES;
+	for (; pEntry < pEnd; ++pEntry)
+	{
+		if (pEntry->Filename[0] == '\0') break; // No more used entries
+		if (pEntry->Filename[0] == '\xE5') continue; // Deleted
+		if (pEntry->Attributes == ATTR_LONG_NAME) continue;
+		if ((pEntry->Attributes & ATTR_VOLUME_LABEL) != 0) continue;
+		if ((pEntry->Attributes & ATTR_DIRECTORY) != 0)
+		{
+			// The entries in a subdirectory would have to be rewritten too
+			std::wcerr << L"Compacting an image with subdirectories is not supported." << std::endl;
+			return false;
+		}
+
+		// A chain that loops or crosses another stops at the first cluster already seen
+		for (unsigned int au = pEntry->StartCluster;
+			au >= Geometry::FIRST_DATA_AU && au < Geometry::END_DATA_AU && !visited[au];
+			au = fat[au])
+		{
+			visited[au] = true;
+			if (moving[au]) sources.push_back(au);
+		}
+	}
+
+	// Then any allocated clusters that no file reaches, so that the FAT stays as it was
+	for (unsigned int au = Geometry::FIRST_DATA_AU; au < Geometry::END_DATA_AU; ++au)
+	{
+		if (moving[au] && !visited[au]) sources.push_back(au);
+	}
+
+	moves.reserve(holes.size());
+	for (size_t i = 0; i < holes.size(); ++i)
+	{
+		moves.push_back({ sources[i], holes[i] });
+	}
+	return true;
+}
+
+template <class Geometry>
+void ApplyCompaction(LPBYTE pImage, const std::vector<ClusterMove>& moves)
+{
+	if (moves.empty()) return;
+
+	// Move the data. The clusters moved to were free, so none is overwritten before it's moved.
+	WORD remap[Geometry::END_DATA_AU];
+	for (unsigned int au = 0; au < Geometry::END_DATA_AU; ++au)
+		remap[au] = (WORD)au;
+	for (const auto& move : moves)
+	{
+		memcpy(pImage + Geometry::DATA_OFFSET + (move.to - Geometry::FIRST_DATA_AU) * Geometry::AU_SIZE,
+			pImage + Geometry::DATA_OFFSET + (move.from - Geometry::FIRST_DATA_AU) * Geometry::AU_SIZE, Geometry::AU_SIZE);
+		remap[move.from] = (WORD)move.to;
+	}
+
+	// Each entry goes to the cluster's new place, linking to the next cluster's new place
+	WORD fat[Geometry::END_DATA_AU];
+	WORD compacted[Geometry::END_DATA_AU] = {};
+	FatDecode<Geometry>(pImage, 0, Geometry::END_DATA_AU, fat);
+	for (unsigned int au = Geometry::FIRST_DATA_AU; au < Geometry::END_DATA_AU; ++au)
+	{
+		WORD next = fat[au];
+		if (next >= Geometry::FIRST_DATA_AU && next < Geometry::END_DATA_AU) next = remap[next];
+		if (fat[au] != 0) compacted[remap[au]] = next;
+	}
+	FatEncode<Geometry>(pImage, Geometry::FIRST_DATA_AU, Geometry::END_DATA_AU - Geometry::FIRST_DATA_AU, compacted + Geometry::FIRST_DATA_AU);
+
+	// Point each file at its first cluster's new place. Deleted entries are left alone.
+	FloppyDirectoryEntry* pEntry = (FloppyDirectoryEntry*)(pImage + Geometry::ROOT_DIR_OFFSET);
+	FloppyDirectoryEntry* pEnd = pEntry + Geometry::ROOT_DIR_ENTRIES;
+	for (; pEntry < pEnd; ++pEntry)
+	{
+		if (pEntry->Filename[0] == '\0') break; // No more used entries
+		if (pEntry->Filename[0] == '\xE5') continue; // Deleted
+		if (pEntry->Attributes == ATTR_LONG_NAME) continue;
+		if (pEntry->StartCluster >= Geometry::FIRST_DATA_AU && pEntry->StartCluster < Geometry::END_DATA_AU)
+			pEntry->StartCluster = remap[pEntry->StartCluster];
+	}
+}
+
+#define INSTANTIATE_COMPACTION(Geometry) \
+	template bool PlanCompaction<Geometry>(LPBYTE pImage, std::vector<ClusterMove>& moves); \
+	template void ApplyCompaction<Geometry>(LPBYTE pImage, const std::vector<ClusterMove>& moves);
+
+INSTANTIATE_COMPACTION(Floppy720K)
+INSTANTIATE_COMPACTION(Floppy1200K)
+INSTANTIATE_COMPACTION(Floppy1440K)
+INSTANTIATE_COMPACTION(Floppy2880K)
@@ -0,0 +1,25 @@
+#pragma once
+
+// The data of an allocated cluster moving to a free one
+struct ClusterMove
+{
+	unsigned int from;
+	unsigned int to;
+};
+
+// Plan the fewest moves that leave all free space in one run at the end of the data area:
+// only the allocated clusters past where the allocated clusters would end are moved, each
+// into a free cluster before that point. The free clusters are filled in order, taking the
+// clusters of each file in chain order so that a moved file stays in sequence.
+// Reads only the FAT and root directory. Fails, reporting why, if the image has subdirectories.
+template <class Geometry = Floppy1440K>
+bool PlanCompaction(LPBYTE pImage, std::vector<ClusterMove>& moves);
+
+// Copy the data of each cluster that moves and rewrite both FATs and the root directory to
+// match. The data of the clusters being moved must be in the image.
+template <class Geometry = Floppy1440K>
+void ApplyCompaction(LPBYTE pImage, const std::vector<ClusterMove>& moves);
+
+// Compact an image of any format that is wholly in memory.
+// Returns the number of clusters moved, or -1 on error.
+extern int ImageCompact(LPBYTE pImage);
@@ -0,0 +1,387 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <algorithm>
+#include <bitset>
+#include <cstring>
+#include <windows.h>
+
+#include "FloppyImage.h"
+#include "FatTable.h"
+#include "ClusterAllocator.h"
+#include "DirectoryIndex.h"
+#include "Smf.h"
+#include "MidiImage.h"
+#include "ImageEdit.h"
+#include "ImageExtract.h"
+#include "ImageCompact.h"
+#include "ThumbDriveImage.h"
+#include "BlockDevice.h"
+
+// Reads and writes are in whole pages so that they stay aligned for unbuffered I/O
+const size_t EDIT_CHUNK_SIZE = 0x1000;
+
+const unsigned int FAT_FIRST_END_OF_CHAIN = 0xFF8;
+
+template <class Geometry>
+bool EditImage(BlockDevice* pDrive, int imageNum, const std::vector<ImageEdit>& edits, const SmfMinimizeOptions* pMinimize, SmfValidation validation, ImageEditStats* pStats);
+template <class Geometry>
+bool RemoveFile(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& name);
+template <class Geometry>
+FloppyDirectoryEntry* FindFile(LPBYTE pImage, const char* filename);
+template <class Geometry>
+bool CompactInPlace(BlockDevice* pDrive, int imageNum, LPBYTE pImage, LPBYTE pChunk, std::vector<bool>& known, std::vector<bool>& changed, ImageEditStats* pStats);
+template <class Geometry>
+void MarkClusters(std::vector<bool>& blocks, unsigned int first, unsigned int count);
+template <class Geometry>
+bool ReadUnknownBlocks(BlockDevice* pDrive, int imageNum, LPBYTE pImage, size_t offset, LPBYTE pChunk, std::vector<bool>& known, ImageEditStats* pStats);
+template <class Geometry>
+bool WriteEditedImage(BlockDevice* pDrive, int imageNum, LPBYTE pImage, LPBYTE pOriginal, std::vector<bool>& known, const std::vector<bool>& changed, ImageEditStats* pStats);
+bool WriteChunks(BlockDevice* pDrive, int imageNum, LPBYTE pImage, size_t begin, size_t end, const std::vector<bool>& dirty, ImageEditStats* pStats);
+
+bool ThumbDriveEditImage(const std::wstring& drive, int imageNum, const std::vector<ImageEdit>& edits, const SmfMinimizeOptions* pMinimize, SmfValidation validation, ImageEditStats* pStats)
+{
+	// Image 0 holds the volume's boot sector so it must be written with the volume locked
+	BlockDevice* pDrive = ThumbDriveOpen(drive, (imageNum == 0) ? BLOCK_DEVICE_WRITE_EXCLUSIVE : BLOCK_DEVICE_WRITE);
+	if (pDrive == NULL)
+	{
+		return false; // Error already reported
+	}
+
+	if (imageNum >= ThumbDriveImageCount(pDrive))
+	{
+		std::wcerr << L"Image number (" << imageNum << L") is past the end of the drive." << std::endl;
+		ThumbDriveClose(pDrive);
+		return false;
+	}
+
+	bool result = EditImage<Floppy1440K>(pDrive, imageNum, edits, pMinimize, validation, pStats);
+	ThumbDriveClose(pDrive);
+	return result;
+}
+
+bool ImageFileEdit(const std::wstring& filename, const std::vector<ImageEdit>& edits, const SmfMinimizeOptions* pMinimize, SmfValidation validation, ImageEditStats* pStats)
+{
+	// An image file is a drive with a single image of any format
+	BlockDevice* pDrive = BlockDeviceOpen(filename, BLOCK_DEVICE_WRITE_EXCLUSIVE);
+	if (pDrive == NULL)
+	{
+		return false; // Error already reported
+	}
+
+	LPBYTE pBootSector = (LPBYTE)VirtualAlloc(NULL, FLOPPY_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (pBootSector == NULL)
+	{
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
+		delete pDrive;
+		return false;
+	}
+
+	FloppyFormat format = FLOPPY_FORMAT_UNKNOWN;
+	if (ThumbDriveReadBlocks(pDrive, 0, 0, FLOPPY_BLOCK_SIZE, pBootSector))
+	{
+		format = GetFloppyFormat(pBootSector);
+	}
+	VirtualFree(pBootSector, 0, MEM_RELEASE);
+	if (format == FLOPPY_FORMAT_UNKNOWN || pDrive->Size() != GetFloppyImageSize(format))
+	{
+		std::wcerr << L"Not a valid floppy image file: " << filename << std::endl;
+		delete pDrive;
+		return false;
+	}
+
+	bool result;
+	switch (format)
+	{
+	case FLOPPY_FORMAT_720K: result = EditImage<Floppy720K>(pDrive, 0, edits, pMinimize, validation, pStats); break;
+	case FLOPPY_FORMAT_1200K: result = EditImage<Floppy1200K>(pDrive, 0, edits, pMinimize, validation, pStats); break;
+	case FLOPPY_FORMAT_2880K: result = EditImage<Floppy2880K>(pDrive, 0, edits, pMinimize, validation, pStats); break;
+	default: result = EditImage<Floppy1440K>(pDrive, 0, edits, pMinimize, validation, pStats); break;
+	}
+	delete pDrive;
+	return result;
+}
+
+template <class Geometry>
+bool EditImage(BlockDevice* pDrive, int imageNum, const std::vector<ImageEdit>& edits, const SmfMinimizeOptions* pMinimize, SmfValidation validation, ImageEditStats* pStats)
+{
+	// The whole image is allocated so that the FAT code can address clusters, but only the
+	// pages holding the boot sector, FATs and root directory are read.
+	// Alongside a copy of those pages as read is a buffer for reading a single chunk.
+	const size_t metadataSize = (Geometry::DATA_OFFSET + EDIT_CHUNK_SIZE - 1) / EDIT_CHUNK_SIZE * EDIT_CHUNK_SIZE;
+	LPBYTE pImage = (LPBYTE)VirtualAlloc(NULL, Geometry::IMAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	LPBYTE pOriginal = (LPBYTE)VirtualAlloc(NULL, metadataSize + EDIT_CHUNK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (pImage == NULL || pOriginal == NULL)
+	{
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
+		if (pImage != NULL) VirtualFree(pImage, 0, MEM_RELEASE);
+		if (pOriginal != NULL) VirtualFree(pOriginal, 0, MEM_RELEASE);
+		return false;
+	}
+
+	bool result = ThumbDriveReadBlocks(pDrive, imageNum, 0, metadataSize, pImage);
+	if (result)
+	{
+		pStats->bytesRead += metadataSize;
+		if (!HasFloppyImageHeader<Geometry>(pImage))
+		{
+			std::wcerr << L"Image number (" << imageNum << L") is not a valid floppy image." << std::endl;
+			result = false;
+		}
+	}
+
+	if (result)
+	{
+		memcpy(pOriginal, pImage, metadataSize);
+
+		// The blocks whose contents are in memory, and those of the data area that were changed
+		std::vector<bool> known(Geometry::BLOCKS_PER_DISK, false);
+		std::vector<bool> changed(Geometry::BLOCKS_PER_DISK, false);
+		std::fill(known.begin(), known.begin() + metadataSize / Geometry::BLOCK_SIZE, true);
+
+		ClusterAllocator allocator;
+		allocator.Load<Geometry>(pImage);
+		DirectoryIndex dirIndex;
+		dirIndex.Load<Geometry>(pImage);
+
+		for (const auto& edit : edits)
+		{
+			if (edit.op == IMAGE_EDIT_COMPACT)
+			{
+				if (!CompactInPlace<Geometry>(pDrive, imageNum, pImage, pOriginal + metadataSize, known, changed, pStats))
+				{
+					result = false;
+					break;
+				}
+				allocator.Load<Geometry>(pImage);
+				dirIndex.Load<Geometry>(pImage);
+				continue;
+			}
+			if (edit.op != IMAGE_EDIT_ADD && !RemoveFile<Geometry>(pImage, allocator, dirIndex, edit.path))
+			{
+				result = false;
+				break;
+			}
+			if (edit.op != IMAGE_EDIT_REMOVE)
+			{
+				std::vector<ClusterRun> runs;
+				if (!AddFile<Geometry>(pImage, allocator, dirIndex, edit.path, runs, pMinimize, validation))
+				{
+					result = false;
+					break;
+				}
+				for (const auto& run : runs)
+				{
+					MarkClusters<Geometry>(known, run.first, run.count);
+					MarkClusters<Geometry>(changed, run.first, run.count);
+				}
+			}
+		}
+
+		// Give it a new serial number so that a catalog scan sees that it changed. Compacting
+		// an image that's already compact changes nothing, so nothing is written.
+		bool anyChanged = memcmp(pImage, pOriginal, metadataSize) != 0
+			|| std::find(changed.begin(), changed.end(), true) != changed.end();
+		if (result && anyChanged)
+		{
+			NewSerialNumber(pImage);
+			result = WriteEditedImage<Geometry>(pDrive, imageNum, pImage, pOriginal, known, changed, pStats);
+		}
+	}
+
+	VirtualFree(pOriginal, 0, MEM_RELEASE);
+	VirtualFree(pImage, 0, MEM_RELEASE);
+	return result;
+}
+
+template <class Geometry>
+bool RemoveFile(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& name)
+{
+	// The name is matched the way a source file's name would be shortened
+	char floppyFilename[11];
+	To8dot3Filename(name.c_str(), floppyFilename);
+	FloppyDirectoryEntry* pEntry = FindFile<Geometry>(pImage, floppyFilename);
+	if (pEntry == NULL)
+	{
+		std::wcerr << L"File not found in image: " << FloppyFilenameToWString(floppyFilename) << std::endl;
+		return false;
+	}
+
+	// Follow the whole chain before changing anything. A chain longer than the data area loops.
+	std::vector<ClusterRun> runs;
+	unsigned int clusterCount = 0;
+	unsigned int au = pEntry->StartCluster;
+	bool more = (au != 0); // An empty file has no clusters
+	while (more)
+	{
+		if (au < Geometry::FIRST_DATA_AU || au >= Geometry::END_DATA_AU
+			|| ++clusterCount > Geometry::END_DATA_AU - Geometry::FIRST_DATA_AU)
+		{
+			std::wcerr << L"Invalid cluster chain for file: " << FloppyFilenameToWString(floppyFilename) << std::endl;
+			return false;
+		}
+		if (!runs.empty() && runs.back().first + runs.back().count == au)
+			++runs.back().count;
+		else
+			runs.push_back({ au, 1 });
+
+		au = GetFAT<Geometry>(pImage, au);
+		more = (au < FAT_FIRST_END_OF_CHAIN);
+	}
+
+	// Free the clusters and the directory entry
+	for (const auto& run : runs)
+	{
+		for (unsigned int i = 0; i < run.count; ++i)
+			PutFAT<Geometry>(pImage, run.first + i, 0);
+	}
+	allocator.Free(runs);
+	dirIndex.FreeEntry(pEntry);
+	pEntry->Filename[0] = '\xE5';
+	return true;
+}
+
+template <class Geometry>
+FloppyDirectoryEntry* FindFile(LPBYTE pImage, const char* filename)
+{
+	FloppyDirectoryEntry* pEntry = (FloppyDirectoryEntry*)(pImage + Geometry::ROOT_DIR_OFFSET);
+	FloppyDirectoryEntry* pEnd = pEntry + Geometry::ROOT_DIR_ENTRIES;
+	for (; pEntry < pEnd; ++pEntry)
+	{
+		if (pEntry->Filename[0] == '\0') break; // No more used entries
+		if (pEntry->Filename[0] == '\xE5') continue; // Deleted
+		if (pEntry->Attributes == ATTR_LONG_NAME) continue;
+		if ((pEntry->Attributes & (ATTR_VOLUME_LABEL | ATTR_DIRECTORY)) != 0) continue;
+		if (memcmp(pEntry->Filename, filename, sizeof(pEntry->Filename)) == 0) return pEntry;
+	}
+	return NULL;
+}
+
+template <class Geometry>
+bool CompactInPlace(BlockDevice* pDrive, int imageNum, LPBYTE pImage, LPBYTE pChunk, std::vector<bool>& known, std::vector<bool>& changed, ImageEditStats* pStats)
+{
+	std::vector<ClusterMove> moves;
+	if (!PlanCompaction<Geometry>(pImage, moves))
+	{
+		return false; // Error already reported
+	}
+
+	// Only the clusters that move need to be read
+	for (const auto& move : moves)
+	{
+		size_t offset = Geometry::DATA_OFFSET + (move.from - Geometry::FIRST_DATA_AU) * Geometry::AU_SIZE;
+		for (size_t chunk = offset / EDIT_CHUNK_SIZE * EDIT_CHUNK_SIZE; chunk < offset + Geometry::AU_SIZE; chunk += EDIT_CHUNK_SIZE)
+		{
+			if (!ReadUnknownBlocks<Geometry>(pDrive, imageNum, pImage, chunk, pChunk, known, pStats))
+			{
+				return false; // Error already reported
+			}
+		}
+	}
+
+	ApplyCompaction<Geometry>(pImage, moves);
+	for (const auto& move : moves)
+	{
+		MarkClusters<Geometry>(known, move.to, 1);
+		MarkClusters<Geometry>(changed, move.to, 1);
+	}
+	pStats->clustersMoved += (unsigned int)moves.size();
+	return true;
+}
+
+template <class Geometry>
+void MarkClusters(std::vector<bool>& blocks, unsigned int first, unsigned int count)
+{
+	size_t firstBlock = Geometry::DATA_OFFSET / Geometry::BLOCK_SIZE + (first - Geometry::FIRST_DATA_AU) * Geometry::BLOCKS_PER_AU;
+	std::fill(blocks.begin() + firstBlock, blocks.begin() + firstBlock + count * Geometry::BLOCKS_PER_AU, true);
+}
+
+// Fill in the blocks of a chunk that aren't in memory yet, reading it only if there are any
+template <class Geometry>
+bool ReadUnknownBlocks(BlockDevice* pDrive, int imageNum, LPBYTE pImage, size_t offset, LPBYTE pChunk, std::vector<bool>& known, ImageEditStats* pStats)
+{
+	const size_t blocksPerChunk = EDIT_CHUNK_SIZE / Geometry::BLOCK_SIZE;
+	size_t firstBlock = offset / Geometry::BLOCK_SIZE;
+	if (std::find(known.begin() + firstBlock, known.begin() + firstBlock + blocksPerChunk, false) == known.begin() + firstBlock + blocksPerChunk)
+	{
+		return true;
+	}
+
+	if (!ThumbDriveReadBlocks(pDrive, imageNum, offset, EDIT_CHUNK_SIZE, pChunk))
+	{
+		return false; // Error already reported
+	}
+	pStats->bytesRead += EDIT_CHUNK_SIZE;
+	for (size_t block = 0; block < blocksPerChunk; ++block)
+	{
+		if (known[firstBlock + block]) continue;
+		memcpy(pImage + offset + block * Geometry::BLOCK_SIZE, pChunk + block * Geometry::BLOCK_SIZE, Geometry::BLOCK_SIZE);
+		known[firstBlock + block] = true;
+	}
+	return true;
+}
+
+template <class Geometry>
+bool WriteEditedImage(BlockDevice* pDrive, int imageNum, LPBYTE pImage, LPBYTE pOriginal, std::vector<bool>& known, const std::vector<bool>& changed, ImageEditStats* pStats)
+{
+	const size_t metadataSize = (Geometry::DATA_OFFSET + EDIT_CHUNK_SIZE - 1) / EDIT_CHUNK_SIZE * EDIT_CHUNK_SIZE;
+	const size_t blocksPerChunk = EDIT_CHUNK_SIZE / Geometry::BLOCK_SIZE;
+	std::vector<bool> dirty(Geometry::IMAGE_SIZE / EDIT_CHUNK_SIZE, false);
+
+	// A chunk of the metadata is dirty if it differs from what was read
+	for (size_t offset = 0; offset < metadataSize; offset += EDIT_CHUNK_SIZE)
+	{
+		dirty[offset / EDIT_CHUNK_SIZE] = (memcmp(pImage + offset, pOriginal + offset, EDIT_CHUNK_SIZE) != 0);
+	}
+
+	// A chunk of the data area is dirty if it holds clusters of a new file or clusters moved
+	// there. Any other blocks it holds are read from the drive first so that they're written
+	// back unchanged.
+	for (size_t offset = metadataSize; offset < Geometry::IMAGE_SIZE; offset += EDIT_CHUNK_SIZE)
+	{
+		size_t firstBlock = offset / Geometry::BLOCK_SIZE;
+		if (std::find(changed.begin() + firstBlock, changed.begin() + firstBlock + blocksPerChunk, true) == changed.begin() + firstBlock + blocksPerChunk) continue;
+		dirty[offset / EDIT_CHUNK_SIZE] = true;
+		if (!ReadUnknownBlocks<Geometry>(pDrive, imageNum, pImage, offset, pOriginal + metadataSize, known, pStats))
+		{
+			return false; // Error already reported
+		}
+	}
+
+	// The data goes down before the FAT and directory that point to it
+	if (!WriteChunks(pDrive, imageNum, pImage, metadataSize, Geometry::IMAGE_SIZE, dirty, pStats)
+		|| !WriteChunks(pDrive, imageNum, pImage, 0, metadataSize, dirty, pStats))
+	{
+		return false; // Error already reported
+	}
+	return ThumbDriveFlush(pDrive);
+}
+
+// Write each run of dirty chunks between begin and end with a single write
+bool WriteChunks(BlockDevice* pDrive, int imageNum, LPBYTE pImage, size_t begin, size_t end, const std::vector<bool>& dirty, ImageEditStats* pStats)
+{
+	size_t runStart = begin;
+	size_t runLength = 0;
+	for (size_t offset = begin; offset <= end; offset += EDIT_CHUNK_SIZE)
+	{
+		if (offset < end && dirty[offset / EDIT_CHUNK_SIZE])
+		{
+			if (runLength == 0) runStart = offset;
+			runLength += EDIT_CHUNK_SIZE;
+			continue;
+		}
+		if (runLength > 0)
+		{
+			if (!ThumbDriveWriteBlocks(pDrive, imageNum, runStart, runLength, pImage + runStart))
+			{
+				return false; // Error already reported
+			}
+			pStats->bytesWritten += runLength;
+			runLength = 0;
+		}
+	}
+	return true;
+}
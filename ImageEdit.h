@@ -0,0 +1,33 @@
+#pragma once
+
+// Changes to the files of an existing image, made in place
+enum ImageEditOp
+{
+	IMAGE_EDIT_ADD, // path is a MIDI file to add
+	IMAGE_EDIT_REMOVE, // path is the name of a file in the image (e.g. SONG.MID)
+	IMAGE_EDIT_REPLACE, // path is a MIDI file that replaces the file in the image with its 8.3 name
+	IMAGE_EDIT_COMPACT, // Move clusters so that the free space is in one run (see PlanCompaction)
+};
+
+struct ImageEdit
+{
+	ImageEditOp op;
+	std::wstring path;
+};
+
+struct ImageEditStats
+{
+	ULONGLONG bytesRead;
+	ULONGLONG bytesWritten;
+	unsigned int clustersMoved;
+};
+
+// Apply edits, in order, to an image without reading or writing all of it. Only the boot sector,
+// FATs and root directory are read, plus the clusters that compaction moves and the neighbours
+// of clusters that change. Only the
+// 4 KB pieces that changed are written. If any edit fails nothing is written.
+// An image in a numbered slot of a thumb drive is 1.44 MB; an image file may be of any format.
+// Files added are minimized with pMinimize and validated with validation, as by MidiToImage.
+struct SmfMinimizeOptions;
+extern bool ThumbDriveEditImage(const std::wstring& drive, int imageNum, const std::vector<ImageEdit>& edits, const SmfMinimizeOptions* pMinimize, SmfValidation validation, ImageEditStats* pStats);
+extern bool ImageFileEdit(const std::wstring& filename, const std::vector<ImageEdit>& edits, const SmfMinimizeOptions* pMinimize, SmfValidation validation, ImageEditStats* pStats);
@@ -0,0 +1,343 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cctype>
+#include <thread>
+#include <atomic>
+#include <windows.h>
+
+#include "FloppyImage.h"
+#include "FatTable.h"
+#include "ImageExtract.h"
+#include "ThumbDriveImage.h"
+#include "WorkQueue.h"
+#include "RunStats.h"
+#include "WinHelp.h"
+
+const unsigned int FAT_FIRST_END_OF_CHAIN = 0xFF8;
+
+bool CreateDirectoryIfMissing(const std::wstring& dir);
+template <class Geometry>
+bool ExtractImage(LPBYTE pImage, const std::wstring& dstDir, bool overwrite);
+template <class Geometry>
+bool ExtractFile(LPBYTE pImage, const WORD* fat, const FloppyDirectoryEntry* pEntry, const std::wstring& dstDir, bool overwrite);
+template <class Geometry>
+bool GetChainRuns(const WORD* fat, unsigned int startCluster, DWORD fileSize, std::vector<ClusterRun>& runs);
+
+bool ImageToDirectory(LPBYTE pImage, std::wstring dstDir, bool overwrite)
+{
+	if (!CreateDirectoryIfMissing(dstDir))
+	{
+		return false; // Error already reported
+	}
+
+	// Lay out the image as its boot sector says, taking 1.44 MB if it's not a known format
+	switch (GetFloppyFormat(pImage))
+	{
+	case FLOPPY_FORMAT_720K: return ExtractImage<Floppy720K>(pImage, dstDir, overwrite);
+	case FLOPPY_FORMAT_1200K: return ExtractImage<Floppy1200K>(pImage, dstDir, overwrite);
+	case FLOPPY_FORMAT_2880K: return ExtractImage<Floppy2880K>(pImage, dstDir, overwrite);
+	default: return ExtractImage<Floppy1440K>(pImage, dstDir, overwrite);
+	}
+}
+
+template <class Geometry>
+bool ExtractImage(LPBYTE pImage, const std::wstring& dstDir, bool overwrite)
+{
+	// Decode the whole FAT once
+	WORD fat[Geometry::END_DATA_AU];
+	FatDecode<Geometry>(pImage, 0, Geometry::END_DATA_AU, fat);
+
+	bool result = true;
+	const FloppyDirectoryEntry* pEntry = (const FloppyDirectoryEntry*)(pImage + Geometry::ROOT_DIR_OFFSET);
+	const FloppyDirectoryEntry* pEnd = pEntry + Geometry::ROOT_DIR_ENTRIES;
+	for (; pEntry < pEnd; ++pEntry)
+	{
+		if (pEntry->Filename[0] == '\0') break; // No more used entries
+		if (pEntry->Filename[0] == '\xE5') continue; // Deleted
+		if (pEntry->Attributes == ATTR_LONG_NAME) continue;
+		if ((pEntry->Attributes & (ATTR_VOLUME_LABEL | ATTR_DIRECTORY)) != 0) continue;
+
+		// The name becomes part of a path, so one that an 8.3 name can't be (e.g. "..\EVIL")
+		// mustn't reach CreateFileW. Keep going after a bad file so that the rest are recovered.
+		if (!IsSafeFloppyFilename(pEntry->Filename))
+		{
+			std::wcerr << L"Skipped file with an invalid name: " << FloppyFilenameToPrintable(pEntry->Filename) << std::endl;
+			result = false;
+		}
+		else if (!ExtractFile<Geometry>(pImage, fat, pEntry, dstDir, overwrite))
+		{
+			result = false;
+		}
+	}
+	return result;
+}
+
+template <class Geometry>
+bool ExtractFile(LPBYTE pImage, const WORD* fat, const FloppyDirectoryEntry* pEntry, const std::wstring& dstDir, bool overwrite)
+{
+	std::wstring path = dstDir + L"\\" + FloppyFilenameToWString(pEntry->Filename);
+
+	std::vector<ClusterRun> runs;
+	if (!GetChainRuns<Geometry>(fat, pEntry->StartCluster, pEntry->FileSize, runs))
+	{
+		std::wcerr << L"Invalid cluster chain for file: " << path << std::endl;
+		return false;
+	}
+
+	StatAdd(STAT_IO_CALLS, 2); // Open and set date
+	HANDLE hFile = CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, overwrite ? CREATE_ALWAYS : CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		std::wcerr << L"Failed to open destination file: " << path << std::endl;
+		ReportError(GetLastError());
+		return false;
+	}
+
+	// Write straight from the image, one run of clusters at a time
+	DWORD remaining = pEntry->FileSize;
+	for (const auto& run : runs)
+	{
+		DWORD toWrite = (DWORD)std::min<size_t>(remaining, run.count * Geometry::AU_SIZE);
+		DWORD bytesWritten;
+		StatAdd(STAT_IO_CALLS);
+		if (!WriteFile(hFile, pImage + Geometry::DATA_OFFSET + (run.first - Geometry::FIRST_DATA_AU) * Geometry::AU_SIZE, toWrite, &bytesWritten, NULL)
+			|| bytesWritten != toWrite)
+		{
+			DWORD hResult = GetLastError();
+			CloseHandle(hFile);
+			std::wcerr << L"Failed to write destination file: " << path << std::endl;
+			ReportError(hResult);
+			return false;
+		}
+		StatAdd(STAT_BYTES_WRITTEN, bytesWritten);
+		remaining -= toWrite;
+	}
+
+	// Restore the date modified
+	FILETIME dateModified;
+	FloppyTimeToFileTime(&pEntry->DateTime, &dateModified);
+	if (!SetFileTime(hFile, NULL, NULL, &dateModified))
+	{
+		DWORD hResult = GetLastError();
+		CloseHandle(hFile);
+		std::wcerr << L"Failed to set date modified on: " << path << std::endl;
+		ReportError(hResult);
+		return false;
+	}
+
+	CloseHandle(hFile);
+	return true;
+}
+
+// Follow a FAT chain, merging consecutive clusters into runs. Fails if the chain
+// leaves the data area, loops, or ends before covering fileSize.
+template <class Geometry>
+bool GetChainRuns(const WORD* fat, unsigned int startCluster, DWORD fileSize, std::vector<ClusterRun>& runs)
+{
+	runs.clear();
+	size_t needed = (fileSize + Geometry::AU_SIZE - 1) / Geometry::AU_SIZE;
+	unsigned int au = startCluster;
+	for (size_t n = 0; n < needed; ++n)
+	{
+		// Because at most `needed` clusters are followed, a loop shows up as running past the end
+		if (au < Geometry::FIRST_DATA_AU || au >= Geometry::END_DATA_AU) return false;
+		if (!runs.empty() && runs.back().first + runs.back().count == au)
+			++runs.back().count;
+		else
+			runs.push_back({ au, 1 });
+		au = fat[au];
+	}
+	return true;
+}
+
+// "NAME    EXT" to "NAME.EXT"
+std::wstring FloppyFilenameToWString(const char* filename)
+{
+	std::wstring result;
+	for (int i = 0; i < 8 && filename[i] != ' '; ++i)
+		result += (i == 0 && filename[i] == 0x05) ? (wchar_t)0xE5 : (wchar_t)(BYTE)filename[i];
+	if (filename[8] != ' ')
+	{
+		result += L'.';
+		for (int i = 8; i < 11 && filename[i] != ' '; ++i)
+			result += (wchar_t)(BYTE)filename[i];
+	}
+	return result;
+}
+
+// Characters allowed in an 8.3 name besides letters, digits and those above 127
+static bool IsFloppyFilenameChar(BYTE c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80
+		|| strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+bool IsSafeFloppyFilename(const char* filename)
+{
+	// Each part is legal characters padded at the end with spaces, and the name part isn't
+	// empty. 0x05 at the start stands for a first character of 0xE5, which would otherwise
+	// mark the entry deleted.
+	if (filename[0] == ' ') return false;
+	for (int i = 0; i < 11; ++i)
+	{
+		BYTE c = (BYTE)filename[i];
+		if (c == ' ')
+		{
+			for (int end = (i < 8) ? 8 : 11; i + 1 < end; ++i)
+			{
+				if (filename[i + 1] != ' ') return false;
+			}
+		}
+		else if (!IsFloppyFilenameChar(c) && !(i == 0 && c == 0x05))
+		{
+			return false;
+		}
+	}
+
+	// Nor is it a device, which Windows opens whatever the extension and directory
+	static const char* const devices[] = { "CON", "PRN", "AUX", "NUL", "CLOCK$" };
+	std::string name(filename, 8);
+	name.erase(name.find_last_not_of(' ') + 1);
+	for (auto& c : name) c = (char)toupper((BYTE)c);
+	for (const char* device : devices)
+	{
+		if (name == device) return false;
+	}
+	if (name.length() == 4 && (name.compare(0, 3, "COM") == 0 || name.compare(0, 3, "LPT") == 0) && name[3] >= '0' && name[3] <= '9')
+		return false;
+	return true;
+}
+
+// For reporting a name that may hold anything: characters that can't be shown become '?'
+std::wstring FloppyFilenameToPrintable(const char* filename)
+{
+	std::wstring result;
+	for (int i = 0; i < 11; ++i)
+	{
+		if (i == 8) result += L'.';
+		BYTE c = (BYTE)filename[i];
+		result += (c >= 0x20 && c < 0x7F) ? (wchar_t)c : L'?';
+	}
+	return result;
+}
+
+void FloppyTimeToFileTime(const FloppyDateTime* pFloppyTime, FILETIME* pFileTime)
+{
+	SYSTEMTIME st = {};
+	st.wYear = (WORD)(pFloppyTime->year + 1980);
+	st.wMonth = (WORD)pFloppyTime->month;
+	st.wDay = (WORD)pFloppyTime->day;
+	st.wHour = (WORD)pFloppyTime->hour;
+	st.wMinute = (WORD)pFloppyTime->minute;
+	st.wSecond = (WORD)(pFloppyTime->twoSecond * 2);
+	if (!SystemTimeToFileTime(&st, pFileTime))
+	{
+		pFileTime->dwLowDateTime = 0;
+		pFileTime->dwHighDateTime = 0;
+	}
+}
+
+bool CreateDirectoryIfMissing(const std::wstring& dir)
+{
+	if (CreateDirectoryW(dir.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS)
+		return true;
+	std::wcerr << L"Failed to create destination directory: " << dir << std::endl;
+	ReportError(GetLastError());
+	return false;
+}
+
+// === Multi-image extraction ===
+
+struct ExtractJob
+{
+	int imageNum;
+	LPBYTE pImage;
+};
+
+bool ThumbDriveToDirectories(const std::wstring& drive, int firstImageNum, int lastImageNum, std::wstring dstDir, bool overwrite)
+{
+	if (!CreateDirectoryIfMissing(dstDir))
+	{
+		return false; // Error already reported
+	}
+
+	BlockDevice* pDrive = ThumbDriveOpen(drive, BLOCK_DEVICE_READ);
+	if (pDrive == NULL)
+	{
+		return false; // Error already reported
+	}
+
+	// A fixed set of buffers circulates between the reader and the workers
+	unsigned int workerCount = (std::max)(1u, std::thread::hardware_concurrency());
+	size_t bufferCount = workerCount + 2;
+	WorkQueue<LPBYTE> freeBuffers;
+	WorkQueue<ExtractJob> jobs;
+	std::vector<LPBYTE> buffers;
+	for (size_t i = 0; i < bufferCount; ++i)
+	{
+		LPBYTE pBuffer = (LPBYTE)VirtualAlloc(NULL, FLOPPY_IMAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (pBuffer == NULL) break;
+		buffers.push_back(pBuffer);
+		freeBuffers.Push(pBuffer);
+	}
+	if (buffers.empty())
+	{
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
+		ThumbDriveClose(pDrive);
+		return false;
+	}
+
+	std::atomic<int> failures(0);
+	std::vector<std::thread> workers;
+	for (unsigned int i = 0; i < workerCount; ++i)
+	{
+		workers.emplace_back([&]()
+		{
+			ExtractJob job;
+			while (jobs.Pop(job))
+			{
+				TraceSpan span(L"extract", job.imageNum);
+				std::wstring imageDir = std::to_wstring(job.imageNum);
+				if (imageDir.length() < 3) imageDir.insert(0, 3 - imageDir.length(), L'0');
+				if (!ImageToDirectory(job.pImage, dstDir + L"\\" + imageDir, overwrite))
+				{
+					std::wcerr << L"Failed to extract image " << job.imageNum << L"." << std::endl;
+					++failures;
+				}
+				freeBuffers.Push(job.pImage);
+			}
+		});
+	}
+
+	// Stream the images off the drive in order
+	for (int imageNum = firstImageNum; imageNum <= lastImageNum; ++imageNum)
+	{
+		LPBYTE pImage;
+		freeBuffers.Pop(pImage);
+		TraceSpan span(L"read", imageNum);
+		if (!ThumbDriveReadImage(pDrive, imageNum, pImage))
+		{
+			std::wcerr << L"Failed to read image " << imageNum << L"." << std::endl;
+			++failures;
+			freeBuffers.Push(pImage);
+			continue;
+		}
+		jobs.Push({ imageNum, pImage });
+	}
+	jobs.Close();
+	for (auto& worker : workers)
+		worker.join();
+	ThumbDriveClose(pDrive);
+
+	for (LPBYTE pBuffer : buffers)
+		VirtualFree(pBuffer, 0, MEM_RELEASE);
+
+	if (failures > 0)
+	{
+		std::wcerr << failures << L" of " << (lastImageNum - firstImageNum + 1) << L" images failed to extract." << std::endl;
+		return false;
+	}
+	return true;
+}
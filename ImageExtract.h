@@ -0,0 +1,18 @@
+#pragma once
+
+// Write every file in an image's root directory to a directory, with its original date modified.
+extern bool ImageToDirectory(LPBYTE pImage, std::wstring dstDir, bool overwrite);
+
+// Extract a range of images from a thumb drive, each into its own numbered subdirectory of dstDir.
+// One thread reads the images off the drive in order while a pool of workers writes out the files.
+extern bool ThumbDriveToDirectories(const std::wstring& drive, int firstImageNum, int lastImageNum, std::wstring dstDir, bool overwrite);
+
+// Directory entry conversions
+extern std::wstring FloppyFilenameToWString(const char* filename);
+
+// Whether a directory entry's name is one an 8.3 name can be, and so safe to put in a path:
+// no separators, dots, control characters or Windows device names. Images from the field
+// may hold anything.
+extern bool IsSafeFloppyFilename(const char* filename);
+extern std::wstring FloppyFilenameToPrintable(const char* filename);
+extern void FloppyTimeToFileTime(const FloppyDateTime* pFloppyTime, FILETIME* pFileTime);
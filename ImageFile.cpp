@@ -1,11 +1,23 @@
 #include <iostream>
+#include <algorithm>
 #include <windows.h>
 
 #include "FloppyImage.h"
+#include "ImageFile.h"
+#include "FileCopy.h"
+#include "ZeroScan.h"
 #include "WinHelp.h"
+#include "RunStats.h"
 
-bool ImageFileRead(std::wstring filename, LPBYTE pImage)
+bool CheckImageFileSize(LONGLONG fileSize, FloppyFormat* pFormat);
+void MakeSparse(HANDLE hFile);
+bool WriteSkippingZeros(HANDLE hFile, const BYTE* pData, size_t length);
+bool SkipZeros(HANDLE hFile, size_t length);
+
+bool ImageFileRead(std::wstring filename, LPBYTE pImage, FloppyFormat* pFormat)
 {
+    StatTimer timer(STAGE_SOURCE_READ);
+    StatAdd(STAT_IO_CALLS, 3);
     HANDLE hFile = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
     if (hFile == INVALID_HANDLE_VALUE)
     {
@@ -22,14 +34,14 @@ bool ImageFileRead(std::wstring filename, LPBYTE pImage)
         ReportError(hResult);
         return false;
     }
-    if (fileSize.QuadPart != FLOPPY_IMAGE_SIZE)
+    if (!CheckImageFileSize(fileSize.QuadPart, pFormat))
     {
         CloseHandle(hFile);
-        std::wcerr << L"Invalid floppy image file. Size is not " << FLOPPY_IMAGE_SIZE << L" bytes." << std::endl;
-        return false;
+        return false; // Error already reported
     }
+    DWORD imageSize = (DWORD)fileSize.QuadPart;
     DWORD bytesRead;
-    if (!ReadFile(hFile, pImage, FLOPPY_IMAGE_SIZE, &bytesRead, NULL))
+    if (!ReadFile(hFile, pImage, imageSize, &bytesRead, NULL))
     {
         DWORD hResult = GetLastError();
         CloseHandle(hFile);
@@ -38,7 +50,8 @@ bool ImageFileRead(std::wstring filename, LPBYTE pImage)
         return false;
     }
     CloseHandle(hFile);
-    if (bytesRead != FLOPPY_IMAGE_SIZE)
+    StatAdd(STAT_BYTES_READ, bytesRead);
+    if (bytesRead != imageSize)
     {
         std::wcerr << L"Failed to read entire source file." << std::endl;
         return false;
@@ -46,8 +59,10 @@ bool ImageFileRead(std::wstring filename, LPBYTE pImage)
     return true;
 }
 
-bool ImageFileWrite(std::wstring filename, LPBYTE pImage, bool overwrite)
+bool ImageFileWrite(std::wstring filename, LPBYTE pImage, bool overwrite, FloppyFormat format)
 {
+    StatTimer timer(STAGE_DEVICE_IO);
+    StatAdd(STAT_IO_CALLS, 3); // Open, make sparse, set end
     HANDLE hFile = CreateFileW(filename.c_str(), GENERIC_WRITE, 0, NULL, overwrite ? CREATE_ALWAYS : CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
     if (hFile == INVALID_HANDLE_VALUE)
     {
@@ -55,8 +70,8 @@ bool ImageFileWrite(std::wstring filename, LPBYTE pImage, bool overwrite)
         ReportError(GetLastError());
         return false;
     }
-    DWORD bytesWritten;
-    if (!WriteFile(hFile, pImage, FLOPPY_IMAGE_SIZE, &bytesWritten, NULL))
+    MakeSparse(hFile);
+    if (!WriteSkippingZeros(hFile, pImage, GetFloppyImageSize(format)) || !SetEndOfFile(hFile))
     {
         DWORD hResult = GetLastError();
         CloseHandle(hFile);
@@ -65,10 +80,213 @@ bool ImageFileWrite(std::wstring filename, LPBYTE pImage, bool overwrite)
         return false;
     }
     CloseHandle(hFile);
-    if (bytesWritten != FLOPPY_IMAGE_SIZE)
+    return true;
+}
+
+bool ImageFileCheck(std::wstring filename, FloppyFormat* pFormat)
+{
+    StatTimer timer(STAGE_SOURCE_READ);
+    StatAdd(STAT_IO_CALLS, 3);
+    HANDLE hFile = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        std::wcerr << L"Failed to open source file: " << filename << std::endl;
+        ReportError(GetLastError());
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile, &fileSize))
+    {
+        DWORD hResult = GetLastError();
+        CloseHandle(hFile);
+        std::wcerr << L"Failed to get source file size." << std::endl;
+        ReportError(hResult);
+        return false;
+    }
+    if (!CheckImageFileSize(fileSize.QuadPart, pFormat))
+    {
+        CloseHandle(hFile);
+        return false; // Error already reported
+    }
+
+    // Only the boot sector is needed
+    BYTE bootSector[FLOPPY_BLOCK_SIZE];
+    DWORD bytesRead;
+    if (!ReadFile(hFile, bootSector, sizeof(bootSector), &bytesRead, NULL) || bytesRead != sizeof(bootSector))
+    {
+        DWORD hResult = GetLastError();
+        CloseHandle(hFile);
+        std::wcerr << L"Failed to read source file." << std::endl;
+        ReportError(hResult);
+        return false;
+    }
+    CloseHandle(hFile);
+    StatAdd(STAT_BYTES_READ, bytesRead);
+    bool valid = (pFormat == NULL) ? HasFloppyImageHeader(bootSector) : GetFloppyFormat(bootSector) == *pFormat;
+    if (!valid)
+    {
+        std::wcerr << L"Invalid header on floppy image file: " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool ImageFileCopy(std::wstring srcFilename, std::wstring dstFilename, bool overwrite)
+{
+    FloppyFormat format;
+    if (!ImageFileCheck(srcFilename, &format))
+    {
+        return false; // Error already reported
+    }
+    return FileCopyWhole(srcFilename, dstFilename, overwrite);
+}
+
+bool DriveImageFileOpen(std::wstring filename, bool overwrite, DriveImageFile* pFile)
+{
+    StatTimer timer(STAGE_DEVICE_IO);
+    StatAdd(STAT_IO_CALLS, 2); // Open, make sparse
+    HANDLE hFile = CreateFileW(filename.c_str(), GENERIC_WRITE, 0, NULL, overwrite ? CREATE_ALWAYS : CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
     {
-        std::wcerr << L"Failed to write entire destination file." << std::endl;
+        std::wcerr << L"Failed to open destination file: " << filename << std::endl;
+        ReportError(GetLastError());
         return false;
     }
+
+    // Zeros, which are most of a drive, are skipped over and left as holes
+    MakeSparse(hFile);
+    pFile->hFile = hFile;
+    pFile->filename = filename;
+    pFile->nextImageNum = 0;
     return true;
-}
\ No newline at end of file
+}
+
+bool DriveImageFileWriteImage(DriveImageFile* pFile, int imageNum, LPBYTE pImage, LPBYTE pBlankImage)
+{
+    // Every image from the last one written through this one is written in one sequential
+    // pass. Image numbers without a source get a blank image so that the drive is a valid
+    // set of floppy images throughout.
+    StatTimer timer(STAGE_DEVICE_IO);
+    for (; pFile->nextImageNum <= imageNum; ++pFile->nextImageNum)
+    {
+        // Pad from the end of the previous image to the beginning of this one
+        if (pFile->nextImageNum > 0 && !SkipZeros(pFile->hFile, FLOPPY_IMAGE_INTERVAL - FLOPPY_IMAGE_SIZE))
+        {
+            std::wcerr << L"Failed to write destination file: " << pFile->filename << std::endl;
+            ReportError(GetLastError());
+            return false;
+        }
+
+        LPBYTE pData = (pFile->nextImageNum == imageNum) ? pImage : pBlankImage;
+        if (!WriteSkippingZeros(pFile->hFile, pData, FLOPPY_IMAGE_SIZE))
+        {
+            std::wcerr << L"Failed to write image " << pFile->nextImageNum << L" to destination file." << std::endl;
+            ReportError(GetLastError());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DriveImageFileClose(DriveImageFile* pFile)
+{
+    bool result = true;
+    if (pFile->nextImageNum == 0)
+    {
+        std::wcerr << L"No images to write to drive image file: " << pFile->filename << std::endl;
+        result = false;
+    }
+
+    // Extend the file over any zeros skipped at the end
+    StatAdd(STAT_IO_CALLS, 2); // Set end, close
+    if (result && !SetEndOfFile(pFile->hFile))
+    {
+        std::wcerr << L"Failed to write destination file: " << pFile->filename << std::endl;
+        ReportError(GetLastError());
+        result = false;
+    }
+
+    CloseHandle(pFile->hFile);
+    pFile->hFile = INVALID_HANDLE_VALUE;
+    return result;
+}
+
+// Without pFormat only a 1.44 MB image will do. With it, the size of any format does and
+// the format is returned.
+bool CheckImageFileSize(LONGLONG fileSize, FloppyFormat* pFormat)
+{
+    if (pFormat == NULL)
+    {
+        if (fileSize == FLOPPY_IMAGE_SIZE) return true;
+        std::wcerr << L"Invalid floppy image file. Size is not " << FLOPPY_IMAGE_SIZE << L" bytes." << std::endl;
+        return false;
+    }
+
+    const FloppyFormat formats[] = { FLOPPY_FORMAT_720K, FLOPPY_FORMAT_1200K, FLOPPY_FORMAT_1440K, FLOPPY_FORMAT_2880K };
+    for (FloppyFormat format : formats)
+    {
+        if (fileSize == (LONGLONG)GetFloppyImageSize(format))
+        {
+            *pFormat = format;
+            return true;
+        }
+    }
+    std::wcerr << L"Invalid floppy image file. Size is not that of a 720K, 1.2M, 1.44M or 2.88M floppy." << std::endl;
+    return false;
+}
+
+// Files are made sparse so that the zeros skipped over take no space. File systems
+// without sparse files (FAT) refuse, and fill what's skipped with zeros instead.
+void MakeSparse(HANDLE hFile)
+{
+    DWORD bytesReturned;
+    DeviceIoControl(hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytesReturned, NULL);
+}
+
+// Write from the current position, seeking over chunks of zeros rather than writing them.
+// The file must be new or truncated, so that what's skipped reads back as zeros, and
+// SetEndOfFile called once everything is written.
+bool WriteSkippingZeros(HANDLE hFile, const BYTE* pData, size_t length)
+{
+    size_t runStart = 0;
+    size_t offset = 0;
+    while (true)
+    {
+        size_t chunkLength = std::min<size_t>(ZERO_CHUNK_SIZE, length - offset);
+        if (chunkLength > 0 && !IsAllZero(pData + offset, chunkLength))
+        {
+            offset += chunkLength;
+            continue;
+        }
+
+        // Write the data before this chunk of zeros (or the end)
+        if (offset > runStart)
+        {
+            DWORD bytesWritten;
+            StatAdd(STAT_IO_CALLS);
+            if (!WriteFile(hFile, pData + runStart, (DWORD)(offset - runStart), &bytesWritten, NULL) || bytesWritten != offset - runStart)
+            {
+                return false;
+            }
+            StatAdd(STAT_BYTES_WRITTEN, bytesWritten);
+        }
+        if (chunkLength == 0)
+        {
+            return true;
+        }
+        if (!SkipZeros(hFile, chunkLength))
+        {
+            return false;
+        }
+        offset += chunkLength;
+        runStart = offset;
+    }
+}
+
+bool SkipZeros(HANDLE hFile, size_t length)
+{
+    StatAdd(STAT_IO_CALLS);
+    LARGE_INTEGER distance;
+    distance.QuadPart = (LONGLONG)length;
+    return SetFilePointerEx(hFile, distance, NULL, FILE_CURRENT) != FALSE;
+}
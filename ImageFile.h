@@ -1,4 +1,26 @@
 #pragma once
 
-extern bool ImageFileRead(std::wstring filename, LPBYTE pImage);
-extern bool ImageFileWrite(std::wstring filename, LPBYTE pImage, bool overwrite);
+// Only 1.44 MB images are read unless pFormat is given, in which case an image of any format
+// is read (into a buffer of FLOPPY_MAX_IMAGE_SIZE) and its format, by its size, returned.
+extern bool ImageFileRead(std::wstring filename, LPBYTE pImage, FloppyFormat* pFormat = NULL);
+extern bool ImageFileWrite(std::wstring filename, LPBYTE pImage, bool overwrite, FloppyFormat format = FLOPPY_FORMAT_1440K);
+
+// Check an image file's size and boot sector without reading the rest of it. As with
+// ImageFileRead, any format is accepted, and returned, only with pFormat.
+extern bool ImageFileCheck(std::wstring filename, FloppyFormat* pFormat = NULL);
+
+// Copy an image file, letting the system copy (or clone) the data rather than this process
+extern bool ImageFileCopy(std::wstring srcFilename, std::wstring dstFilename, bool overwrite);
+
+// Write a whole-drive image file laid out the same as a thumb drive: image n begins
+// at FLOPPY_IMAGE_INTERVAL * n. Open it, write images in ascending order as they become
+// available, then close it. Image numbers skipped over are filled with pBlankImage.
+struct DriveImageFile
+{
+    HANDLE hFile;
+    std::wstring filename;
+    int nextImageNum;
+};
+extern bool DriveImageFileOpen(std::wstring filename, bool overwrite, DriveImageFile* pFile);
+extern bool DriveImageFileWriteImage(DriveImageFile* pFile, int imageNum, LPBYTE pImage, LPBYTE pBlankImage);
+extern bool DriveImageFileClose(DriveImageFile* pFile);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include "WorkQueue.h"
+
+// A fixed set of page-aligned image buffers shared between threads. Acquire waits for a buffer
+// to be released, so however many images pass through, memory stays at the size of the pool.
+class ImagePool
+{
+public:
+	// Allocates as many of count buffers as it can. Check Size.
+	ImagePool(size_t count, size_t imageSize)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			LPBYTE pBuffer = (LPBYTE)VirtualAlloc(NULL, imageSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+			if (pBuffer == NULL) break;
+			m_buffers.push_back(pBuffer);
+			m_free.Push(pBuffer);
+		}
+	}
+
+	// Every buffer must have been released
+	~ImagePool()
+	{
+		for (LPBYTE pBuffer : m_buffers)
+			VirtualFree(pBuffer, 0, MEM_RELEASE);
+	}
+
+	ImagePool(const ImagePool&) = delete;
+	ImagePool& operator=(const ImagePool&) = delete;
+
+	size_t Size() const { return m_buffers.size(); }
+
+	LPBYTE Acquire()
+	{
+		LPBYTE pBuffer = NULL;
+		m_free.Pop(pBuffer);
+		return pBuffer;
+	}
+
+	void Release(LPBYTE pBuffer)
+	{
+		m_free.Push(pBuffer);
+	}
+
+private:
+	std::vector<LPBYTE> m_buffers;
+	WorkQueue<LPBYTE> m_free;
+};
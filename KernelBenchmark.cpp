@@ -0,0 +1,276 @@
+#if !defined(_WIN32)
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <functional>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "WinTypes.h"
+#include "BenchmarkHarness.h"
+#include "FloppyImage.h"
+#include "FatTable.h"
+#include "ClusterAllocator.h"
+#include "Checksum.h"
+#include "ZeroScan.h"
+#include "BlockDevice.h"
+#include "TextFile.h"
+
+// A standalone benchmark of the parts of the image builder and drive I/O that build without
+// Windows: the FAT, cluster allocation, checksums, zero scanning and the POSIX block device.
+// The rest of the builder is timed by the tool's -bench, on Windows. See CMakeLists.txt.
+
+// Clusters taken from free space that is fragmented into single clusters
+const unsigned int BENCH_ALLOCATE_CLUSTERS = 100;
+
+// Image slots in the scratch drive file, written and read in turn
+const int BENCH_DRIVE_SLOTS = 4;
+
+LPBYTE AllocateImage();
+void FragmentFreeSpace(LPBYTE pImage);
+bool BenchmarkDrive(const std::wstring& path, LPBYTE pImage, LPBYTE pBuffer, std::vector<BenchResult>& results);
+void Syntax();
+
+int main(int argc, char* argv[])
+{
+	std::wstring resultsPath;
+	std::wstring drivePath;
+	bool overwrite = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (0 == strcmp(argv[i], "-overwrite"))
+		{
+			overwrite = true;
+		}
+		else if (0 == strcmp(argv[i], "-drive"))
+		{
+			// Advance to the next string and check for end
+			if (++i >= argc)
+			{
+				Syntax();
+				return 1;
+			}
+			drivePath = FromUtf8(argv[i]);
+		}
+		else if (argv[i][0] != '-' && resultsPath.empty())
+		{
+			resultsPath = FromUtf8(argv[i]);
+		}
+		else
+		{
+			Syntax();
+			return 1;
+		}
+	}
+	if (resultsPath.empty())
+	{
+		Syntax();
+		return 1;
+	}
+
+	LPBYTE pImage = AllocateImage();
+	LPBYTE pBuffer = AllocateImage();
+	if (pImage == NULL || pBuffer == NULL)
+	{
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
+		free(pImage);
+		free(pBuffer);
+		return 1;
+	}
+
+	// Check that every FAT kernel this CPU runs is right before timing the fastest
+	bool result = FatSelfTest();
+
+	std::vector<BenchResult> results;
+	if (result)
+	{
+		ReportHeader();
+
+		// Two files whose clusters alternate across the whole disk
+		memset(pImage, 0, FLOPPY_IMAGE_SIZE);
+		FragmentFat(pImage);
+		const unsigned int dataAus = (unsigned int)FLOPPY_DATA_AU_PER_DISK;
+		results.push_back(Measure(L"GetFAT/fragmented FAT", L"entry", dataAus, [&]() {
+			unsigned int sum = 0;
+			for (unsigned int au = FLOPPY_FIRST_DATA_AU; au < FLOPPY_END_DATA_AU; ++au)
+				sum += GetFAT(pImage, au);
+			benchSink += sum;
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"PutFAT/fragmented FAT", L"entry", dataAus, [&]() {
+			FragmentFat(pImage);
+		}));
+		ReportResult(results.back());
+
+		std::vector<WORD> entries(FLOPPY_END_DATA_AU);
+		results.push_back(Measure(L"FatDecode/whole FAT", L"entry", FLOPPY_END_DATA_AU, [&]() {
+			FatDecode(pImage, 0, (unsigned int)FLOPPY_END_DATA_AU, entries.data());
+			benchSink += entries.back();
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"FatEncode/whole FAT", L"entry", FLOPPY_END_DATA_AU, [&]() {
+			FatEncode(pImage, 0, (unsigned int)FLOPPY_END_DATA_AU, entries.data());
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"ClusterAllocator.Load/fragmented FAT", L"image", 1, [&]() {
+			ClusterAllocator allocator;
+			allocator.Load(pImage);
+			benchSink += allocator.FreeCount();
+		}));
+		ReportResult(results.back());
+
+		// No free run is big enough, so every allocation is split across the largest runs
+		FragmentFreeSpace(pImage);
+		ClusterAllocator fragmented;
+		fragmented.Load(pImage);
+		std::vector<ClusterRun> runs;
+		results.push_back(Measure(L"ClusterAllocator.Allocate+Free/100 clusters", L"cluster", BENCH_ALLOCATE_CLUSTERS, [&]() {
+			fragmented.Allocate(BENCH_ALLOCATE_CLUSTERS, runs);
+			fragmented.Free(runs);
+			benchSink += (unsigned int)runs.size();
+		}));
+		ReportResult(results.back());
+
+		for (size_t i = 0; i < FLOPPY_IMAGE_SIZE; ++i)
+			pImage[i] = (BYTE)(i * 7 + 1);
+		results.push_back(Measure(L"Crc32c/1.44 MB image", L"image", 1, [&]() {
+			benchSink += Crc32c(pImage, FLOPPY_IMAGE_SIZE);
+		}));
+		ReportResult(results.back());
+
+		results.push_back(Measure(L"Fnv1a64/1.44 MB image", L"image", 1, [&]() {
+			benchSink += (unsigned int)Fnv1a64(pImage, FLOPPY_IMAGE_SIZE);
+		}));
+		ReportResult(results.back());
+
+		// As a delta or sparse write scans an image that is mostly empty
+		memset(pBuffer, 0, FLOPPY_IMAGE_SIZE);
+		results.push_back(Measure(L"IsAllZero/1.44 MB of zeros in 4 KB chunks", L"image", 1, [&]() {
+			unsigned int zeroChunks = 0;
+			for (size_t offset = 0; offset < FLOPPY_IMAGE_SIZE; offset += ZERO_CHUNK_SIZE)
+				zeroChunks += IsAllZero(pBuffer + offset, ZERO_CHUNK_SIZE) ? 1 : 0;
+			benchSink += zeroChunks;
+		}));
+		ReportResult(results.back());
+
+		if (!drivePath.empty())
+		{
+			result = BenchmarkDrive(drivePath, pImage, pBuffer, results);
+		}
+	}
+
+	free(pImage);
+	free(pBuffer);
+
+	if (!result)
+	{
+		return 1;
+	}
+	std::wcout << L"Saving results to: " << resultsPath << std::endl;
+	return TextFileWrite(resultsPath, ResultsToJson(results, L"  \"suite\": \"kernels\",\n"), overwrite) ? 0 : 1;
+}
+
+// Page aligned, as the block device needs for direct I/O
+LPBYTE AllocateImage()
+{
+	void* pImage = NULL;
+	if (posix_memalign(&pImage, 0x1000, FLOPPY_IMAGE_SIZE) != 0)
+	{
+		return NULL;
+	}
+	return (LPBYTE)pImage;
+}
+
+// Every other data cluster is used by a file of one cluster; the rest are free
+void FragmentFreeSpace(LPBYTE pImage)
+{
+	memset(pImage, 0, FLOPPY_IMAGE_SIZE);
+	for (unsigned int au = FLOPPY_FIRST_DATA_AU; au < FLOPPY_END_DATA_AU; au += 2)
+		PutFAT(pImage, au, 0xFFF);
+}
+
+// Time whole image slots through the block device, on a new file laid out like a drive
+bool BenchmarkDrive(const std::wstring& path, LPBYTE pImage, LPBYTE pBuffer, std::vector<BenchResult>& results)
+{
+	std::string utf8Path = ToUtf8(path);
+	int fd = open(utf8Path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd < 0)
+	{
+		std::wcerr << L"Failed to create file: " << path << L": " << strerror(errno) << std::endl;
+		return false;
+	}
+	bool sized = (ftruncate(fd, (off_t)FLOPPY_IMAGE_INTERVAL * BENCH_DRIVE_SLOTS) == 0);
+	int error = errno;
+	close(fd);
+	if (!sized)
+	{
+		std::wcerr << L"Failed to size file: " << path << L": " << strerror(error) << std::endl;
+		unlink(utf8Path.c_str());
+		return false;
+	}
+
+	BlockDevice* pDrive = BlockDeviceOpen(path, BLOCK_DEVICE_WRITE_EXCLUSIVE);
+	if (pDrive == NULL)
+	{
+		unlink(utf8Path.c_str());
+		return false; // Error already reported
+	}
+
+	// A failed write or read is reported by the device; the first one stops the timing
+	bool result = true;
+	int slot = 0;
+	auto nextSlot = [&]() -> uint64_t
+	{
+		slot = (slot + 1) % BENCH_DRIVE_SLOTS;
+		return (uint64_t)FLOPPY_IMAGE_INTERVAL * slot;
+	};
+
+	results.push_back(Measure(L"BlockDevice.Write+Flush/image slot", L"image", 1, [&]() {
+		if (result)
+			result = pDrive->Write(nextSlot(), FLOPPY_IMAGE_SIZE, pImage) && pDrive->Flush();
+	}));
+	ReportResult(results.back());
+
+	results.push_back(Measure(L"BlockDevice.Read/image slot", L"image", 1, [&]() {
+		if (result)
+			result = pDrive->Read(nextSlot(), FLOPPY_IMAGE_SIZE, pBuffer);
+	}));
+	ReportResult(results.back());
+
+	results.push_back(Measure(L"BlockDevice.WriteZeros/image slot", L"image", 1, [&]() {
+		if (result)
+			result = pDrive->WriteZeros(nextSlot(), FLOPPY_IMAGE_SIZE);
+	}));
+	ReportResult(results.back());
+
+	delete pDrive;
+	unlink(utf8Path.c_str());
+	return result;
+}
+
+void Syntax()
+{
+	std::wcout <<
+"Syntax:\n"
+"KernelBenchmark [-overwrite] [-drive <scratchFile>] <resultsFile>\n"
+"  Time the FAT, allocator, checksum and zero-scan kernels on synthetic\n"
+"  workloads and save the results as JSON.\n"
+"\n"
+"Arguments:\n"
+"-drive <scratchFile>\n"
+"  Also time writing and reading image slots through the block device, on a\n"
+"  new file of that name laid out like a thumb drive. It is deleted after.\n"
+"-overwrite\n"
+"  Replace the results file if it exists.\n";
+}
+
+#endif
@@ -0,0 +1,125 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <bitset>
+#include <windows.h>
+
+#include "FloppyImage.h"
+#include "Manifest.h"
+#include "LibraryScan.h"
+#include "LibraryPlan.h"
+#include "Smf.h"
+#include "MidiImage.h"
+
+// The volume label takes one root directory entry
+const unsigned int PLAN_FILES_PER_IMAGE = FLOPPY_ROOT_DIR_ENTRIES - 1;
+const unsigned int PLAN_AUS_PER_IMAGE = FLOPPY_DATA_AU_PER_DISK;
+
+// Something to be placed: a single file or a group of files that go together
+struct PlanItem
+{
+	size_t firstFile; // Index into the file list
+	size_t fileCount;
+	unsigned int aus;
+};
+
+struct PlanImage
+{
+	unsigned int aus = 0;
+	unsigned int files = 0;
+	std::vector<size_t> items;
+};
+
+std::wstring GroupOf(const std::wstring& path);
+
+bool PlanLibrary(const std::vector<MidiFile>& midiFiles, const SmfMinimizeOptions* pMinimize, bool keepGroups, std::vector<ManifestEntry>& plan)
+{
+	// Get the size of each file in clusters
+	std::vector<unsigned int> fileAus(midiFiles.size());
+	for (size_t i = 0; i < midiFiles.size(); ++i)
+	{
+		ULONGLONG size = midiFiles[i].size;
+		if (pMinimize != NULL && !MinimizedMidiFileSize(midiFiles[i].path, *pMinimize, &size))
+		{
+			return false; // Error already reported
+		}
+		ULONGLONG aus = (size + FLOPPY_AU_SIZE - 1) / FLOPPY_AU_SIZE;
+		if (aus > PLAN_AUS_PER_IMAGE)
+		{
+			std::wcerr << L"Source file is too big to fit in an image: " << midiFiles[i].path << std::endl;
+			return false;
+		}
+		fileAus[i] = (unsigned int)aus;
+	}
+
+	// Build the items. A group that's too big for one image is split, in order, into
+	// pieces that each fill an image.
+	std::vector<PlanItem> items;
+	for (size_t i = 0; i < midiFiles.size(); )
+	{
+		PlanItem item = { i, 0, 0 };
+		std::wstring group = keepGroups ? GroupOf(midiFiles[i].path) : std::wstring();
+		while (i < midiFiles.size()
+			&& item.fileCount < PLAN_FILES_PER_IMAGE
+			&& item.aus + fileAus[i] <= PLAN_AUS_PER_IMAGE
+			&& (item.fileCount == 0 || (keepGroups && 0 == _wcsicmp(GroupOf(midiFiles[i].path).c_str(), group.c_str()))))
+		{
+			item.aus += fileAus[i];
+			++item.fileCount;
+			++i;
+		}
+		items.push_back(item);
+	}
+
+	// First fit decreasing: place the biggest items first, each into the first image with room
+	std::vector<size_t> order(items.size());
+	for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&items](size_t a, size_t b) { return items[a].aus > items[b].aus; });
+
+	std::vector<PlanImage> images;
+	for (size_t itemIndex : order)
+	{
+		const PlanItem& item = items[itemIndex];
+		size_t i = 0;
+		for (; i < images.size(); ++i)
+		{
+			if (images[i].aus + item.aus <= PLAN_AUS_PER_IMAGE && images[i].files + item.fileCount <= PLAN_FILES_PER_IMAGE)
+				break;
+		}
+		if (i == images.size())
+			images.push_back(PlanImage());
+		images[i].aus += item.aus;
+		images[i].files += (unsigned int)item.fileCount;
+		images[i].items.push_back(itemIndex);
+	}
+
+	// Emit each image's files in their original order
+	plan.clear();
+	plan.reserve(midiFiles.size());
+	for (size_t imageNum = 0; imageNum < images.size(); ++imageNum)
+	{
+		std::vector<size_t>& imageItems = images[imageNum].items;
+		std::sort(imageItems.begin(), imageItems.end());
+		for (size_t itemIndex : imageItems)
+		{
+			const PlanItem& item = items[itemIndex];
+			for (size_t f = item.firstFile; f < item.firstFile + item.fileCount; ++f)
+			{
+				ManifestEntry entry;
+				entry.imageNum = (int)imageNum;
+				entry.source = midiFiles[f].path;
+				entry.lineNum = (int)plan.size() + 1;
+				plan.push_back(entry);
+			}
+		}
+	}
+	return true;
+}
+
+// The directory portion of a path
+std::wstring GroupOf(const std::wstring& path)
+{
+	size_t lastSlash = path.find_last_of(L'\\');
+	return (lastSlash == std::wstring::npos) ? std::wstring() : path.substr(0, lastSlash);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// Assign a library of MIDI files to as few images as possible, respecting both the
+// cluster and the directory entry limits, using the file sizes found by the scan. With
+// pMinimize, each file is read to find its size once minimized (see MidiToImage). With
+// keepGroups, files from the same directory are kept in the same image where they fit.
+// The result is a manifest (image number and path per file) with files in their
+// original order within each image.
+struct SmfMinimizeOptions;
+extern bool PlanLibrary(const std::vector<MidiFile>& midiFiles, const SmfMinimizeOptions* pMinimize, bool keepGroups, std::vector<ManifestEntry>& plan);
@@ -0,0 +1,247 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <cwctype>
+#include <windows.h>
+
+#include "WorkQueue.h"
+#include "LibraryScan.h"
+#include "WinHelp.h"
+
+// Listing a directory mostly waits on the file system, or on the file server for a library
+// on a share, so more workers than cores keep more listings in flight
+const unsigned int SCAN_MIN_WORKERS = 8;
+
+bool ListDirectory(const std::wstring& directory, const std::wstring& pattern, const ScanOptions& options,
+	std::vector<MidiFile>& files, std::vector<std::wstring>& subdirectories);
+bool MatchesAny(const std::vector<std::wstring>& globs, const wchar_t* name);
+bool GlobMatch(const wchar_t* pattern, const wchar_t* name);
+bool PathLess(const MidiFile& a, const MidiFile& b);
+int CompareNoCase(const wchar_t* a, size_t lengthA, const wchar_t* b, size_t lengthB);
+
+int ScanMidiSource(const std::wstring& source, const ScanOptions& options, std::vector<MidiFile>& files)
+{
+	// The directory (empty or ending in a slash) and the pattern its files must match
+	std::wstring directory;
+	std::wstring pattern;
+	if (source.find_first_of(L"*?") != std::wstring::npos)
+	{
+		size_t slash = source.find_last_of(L'\\');
+		directory = (slash == std::wstring::npos) ? std::wstring() : source.substr(0, slash + 1);
+		pattern = (slash == std::wstring::npos) ? source : source.substr(slash + 1);
+	}
+	else
+	{
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (!GetFileAttributesExW(source.c_str(), GetFileExInfoStandard, &data))
+		{
+			return 0;
+		}
+		if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+		{
+			MidiFile file = { source, ((ULONGLONG)data.nFileSizeHigh << 32) | data.nFileSizeLow, data.ftLastWriteTime };
+			files.push_back(file);
+			return 1;
+		}
+		directory = source;
+		if (directory.back() != L'\\' && directory.back() != L':')
+		{
+			directory += L'\\';
+		}
+		pattern = L"*.mid";
+	}
+
+	// Each directory listed queues its subdirectories for whichever worker is free next.
+	// The worker that finishes the last one closes the queue.
+	WorkQueue<std::wstring> directories;
+	std::atomic<int> pending(1);
+	std::atomic<bool> failed(false);
+	directories.Push(directory);
+
+	std::vector<MidiFile> found;
+	std::mutex foundMutex;
+	unsigned int workerCount = options.recurse ? (std::max)(SCAN_MIN_WORKERS, std::thread::hardware_concurrency()) : 1;
+	std::vector<std::thread> workers;
+	for (unsigned int i = 0; i < workerCount; ++i)
+	{
+		workers.emplace_back([&]()
+		{
+			std::vector<MidiFile> workerFiles;
+			std::vector<std::wstring> subdirectories;
+			std::wstring next;
+			while (directories.Pop(next))
+			{
+				subdirectories.clear();
+				if (!failed && !ListDirectory(next, pattern, options, workerFiles, subdirectories))
+				{
+					failed = true;
+				}
+				if (!failed)
+				{
+					pending += (int)subdirectories.size();
+					for (auto& subdirectory : subdirectories)
+					{
+						directories.Push(std::move(subdirectory));
+					}
+				}
+				if (--pending == 0)
+				{
+					directories.Close();
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(foundMutex);
+			found.insert(found.end(), workerFiles.begin(), workerFiles.end());
+		});
+	}
+	for (auto& worker : workers)
+		worker.join();
+
+	if (failed)
+	{
+		return -1;
+	}
+	std::sort(found.begin(), found.end(), PathLess);
+	files.insert(files.end(), found.begin(), found.end());
+	return (int)found.size();
+}
+
+std::vector<std::wstring> MidiFilePaths(const std::vector<MidiFile>& files)
+{
+	std::vector<std::wstring> paths;
+	paths.reserve(files.size());
+	for (const auto& file : files)
+	{
+		paths.push_back(file.path);
+	}
+	return paths;
+}
+
+// Every entry is listed and matched here, rather than by the file system, so that
+// subdirectories are found whatever the pattern. The basic information level skips the
+// 8.3 names, and large fetches take fewer round trips to a file server.
+bool ListDirectory(const std::wstring& directory, const std::wstring& pattern, const ScanOptions& options,
+	std::vector<MidiFile>& files, std::vector<std::wstring>& subdirectories)
+{
+	WIN32_FIND_DATAW findData;
+	HANDLE hFind = FindFirstFileExW((directory + L"*").c_str(), FindExInfoBasic, &findData, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		DWORD hResult = GetLastError();
+		if (hResult == ERROR_FILE_NOT_FOUND)
+		{
+			return true; // Only the root of an empty volume has no entries at all
+		}
+		std::wcerr << L"Failed to list directory: " << directory << std::endl;
+		ReportError(hResult);
+		return false;
+	}
+
+	do
+	{
+		const wchar_t* name = findData.cFileName;
+		if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+		{
+			// Junctions and links are left alone as they can lead back up the tree
+			if (options.recurse
+				&& (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0
+				&& wcscmp(name, L".") != 0 && wcscmp(name, L"..") != 0
+				&& !MatchesAny(options.excludes, name))
+			{
+				subdirectories.push_back(directory + name + L"\\");
+			}
+		}
+		else if (GlobMatch(pattern.c_str(), name)
+			&& (options.includes.empty() || MatchesAny(options.includes, name))
+			&& !MatchesAny(options.excludes, name))
+		{
+			MidiFile file = { directory + name, ((ULONGLONG)findData.nFileSizeHigh << 32) | findData.nFileSizeLow, findData.ftLastWriteTime };
+			files.push_back(file);
+		}
+	} while (FindNextFileW(hFind, &findData));
+
+	DWORD hResult = GetLastError();
+	FindClose(hFind);
+	if (hResult != ERROR_NO_MORE_FILES)
+	{
+		std::wcerr << L"Failed to list directory: " << directory << std::endl;
+		ReportError(hResult);
+		return false;
+	}
+	return true;
+}
+
+bool MatchesAny(const std::vector<std::wstring>& globs, const wchar_t* name)
+{
+	for (const auto& glob : globs)
+	{
+		if (GlobMatch(glob.c_str(), name)) return true;
+	}
+	return false;
+}
+
+// * matches any run of characters and ? any one character, ignoring case
+bool GlobMatch(const wchar_t* pattern, const wchar_t* name)
+{
+	// On a mismatch, go back to the last * and let it take one more character
+	const wchar_t* afterStar = NULL;
+	const wchar_t* starName = NULL;
+	while (*name != L'\0')
+	{
+		if (*pattern == L'*')
+		{
+			afterStar = ++pattern;
+			starName = name;
+		}
+		else if (*pattern != L'\0' && (*pattern == L'?' || std::towupper(*pattern) == std::towupper(*name)))
+		{
+			++pattern;
+			++name;
+		}
+		else if (afterStar != NULL)
+		{
+			pattern = afterStar;
+			name = ++starName;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	while (*pattern == L'*') ++pattern;
+	return *pattern == L'\0';
+}
+
+// Files are ordered by directory and then by name, so that the files of a directory are
+// together (as -group needs) and a directory comes just before its subdirectories. Names are
+// compared in upper case, the order NTFS keeps a directory in, so a directory scanned on its
+// own lists as it always has.
+bool PathLess(const MidiFile& a, const MidiFile& b)
+{
+	size_t nameA = a.path.find_last_of(L'\\') + 1; // 0 without a slash
+	size_t nameB = b.path.find_last_of(L'\\') + 1;
+	int order = CompareNoCase(a.path.c_str(), nameA, b.path.c_str(), nameB);
+	if (order == 0)
+	{
+		order = CompareNoCase(a.path.c_str() + nameA, a.path.length() - nameA, b.path.c_str() + nameB, b.path.length() - nameB);
+	}
+	return (order != 0) ? (order < 0) : (a.path < b.path);
+}
+
+// A slash sorts before everything else so that a directory comes before the others it's
+// a prefix of
+int CompareNoCase(const wchar_t* a, size_t lengthA, const wchar_t* b, size_t lengthB)
+{
+	size_t length = (std::min)(lengthA, lengthB);
+	for (size_t i = 0; i < length; ++i)
+	{
+		wint_t ca = (a[i] == L'\\') ? 0 : std::towupper(a[i]);
+		wint_t cb = (b[i] == L'\\') ? 0 : std::towupper(b[i]);
+		if (ca != cb) return (ca < cb) ? -1 : 1;
+	}
+	return (lengthA == lengthB) ? 0 : (lengthA < lengthB) ? -1 : 1;
+}
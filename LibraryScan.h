@@ -0,0 +1,28 @@
+#pragma once
+
+// A MIDI file found by a scan, with what its directory listing said about it so that
+// nothing later has to ask the file system again
+struct MidiFile
+{
+	std::wstring path;
+	ULONGLONG size;
+	FILETIME lastWriteTime;
+};
+
+// Which files a scan takes. Globs have * and ? wildcards and are matched, ignoring case,
+// against file and directory names.
+struct ScanOptions
+{
+	bool recurse = false; // Walk subdirectories too
+	std::vector<std::wstring> includes; // With any, a file must match one of them
+	std::vector<std::wstring> excludes; // Files, and directories with all they hold, matching any are skipped
+};
+
+// Find the files that a MIDI source names: a file, a wildcard pattern on the filename, or a
+// directory (its .mid files). Directories are listed on several threads. The files found
+// are added to files sorted by path. A file named outright is taken whatever the globs.
+// Returns the number of files added, or -1 on an error (already reported).
+extern int ScanMidiSource(const std::wstring& source, const ScanOptions& options, std::vector<MidiFile>& files);
+
+// The paths of files, in the same order
+extern std::vector<std::wstring> MidiFilePaths(const std::vector<MidiFile>& files);
@@ -0,0 +1,110 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <windows.h>
+
+#include "Manifest.h"
+#include "TextFile.h"
+
+// Manifest file format
+// * UTF-8 text (a byte order mark is optional), one entry per line.
+// * Each entry is an image number followed by whitespace and a source.
+//   The source is the balance of the line so it may include spaces.
+// * An image number may be repeated to put multiple MIDI sources into one image.
+// * Blank lines and lines beginning with '#' are ignored.
+//
+// Example:
+//   # Slot  Source
+//   0       C:\Music\Chopin\*.mid
+//   0       C:\Music\Encores\Minute Waltz.mid
+//   1       C:\Music\Gershwin
+//   2       C:\Images\Christmas.img
+//   3       G:12
+
+bool ParseManifestLine(const std::wstring& line, int lineNum, std::vector<ManifestEntry>& entries);
+
+bool ManifestRead(std::wstring filename, std::vector<ManifestEntry>& entries)
+{
+	std::wstring wtext;
+	if (!TextFileRead(filename, wtext))
+	{
+		return false; // Error already reported
+	}
+
+	// Parse line by line
+	int lineNum = 0;
+	size_t pos = 0;
+	while (pos < wtext.length())
+	{
+		size_t eol = wtext.find(L'\n', pos);
+		if (eol == std::wstring::npos) eol = wtext.length();
+		++lineNum;
+		if (!ParseManifestLine(wtext.substr(pos, eol - pos), lineNum, entries))
+		{
+			std::wcerr << L"Manifest: " << filename << L" line " << lineNum << std::endl;
+			return false;
+		}
+		pos = eol + 1;
+	}
+
+	if (entries.empty())
+	{
+		std::wcerr << L"Manifest has no entries: " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool ParseManifestLine(const std::wstring& line, int lineNum, std::vector<ManifestEntry>& entries)
+{
+	// Trim leading and trailing whitespace (including the CR of a CRLF)
+	size_t begin = line.find_first_not_of(L" \t\r");
+	if (begin == std::wstring::npos) return true; // Blank line
+	size_t end = line.find_last_not_of(L" \t\r") + 1;
+
+	// Comment
+	if (line[begin] == L'#') return true;
+
+	// Image number
+	size_t p = begin;
+	int imageNum = 0;
+	while (p < end && line[p] >= L'0' && line[p] <= L'9')
+	{
+		imageNum = imageNum * 10 + (line[p] - L'0');
+		if (imageNum > 0xFFFF)
+		{
+			std::wcerr << L"Image number is out of range." << std::endl;
+			return false;
+		}
+		++p;
+	}
+	if (p == begin || p >= end || (line[p] != L' ' && line[p] != L'\t'))
+	{
+		std::wcerr << L"Expected an image number followed by a source." << std::endl;
+		return false;
+	}
+
+	// Source is the balance of the line
+	p = line.find_first_not_of(L" \t", p);
+	ManifestEntry entry;
+	entry.imageNum = imageNum;
+	entry.source = line.substr(p, end - p);
+	entry.lineNum = lineNum;
+	entries.push_back(entry);
+	return true;
+}
+
+bool ManifestWrite(std::wstring filename, const std::vector<ManifestEntry>& entries, bool overwrite)
+{
+	// Build the text
+	std::wstring wtext = L"# Image\tSource\r\n";
+	for (const auto& entry : entries)
+	{
+		wtext += std::to_wstring(entry.imageNum);
+		wtext += L'\t';
+		wtext += entry.source;
+		wtext += L"\r\n";
+	}
+
+	return TextFileWrite(filename, wtext, overwrite);
+}
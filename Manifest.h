@@ -0,0 +1,14 @@
+#pragma once
+
+// One line of a manifest file: an image number and the source to put there.
+// The source may be a MIDI file, wildcard or directory (as with -midi)
+// or an image (as with -simg).
+struct ManifestEntry
+{
+	int imageNum;
+	std::wstring source;
+	int lineNum;
+};
+
+extern bool ManifestRead(std::wstring filename, std::vector<ManifestEntry>& entries);
+extern bool ManifestWrite(std::wstring filename, const std::vector<ManifestEntry>& entries, bool overwrite);
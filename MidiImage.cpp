@@ -1,10 +1,22 @@
 #include <iostream>
 #include <vector>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <algorithm>
+#include <bitset>
 #include <cstring>
 #include <windows.h>
 
-#include "MidiImage.h"
 #include "FloppyImage.h"
+#include "Smf.h"
+#include "MidiImage.h"
+#include "FatTable.h"
+#include "ClusterAllocator.h"
+#include "DirectoryIndex.h"
+#include "Checksum.h"
+#include "RunStats.h"
 #include "WinHelp.h"
 
 
@@ -12,56 +24,171 @@
 // https://www.tavi.co.uk/phobos/fat.html - This has been the most helpful even though the examples are all FAT16 instead of FAT12
 
 const char DiskLabel[] = "Piano_Midi  "; // Pad to at least 11 bytes;
-const byte FatHeader[] = { 0xF0, 0xFF, 0xFF };
-
-bool AddFile(LPBYTE pImage, std::wstring filename);
-void FormatImage(LPBYTE pImage);
-unsigned int GetFAT(LPBYTE pImage, unsigned int au);
-void PutFAT(LPBYTE pImage, unsigned int au, unsigned int value);
-void To8dot3Filename(const wchar_t* srcFilename, char* dstFilename);
-void Uniquify8dot3Filename(char* filename, LPBYTE pImage);
+
+// A file whose clusters and directory entry have been assigned but whose data hasn't been read.
+// A minimized file has been read, and closed, already.
+struct PlannedFile
+{
+	std::wstring filename;
+	HANDLE hFile; // INVALID_HANDLE_VALUE once read into data
+	DWORD size;
+	std::vector<ClusterRun> runs;
+	std::vector<BYTE> data;
+};
+
+template <class Geometry>
+bool PlanFile(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& filename, PlannedFile& file, const SmfMinimizeOptions* pMinimize, SmfValidation validation);
+template <class Geometry>
+bool PlanFileData(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const MidiFileData& source, PlannedFile& file, const SmfMinimizeOptions* pMinimize);
+bool CheckRoomForFile(const ClusterAllocator& allocator, const DirectoryIndex& dirIndex);
+template <class Geometry>
+bool PlaceFile(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& filename, FILETIME* pLastWriteTime, ULONGLONG fileSize, HANDLE hFile, PlannedFile& file);
+bool ReadMinimized(HANDLE hFile, const std::wstring& filename, DWORD size, const SmfMinimizeOptions& options, SmfValidation validation, std::vector<BYTE>& data);
+bool MayMinimize(HANDLE hFile);
+void MinimizeData(const SmfMinimizeOptions& options, std::vector<BYTE>& data);
+template <class Geometry>
+bool IngestFile(LPBYTE pImage, const PlannedFile& file, SmfValidation validation);
+template <class Geometry>
+void StampDeterministic(LPBYTE pImage);
 void SystemTimeToFloppyTime(SYSTEMTIME* pSystemTime, FloppyDateTime* pFloppyTime);
 void FileTimeToFloppyTime(FILETIME* pFileTime, FloppyDateTime* pFloppyTime);
 
-bool MidiToImage(std::vector<std::wstring> midiPaths, LPBYTE pImage)
+template <class Geometry>
+bool MidiToImage(std::vector<std::wstring> midiPaths, LPBYTE pImage, bool deterministic, const SmfMinimizeOptions* pMinimize, SmfValidation validation)
 {
-	FormatImage(pImage);
-	for (const auto& path : midiPaths)
+	StatTimer buildTimer(STAGE_BUILD);
+	FormatImage<Geometry>(pImage);
+	ClusterAllocator allocator;
+	allocator.Load<Geometry>(pImage);
+	DirectoryIndex dirIndex;
+	dirIndex.Load<Geometry>(pImage);
+
+	// Plan where every file goes before reading any data
+	std::vector<PlannedFile> plan;
+	plan.reserve(midiPaths.size());
+	bool result = true;
 	{
-		if (!AddFile(pImage, path))
+		StatTimer planTimer(STAGE_PLAN);
+		for (const auto& path : midiPaths)
 		{
-			return false;
+			PlannedFile file;
+			if (!PlanFile<Geometry>(pImage, allocator, dirIndex, path, file, pMinimize, validation))
+			{
+				result = false;
+				break;
+			}
+			plan.push_back(std::move(file));
+		}
+	}
+
+	// Read each file straight into its clusters
+	for (auto& file : plan)
+	{
+		if (result && !IngestFile<Geometry>(pImage, file, validation))
+		{
+			result = false;
+		}
+		if (file.hFile != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(file.hFile);
+		}
+	}
+
+	if (result && deterministic)
+	{
+		StampDeterministic<Geometry>(pImage);
+	}
+	return result;
+}
+
+template bool MidiToImage<Floppy720K>(std::vector<std::wstring> midiPaths, LPBYTE pImage, bool deterministic, const SmfMinimizeOptions* pMinimize, SmfValidation validation);
+template bool MidiToImage<Floppy1200K>(std::vector<std::wstring> midiPaths, LPBYTE pImage, bool deterministic, const SmfMinimizeOptions* pMinimize, SmfValidation validation);
+template bool MidiToImage<Floppy1440K>(std::vector<std::wstring> midiPaths, LPBYTE pImage, bool deterministic, const SmfMinimizeOptions* pMinimize, SmfValidation validation);
+template bool MidiToImage<Floppy2880K>(std::vector<std::wstring> midiPaths, LPBYTE pImage, bool deterministic, const SmfMinimizeOptions* pMinimize, SmfValidation validation);
+
+template <class Geometry>
+bool MidiDataToImage(const std::vector<MidiFileData>& files, LPBYTE pImage, bool deterministic, const SmfMinimizeOptions* pMinimize)
+{
+	StatTimer buildTimer(STAGE_BUILD);
+	FormatImage<Geometry>(pImage);
+	ClusterAllocator allocator;
+	allocator.Load<Geometry>(pImage);
+	DirectoryIndex dirIndex;
+	dirIndex.Load<Geometry>(pImage);
+
+	// With the data at hand each file can be copied in as soon as it's placed
+	for (const auto& source : files)
+	{
+		PlannedFile file;
+		{
+			StatTimer planTimer(STAGE_PLAN);
+			if (!PlanFileData<Geometry>(pImage, allocator, dirIndex, source, file, pMinimize))
+			{
+				return false; // Error already reported
+			}
 		}
+		IngestFile<Geometry>(pImage, file, SMF_VALIDATE_NONE);
+	}
+
+	if (deterministic)
+	{
+		StampDeterministic<Geometry>(pImage);
 	}
 	return true;
 }
 
+template bool MidiDataToImage<Floppy720K>(const std::vector<MidiFileData>& files, LPBYTE pImage, bool deterministic, const SmfMinimizeOptions* pMinimize);
+template bool MidiDataToImage<Floppy1200K>(const std::vector<MidiFileData>& files, LPBYTE pImage, bool deterministic, const SmfMinimizeOptions* pMinimize);
+template bool MidiDataToImage<Floppy1440K>(const std::vector<MidiFileData>& files, LPBYTE pImage, bool deterministic, const SmfMinimizeOptions* pMinimize);
+template bool MidiDataToImage<Floppy2880K>(const std::vector<MidiFileData>& files, LPBYTE pImage, bool deterministic, const SmfMinimizeOptions* pMinimize);
+
+template <class Geometry>
+void StampDeterministic(LPBYTE pImage)
+{
+	// Date the volume label with the newest file. Packed FAT date/times sort as integers.
+	FloppyDirectoryEntry* pLabelEntry = (FloppyDirectoryEntry*)(pImage + Geometry::ROOT_DIR_OFFSET);
+	DWORD newest = (1 << 21) | (1 << 16); // 1980-01-01 if there are no files
+	for (DWORD i = 1; i < Geometry::ROOT_DIR_ENTRIES && pLabelEntry[i].Filename[0] != '\0'; ++i)
+	{
+		DWORD dateTime;
+		memcpy(&dateTime, &pLabelEntry[i].DateTime, sizeof(dateTime));
+		newest = (std::max)(newest, dateTime);
+	}
+	memcpy(&pLabelEntry->DateTime, &newest, sizeof(newest));
+
+	// The serial number is a hash of everything else
+	memset(pImage + BOOTSECTOR_SERIALNUM_OFFSET, 0, BOOTSECTOR_SERIALNUM_LEN);
+	DWORD serial = Fnv1a(pImage, Geometry::IMAGE_SIZE);
+	memcpy(pImage + BOOTSECTOR_SERIALNUM_OFFSET, &serial, BOOTSECTOR_SERIALNUM_LEN);
+}
+
+template <class Geometry>
 void FormatImage(LPBYTE pImage) {
 	// Zero it all
-	memset(pImage, 0, FLOPPY_IMAGE_SIZE);
+	memset(pImage, 0, Geometry::IMAGE_SIZE);
 
-	// Fill in the boot sector (minus serial number and volume label)
-	memcpy(pImage, BootSector, FLOPPY_BLOCK_SIZE);
+	// Fill in the boot sector (minus serial number and volume label), then the BPB for this format
+	memcpy(pImage, BootSector, Geometry::BLOCK_SIZE);
+	pImage[BPB_BLOCKS_PER_AU_OFFSET] = (BYTE)Geometry::BLOCKS_PER_AU;
+	*(WORD*)(pImage + BPB_ROOT_DIR_ENTRIES_OFFSET) = (WORD)Geometry::ROOT_DIR_ENTRIES;
+	*(WORD*)(pImage + BPB_BLOCKS_PER_DISK_OFFSET) = (WORD)Geometry::BLOCKS_PER_DISK;
+	pImage[BPB_MEDIA_DESCRIPTOR_OFFSET] = Geometry::MEDIA_DESCRIPTOR;
+	*(WORD*)(pImage + BPB_BLOCKS_PER_FAT_OFFSET) = (WORD)Geometry::BLOCKS_PER_FAT;
+	*(WORD*)(pImage + BPB_BLOCKS_PER_TRACK_OFFSET) = (WORD)Geometry::BLOCKS_PER_TRACK;
 
 	// Random "serial number"
-	{
-		// They want me to use GetTickCount64 but for my purposes this one works better
-#pragma warning( push )
-#pragma warning ( disable: 28159)
-		DWORD ticks = GetTickCount();
-#pragma warning( pop )
-		memcpy(pImage + BOOTSECTOR_SERIALNUM_OFFSET, &ticks, BOOTSECTOR_SERIALNUM_LEN);
-	}
+	NewSerialNumber(pImage);
 
 	// Volume Label
 	memcpy(pImage + BOOTSECTOR_LABEL_OFFSET, DiskLabel, BOOTSECTOR_LABEL_LEN);
 
-	// Init the two FATs
-	memcpy(pImage + FLOPPY_FAT0_OFFSET, FatHeader, sizeof(FatHeader));
-	memcpy(pImage + FLOPPY_FAT1_OFFSET, FatHeader, sizeof(FatHeader));
+	// Init the two FATs. The first entry repeats the media descriptor.
+	const BYTE fatHeader[] = { Geometry::MEDIA_DESCRIPTOR, 0xFF, 0xFF };
+	memcpy(pImage + Geometry::FAT0_OFFSET, fatHeader, sizeof(fatHeader));
+	memcpy(pImage + Geometry::FAT1_OFFSET, fatHeader, sizeof(fatHeader));
 
 	// Init the directory
-	FloppyDirectoryEntry* pFirstEntry = (FloppyDirectoryEntry*)(pImage + FLOPPY_ROOT_DIR_OFFSET);
+	FloppyDirectoryEntry* pFirstEntry = (FloppyDirectoryEntry*)(pImage + Geometry::ROOT_DIR_OFFSET);
 	memcpy(pFirstEntry->Filename, DiskLabel, sizeof(FloppyDirectoryEntry::Filename));
 	pFirstEntry->Attributes = 0x08;
 	{
@@ -71,45 +198,68 @@ void FormatImage(LPBYTE pImage) {
 	}
 }
 
-bool AddFile(LPBYTE pImage, std::wstring filename)
+template void FormatImage<Floppy720K>(LPBYTE pImage);
+template void FormatImage<Floppy1200K>(LPBYTE pImage);
+template void FormatImage<Floppy1440K>(LPBYTE pImage);
+template void FormatImage<Floppy2880K>(LPBYTE pImage);
+
+void NewSerialNumber(LPBYTE pImage)
 {
-	// Generate an 8.3 filename
-	char floppyFilename[11];
-	To8dot3Filename(filename.c_str(), floppyFilename);
-	Uniquify8dot3Filename(floppyFilename, pImage);
+	// They want me to use GetTickCount64 but for my purposes this one works better
+#pragma warning( push )
+#pragma warning ( disable: 28159)
+	DWORD ticks = GetTickCount();
+#pragma warning( pop )
 
-	// Find the next available FAT entry
-	unsigned int fileFirstAu = 2;
-	for (;;)
+	// Anything that tells images apart by serial number must see a change
+	DWORD old;
+	memcpy(&old, pImage + BOOTSECTOR_SERIALNUM_OFFSET, BOOTSECTOR_SERIALNUM_LEN);
+	if (ticks == old) ++ticks;
+	memcpy(pImage + BOOTSECTOR_SERIALNUM_OFFSET, &ticks, BOOTSECTOR_SERIALNUM_LEN);
+}
+
+template <class Geometry>
+bool AddFile(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& path, std::vector<ClusterRun>& runs, const SmfMinimizeOptions* pMinimize, SmfValidation validation)
+{
+	PlannedFile file;
+	if (!PlanFile<Geometry>(pImage, allocator, dirIndex, path, file, pMinimize, validation))
 	{
-		if (fileFirstAu >= FLOPPY_DATA_AU_PER_DISK)
-		{
-			std::wcerr << L"Floppy is full." << std::endl;
-			return false;
-		}
-		if (GetFAT(pImage, fileFirstAu) == 0) break;
-		++fileFirstAu;
+		return false; // Error already reported
 	}
 
-	// Find the next available Directory entry
-	FloppyDirectoryEntry* pDirEntry;
+	// Clusters freed by other files still hold their data. Clear them so that the
+	// slack after the end of the file is zero, as in a newly built image.
+	for (const auto& run : file.runs)
 	{
-		pDirEntry = (FloppyDirectoryEntry*)(pImage + FLOPPY_ROOT_DIR_OFFSET);
-		FloppyDirectoryEntry* pEnd = pDirEntry + FLOPPY_ROOT_DIR_ENTRIES;
-		for (;;)
-		{
-			if (pDirEntry >= pEnd) {
-				std::wcerr << L"Floppy directory is full." << std::endl;
-				return false;
-			}
-			char nameFirst = pDirEntry->Filename[0];
-			if (nameFirst == '\0' || nameFirst == '\xE5') break;
-			++pDirEntry;
-		}
+		memset(pImage + Geometry::DATA_OFFSET + (run.first - Geometry::FIRST_DATA_AU) * Geometry::AU_SIZE, 0, run.count * Geometry::AU_SIZE);
+	}
+
+	bool result = IngestFile<Geometry>(pImage, file, validation);
+	if (file.hFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(file.hFile);
+	}
+	runs = file.runs;
+	return result;
+}
+
+template bool AddFile<Floppy720K>(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& path, std::vector<ClusterRun>& runs, const SmfMinimizeOptions* pMinimize, SmfValidation validation);
+template bool AddFile<Floppy1200K>(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& path, std::vector<ClusterRun>& runs, const SmfMinimizeOptions* pMinimize, SmfValidation validation);
+template bool AddFile<Floppy1440K>(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& path, std::vector<ClusterRun>& runs, const SmfMinimizeOptions* pMinimize, SmfValidation validation);
+template bool AddFile<Floppy2880K>(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& path, std::vector<ClusterRun>& runs, const SmfMinimizeOptions* pMinimize, SmfValidation validation);
+
+template <class Geometry>
+bool PlanFile(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& filename, PlannedFile& file, const SmfMinimizeOptions* pMinimize, SmfValidation validation)
+{
+	if (!CheckRoomForFile(allocator, dirIndex))
+	{
+		return false; // Error already reported
 	}
 
-	// Open the source file
-	HANDLE hFile = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	// Open the source file. It stays open until its data has been read.
+	StatTimer readTimer(STAGE_SOURCE_READ);
+	StatAdd(STAT_IO_CALLS, 2);
+	HANDLE hFile = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
 	if (hFile == INVALID_HANDLE_VALUE)
 	{
 		std::wcerr << L"Failed to open source file: " << filename << std::endl;
@@ -117,93 +267,258 @@ bool AddFile(LPBYTE pImage, std::wstring filename)
 		return false;
 	}
 
-	// Get its size
-	LARGE_INTEGER fileSize;
-	if (!GetFileSizeEx(hFile, &fileSize))
+	// Get its size and date modified in one call
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(hFile, &info))
 	{
 		DWORD hResult = GetLastError();
 		CloseHandle(hFile);
-		std::wcerr << L"Failed to get source file size." << std::endl;
+		std::wcerr << L"Failed to get source file information: " << filename << std::endl;
 		ReportError(hResult);
 		return false;
 	}
 
-	// See if there's enough room left
-	if ((size_t)fileSize.QuadPart > (FLOPPY_DATA_AU_PER_DISK - fileFirstAu) * FLOPPY_AU_SIZE)
+	// A minimized file's size isn't known until it has been read, so it's read now. Minimizing
+	// never makes a file bigger, so one too big for the space left is only read if minimizing
+	// could make it smaller. Otherwise it's turned away below without being read.
+	ULONGLONG fileSize = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	if (pMinimize != NULL && fileSize <= MAXDWORD
+		&& (fileSize <= (ULONGLONG)allocator.FreeCount() * Geometry::AU_SIZE || MayMinimize(hFile)))
 	{
+		bool read = ReadMinimized(hFile, filename, (DWORD)fileSize, *pMinimize, validation, file.data);
 		CloseHandle(hFile);
-		std::wcerr << L"Insufficient space for source file: " << filename << std::endl;
+		hFile = INVALID_HANDLE_VALUE;
+		if (!read)
+		{
+			return false; // Error already reported
+		}
+		fileSize = file.data.size();
+	}
+
+	return PlaceFile<Geometry>(pImage, allocator, dirIndex, filename, &info.ftLastWriteTime, fileSize, hFile, file);
+}
+
+template <class Geometry>
+bool PlanFileData(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const MidiFileData& source, PlannedFile& file, const SmfMinimizeOptions* pMinimize)
+{
+	if (!CheckRoomForFile(allocator, dirIndex))
+	{
+		return false; // Error already reported
+	}
+
+	file.data = source.data;
+	if (pMinimize != NULL)
+	{
+		MinimizeData(*pMinimize, file.data);
+	}
+	FILETIME lastWriteTime = source.lastWriteTime;
+	return PlaceFile<Geometry>(pImage, allocator, dirIndex, source.path, &lastWriteTime, file.data.size(), INVALID_HANDLE_VALUE, file);
+}
+
+bool CheckRoomForFile(const ClusterAllocator& allocator, const DirectoryIndex& dirIndex)
+{
+	if (allocator.FreeCount() == 0)
+	{
+		std::wcerr << L"Floppy is full." << std::endl;
 		return false;
 	}
 
-	// Get its date modified
-	FILETIME dateModified;
-	if (!GetFileTime(hFile, NULL, NULL, &dateModified))
+	// Make sure there's a directory entry available
+	if (!dirIndex.HasFreeEntry())
 	{
-		DWORD hResult = GetLastError();
-		CloseHandle(hFile);
-		std::wcerr << L"Failed to get source file date modified." << std::endl;
-		ReportError(hResult);
+		std::wcerr << L"Floppy directory is full." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Give a file its name, directory entry and clusters. hFile is where its data is to be read
+// from, or INVALID_HANDLE_VALUE if it has been read into file.data already. It's closed on failure.
+template <class Geometry>
+bool PlaceFile(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& filename, FILETIME* pLastWriteTime, ULONGLONG fileSize, HANDLE hFile, PlannedFile& file)
+{
+	// Generate an 8.3 filename
+	char floppyFilename[11];
+	To8dot3Filename(filename.c_str(), floppyFilename);
+	Uniquify8dot3Filename(floppyFilename, dirIndex);
+
+	// Allocate clusters, if there's enough room left
+	if (fileSize > (ULONGLONG)allocator.FreeCount() * Geometry::AU_SIZE
+		|| !allocator.Allocate((unsigned int)((fileSize + Geometry::AU_SIZE - 1) / Geometry::AU_SIZE), file.runs))
+	{
+		if (hFile != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(hFile);
+		}
+		std::wcerr << L"Insufficient space for source file: " << filename << std::endl;
 		return false;
 	}
 
 	// Write the directory entry
+	FloppyDirectoryEntry* pDirEntry = dirIndex.AllocateEntry(floppyFilename);
 	memcpy(pDirEntry->Filename, floppyFilename, sizeof(floppyFilename));
 	pDirEntry->Attributes = 0x20; // Archive bit
-	FileTimeToFloppyTime(&dateModified, &pDirEntry->DateTime);
-	pDirEntry->StartCluster = fileFirstAu;
-	pDirEntry->FileSize = fileSize.LowPart;
+	FileTimeToFloppyTime(pLastWriteTime, &pDirEntry->DateTime);
+	pDirEntry->StartCluster = file.runs.empty() ? 0 : file.runs[0].first; // An empty file has no clusters
+	pDirEntry->FileSize = (DWORD)fileSize;
 
 	// Write the FAT entries
+	PutFATChain<Geometry>(pImage, file.runs);
+
+	file.filename = filename;
+	file.hFile = hFile;
+	file.size = (DWORD)fileSize;
+	return true;
+}
+
+template <class Geometry>
+bool IngestFile(LPBYTE pImage, const PlannedFile& file, SmfValidation validation)
+{
+	StatTimer readTimer(STAGE_SOURCE_READ);
+	StatAdd(STAT_FILES_INGESTED);
+	if (file.hFile == INVALID_HANDLE_VALUE)
 	{
-		int fileAus = (int)(fileSize.LowPart / FLOPPY_AU_SIZE); // Round down
-		for (int i = 0; i < fileAus; ++i)
-			PutFAT(pImage, fileFirstAu + i, fileFirstAu + i + 1);
-		PutFAT(pImage, fileFirstAu + fileAus, 0xFFFF); // Last entry
+		// Already read, validated and minimized
+		size_t copied = 0;
+		for (const auto& run : file.runs)
+		{
+			size_t toCopy = std::min<size_t>(file.data.size() - copied, run.count * Geometry::AU_SIZE);
+			memcpy(pImage + Geometry::DATA_OFFSET + (run.first - Geometry::FIRST_DATA_AU) * Geometry::AU_SIZE, file.data.data() + copied, toCopy);
+			copied += toCopy;
+		}
+		return true;
 	}
 
-	// Read the data from the file into the image
-	DWORD bytesRead;
-	if (!ReadFile(hFile, pImage + FLOPPY_DATA_OFFSET + (fileFirstAu - 2) * FLOPPY_AU_SIZE, fileSize.LowPart, &bytesRead, NULL))
+	// Read each run of clusters at its file offset directly into its final place in the image,
+	// validating it there
+	SmfValidator validator(file.size);
+	DWORD remaining = file.size;
+	ULONGLONG offset = 0;
+	for (const auto& run : file.runs)
+	{
+		DWORD toRead = (DWORD)std::min<size_t>(remaining, run.count * Geometry::AU_SIZE);
+		OVERLAPPED position = {};
+		position.Offset = (DWORD)offset;
+		position.OffsetHigh = (DWORD)(offset >> 32);
+		LPBYTE pRun = pImage + Geometry::DATA_OFFSET + (run.first - Geometry::FIRST_DATA_AU) * Geometry::AU_SIZE;
+		DWORD bytesRead;
+		StatAdd(STAT_IO_CALLS);
+		if (!ReadFile(file.hFile, pRun, toRead, &bytesRead, &position))
+		{
+			std::wcerr << L"Failed to read source file: " << file.filename << std::endl;
+			ReportError(GetLastError());
+			return false;
+		}
+		if (bytesRead != toRead)
+		{
+			std::wcerr << L"Failed to read entire source file:" << file.filename << std::endl;
+			return false;
+		}
+		StatAdd(STAT_BYTES_READ, bytesRead);
+		if (validation != SMF_VALIDATE_NONE)
+		{
+			validator.Add(pRun, bytesRead);
+		}
+		remaining -= toRead;
+		offset += toRead;
+	}
+	return validation == SMF_VALIDATE_NONE || CheckSmfVerdict(validator, file.filename, validation);
+}
+
+// Read all of a file, validate it and minimize it
+bool ReadMinimized(HANDLE hFile, const std::wstring& filename, DWORD size, const SmfMinimizeOptions& options, SmfValidation validation, std::vector<BYTE>& data)
+{
+	data.resize(size);
+	DWORD bytesRead = 0;
+	OVERLAPPED position = {}; // From the start, whatever MayMinimize has read
+	StatAdd(STAT_IO_CALLS);
+	if (size > 0 && !ReadFile(hFile, data.data(), size, &bytesRead, &position))
 	{
-		DWORD hResult = GetLastError();
-		CloseHandle(hFile);
 		std::wcerr << L"Failed to read source file: " << filename << std::endl;
-		ReportError(hResult);
+		ReportError(GetLastError());
 		return false;
 	}
-	CloseHandle(hFile);
-	if (bytesRead != fileSize.LowPart)
+	if (bytesRead != size)
 	{
 		std::wcerr << L"Failed to read entire source file:" << filename << std::endl;
 		return false;
 	}
+	StatAdd(STAT_BYTES_READ, bytesRead);
+	if (validation != SMF_VALIDATE_NONE)
+	{
+		SmfValidator validator(size);
+		validator.Add(data.data(), data.size());
+		if (!CheckSmfVerdict(validator, filename, validation))
+		{
+			return false;
+		}
+	}
 
+	MinimizeData(options, data);
 	return true;
 }
 
-unsigned int GetFAT(LPBYTE pImage, unsigned int au)
+// Whether a file's header says it's an SMF that MinimizeSmf could rewrite. If it can't be
+// read, it may be, so that the error is reported by the read of the whole file.
+bool MayMinimize(HANDLE hFile)
 {
-	if (au < FLOPPY_FIRST_DATA_AU || au >= FLOPPY_DATA_AU_PER_DISK) return 0xFFF; // Out of range
-	DWORD* pEntry = (DWORD*)(pImage + FLOPPY_FAT0_OFFSET + (au >> 1) * 3);
-	return (int)(((au & 0x01) == 0) ? *pEntry & 0x0FFF : (*pEntry >> 12) & 0xFFF);
+	BYTE header[SMF_HEADER_SIZE];
+	DWORD bytesRead = 0;
+	OVERLAPPED position = {};
+	StatAdd(STAT_IO_CALLS);
+	if (!ReadFile(hFile, header, sizeof(header), &bytesRead, &position))
+	{
+		return true;
+	}
+	StatAdd(STAT_BYTES_READ, bytesRead);
+	return IsMinimizableSmf(header, bytesRead);
 }
 
-void PutFAT(LPBYTE pImage, unsigned int au, unsigned int value)
+// The data is kept as it is if minimizing it is no smaller or it can't be read as an SMF
+void MinimizeData(const SmfMinimizeOptions& options, std::vector<BYTE>& data)
 {
-	if (au < FLOPPY_FIRST_DATA_AU || au >= FLOPPY_DATA_AU_PER_DISK) return; // Out of range
-	DWORD* pEntry0 = (DWORD*)(pImage + FLOPPY_FAT0_OFFSET + (au >> 1) * 3);
-	DWORD* pEntry1 = (DWORD*)(((BYTE*)pEntry0) + FLOPPY_FAT_SIZE);
-	DWORD newEntry;
-	if ((au & 0x01) == 0)
+	std::vector<BYTE> minimized;
+	if (MinimizeSmf(data.data(), data.size(), options, minimized) && minimized.size() < data.size())
 	{
-		newEntry = (*pEntry0 & 0xFFFFF000) | (((DWORD)value) & 0x00000FFF);
+		StatAdd(STAT_MIDI_BYTES_SAVED, data.size() - minimized.size());
+		data.swap(minimized);
 	}
-	else {
-		newEntry = (*pEntry0 & 0xFF000FFF) | ((((DWORD)value) << 12) & 0x00FFF000);
+}
+
+bool MinimizedMidiFileSize(const std::wstring& path, const SmfMinimizeOptions& options, ULONGLONG* pSize)
+{
+	StatTimer readTimer(STAGE_SOURCE_READ);
+	StatAdd(STAT_IO_CALLS, 2);
+	HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		std::wcerr << L"Failed to open source file: " << path << std::endl;
+		ReportError(GetLastError());
+		return false;
 	}
-	*pEntry0 = newEntry;
-	*pEntry1 = newEntry;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(hFile, &fileSize))
+	{
+		DWORD hResult = GetLastError();
+		CloseHandle(hFile);
+		std::wcerr << L"Failed to get source file information: " << path << std::endl;
+		ReportError(hResult);
+		return false;
+	}
+
+	// Far too big either way, or stored as it is
+	*pSize = fileSize.QuadPart;
+	if (*pSize > MAXDWORD || !MayMinimize(hFile))
+	{
+		CloseHandle(hFile);
+		return true;
+	}
+
+	std::vector<BYTE> data;
+	bool result = ReadMinimized(hFile, path, (DWORD)*pSize, options, SMF_VALIDATE_NONE, data);
+	CloseHandle(hFile);
+	*pSize = data.size();
+	return result;
 }
 
 void SystemTimeToFloppyTime(SYSTEMTIME* pSystemTime, FloppyDateTime* pFloppyTime)
@@ -275,30 +590,13 @@ void To8dot3Filename(const wchar_t* srcPath, char* dstFilename)
 	CopyWStringToFnString(pSrcExt + 1, pSrcEnd, dstFilename + 8, dstFilename + 11); // this is OK if there's no extension and pSrcExt+1 is greater than pSrcEnd because the copier will just exit the loop
 }
 
-void Uniquify8dot3Filename(char* filename, LPBYTE pImage)
+void Uniquify8dot3Filename(char* filename, const DirectoryIndex& dirIndex)
 {
-	FloppyDirectoryEntry* pDir = (FloppyDirectoryEntry*)(pImage + FLOPPY_ROOT_DIR_OFFSET);
-	FloppyDirectoryEntry* pDirEnd = pDir + FLOPPY_ROOT_DIR_ENTRIES;
-
 	// Keep going until it's unique
 	for (;;)
 	{
-		FloppyDirectoryEntry* pEntry;
-		for (pEntry = pDir; pEntry < pDirEnd; ++pEntry)
-		{
-			if (pEntry->Filename[0] == '\0')
-			{
-				// No more used entries (a used but freed entry has 0xE5 in the first byte)
-				pDirEnd = pEntry;
-				break;
-			}
-			if (0 == memcmp(filename, pEntry->Filename, sizeof(FloppyDirectoryEntry::Filename)))
-			{
-				// Found a match
-				break;
-			}
-		}
-		if (pEntry >= pDirEnd)
+		StatAdd(STAT_DIRECTORY_PROBES);
+		if (!dirIndex.Contains(filename))
 		{
 			return; // it's unique
 		}
@@ -1,4 +1,46 @@
 #pragma once
 
-extern bool MidiToImage(std::vector<std::wstring> midiPaths, LPBYTE pImage);
+// Bump whenever a change to MidiToImage alters the bytes it produces, so cached images are rebuilt
+const DWORD BUILDER_VERSION = 1;
 
+// With deterministic, the same inputs always give the same bytes: The serial number is a hash
+// of the image and the volume label is dated with the newest file rather than the clock.
+// With pMinimize, each file is stored as MinimizeSmf rewrites it when that's smaller.
+// With validation, each file is checked by SmfValidator as it's read, and reported or rejected.
+// Images are 1.44 MB unless another format is specified.
+struct SmfMinimizeOptions;
+template <class Geometry = Floppy1440K>
+bool MidiToImage(std::vector<std::wstring> midiPaths, LPBYTE pImage, bool deterministic = false, const SmfMinimizeOptions* pMinimize = NULL, SmfValidation validation = SMF_VALIDATE_NONE);
+template <class Geometry = Floppy1440K>
+void FormatImage(LPBYTE pImage);
+
+// A MIDI file read into memory, with the date modified for its directory entry
+struct MidiFileData
+{
+	std::wstring path;
+	FILETIME lastWriteTime;
+	std::vector<BYTE> data;
+};
+
+// As MidiToImage, from files that have been read (and validated, if they're to be) already
+template <class Geometry = Floppy1440K>
+bool MidiDataToImage(const std::vector<MidiFileData>& files, LPBYTE pImage, bool deterministic = false, const SmfMinimizeOptions* pMinimize = NULL);
+
+// Add a file to an existing image whose free clusters and directory have been loaded into
+// allocator and dirIndex. The clusters given to the file are returned in runs. The file is
+// minimized and validated as by MidiToImage.
+class ClusterAllocator;
+class DirectoryIndex;
+struct ClusterRun;
+template <class Geometry = Floppy1440K>
+bool AddFile(LPBYTE pImage, ClusterAllocator& allocator, DirectoryIndex& dirIndex, const std::wstring& path, std::vector<ClusterRun>& runs, const SmfMinimizeOptions* pMinimize = NULL, SmfValidation validation = SMF_VALIDATE_NONE);
+
+// The size a MIDI file takes in an image when minimized as with pMinimize above. The file is read.
+extern bool MinimizedMidiFileSize(const std::wstring& path, const SmfMinimizeOptions& options, ULONGLONG* pSize);
+
+// Give an image a new random serial number, one that differs from the one it had
+extern void NewSerialNumber(LPBYTE pImage);
+
+// Naming of files in an image. Names are 11 bytes: 8.3, space padded, without the dot.
+extern void To8dot3Filename(const wchar_t* srcPath, char* dstFilename);
+extern void Uniquify8dot3Filename(char* filename, const DirectoryIndex& dirIndex);
@@ -3,29 +3,96 @@
 
 #include <iostream>
 #include <vector>
+#include <map>
+#include <thread>
+#include <functional>
+#include <bitset>
 #include <windows.h>
 #include <cwctype>
 
 #include "FloppyImage.h"
+#include "FatTable.h"
 #include "WinHelp.h"
 #include "ImageFile.h"
 #include "ThumbDriveImage.h"
+#include "Smf.h"
 #include "MidiImage.h"
+#include "Manifest.h"
+#include "LibraryScan.h"
+#include "LibraryPlan.h"
+#include "ImageExtract.h"
+#include "Catalog.h"
+#include "ImageCheck.h"
+#include "ImageEdit.h"
+#include "ImageCompact.h"
+#include "BuildCache.h"
+#include "WorkQueue.h"
+#include "ImagePool.h"
+#include "ImageBuilder.h"
+#include "DriveWriter.h"
+#include "Checksum.h"
+#include "Benchmark.h"
+#include "DriveBackup.h"
+#include "RunStats.h"
 
 extern const wchar_t* g_syntax;
 bool g_reportSyntax = false;
 bool g_verbose = false;
 bool g_overwrite = false;
-std::vector<std::wstring> g_srcMidiPaths;
+std::vector<MidiFile> g_srcMidiFiles;
+ScanOptions g_scanOptions;
 std::wstring g_srcImg;
 std::wstring g_dstImg;
 std::wstring g_dstDir;
+std::wstring g_manifest;
+std::wstring g_plan;
+bool g_group = false;
+std::wstring g_catalog;
+std::wstring g_check;
+std::wstring g_backup;
+std::wstring g_restore;
+std::vector<ImageEdit> g_edits;
+std::wstring g_find;
+bool g_list = false;
+bool g_delta = false;
+DeltaStats g_deltaStats = {};
+bool g_deterministic = false;
+bool g_minimize = false;
+SmfMinimizeOptions g_minimizeOptions;
+SmfValidation g_validation = SMF_VALIDATE_NONE;
+std::wstring g_cacheDir;
+bool g_verify = false;
+std::wstring g_bench;
+bool g_selfTest = false;
+std::wstring g_stats;
+std::wstring g_trace;
+FloppyFormat g_format = FLOPPY_FORMAT_1440K;
 
 void syntax();
 int parseCommandLine(int argc, wchar_t* argv[]);
-int addToMidiPaths(const wchar_t* pattern);
+int runCommand();
+int runManifest();
+int runPlan();
+int runCatalog();
+int runCheck();
+int runBackup();
+int runRestore();
+int runEdit();
+int addEdits(ImageEditOp op, wchar_t* source);
+int addMidiSource(wchar_t* source, std::vector<MidiFile>& midiFiles);
+bool tryParseMetaTypes(const wchar_t* list, std::bitset<128>* pTypes);
 void winSlash(wchar_t* str); // Substitute windows slashes for forward slashes
-bool tryParseThumbDriveImageNum(const wchar_t* name, wchar_t* driveLetter, int* imageNumber);
+bool tryParseDriveName(const wchar_t* name, std::wstring* drive, const wchar_t** slots);
+bool tryParseImageNum(const wchar_t* p, const wchar_t* end, int* imageNumber);
+bool tryParseThumbDriveImageNum(const wchar_t* name, std::wstring* drive, int* imageNumber);
+bool tryParseThumbDrive(const wchar_t* name, std::wstring* drive);
+bool tryParseThumbDriveImageRange(const wchar_t* name, std::wstring* drive, int* firstImageNum, int* lastImageNum);
+bool isImageSource(const std::wstring& source);
+void reportDeltaStats();
+void reportVerifyStats(const VerifyStats& stats, size_t imageCount);
+void reportBackupStats(const DriveBackupStats& stats);
+BuildOptions buildOptions();
+bool writeImageToDrive(const std::wstring& drive, int imageNum, LPBYTE pImage);
 
 int wmain( int argc, wchar_t *argv[])
 {
@@ -34,9 +101,9 @@ int wmain( int argc, wchar_t *argv[])
     if (result != 0 || g_reportSyntax) return result;
 
     if (g_verbose) {
-        if (g_srcMidiPaths.size() > 0) {
-            for (const auto& path : g_srcMidiPaths) {
-                std::wcout << L"-midi " << path << std::endl;
+        if (g_srcMidiFiles.size() > 0) {
+            for (const auto& file : g_srcMidiFiles) {
+                std::wcout << L"-midi " << file.path << std::endl;
             }
         }
         if (g_srcImg.length() > 0) {
@@ -48,10 +115,115 @@ int wmain( int argc, wchar_t *argv[])
         if (g_dstDir.length() > 0) {
             std::wcout << L"-ddir " << g_dstDir << std::endl;
         }
+        if (g_manifest.length() > 0) {
+            std::wcout << L"-manifest " << g_manifest << std::endl;
+        }
+        if (g_plan.length() > 0) {
+            std::wcout << L"-plan " << g_plan << std::endl;
+        }
+        if (g_catalog.length() > 0) {
+            std::wcout << L"-catalog " << g_catalog << std::endl;
+        }
+        if (g_backup.length() > 0) {
+            std::wcout << L"-backup " << g_backup << std::endl;
+        }
+        if (g_restore.length() > 0) {
+            std::wcout << L"-restore " << g_restore << std::endl;
+        }
+        for (const auto& edit : g_edits) {
+            const wchar_t* names[] = { L"-add ", L"-remove ", L"-replace ", L"-compact" };
+            std::wcout << names[edit.op] << edit.path << std::endl;
+        }
         std::wcout << std::endl;
     }
 
-    if (g_srcMidiPaths.size() > 0 && g_srcImg.length() > 0)
+    result = runCommand();
+
+    // Statistics cover the whole run, whether or not it succeeded
+    if (g_stats.length() > 0 && !StatsWrite(g_stats, g_overwrite))
+    {
+        result = -1; // Error already reported
+    }
+    if (g_trace.length() > 0 && !TraceWrite(g_trace, g_overwrite))
+    {
+        result = -1; // Error already reported
+    }
+    return result;
+}
+
+int runCommand()
+{
+    if (g_bench.length() > 0)
+    {
+        return RunBenchmarks(g_bench, g_overwrite) ? 0 : -1;
+    }
+
+    if (g_selfTest)
+    {
+        return FatSelfTest() ? 0 : -1;
+    }
+
+    // Thumb drives, and so manifests, plans and cached builds, are 1.44 MB throughout
+    if (g_format != FLOPPY_FORMAT_1440K)
+    {
+        std::wstring drive;
+        int imageNum;
+        if (g_srcMidiFiles.empty() || g_dstImg.length() == 0 || tryParseThumbDriveImageNum(g_dstImg.c_str(), &drive, &imageNum)
+            || g_manifest.length() > 0 || g_plan.length() > 0 || g_cacheDir.length() > 0)
+        {
+            std::wcerr << L"Error: -format only applies to building an image file from -midi sources. (-h for help)" << std::endl;
+            return -1;
+        }
+    }
+
+    if (g_plan.length() > 0)
+    {
+        return runPlan();
+    }
+
+    if (g_catalog.length() > 0)
+    {
+        return runCatalog();
+    }
+
+    if (g_check.length() > 0)
+    {
+        return runCheck();
+    }
+
+    if (g_backup.length() > 0)
+    {
+        return runBackup();
+    }
+
+    if (g_restore.length() > 0)
+    {
+        return runRestore();
+    }
+
+    // Changes are made in place, except that an image being copied may be compacted on the way
+    if (g_edits.size() > 0)
+    {
+        if (g_srcImg.length() == 0)
+        {
+            return runEdit();
+        }
+        for (const auto& edit : g_edits)
+        {
+            if (edit.op != IMAGE_EDIT_COMPACT)
+            {
+                std::wcerr << L"Error: -add, -remove and -replace change the -dimg image in place and take no -simg source. (-h for help)" << std::endl;
+                return -1;
+            }
+        }
+    }
+
+    if (g_manifest.length() > 0)
+    {
+        return runManifest();
+    }
+
+    if (g_srcMidiFiles.size() > 0 && g_srcImg.length() > 0)
     {
         std::wcerr << L"Error: Both MIDI and image sources specified. Use either -midi or -simg but not both. (-h for help)" << std::endl;
         return -1;
@@ -61,34 +233,101 @@ int wmain( int argc, wchar_t *argv[])
         std::wcerr << L"Error: Both image and directory destinations specified. Use either -dimg or -ddir but not both. (-h for help)" << std::endl;
         return -1;
     }
-    
-    // Allocate a page-aligned buffer for reading and writing
-    LPBYTE pImage = (LPBYTE)VirtualAlloc(NULL, FLOPPY_IMAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+    // A range of thumb drive images is extracted straight to directories
+    {
+        std::wstring drive;
+        int firstImageNum, lastImageNum;
+        if (g_srcImg.length() > 0 && tryParseThumbDriveImageRange(g_srcImg.c_str(), &drive, &firstImageNum, &lastImageNum))
+        {
+            if (g_dstDir.length() == 0)
+            {
+                std::wcerr << L"Error: A range of source images can only be extracted with -ddir. (-h for help)" << std::endl;
+                return -1;
+            }
+            std::wcout << L"Extracting images " << firstImageNum << L" through " << lastImageNum << L" to: " << g_dstDir << std::endl;
+            if (!ThumbDriveToDirectories(drive, firstImageNum, lastImageNum, g_dstDir, g_overwrite))
+            {
+                return -1; // Error already reported
+            }
+            std::wcout << L"Done.";
+            return 0;
+        }
+    }
+
+    // An image file copied to another file, or into a drive image file, can be left to the
+    // system to copy (or clone) without passing through here. -delta, -verify and -compact need the bytes.
+    if (g_srcImg.length() > 0 && g_dstImg.length() > 0 && !g_delta && !g_verify && g_edits.empty())
+    {
+        std::wstring drive;
+        int imageNum;
+        if (!tryParseThumbDriveImageNum(g_srcImg.c_str(), &drive, &imageNum))
+        {
+            if (!tryParseThumbDriveImageNum(g_dstImg.c_str(), &drive, &imageNum))
+            {
+                std::wcout << L"Copying " << g_srcImg << L" to: " << g_dstImg << std::endl;
+                if (!ImageFileCopy(g_srcImg, g_dstImg, g_overwrite))
+                {
+                    return -1; // Error already reported
+                }
+                std::wcout << L"Done.";
+                return 0;
+            }
+
+            if (!ImageFileCheck(g_srcImg))
+            {
+                return -1; // Error already reported
+            }
+            bool copied;
+            if (!ThumbDriveCopyImageFile(drive, imageNum, g_srcImg, &copied))
+            {
+                return -1; // Error already reported
+            }
+            if (copied)
+            {
+                std::wcout << L"Copied " << g_srcImg << L" to: " << g_dstImg << std::endl;
+                std::wcout << L"Done.";
+                return 0;
+            }
+            if (g_verbose) {
+                std::wcout << L"Unable to copy within the file system. Writing the image instead." << std::endl;
+            }
+        }
+    }
+
+    // Allocate a page-aligned buffer for reading and writing, big enough for an image file of any format
+    LPBYTE pImage = (LPBYTE)VirtualAlloc(NULL, FLOPPY_MAX_IMAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    FloppyFormat format = g_format;
 
     // === Get the image =======
-    if (g_srcMidiPaths.size() > 0)
+    if (g_srcMidiFiles.size() > 0)
     {
-        if (!MidiToImage(g_srcMidiPaths, pImage)) {
+        TraceSpan span(L"build image");
+        if (!BuildMidiImage(MidiFilePaths(g_srcMidiFiles), pImage, buildOptions())) {
             return -1; // Error already reported
         }
     }
     else if (g_srcImg.length() > 0)
     {
         std::wcout << L"Reading from: " << g_srcImg << std::endl;
-        wchar_t driveLetter;
+        TraceSpan span(L"read image");
+        std::wstring drive;
         int imageNum;
-        if (tryParseThumbDriveImageNum(g_srcImg.c_str(), &driveLetter, &imageNum))
+        if (tryParseThumbDriveImageNum(g_srcImg.c_str(), &drive, &imageNum))
         {
-            if (!ThumbDriveRead(driveLetter, imageNum, pImage))
+            if (!ThumbDriveRead(drive, imageNum, pImage))
             {
                 return -1; // Error already reported
             }
         }
         else {
-            if (!ImageFileRead(g_srcImg, pImage))
+            if (!ImageFileRead(g_srcImg, pImage, &format))
             {
                 return -1;
             }
+            if (g_verbose && format != FLOPPY_FORMAT_1440K) {
+                std::wcout << L"Format: " << GetFloppyFormatName(format) << std::endl;
+            }
         }
     }
     else
@@ -97,21 +336,39 @@ int wmain( int argc, wchar_t *argv[])
         return -1;
     }
 
+    // Only -compact is left in g_edits here
+    if (g_edits.size() > 0)
+    {
+        TraceSpan span(L"compact");
+        int movedCount = ImageCompact(pImage);
+        if (movedCount < 0)
+        {
+            return -1; // Error already reported
+        }
+        std::wcout << L"Moved " << movedCount << L" clusters." << std::endl;
+    }
+
     // === Store the image ======
     if (g_dstImg.length() > 0)
     {
         std::wcout << L"Writing to: " << g_dstImg << std::endl;
-        wchar_t driveLetter;
+        TraceSpan span(L"write image");
+        std::wstring drive;
         int imageNum;
-        if (tryParseThumbDriveImageNum(g_dstImg.c_str(), &driveLetter, &imageNum))
+        if (tryParseThumbDriveImageNum(g_dstImg.c_str(), &drive, &imageNum))
         {
-            if (!ThumbDriveWrite(driveLetter, imageNum, pImage))
+            if (format != FLOPPY_FORMAT_1440K)
+            {
+                std::wcerr << L"Error: Only 1.44 MB images can be written to a thumb drive. This is " << GetFloppyFormatName(format) << L"." << std::endl;
+                return -1;
+            }
+            if (!writeImageToDrive(drive, imageNum, pImage))
             {
                 return -1; // Error already reported
             }
         }
         else {
-            if (!ImageFileWrite(g_dstImg, pImage, g_overwrite))
+            if (!ImageFileWrite(g_dstImg, pImage, g_overwrite, format))
             {
                 return -1;
             }
@@ -119,8 +376,12 @@ int wmain( int argc, wchar_t *argv[])
     }
     else if (g_dstDir.length() > 0)
     {
-        std::wcerr << L"Directory destination not yet implemented. Use either -dimg or -ddir. (-h for help)" << std::endl;
-        return -1;
+        std::wcout << L"Extracting to: " << g_dstDir << std::endl;
+        TraceSpan span(L"extract image");
+        if (!ImageToDirectory(pImage, g_dstDir, g_overwrite))
+        {
+            return -1; // Error already reported
+        }
     }
     else
     {
@@ -132,6 +393,373 @@ int wmain( int argc, wchar_t *argv[])
     return 0;
 }
 
+int runManifest()
+{
+    if (g_srcMidiFiles.size() > 0 || g_srcImg.length() > 0)
+    {
+        std::wcerr << L"Error: -manifest cannot be combined with -midi or -simg. (-h for help)" << std::endl;
+        return -1;
+    }
+    if (g_dstImg.length() == 0)
+    {
+        std::wcerr << L"Error: -manifest requires a -dimg destination drive (e.g. F:) or drive image file. (-h for help)" << std::endl;
+        return -1;
+    }
+
+    std::vector<ManifestEntry> entries;
+    if (!ManifestRead(g_manifest, entries))
+    {
+        return -1; // Error already reported
+    }
+
+    // Collect the sources for each image
+    std::map<int, ImageSource> sources;
+    for (auto& entry : entries)
+    {
+        ImageSource& image = sources[entry.imageNum];
+        if (isImageSource(entry.source))
+        {
+            if (image.srcImg.length() > 0 || image.midiPaths.size() > 0)
+            {
+                std::wcerr << L"Manifest line " << entry.lineNum << L": Image " << entry.imageNum << L" has more than one source and one of them is an image." << std::endl;
+                return -1;
+            }
+            image.srcImg = entry.source;
+            std::wstring drive;
+            if (tryParseThumbDriveImageNum(entry.source.c_str(), &drive, &image.srcImageNum))
+            {
+                image.srcImg = drive;
+            }
+        }
+        else
+        {
+            if (image.srcImg.length() > 0)
+            {
+                std::wcerr << L"Manifest line " << entry.lineNum << L": Image " << entry.imageNum << L" has more than one source and one of them is an image." << std::endl;
+                return -1;
+            }
+            std::vector<MidiFile> midiFiles;
+            int findCount = addMidiSource(&entry.source[0], midiFiles);
+            if (findCount < 0)
+            {
+                return -1; // Error already reported
+            }
+            if (findCount == 0)
+            {
+                std::wcerr << L"Manifest line " << entry.lineNum << L": No matches found for '" << entry.source << L"'." << std::endl;
+                return -1;
+            }
+            for (const auto& file : midiFiles)
+            {
+                image.midiPaths.push_back(file.path);
+            }
+        }
+    }
+
+    // Images are built on every core and written in ascending order as they're finished. A
+    // buffer per builder, plus one being written and one being verified, keeps them all busy.
+    unsigned int workerCount = (std::max)(1u, std::thread::hardware_concurrency());
+    ImagePool pool(workerCount + 2, FLOPPY_IMAGE_SIZE);
+    if (pool.Size() == 0)
+    {
+        std::wcerr << L"Failed to allocate buffer." << std::endl;
+        return -1;
+    }
+    BuildOptions options = buildOptions();
+
+    // Build every image once before the destination is touched, so that a bad source leaves
+    // it as it was. Images aren't kept from one pass to the next, so memory use is still
+    // bounded by the pool.
+    std::wcout << L"Checking " << sources.size() << L" images." << std::endl;
+    {
+        TraceSpan span(L"check images");
+        if (!CheckImages(sources, options, pool))
+        {
+            return -1; // Error already reported
+        }
+    }
+
+    int result = 0;
+    TraceSpan span(L"build and write images");
+    std::wstring drive;
+    if (tryParseThumbDrive(g_dstImg.c_str(), &drive))
+    {
+        std::wcout << L"Writing " << sources.size() << L" images to: " << g_dstImg << std::endl;
+
+        // Image 0 holds the volume's boot sector so it must be written with the volume locked
+        BlockDevice* pDrive = ThumbDriveOpen(drive, (sources.begin()->first == 0) ? BLOCK_DEVICE_WRITE_EXCLUSIVE : BLOCK_DEVICE_WRITE);
+        if (pDrive == NULL)
+        {
+            return -1; // Error already reported
+        }
+
+        VerifyStats verifyStats = {};
+        {
+            ThumbDriveImageWriter writer(pDrive, &pool, g_delta ? &g_deltaStats : NULL, g_verify, &verifyStats, g_verbose);
+            bool built = BuildImages(sources, options, pool,
+                [&](int imageNum, LPBYTE pImage, DWORD checksum) { return writer.Write(imageNum, pImage, checksum); });
+            if (!writer.Finish() || !built)
+            {
+                result = -1; // Error already reported
+            }
+        }
+        ThumbDriveClose(pDrive);
+
+        reportDeltaStats();
+        reportVerifyStats(verifyStats, sources.size());
+    }
+    else
+    {
+        std::wcout << L"Writing drive image to: " << g_dstImg << std::endl;
+        LPBYTE pBlankImage = (LPBYTE)VirtualAlloc(NULL, FLOPPY_IMAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (pBlankImage == NULL)
+        {
+            std::wcerr << L"Failed to allocate buffer." << std::endl;
+            return -1;
+        }
+        FormatImage(pBlankImage);
+
+        DriveImageFile file;
+        if (!DriveImageFileOpen(g_dstImg, g_overwrite, &file))
+        {
+            result = -1; // Error already reported
+        }
+        else
+        {
+            bool built = BuildImages(sources, options, pool,
+                [&](int imageNum, LPBYTE pImage, DWORD) {
+                    if (g_verbose) {
+                        std::wcout << L"Writing image " << imageNum << std::endl;
+                    }
+                    bool written = DriveImageFileWriteImage(&file, imageNum, pImage, pBlankImage);
+                    pool.Release(pImage);
+                    return written;
+                });
+            if (!DriveImageFileClose(&file) || !built)
+            {
+                result = -1; // Error already reported
+            }
+        }
+        VirtualFree(pBlankImage, 0, MEM_RELEASE);
+    }
+
+    if (result == 0)
+    {
+        std::wcout << L"Done.";
+    }
+    return result;
+}
+
+int runPlan()
+{
+    if (g_srcMidiFiles.size() == 0)
+    {
+        std::wcerr << L"Error: -plan requires a -midi source. (-h for help)" << std::endl;
+        return -1;
+    }
+    if (g_srcImg.length() > 0 || g_dstImg.length() > 0 || g_dstDir.length() > 0 || g_manifest.length() > 0)
+    {
+        std::wcerr << L"Error: -plan only takes -midi sources. Build the plan with -manifest afterward. (-h for help)" << std::endl;
+        return -1;
+    }
+
+    std::vector<ManifestEntry> plan;
+    {
+        StatTimer timer(STAGE_PLAN);
+        TraceSpan span(L"plan");
+        if (!PlanLibrary(g_srcMidiFiles, g_minimize ? &g_minimizeOptions : NULL, g_group, plan))
+        {
+            return -1; // Error already reported
+        }
+    }
+    if (!ManifestWrite(g_plan, plan, g_overwrite))
+    {
+        return -1; // Error already reported
+    }
+
+    int imageCount = plan.empty() ? 0 : plan.back().imageNum + 1;
+    std::wcout << L"Planned " << plan.size() << L" files into " << imageCount << L" images: " << g_plan << std::endl;
+    std::wcout << L"Done.";
+    return 0;
+}
+
+int runCatalog()
+{
+    if (g_srcMidiFiles.size() > 0 || g_dstImg.length() > 0 || g_dstDir.length() > 0 || g_manifest.length() > 0)
+    {
+        std::wcerr << L"Error: -catalog only takes a -simg drive to scan. (-h for help)" << std::endl;
+        return -1;
+    }
+    if (g_srcImg.length() == 0 && g_find.length() == 0 && !g_list)
+    {
+        std::wcerr << L"Error: -catalog requires a -simg drive to scan, -find or -list. (-h for help)" << std::endl;
+        return -1;
+    }
+
+    // With -o the catalog is rebuilt from scratch rather than revalidated
+    std::vector<CatalogImage> images;
+    if (!g_overwrite && !CatalogRead(g_catalog, images))
+    {
+        return -1; // Error already reported
+    }
+
+    if (g_srcImg.length() > 0)
+    {
+        std::wstring drive;
+        int firstImageNum = 0;
+        int lastImageNum = -1;
+        if (!tryParseThumbDrive(g_srcImg.c_str(), &drive) &&
+            !tryParseThumbDriveImageRange(g_srcImg.c_str(), &drive, &firstImageNum, &lastImageNum))
+        {
+            if (!tryParseThumbDriveImageNum(g_srcImg.c_str(), &drive, &firstImageNum))
+            {
+                std::wcerr << L"Error: -catalog scans a thumb drive (e.g. F: or F:0-99), not an image file. (-h for help)" << std::endl;
+                return -1;
+            }
+            lastImageNum = firstImageNum;
+        }
+
+        std::wcout << L"Scanning: " << g_srcImg << std::endl;
+        TraceSpan span(L"scan");
+        bool scanned = CatalogScan(drive, firstImageNum, lastImageNum, images);
+
+        // Save whatever was scanned, even after an error, so that it needn't be read again
+        if (!CatalogWrite(g_catalog, images) || !scanned)
+        {
+            return -1; // Error already reported
+        }
+    }
+
+    if (g_list)
+    {
+        CatalogList(images);
+    }
+    if (g_find.length() > 0)
+    {
+        int matchCount = CatalogFind(images, g_find);
+        std::wcout << matchCount << L" matches." << std::endl;
+        if (matchCount == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int runCheck()
+{
+    if (g_srcMidiFiles.size() > 0 || g_srcImg.length() > 0 || g_dstImg.length() > 0 || g_dstDir.length() > 0 || g_manifest.length() > 0)
+    {
+        std::wcerr << L"Error: -check takes no other sources or destinations. (-h for help)" << std::endl;
+        return -1;
+    }
+
+    std::wstring drive;
+    int firstImageNum = 0;
+    int lastImageNum = -1;
+    if (!tryParseThumbDrive(g_check.c_str(), &drive) &&
+        !tryParseThumbDriveImageRange(g_check.c_str(), &drive, &firstImageNum, &lastImageNum))
+    {
+        if (!tryParseThumbDriveImageNum(g_check.c_str(), &drive, &firstImageNum))
+        {
+            std::wcerr << L"Error: -check checks a thumb drive (e.g. F: or F:0-99), not an image file. (-h for help)" << std::endl;
+            return -1;
+        }
+        lastImageNum = firstImageNum;
+    }
+
+    std::wcout << L"Checking: " << g_check << std::endl;
+    TraceSpan span(L"check drive");
+    if (!ThumbDriveCheck(drive, firstImageNum, lastImageNum))
+    {
+        return -1; // Problems already reported
+    }
+    std::wcout << L"Done.";
+    return 0;
+}
+
+int runBackup()
+{
+    std::wstring drive;
+    if (g_srcMidiFiles.size() > 0 || g_dstImg.length() > 0 || g_dstDir.length() > 0 || g_manifest.length() > 0 || g_edits.size() > 0
+        || g_restore.length() > 0 || !tryParseThumbDrive(g_srcImg.c_str(), &drive))
+    {
+        std::wcerr << L"Error: -backup requires a -simg drive alone (e.g. F:) and takes no other sources or destinations. (-h for help)" << std::endl;
+        return -1;
+    }
+
+    std::wcout << L"Backing up: " << g_srcImg << L" to: " << g_backup << std::endl;
+    TraceSpan span(L"backup");
+    DriveBackupStats stats = {};
+    if (!DriveBackup(drive, g_backup, g_overwrite, &stats))
+    {
+        return -1; // Error already reported
+    }
+    reportBackupStats(stats);
+    std::wcout << L"Done.";
+    return 0;
+}
+
+int runRestore()
+{
+    std::wstring drive;
+    if (g_srcMidiFiles.size() > 0 || g_srcImg.length() > 0 || g_dstDir.length() > 0 || g_manifest.length() > 0 || g_edits.size() > 0
+        || !tryParseThumbDrive(g_dstImg.c_str(), &drive))
+    {
+        std::wcerr << L"Error: -restore requires a -dimg drive alone (e.g. F:) and takes no other sources or destinations. (-h for help)" << std::endl;
+        return -1;
+    }
+
+    std::wcout << L"Restoring: " << g_restore << L" to: " << g_dstImg << std::endl;
+    TraceSpan span(L"restore");
+    DriveBackupStats stats = {};
+    if (!DriveRestore(g_restore, drive, g_overwrite, &stats))
+    {
+        return -1; // Error already reported
+    }
+    reportBackupStats(stats);
+    std::wcout << L"Done.";
+    return 0;
+}
+
+int runEdit()
+{
+    if (g_srcMidiFiles.size() > 0 || g_srcImg.length() > 0 || g_dstDir.length() > 0 || g_manifest.length() > 0)
+    {
+        std::wcerr << L"Error: -add, -remove and -replace change the -dimg image in place and take no other sources or destinations. (-h for help)" << std::endl;
+        return -1;
+    }
+    if (g_dstImg.length() == 0)
+    {
+        std::wcerr << L"Error: -add, -remove and -replace require a -dimg image to change. (-h for help)" << std::endl;
+        return -1;
+    }
+
+    std::wcout << L"Changing: " << g_dstImg << std::endl;
+    TraceSpan span(L"edit");
+    ImageEditStats stats = {};
+    std::wstring drive;
+    int imageNum;
+    bool result = tryParseThumbDriveImageNum(g_dstImg.c_str(), &drive, &imageNum)
+        ? ThumbDriveEditImage(drive, imageNum, g_edits, g_minimize ? &g_minimizeOptions : NULL, g_validation, &stats)
+        : ImageFileEdit(g_dstImg, g_edits, g_minimize ? &g_minimizeOptions : NULL, g_validation, &stats);
+    if (!result)
+    {
+        return -1; // Error already reported
+    }
+    for (const auto& edit : g_edits)
+    {
+        if (edit.op == IMAGE_EDIT_COMPACT)
+        {
+            std::wcout << L"Moved " << stats.clustersMoved << L" clusters." << std::endl;
+            break;
+        }
+    }
+    std::wcout << L"Read " << stats.bytesRead / 1024 << L" KB, wrote " << stats.bytesWritten / 1024 << L" KB." << std::endl;
+    std::wcout << L"Done.";
+    return 0;
+}
+
 void syntax() {
     std::wcerr << g_syntax;
 }
@@ -159,33 +787,11 @@ int parseCommandLine(int argc, wchar_t* argv[]) {
                 std::wcerr << L"No value for argument '-midi'." << std::endl;
                 return -1;
             }
-            winSlash(argv[i]);
-
-            int findCount = 0;
-
-            // Check for wildcards
-            if (NULL != wcschr(argv[i], L'*') || NULL != wcschr(argv[i], L'?'))
-            {
-                findCount = addToMidiPaths(argv[i]);
-            }
-            else
-            {
-                // Get the attributes
-                DWORD attributes = GetFileAttributesW(argv[i]);
-                if (attributes == INVALID_FILE_ATTRIBUTES)
-                {
-                    findCount = 0;
-                }
-                else if ((attributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
-                {
-                    findCount = addToMidiPaths((std::wstring(argv[i]) + L"\\*.mid").c_str());
-                }
-                else {
-                    g_srcMidiPaths.push_back(std::wstring(argv[i]));
-                    findCount = 1;
-                }
+            int findCount = addMidiSource(argv[i], g_srcMidiFiles);
+            if (findCount < 0) {
+                return -1; // Error already reported
             }
-            if (findCount <= 0) {
+            if (findCount == 0) {
                 std::wcerr << L"No matches found for -midi '" << argv[i] << "'." << std::endl;
                 return -1;
             }
@@ -215,7 +821,213 @@ int parseCommandLine(int argc, wchar_t* argv[]) {
                 std::wcerr << L"No value for argument '-ddir'." << std::endl;
                 return -1;
             }
-            g_dstImg = argv[i];
+            winSlash(argv[i]);
+            g_dstDir = argv[i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-manifest")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-manifest'." << std::endl;
+                return -1;
+            }
+            g_manifest = argv[i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-plan")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-plan'." << std::endl;
+                return -1;
+            }
+            g_plan = argv[i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-group")) {
+            g_group = true;
+        }
+        else if (0 == _wcsicmp(argv[i], L"-recurse")) {
+            g_scanOptions.recurse = true;
+        }
+        else if (0 == _wcsicmp(argv[i], L"-include") || 0 == _wcsicmp(argv[i], L"-exclude")) {
+            // Advance to the next string and check for end
+            bool include = (0 == _wcsicmp(argv[i], L"-include"));
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '" << argv[i - 1] << L"'." << std::endl;
+                return -1;
+            }
+            (include ? g_scanOptions.includes : g_scanOptions.excludes).push_back(argv[i]);
+        }
+        else if (0 == _wcsicmp(argv[i], L"-catalog")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-catalog'." << std::endl;
+                return -1;
+            }
+            g_catalog = argv[i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-check")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-check'." << std::endl;
+                return -1;
+            }
+            g_check = argv[i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-backup") || 0 == _wcsicmp(argv[i], L"-restore")) {
+            // Advance to the next string and check for end
+            std::wstring& backup = (0 == _wcsicmp(argv[i], L"-backup")) ? g_backup : g_restore;
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '" << argv[i - 1] << L"'." << std::endl;
+                return -1;
+            }
+            backup = argv[i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-add") || 0 == _wcsicmp(argv[i], L"-replace")) {
+            // Advance to the next string and check for end
+            ImageEditOp op = (0 == _wcsicmp(argv[i], L"-add")) ? IMAGE_EDIT_ADD : IMAGE_EDIT_REPLACE;
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '" << argv[i - 1] << L"'." << std::endl;
+                return -1;
+            }
+            int findCount = addEdits(op, argv[i]);
+            if (findCount < 0) {
+                return -1; // Error already reported
+            }
+            if (findCount == 0) {
+                std::wcerr << L"No matches found for " << argv[i - 1] << L" '" << argv[i] << "'." << std::endl;
+                return -1;
+            }
+        }
+        else if (0 == _wcsicmp(argv[i], L"-compact")) {
+            g_edits.push_back({ IMAGE_EDIT_COMPACT, L"" });
+        }
+        else if (0 == _wcsicmp(argv[i], L"-remove")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-remove'." << std::endl;
+                return -1;
+            }
+            g_edits.push_back({ IMAGE_EDIT_REMOVE, argv[i] });
+        }
+        else if (0 == _wcsicmp(argv[i], L"-find")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-find'." << std::endl;
+                return -1;
+            }
+            g_find = argv[i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-list")) {
+            g_list = true;
+        }
+        else if (0 == _wcsicmp(argv[i], L"-delta")) {
+            g_delta = true;
+        }
+        else if (0 == _wcsicmp(argv[i], L"-verify")) {
+            g_verify = true;
+        }
+        else if (0 == _wcsicmp(argv[i], L"-deterministic")) {
+            g_deterministic = true;
+        }
+        else if (0 == _wcsicmp(argv[i], L"-minimize")) {
+            g_minimize = true;
+        }
+        else if (0 == _wcsicmp(argv[i], L"-dropsysex")) {
+            g_minimizeOptions.keepSysex = false;
+        }
+        else if (0 == _wcsicmp(argv[i], L"-keepmeta")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-keepmeta'." << std::endl;
+                return -1;
+            }
+            if (!tryParseMetaTypes(argv[i], &g_minimizeOptions.keepMeta)) {
+                std::wcerr << L"Invalid meta event types for -keepmeta '" << argv[i] << L"'. Use numbers from 0 to 127 separated by commas." << std::endl;
+                return -1;
+            }
+        }
+        else if (0 == _wcsicmp(argv[i], L"-validate")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-validate'." << std::endl;
+                return -1;
+            }
+            if (0 == _wcsicmp(argv[i], L"warn")) {
+                g_validation = SMF_VALIDATE_WARN;
+            }
+            else if (0 == _wcsicmp(argv[i], L"reject")) {
+                g_validation = SMF_VALIDATE_REJECT;
+            }
+            else {
+                std::wcerr << L"Unknown policy for -validate '" << argv[i] << L"'. Use warn or reject." << std::endl;
+                return -1;
+            }
+        }
+        else if (0 == _wcsicmp(argv[i], L"-bench")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-bench'." << std::endl;
+                return -1;
+            }
+            g_bench = argv[i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-selftest")) {
+            g_selfTest = true;
+        }
+        else if (0 == _wcsicmp(argv[i], L"-format")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-format'." << std::endl;
+                return -1;
+            }
+            const FloppyFormat formats[] = { FLOPPY_FORMAT_720K, FLOPPY_FORMAT_1200K, FLOPPY_FORMAT_1440K, FLOPPY_FORMAT_2880K };
+            g_format = FLOPPY_FORMAT_UNKNOWN;
+            for (FloppyFormat format : formats) {
+                if (0 == _wcsicmp(argv[i], GetFloppyFormatName(format))) g_format = format;
+            }
+            if (g_format == FLOPPY_FORMAT_UNKNOWN) {
+                std::wcerr << L"Unknown format '" << argv[i] << L"'. Use 720K, 1.2M, 1.44M or 2.88M." << std::endl;
+                return -1;
+            }
+        }
+        else if (0 == _wcsicmp(argv[i], L"-stats")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-stats'." << std::endl;
+                return -1;
+            }
+            g_stats = argv[i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-trace")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-trace'." << std::endl;
+                return -1;
+            }
+            g_trace = argv[i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-cache")) {
+            // Advance to the next string and check for end
+            ++i;
+            if (i >= argc) {
+                std::wcerr << L"No value for argument '-cache'." << std::endl;
+                return -1;
+            }
+            winSlash(argv[i]);
+            g_cacheDir = argv[i];
         }
         else {
             std::wcerr << L"Unexpected argument: " << argv[i] << std::endl;
@@ -231,51 +1043,170 @@ void winSlash(wchar_t* str) {
     }
 }
 
-int addToMidiPaths(const wchar_t* pattern)
+// Add an edit for each MIDI file that a source names, keeping the order of the command line.
+// Returns the number of edits added, or -1 on an error.
+int addEdits(ImageEditOp op, wchar_t* source)
 {
-    int findCount = 0;
-
-    // Find the directory prefix (if any)
-    std::wstring prefix;
-    wchar_t* lastSlash = wcsrchr((wchar_t*)pattern, L'\\');
-    if (NULL != lastSlash) {
-        prefix = std::wstring(pattern, lastSlash + 1 - pattern);
-    }
-    WIN32_FIND_DATAW findData;
-    HANDLE hFind = FindFirstFileW(pattern, &findData);
-    while (hFind != INVALID_HANDLE_VALUE)
+    std::vector<MidiFile> midiFiles;
+    int findCount = addMidiSource(source, midiFiles);
+    for (const auto& file : midiFiles)
     {
-        if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) {
-            std::wstring path = prefix + findData.cFileName;
-            g_srcMidiPaths.push_back(path);
-            ++findCount;
-        }
-        if (!FindNextFileW(hFind, &findData))
-        {
-            FindClose(hFind);
-            hFind = INVALID_HANDLE_VALUE;
-        }
+        g_edits.push_back({ op, file.path });
     }
-
     return findCount;
 }
 
-bool tryParseThumbDriveImageNum(const wchar_t* name, wchar_t* driveLetter, int* imageNumber) {
-    if (wcslen(name) < 3 || name[1] != ':') return false;
-    wchar_t letter = towupper(name[0]);
-    if (letter < L'A' || letter > L'Z') return false;
+// Add the MIDI files that a file, wildcard pattern or directory names, as -recurse,
+// -include and -exclude have it so far.
+// Returns the number of files added, or -1 on an error (already reported).
+int addMidiSource(wchar_t* source, std::vector<MidiFile>& midiFiles)
+{
+    StatTimer timer(STAGE_ENUMERATE);
+    TraceSpan span(L"enumerate");
+    winSlash(source);
+    return ScanMidiSource(source, g_scanOptions, midiFiles);
+}
+
+// A comma-separated list of meta event types, each decimal or hex (e.g. 3,0x58)
+bool tryParseMetaTypes(const wchar_t* list, std::bitset<128>* pTypes) {
+    const wchar_t* p = list;
+    for (;;) {
+        wchar_t* end;
+        unsigned long type = wcstoul(p, &end, 0);
+        if (end == p || type > 127) return false;
+        pTypes->set(type);
+        if (*end == L'\0') return true;
+        if (*end != L',') return false;
+        p = end + 1;
+    }
+}
+
+// A thumb drive is a drive letter, or the path of a device or whole-drive image file, then a colon.
+// What follows the colon is returned in slots.
+bool tryParseDriveName(const wchar_t* name, std::wstring* drive, const wchar_t** slots) {
+    const wchar_t* colon = wcsrchr(name, L':');
+    if (colon == NULL || colon == name) return false;
+    std::wstring prefix(name, colon - name);
+    if (prefix.length() == 1) {
+        wchar_t letter = towupper(prefix[0]);
+        if (letter < L'A' || letter > L'Z') return false;
+        prefix[0] = letter;
+    }
+    *drive = prefix;
+    *slots = colon + 1;
+    return true;
+}
+
+// Parse a whole image number that ends at end (or at the end of the string)
+bool tryParseImageNum(const wchar_t* p, const wchar_t* end, int* imageNumber) {
+    if (p == end || *p == L'\0') return false;
     int num = 0;
-    const wchar_t* p = name + 2;
-    while (*p != L'\0') {
+    for (; p != end && *p != L'\0'; ++p) {
         if (*p < L'0' || *p > L'9') return false;
         num = num * 10 + (*p - L'0');
-        ++p;
     }
-    *driveLetter = letter;
     *imageNumber = num;
     return true;
 }
 
+// A drive followed by an image number (e.g. F:25)
+bool tryParseThumbDriveImageNum(const wchar_t* name, std::wstring* drive, int* imageNumber) {
+    const wchar_t* slots;
+    if (!tryParseDriveName(name, drive, &slots)) return false;
+    return tryParseImageNum(slots, NULL, imageNumber);
+}
+
+// A drive alone (e.g. F:)
+bool tryParseThumbDrive(const wchar_t* name, std::wstring* drive) {
+    const wchar_t* slots;
+    if (!tryParseDriveName(name, drive, &slots)) return false;
+    return *slots == L'\0';
+}
+
+// A drive followed by a range of image numbers (e.g. F:0-499)
+bool tryParseThumbDriveImageRange(const wchar_t* name, std::wstring* drive, int* firstImageNum, int* lastImageNum) {
+    const wchar_t* slots;
+    if (!tryParseDriveName(name, drive, &slots)) return false;
+    const wchar_t* dash = wcschr(slots, L'-');
+    if (dash == NULL) return false;
+    if (!tryParseImageNum(slots, dash, firstImageNum)) return false;
+    if (!tryParseImageNum(dash + 1, NULL, lastImageNum)) return false;
+    return *lastImageNum >= *firstImageNum;
+}
+
+// Write to a thumb drive with the -delta and -verify options, and report on them
+bool writeImageToDrive(const std::wstring& drive, int imageNum, LPBYTE pImage) {
+    // Image 0 holds the volume's boot sector so it must be written with the volume locked
+    BlockDevice* pDrive = ThumbDriveOpen(drive, (imageNum == 0) ? BLOCK_DEVICE_WRITE_EXCLUSIVE : BLOCK_DEVICE_WRITE);
+    if (pDrive == NULL) {
+        return false; // Error already reported
+    }
+
+    VerifyStats verifyStats = {};
+    bool result;
+    {
+        ThumbDriveImageWriter writer(pDrive, NULL, g_delta ? &g_deltaStats : NULL, g_verify, &verifyStats, g_verbose);
+        result = writer.Write(imageNum, pImage, g_verify ? Crc32c(pImage, FLOPPY_IMAGE_SIZE) : 0);
+        result = writer.Finish() && result;
+    }
+    ThumbDriveClose(pDrive);
+
+    reportDeltaStats();
+    reportVerifyStats(verifyStats, 1);
+    return result;
+}
+
+// The build options from the command line
+BuildOptions buildOptions() {
+    BuildOptions options;
+    options.format = g_format;
+    options.deterministic = g_deterministic;
+    options.cacheDir = g_cacheDir;
+    options.checksum = g_verify;
+    options.verbose = g_verbose;
+    options.minimize = g_minimize;
+    options.minimizeOptions = g_minimizeOptions;
+    options.validation = g_validation;
+    return options;
+}
+
+void reportDeltaStats() {
+    if (!g_delta) return;
+    ULONGLONG total = g_deltaStats.bytesWritten + g_deltaStats.bytesSkipped;
+    std::wcout << L"Delta: wrote " << g_deltaStats.bytesWritten / 1024 << L" KB, skipped " << g_deltaStats.bytesSkipped / 1024
+        << L" KB unchanged (" << (total == 0 ? 0 : g_deltaStats.bytesSkipped * 100 / total) << L"%)." << std::endl;
+}
+
+void reportVerifyStats(const VerifyStats& stats, size_t imageCount) {
+    if (!g_verify) return;
+    std::wcout << L"Verify: " << stats.verifiedCount << L" of " << imageCount << L" images read back correctly";
+    if (stats.rewriteCount > 0) {
+        std::wcout << L" after " << stats.rewriteCount << L" rewrites";
+    }
+    std::wcout << L"." << std::endl;
+    if (!stats.failedImageNums.empty()) {
+        std::wcerr << L"Failed verification:";
+        for (int imageNum : stats.failedImageNums) {
+            std::wcerr << L" " << imageNum;
+        }
+        std::wcerr << std::endl;
+    }
+}
+
+void reportBackupStats(const DriveBackupStats& stats) {
+    std::wcout << L"Drive " << stats.driveSize / (1024 * 1024) << L" MB, backup " << stats.backupSize / 1024 << L" KB: "
+        << stats.uniqueSectors << L" distinct sectors kept, " << stats.zeroSectors << L" zero sectors." << std::endl;
+}
+
+// A manifest source is an image if it's a numbered thumb drive image or has a .img extension.
+// Otherwise it's a MIDI source.
+bool isImageSource(const std::wstring& source) {
+    std::wstring drive;
+    int imageNum;
+    if (tryParseThumbDriveImageNum(source.c_str(), &drive, &imageNum)) return true;
+    return source.length() > 4 && 0 == _wcsicmp(source.c_str() + source.length() - 4, L".img");
+}
+
 const wchar_t* g_syntax =
 L"Syntax:\n"
 "PianoDiscThumbDrive -midi <midiPath> ... -dimg <dstImage>\n"
@@ -284,7 +1215,24 @@ L"Syntax:\n"
 "  Copy an image\n"
 "PianoDiscThumbDrive -simg <srcImage> -ddir <dstDirectory>\n"
 "  Unpack an image into the original files\n"
-"  (Not yet implemented)\n"
+"PianoDiscThumbDrive -manifest <manifestFile> -dimg <dstDrive>\n"
+"  Build and write many images in one pass\n"
+"PianoDiscThumbDrive -midi <midiPath> ... -plan <manifestFile> [-group]\n"
+"  Split a MIDI library across as few images as possible\n"
+"PianoDiscThumbDrive -catalog <catalogFile> [-simg <srcDrive>] [-find <text>] [-list]\n"
+"  Index the images on a thumb drive and find songs without reading them\n"
+"PianoDiscThumbDrive -check <srcDrive>\n"
+"  Check the file system of every image on a thumb drive\n"
+"PianoDiscThumbDrive -simg <srcDrive> -backup <backupFile>\n"
+"  Back up a whole thumb drive to a compact file\n"
+"PianoDiscThumbDrive -restore <backupFile> -dimg <dstDrive>\n"
+"  Restore a whole thumb drive from a backup\n"
+"PianoDiscThumbDrive -dimg <dstImage> -add <midiPath> -remove <name> -replace <midiPath> -compact ...\n"
+"  Change the files of an existing image in place\n"
+"PianoDiscThumbDrive -bench <resultsFile>\n"
+"  Time the image builder on synthetic workloads\n"
+"PianoDiscThumbDrive -selftest\n"
+"  Check the FAT kernels for this CPU against the reference code\n"
 "\n"
 "Arguments:\n"
 "-midi\n"
@@ -294,20 +1242,183 @@ L"Syntax:\n"
 "  files are included.\n"
 "  The path may be to a directory in which case all .mid files in that directory\n"
 "  will be included.\n"
+"  The files found in a directory or by wildcards are sorted by directory and\n"
+"  then by name. See also -recurse, -include and -exclude.\n"
 "-simg\n"
 "  Designation of a source image. It may be in one of two formats.\n"
 "  A path to a filename with a .img extension indicates a floppy image file.\n"
 "  A drive letter followed by a number (e.g. F:25) indicates a numbered image\n"
 "  on a thumb drive intended for use on a floppy disk emulator.\n"
+"  In place of the drive letter, the path of a device (e.g. \\\\.\\PhysicalDrive2\n"
+"  or /dev/sdb) or of a whole-drive image file may be given, followed by a\n"
+"  colon and the number (e.g. drive.bin:25).\n"
+"  With -ddir, a range of numbered images (e.g. F:0-499) may be given. Each\n"
+"  is extracted into a numbered subdirectory (000, 001, ...) of the\n"
+"  destination, several at a time.\n"
 "-dimg\n"
 "  Designation of a destination image. It may be in either of the two formats\n"
 "  listed for -simg: a path to an image file or a numbered image on a thumb\n"
 "  drive intended for use on a floppy disk emulator.\n"
+"-ddir\n"
+"  Destination directory for the files in the source image. Each file keeps\n"
+"  its date modified. The directory is created if it doesn't exist.\n"
+"-manifest\n"
+"  Path to a text file that maps image numbers to sources. Each line is an\n"
+"  image number followed by a source. A source may be anything accepted by\n"
+"  -midi or -simg. Repeat an image number to combine several MIDI sources\n"
+"  into one image. Lines beginning with '#' are comments.\n"
+"  Every image is built first to check its sources, so that nothing is\n"
+"  written if any fails. Each is then built again on one of several threads\n"
+"  and written in ascending order as it's finished, so memory use doesn't\n"
+"  grow with the number of images.\n"
+"  The destination (-dimg) is either a drive alone (e.g. F: or /dev/sdb:) or\n"
+"  the path of a whole-drive image file to create. Image numbers in a new\n"
+"  drive image file that are not in the manifest are filled with blank\n"
+"  images.\n"
+"-plan\n"
+"  Path of a manifest file to create. The -midi sources are assigned to as\n"
+"  few images as possible, numbered from 0, keeping within both the space and\n"
+"  the directory entry limits of a floppy. Files keep their order within each\n"
+"  image. Build the images by passing the result to -manifest.\n"
+"-group\n"
+"  With -plan, keep files from the same directory in the same image when\n"
+"  they fit.\n"
+"-catalog\n"
+"  Path to a catalog file listing the label, serial number and files of\n"
+"  every image on a thumb drive. With -simg (a drive letter alone, e.g. F:,\n"
+"  or a range such as F:0-99) the drive is scanned and the catalog updated.\n"
+"  Only the boot sector, FAT and root directory of each image (16.5 KB) are\n"
+"  read, in one read, to check whether it changed since the last scan, so\n"
+"  changes made by other tools are seen as well as this one's.\n"
+"  With -o the catalog is rebuilt from scratch.\n"
+"-find\n"
+"  With -catalog, list every file whose name contains the text, with the\n"
+"  number of the image that holds it.\n"
+"-list\n"
+"  With -catalog, list every image and its files.\n"
+"-check\n"
+"  A thumb drive (e.g. F:), or a range of its images (e.g. F:0-99), to check.\n"
+"  Each image must have a valid boot sector and two identical FATs. The\n"
+"  cluster chain of each file must stay within the data area, not loop, not\n"
+"  be cross-linked with another file's, and be as long as the file's size\n"
+"  needs. Clusters allocated to no file are also reported. The images are\n"
+"  read in order while several are checked at once.\n"
+"-backup\n"
+"  Path of a file to back the whole -simg drive (e.g. F: or /dev/sdb:) up to.\n"
+"  Each distinct 512-byte sector is kept once, so repeated boot sectors, FATs\n"
+"  and songs, and free space, take almost nothing; the sectors kept are\n"
+"  compressed. The drive is read front to back in 4 MB pieces.\n"
+"-restore\n"
+"  Path of a backup to write back to the whole -dimg drive. The drive must\n"
+"  already hold floppy images unless -o is given. A whole-drive image file\n"
+"  may be named instead of a drive; with -o it may be empty, and it's grown to\n"
+"  fit with the zeros left as holes. What's written is checked against the\n"
+"  drive that was backed up.\n"
+"-add\n"
+"  This argument may be repeated, as may -remove, -replace and -compact. Each\n"
+"  is applied in order to the -dimg image, an image file or a numbered image\n"
+"  on a thumb drive. Path to MIDI files to add, as for -midi. Only the boot\n"
+"  sector, FATs and root directory are read, and only the 4 KB pieces that\n"
+"  change are written. If any change fails the image is left as it was.\n"
+"-remove\n"
+"  Name of a file to remove from the -dimg image (e.g. SONG.MID). A path to\n"
+"  the source file may be given instead; it is shortened to an 8.3 name the\n"
+"  same way as when the image was built.\n"
+"-replace\n"
+"  Path to MIDI files, as for -midi, each of which replaces the file of the\n"
+"  same 8.3 name in the -dimg image.\n"
+"-compact\n"
+"  Move clusters of the -dimg image so that its free space is in one run at\n"
+"  the end, so files added afterward aren't split up. Only the clusters past\n"
+"  the end of the space in use are moved, into the gaps before it, which is\n"
+"  the fewest moves possible; only those clusters are read. With -simg, the\n"
+"  image is compacted in memory on its way to -dimg or -ddir instead.\n"
+"  Images with subdirectories can't be compacted.\n"
+"-bench\n"
+"  Path of a JSON file to save benchmark results to. Formatting, adding\n"
+"  files (one large, a full directory, a full directory of names that all\n"
+"  shorten to the same 8.3 name), FAT access on a fragmented FAT and header\n"
+"  checks are each timed. The median and minimum time per operation are\n"
+"  printed and saved. Scratch files are made in the temporary directory.\n"
+"-selftest\n"
+"  Check that the bulk FAT readers and writers give exactly what reading and\n"
+"  writing one entry at a time does, on random FATs of every floppy format,\n"
+"  including the copy to the second FAT. Each version of them this CPU can\n"
+"  run (scalar, SSSE3, AVX2) is checked in turn, not only the one it uses.\n"
 "\n"
 "Additional Arguments\n"
+"-cache <cacheDirectory>\n"
+"  Keep built images in this directory, named by a hash of the MIDI files'\n"
+"  names, sizes, dates and contents. Building the same files again reads the\n"
+"  image from the cache instead. Implies -deterministic.\n"
+"-delta\n"
+"  When writing to a thumb drive, read each image slot first and write only\n"
+"  the 4 KB pieces that changed. Faster, and easier on the flash, when most\n"
+"  of an image is unchanged.\n"
+"-deterministic\n"
+"  Make images built from MIDI files depend only on the files: the serial\n"
+"  number is a hash of the image and the volume label takes the date of the\n"
+"  newest file, so building the same files twice gives identical images.\n"
+"-dropsysex\n"
+"  With -minimize, also drop system exclusive messages. They may reset the\n"
+"  sound module or set up its instruments, so drop them only from files that\n"
+"  play the same without them.\n"
+"-exclude <glob>\n"
+"  This argument may be repeated. Skip files, and directories with all they\n"
+"  hold, whose names match the glob (* and ? wildcards, any case), e.g.\n"
+"  -exclude Archive or -exclude *_old.mid.\n"
+"-format <format>\n"
+"  Build the image from -midi sources in another floppy format: 720K, 1.2M,\n"
+"  1.44M (the default) or 2.88M, for older units and emulators. Only an image\n"
+"  file can be built this way; thumb drives hold 1.44 MB images. Image files\n"
+"  of any of these formats can be read and extracted, the format being taken\n"
+"  from the boot sector.\n"
 "-h\n"
 "  Help: Print this syntax.\n"
+"-include <glob>\n"
+"  This argument may be repeated. Take only files whose names match one of\n"
+"  the globs, within what the directory or wildcard names, e.g.\n"
+"  -include Chopin*. A file named outright is always taken.\n"
+"-keepmeta <types>\n"
+"  With -minimize, also keep these meta events, as a comma-separated list of\n"
+"  types (e.g. 3,0x58 for track names and time signatures).\n"
+"-minimize\n"
+"  Store each MIDI file in the fewest bytes that play the same, so more songs\n"
+"  fit in an image: the tracks are merged into one (format 0), running status\n"
+"  is used throughout, and text and other meta events (but tempo changes) are\n"
+"  dropped. System exclusive messages are kept (see -dropsysex). A file is\n"
+"  stored as it is if that isn't smaller or it can't be read as a MIDI file.\n"
+"  Applies to images built from -midi or -manifest and to -add and -replace.\n"
+"  With -plan, each file is read to find its minimized size.\n"
 "-o\n"
 "  Overwrite the destination file if it already exists.\n"
+"-recurse\n"
+"  Also take the files in the subdirectories of a directory or wildcard\n"
+"  source, at any depth. Directories are listed on several threads, which\n"
+"  helps most with a large library on a network share.\n"
+"  -recurse, -include and -exclude apply to the -midi, -add and -replace\n"
+"  sources after them on the command line, and to every -manifest source.\n"
+"-stats <statsFile>\n"
+"  Save counters for the run as JSON: files ingested, bytes read and written,\n"
+"  I/O calls, FAT entries read or written, name lookups made while choosing\n"
+"  unique 8.3 names, bytes saved by -minimize, and files checked and found\n"
+"  invalid by -validate. Also the milliseconds spent in each stage:\n"
+"  enumerate, plan, build, sourceRead, deviceIo and verify. Stages overlap\n"
+"  (reading sources is part of building) and are summed across threads.\n"
+"-trace <traceFile>\n"
+"  Save a Chrome trace (open in chrome://tracing or Perfetto) with a span for\n"
+"  each stage of the run and for each image built, read, written or verified.\n"
 "-v\n"
-"  Verbose: Print extra information.\n";
\ No newline at end of file
+"  Verbose: Print extra information.\n"
+"-validate <policy>\n"
+"  Check each MIDI file as it's read into an image: its header, that its\n"
+"  chunks fit in the file and that its tracks hold well-formed events ending\n"
+"  in an End of Track. With warn, a file that fails is reported and stored\n"
+"  anyway; with reject, the image fails to build, as for a file that can't\n"
+"  be read. Applies to images built from -midi or -manifest and to -add and\n"
+"  -replace. Files aren't read again to be checked.\n"
+"-verify\n"
+"  When writing to a thumb drive, read each image back and compare its\n"
+"  CRC-32C with the image that was written. Each image is checked while the\n"
+"  next one is being written. An image that doesn't match is rewritten, up\n"
+"  to 3 attempts, and any that still fail are listed at the end.\n";
\ No newline at end of file
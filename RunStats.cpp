@@ -0,0 +1,142 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#if !defined(_WIN32)
+#include <chrono>
+#include <thread>
+#include <functional>
+#endif
+
+#include "WinTypes.h"
+#include "RunStats.h"
+#include "TextFile.h"
+
+const wchar_t* const CounterNames[STAT_COUNTER_COUNT] = {
+	L"filesIngested", L"bytesRead", L"bytesWritten", L"ioCalls", L"fatEntries", L"directoryProbes", L"midiBytesSaved",
+	L"midiFilesValidated", L"midiFilesInvalid"
+};
+const wchar_t* const StageNames[STAGE_COUNT] = {
+	L"enumerate", L"plan", L"build", L"sourceRead", L"deviceIo", L"verify"
+};
+
+struct TraceEvent
+{
+	const wchar_t* name;
+	int imageNum;
+	DWORD threadId;
+	int64_t start;
+	int64_t end;
+};
+
+std::atomic<uint64_t> g_statCounters[STAT_COUNTER_COUNT];
+std::atomic<int64_t> stageTicks[STAGE_COUNT];
+std::mutex traceMutex;
+std::vector<TraceEvent> traceEvents;
+
+int64_t Now();
+int64_t TicksPerSecond();
+DWORD CurrentThreadId();
+
+// Trace times are from the start of the run
+const int64_t runStart = Now();
+
+StatTimer::StatTimer(StatStage stage) : m_stage(stage), m_start(Now())
+{
+}
+
+StatTimer::~StatTimer()
+{
+	stageTicks[m_stage].fetch_add(Now() - m_start, std::memory_order_relaxed);
+}
+
+TraceSpan::TraceSpan(const wchar_t* name, int imageNum) : m_name(name), m_imageNum(imageNum), m_start(Now())
+{
+}
+
+TraceSpan::~TraceSpan()
+{
+	TraceEvent event = { m_name, m_imageNum, CurrentThreadId(), m_start, Now() };
+	std::lock_guard<std::mutex> lock(traceMutex);
+	traceEvents.push_back(event);
+}
+
+bool StatsWrite(const std::wstring& filename, bool overwrite)
+{
+	double ticksPerMs = (double)TicksPerSecond() / 1000.0;
+	std::wostringstream json;
+	json << std::fixed << std::setprecision(3);
+	json << L"{\n";
+	json << L"  \"elapsedMs\": " << (double)(Now() - runStart) / ticksPerMs << L",\n";
+	json << L"  \"counters\": {\n";
+	for (int i = 0; i < STAT_COUNTER_COUNT; ++i)
+	{
+		json << L"    \"" << CounterNames[i] << L"\": " << g_statCounters[i].load() << (i + 1 < STAT_COUNTER_COUNT ? L"," : L"") << L"\n";
+	}
+	json << L"  },\n";
+	json << L"  \"stageMs\": {\n";
+	for (int i = 0; i < STAGE_COUNT; ++i)
+	{
+		json << L"    \"" << StageNames[i] << L"\": " << (double)stageTicks[i].load() / ticksPerMs << (i + 1 < STAGE_COUNT ? L"," : L"") << L"\n";
+	}
+	json << L"  }\n";
+	json << L"}\n";
+	return TextFileWrite(filename, json.str(), overwrite);
+}
+
+bool TraceWrite(const std::wstring& filename, bool overwrite)
+{
+	// Complete ("X") events, timed in microseconds
+	double ticksPerUs = (double)TicksPerSecond() / 1000000.0;
+	std::wostringstream json;
+	json << std::fixed << std::setprecision(1);
+	json << L"{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	std::lock_guard<std::mutex> lock(traceMutex);
+	for (size_t i = 0; i < traceEvents.size(); ++i)
+	{
+		const TraceEvent& event = traceEvents[i];
+		json << L"{\"name\": \"" << event.name;
+		if (event.imageNum >= 0) json << L" " << event.imageNum;
+		json << L"\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.threadId
+			<< L", \"ts\": " << (double)(event.start - runStart) / ticksPerUs
+			<< L", \"dur\": " << (double)(event.end - event.start) / ticksPerUs;
+		if (event.imageNum >= 0) json << L", \"args\": {\"image\": " << event.imageNum << L"}";
+		json << L"}" << (i + 1 < traceEvents.size() ? L"," : L"") << L"\n";
+	}
+	json << L"]}\n";
+	return TextFileWrite(filename, json.str(), overwrite);
+}
+
+int64_t Now()
+{
+#if defined(_WIN32)
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+int64_t TicksPerSecond()
+{
+#if defined(_WIN32)
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	return frequency.QuadPart;
+#else
+	return 1000000000;
+#endif
+}
+
+DWORD CurrentThreadId()
+{
+#if defined(_WIN32)
+	return GetCurrentThreadId();
+#else
+	// Only needs to tell the threads in a trace apart
+	return (DWORD)std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Counters and stage timings for a run, reported by -stats, and spans for a
+// Chrome trace (chrome://tracing, Perfetto), saved by -trace. Safe to update
+// from any thread.
+
+enum StatCounter
+{
+	STAT_FILES_INGESTED,
+	STAT_BYTES_READ,
+	STAT_BYTES_WRITTEN,
+	STAT_IO_CALLS, // Opens, reads, writes, flushes and ioctls
+	STAT_FAT_ENTRIES, // Read or written
+	STAT_DIRECTORY_PROBES, // Names looked up while making an 8.3 name unique
+	STAT_MIDI_BYTES_SAVED, // By -minimize
+	STAT_MIDI_FILES_VALIDATED,
+	STAT_MIDI_FILES_INVALID, // Found so by validation, whether rejected or not
+	STAT_COUNTER_COUNT
+};
+
+// Stages overlap: the time reading sources is also part of planning and building,
+// and verification includes reading back from the device.
+enum StatStage
+{
+	STAGE_ENUMERATE, // Finding MIDI files
+	STAGE_PLAN, // Assigning clusters and directory entries, and -plan
+	STAGE_BUILD, // Building images
+	STAGE_SOURCE_READ, // Opening and reading MIDI and image files
+	STAGE_DEVICE_IO, // Reading and writing drives and image files
+	STAGE_VERIFY, // Reading back and comparing written images
+	STAGE_COUNT
+};
+
+extern std::atomic<uint64_t> g_statCounters[STAT_COUNTER_COUNT];
+
+inline void StatAdd(StatCounter counter, uint64_t amount = 1)
+{
+	g_statCounters[counter].fetch_add(amount, std::memory_order_relaxed);
+}
+
+// Adds the time from construction to destruction to a stage
+class StatTimer
+{
+public:
+	explicit StatTimer(StatStage stage);
+	~StatTimer();
+
+private:
+	StatStage m_stage;
+	int64_t m_start;
+};
+
+// One span in the trace: a stage of the run or the work on one image slot
+class TraceSpan
+{
+public:
+	explicit TraceSpan(const wchar_t* name, int imageNum = -1);
+	~TraceSpan();
+
+private:
+	const wchar_t* m_name;
+	int m_imageNum;
+	int64_t m_start;
+};
+
+// Save the counters and stage times as JSON, or the spans as a Chrome trace
+extern bool StatsWrite(const std::wstring& filename, bool overwrite);
+extern bool TraceWrite(const std::wstring& filename, bool overwrite);
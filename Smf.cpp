@@ -0,0 +1,621 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <bitset>
+#include <algorithm>
+#include <cstring>
+#include <windows.h>
+
+#include "Smf.h"
+#include "RunStats.h"
+
+// Reference:
+// https://www.midi.org/specifications/file-format-specifications/standard-midi-files
+
+const size_t SMF_CHUNK_HEADER_SIZE = 8; // Type and big-endian length
+const DWORD SMF_MAX_VAR_LEN = 0x0FFFFFFF; // Four bytes of seven bits
+const BYTE SMF_SYSEX = 0xF0;
+const BYTE SMF_SYSEX_ESCAPE = 0xF7;
+const BYTE SMF_META = 0xFF;
+const BYTE SMF_NOTE_OFF = 0x80;
+const BYTE SMF_NOTE_ON = 0x90;
+const BYTE SMF_DEFAULT_RELEASE_VELOCITY = 64; // What a Note On of velocity 0 stands for
+
+// Where a track has got to in the merge
+struct SmfTrack
+{
+	const BYTE* p; // The next event, past its delta time
+	const BYTE* end;
+	ULONGLONG time; // Of the next event, in ticks from the start of the song
+	BYTE runningStatus;
+	bool done;
+};
+
+// Where the merged track has got to
+struct SmfWriter
+{
+	std::vector<BYTE>& out;
+	ULONGLONG time; // Of the last event written
+	BYTE runningStatus;
+};
+
+bool CopyEvent(SmfTrack& track, const SmfMinimizeOptions& options, SmfWriter& writer, ULONGLONG& endTime);
+bool NextDeltaTime(SmfTrack& track);
+size_t ChannelDataLength(BYTE status);
+bool WriteDeltaTime(SmfWriter& writer, ULONGLONG time);
+bool ReadVarLen(const BYTE*& p, const BYTE* end, DWORD& value);
+void WriteVarLen(std::vector<BYTE>& out, DWORD value);
+DWORD ReadBigEndian(const BYTE* p, size_t bytes);
+
+bool MinimizeSmf(const BYTE* pData, size_t size, const SmfMinimizeOptions& options, std::vector<BYTE>& out)
+{
+	out.clear();
+
+	// The header chunk: format, track count and timing
+	const BYTE* end = pData + size;
+	if (!IsMinimizableSmf(pData, size))
+	{
+		return false;
+	}
+	DWORD headerLength = ReadBigEndian(pData + 4, 4);
+	if (headerLength > size - SMF_CHUNK_HEADER_SIZE)
+	{
+		return false;
+	}
+	DWORD trackCount = ReadBigEndian(pData + 10, 2);
+
+	// Find the tracks. Chunks of other types are skipped, as players do.
+	std::vector<SmfTrack> tracks;
+	tracks.reserve(trackCount);
+	for (const BYTE* p = pData + SMF_CHUNK_HEADER_SIZE + headerLength; tracks.size() < trackCount; )
+	{
+		if ((size_t)(end - p) < SMF_CHUNK_HEADER_SIZE)
+		{
+			return false;
+		}
+		DWORD length = ReadBigEndian(p + 4, 4);
+		if (length > (size_t)(end - p) - SMF_CHUNK_HEADER_SIZE)
+		{
+			return false;
+		}
+		if (memcmp(p, "MTrk", 4) == 0)
+		{
+			SmfTrack track = { p + SMF_CHUNK_HEADER_SIZE, p + SMF_CHUNK_HEADER_SIZE + length, 0, 0, false };
+			if (!NextDeltaTime(track))
+			{
+				return false;
+			}
+			tracks.push_back(track);
+		}
+		p += SMF_CHUNK_HEADER_SIZE + length;
+	}
+
+	// A format 0 header, with the same timing, and one track whose length is filled in at the end
+	out.reserve(size);
+	const BYTE header[] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, pData[12], pData[13], 'M', 'T', 'r', 'k', 0, 0, 0, 0 };
+	out.insert(out.end(), header, header + sizeof(header));
+	size_t trackStart = out.size();
+
+	// Take the earliest event of all the tracks each time, the first track's on a tie. Songs
+	// have few tracks, so looking at each is quicker than keeping them in a heap.
+	SmfWriter writer = { out, 0, 0 };
+	ULONGLONG endTime = 0;
+	for (;;)
+	{
+		SmfTrack* pNext = NULL;
+		for (auto& track : tracks)
+		{
+			if (!track.done && (pNext == NULL || track.time < pNext->time))
+			{
+				pNext = &track;
+			}
+		}
+		if (pNext == NULL)
+		{
+			break;
+		}
+		if (!CopyEvent(*pNext, options, writer, endTime) || !NextDeltaTime(*pNext))
+		{
+			out.clear();
+			return false;
+		}
+	}
+
+	// The song lasts until the last track ends
+	if (!WriteDeltaTime(writer, (std::max)(endTime, writer.time)))
+	{
+		out.clear();
+		return false;
+	}
+	const BYTE endOfTrack[] = { SMF_META, SMF_META_END_OF_TRACK, 0 };
+	out.insert(out.end(), endOfTrack, endOfTrack + sizeof(endOfTrack));
+
+	DWORD trackLength = (DWORD)(out.size() - trackStart);
+	for (size_t i = 0; i < 4; ++i)
+	{
+		out[trackStart - 4 + i] = (BYTE)(trackLength >> (24 - 8 * i));
+	}
+	return true;
+}
+
+bool IsMinimizableSmf(const BYTE* pData, size_t size)
+{
+	// The tracks of format 2 are separate songs
+	return size >= SMF_HEADER_SIZE && memcmp(pData, "MThd", 4) == 0
+		&& ReadBigEndian(pData + 4, 4) >= 6 && ReadBigEndian(pData + 8, 2) <= 1;
+}
+
+// Copy, or drop, the event a track is at
+bool CopyEvent(SmfTrack& track, const SmfMinimizeOptions& options, SmfWriter& writer, ULONGLONG& endTime)
+{
+	if (track.p >= track.end)
+	{
+		return false;
+	}
+
+	// Running status: a data byte where a status byte would be repeats the last channel status.
+	// It's kept across sysex and meta events, which some files rely on.
+	BYTE status = *track.p;
+	if (status < 0x80)
+	{
+		if (track.runningStatus == 0)
+		{
+			return false;
+		}
+		status = track.runningStatus;
+	}
+	else
+	{
+		++track.p;
+	}
+
+	if (status < SMF_SYSEX)
+	{
+		// A channel message
+		track.runningStatus = status;
+		size_t dataLength = ChannelDataLength(status);
+		if ((size_t)(track.end - track.p) < dataLength)
+		{
+			return false;
+		}
+		BYTE data[2] = { track.p[0], (dataLength > 1) ? track.p[1] : (BYTE)0 };
+		if (((data[0] | data[1]) & 0x80) != 0)
+		{
+			return false;
+		}
+		track.p += dataLength;
+
+		if ((status & 0xF0) == SMF_NOTE_OFF && data[1] == SMF_DEFAULT_RELEASE_VELOCITY)
+		{
+			status = SMF_NOTE_ON | (status & 0x0F);
+			data[1] = 0;
+		}
+		if (!WriteDeltaTime(writer, track.time))
+		{
+			return false;
+		}
+		if (status != writer.runningStatus)
+		{
+			writer.out.push_back(status);
+			writer.runningStatus = status;
+		}
+		writer.out.insert(writer.out.end(), data, data + dataLength);
+		return true;
+	}
+
+	// Sysex and meta events carry their own length
+	BYTE metaType = 0;
+	if (status == SMF_META)
+	{
+		if (track.p >= track.end || (*track.p & 0x80) != 0)
+		{
+			return false;
+		}
+		metaType = *track.p++;
+	}
+	else if (status != SMF_SYSEX && status != SMF_SYSEX_ESCAPE)
+	{
+		return false; // System common and real-time messages have no place in a file
+	}
+	const BYTE* pLength = track.p;
+	DWORD length;
+	if (!ReadVarLen(track.p, track.end, length) || length > (size_t)(track.end - track.p))
+	{
+		return false;
+	}
+	const BYTE* pNext = track.p + length;
+
+	if (status == SMF_META && metaType == SMF_META_END_OF_TRACK)
+	{
+		// Anything after it isn't part of the track
+		endTime = (std::max)(endTime, track.time);
+		track.done = true;
+	}
+	else if ((status == SMF_META) ? (metaType == SMF_META_TEMPO || options.keepMeta[metaType]) : options.keepSysex)
+	{
+		if (!WriteDeltaTime(writer, track.time))
+		{
+			return false;
+		}
+
+		// Sysex and meta events end running status
+		writer.out.push_back(status);
+		if (status == SMF_META)
+		{
+			writer.out.push_back(metaType);
+		}
+		writer.out.insert(writer.out.end(), pLength, pNext);
+		writer.runningStatus = 0;
+	}
+	track.p = pNext;
+	return true;
+}
+
+// Read the time to a track's next event, if it has one
+bool NextDeltaTime(SmfTrack& track)
+{
+	// A track that ends without an end of track event ends there
+	if (track.done || track.p == track.end)
+	{
+		track.done = true;
+		return true;
+	}
+	DWORD delta;
+	if (!ReadVarLen(track.p, track.end, delta))
+	{
+		return false;
+	}
+	track.time += delta;
+	return true;
+}
+
+// Program change and channel pressure have one data byte, the other channel messages two
+size_t ChannelDataLength(BYTE status)
+{
+	return ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+}
+
+bool WriteDeltaTime(SmfWriter& writer, ULONGLONG time)
+{
+	// Dropped events can leave a gap too long for one delta time
+	ULONGLONG delta = time - writer.time;
+	if (delta > SMF_MAX_VAR_LEN)
+	{
+		return false;
+	}
+	WriteVarLen(writer.out, (DWORD)delta);
+	writer.time = time;
+	return true;
+}
+
+// Seven bits to a byte, most significant first, with the top bit set on all but the last
+bool ReadVarLen(const BYTE*& p, const BYTE* end, DWORD& value)
+{
+	value = 0;
+	for (int i = 0; i < 4 && p < end; ++i)
+	{
+		BYTE b = *p++;
+		value = (value << 7) | (b & 0x7F);
+		if ((b & 0x80) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void WriteVarLen(std::vector<BYTE>& out, DWORD value)
+{
+	BYTE bytes[4];
+	int count = 0;
+	do
+	{
+		bytes[count++] = (BYTE)(value & 0x7F);
+		value >>= 7;
+	} while (value != 0);
+	while (count > 1)
+	{
+		out.push_back(bytes[--count] | 0x80);
+	}
+	out.push_back(bytes[0]);
+}
+
+DWORD ReadBigEndian(const BYTE* p, size_t bytes)
+{
+	DWORD value = 0;
+	for (size_t i = 0; i < bytes; ++i)
+	{
+		value = (value << 8) | p[i];
+	}
+	return value;
+}
+
+void SmfValidator::Add(const BYTE* pData, size_t size)
+{
+	const BYTE* p = pData;
+	const BYTE* end = pData + size;
+	while (p < end && m_problem == NULL)
+	{
+		// Whatever isn't checked is passed over whole
+		if (m_state == STATE_SKIP || m_state == STATE_BODY || m_state == STATE_DONE)
+		{
+			size_t count = (size_t)(end - p);
+			if (m_state != STATE_DONE)
+			{
+				count = std::min<size_t>(count, (m_state == STATE_SKIP) ? m_remaining : m_value);
+				m_remaining -= (DWORD)count;
+			}
+			p += count;
+			m_offset += count;
+			if (m_state == STATE_SKIP && m_remaining == 0)
+			{
+				m_state = STATE_CHUNK_HEADER;
+			}
+			else if (m_state == STATE_BODY && (m_value -= (DWORD)count) == 0)
+			{
+				EndEvent();
+			}
+			continue;
+		}
+
+		// The rest a byte at a time
+		bool inTrack = m_state != STATE_HEADER && m_state != STATE_CHUNK_HEADER;
+		BYTE b = *p++;
+		++m_offset;
+		if (inTrack)
+		{
+			--m_remaining;
+		}
+
+		switch (m_state)
+		{
+		case STATE_HEADER:
+		case STATE_CHUNK_HEADER:
+			m_header[m_headerBytes++] = b;
+			if (m_headerBytes == ((m_state == STATE_HEADER) ? sizeof(m_header) : SMF_CHUNK_HEADER_SIZE))
+			{
+				StartChunk();
+			}
+			break;
+
+		case STATE_DELTA_TIME:
+			ReadVarLenByte(b, L"a delta time is longer than four bytes");
+			if (m_problem == NULL && m_valueBytes == 0)
+			{
+				m_state = STATE_STATUS;
+			}
+			break;
+
+		case STATE_STATUS:
+			if (b >= SMF_SYSEX)
+			{
+				if (b == SMF_META)
+				{
+					m_state = STATE_META_TYPE;
+				}
+				else if (b == SMF_SYSEX || b == SMF_SYSEX_ESCAPE)
+				{
+					m_metaType = 0x80;
+					m_state = STATE_LENGTH;
+				}
+				else
+				{
+					Fail(L"a system message is where an event should be");
+				}
+				break;
+			}
+			if (b >= 0x80)
+			{
+				m_runningStatus = b;
+				m_dataBytes = (int)ChannelDataLength(b);
+				m_state = STATE_DATA;
+				break;
+			}
+
+			// Running status: the byte is the first data byte of another message like the last
+			if (m_runningStatus == 0)
+			{
+				Fail(L"a data byte comes before any status byte");
+				break;
+			}
+			m_dataBytes = (int)ChannelDataLength(m_runningStatus);
+			m_state = STATE_DATA;
+			// Fall through
+
+		case STATE_DATA:
+			if (b >= 0x80)
+			{
+				Fail(L"a channel message is cut short by a status byte");
+			}
+			else if (--m_dataBytes == 0)
+			{
+				EndEvent();
+			}
+			break;
+
+		case STATE_META_TYPE:
+			if (b >= 0x80)
+			{
+				Fail(L"a meta event type is out of range");
+				break;
+			}
+			m_metaType = b;
+			m_state = STATE_LENGTH;
+			break;
+
+		case STATE_LENGTH:
+			ReadVarLenByte(b, L"a sysex or meta event length is longer than four bytes");
+			if (m_problem != NULL || m_valueBytes != 0)
+			{
+				break;
+			}
+			if (m_value > m_remaining)
+			{
+				Fail(L"a sysex or meta event runs past the end of its track");
+			}
+			else if (m_metaType == SMF_META_TEMPO && m_value != 3)
+			{
+				Fail(L"a tempo event isn't three bytes long");
+			}
+			else
+			{
+				m_endOfTrack = (m_metaType == SMF_META_END_OF_TRACK);
+				m_state = STATE_BODY;
+				if (m_value == 0)
+				{
+					EndEvent();
+				}
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		// The last event of a track takes the state on to the next chunk
+		if (inTrack && m_remaining == 0 && m_problem == NULL && m_state != STATE_CHUNK_HEADER && m_state != STATE_DONE)
+		{
+			Fail(L"an event runs past the end of its track");
+		}
+	}
+}
+
+bool SmfValidator::Finish(std::wstring& problem) const
+{
+	if (m_problem != NULL)
+	{
+		// Faults in the header are found with all of it read, so the byte isn't much help
+		problem = m_problem;
+		if (m_state != STATE_HEADER)
+		{
+			problem += L" at byte " + std::to_wstring(m_problemOffset);
+		}
+		return false;
+	}
+	if (m_state != STATE_DONE)
+	{
+		problem = (m_state == STATE_HEADER) ? L"it's too short to be a MIDI file" : L"it ends before its last track";
+		return false;
+	}
+	return true;
+}
+
+// With a chunk's type and length read, check them and go on to its contents
+void SmfValidator::StartChunk()
+{
+	m_headerBytes = 0;
+	DWORD length = ReadBigEndian(m_header + 4, 4);
+	if (m_state == STATE_HEADER)
+	{
+		// The fields have been read with the type and length
+		DWORD format = ReadBigEndian(m_header + 8, 2);
+		m_trackCount = ReadBigEndian(m_header + 10, 2);
+		if (memcmp(m_header, "MThd", 4) != 0)
+		{
+			Fail(L"it doesn't start with an MThd chunk");
+			return;
+		}
+		if (length < 6)
+		{
+			Fail(L"its MThd chunk is too short");
+			return;
+		}
+		if (format > 2)
+		{
+			Fail(L"its format isn't 0, 1 or 2");
+			return;
+		}
+		if (m_trackCount == 0 || (format == 0 && m_trackCount != 1))
+		{
+			Fail(L"its number of tracks doesn't suit its format");
+			return;
+		}
+		length -= 6;
+	}
+	if (length > m_fileSize - m_offset)
+	{
+		Fail(L"a chunk runs past the end of the file");
+		return;
+	}
+
+	// Chunks of other types are for other programs, and players skip them
+	m_remaining = length;
+	if (m_state == STATE_HEADER || memcmp(m_header, "MTrk", 4) != 0)
+	{
+		m_state = (length == 0) ? STATE_CHUNK_HEADER : STATE_SKIP;
+		return;
+	}
+	if (length == 0)
+	{
+		Fail(L"a track has no End of Track event");
+		return;
+	}
+	m_runningStatus = 0;
+	m_endOfTrack = false;
+	m_state = STATE_DELTA_TIME;
+}
+
+// Seven bits to a byte, as in ReadVarLen. m_valueBytes is back to 0 once the last is read.
+void SmfValidator::ReadVarLenByte(BYTE b, const wchar_t* tooLong)
+{
+	if (m_valueBytes == 0)
+	{
+		m_value = 0;
+	}
+	m_value = (m_value << 7) | (b & 0x7F);
+	if ((b & 0x80) == 0)
+	{
+		m_valueBytes = 0;
+	}
+	else if (++m_valueBytes == 4)
+	{
+		Fail(tooLong);
+	}
+}
+
+void SmfValidator::EndEvent()
+{
+	if (m_endOfTrack)
+	{
+		if (m_remaining != 0)
+		{
+			Fail(L"a track goes on after its End of Track event");
+			return;
+		}
+		m_state = (++m_tracksRead == m_trackCount) ? STATE_DONE : STATE_CHUNK_HEADER;
+	}
+	else if (m_remaining == 0)
+	{
+		Fail(L"a track has no End of Track event");
+	}
+	else
+	{
+		m_state = STATE_DELTA_TIME;
+	}
+}
+
+void SmfValidator::Fail(const wchar_t* problem)
+{
+	m_problem = problem;
+	m_problemOffset = m_offset - 1; // The last byte read
+}
+
+bool CheckSmfVerdict(const SmfValidator& validator, const std::wstring& path, SmfValidation policy)
+{
+	StatAdd(STAT_MIDI_FILES_VALIDATED);
+	std::wstring problem;
+	if (validator.Finish(problem))
+	{
+		return true;
+	}
+	StatAdd(STAT_MIDI_FILES_INVALID);
+
+	// One write per line so that lines from different builders don't interleave
+	if (policy == SMF_VALIDATE_REJECT)
+	{
+		std::wcerr << (L"Invalid MIDI file: " + path + L": " + problem + L"\n");
+		return false;
+	}
+	std::wcerr << (L"Warning: Invalid MIDI file: " + path + L": " + problem + L"\n");
+	return true;
+}
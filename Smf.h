@@ -0,0 +1,92 @@
+#pragma once
+
+// Standard MIDI Files (SMF)
+
+const BYTE SMF_META_END_OF_TRACK = 0x2F;
+const BYTE SMF_META_TEMPO = 0x51;
+
+// What MinimizeSmf keeps besides the channel messages, tempo changes and the end of the song.
+// Sysex is kept unless told otherwise since it can set up the instruments (e.g. a GM or GS reset).
+struct SmfMinimizeOptions
+{
+	bool keepSysex = true;
+	std::bitset<128> keepMeta; // By meta event type (e.g. 0x03 for track names)
+};
+
+// Rewrite a format 0 or 1 SMF in the fewest bytes that play the same: all tracks merged into
+// one (format 0), running status wherever it applies, Note Offs with the default release
+// velocity sent as Note Ons of velocity 0 so that running status carries across them, delta
+// times in as few bytes as they go, and without the sysex and meta events options doesn't
+// keep. The time of a dropped event is added to the next one kept. One pass is made over the
+// data, merging the tracks as it goes.
+// Returns false, with out empty, if the data can't be read as such a file to the end.
+extern bool MinimizeSmf(const BYTE* pData, size_t size, const SmfMinimizeOptions& options, std::vector<BYTE>& out);
+
+// Whether a file that starts with these bytes is one MinimizeSmf might rewrite: a format 0 or 1
+// SMF. It stores anything else as it is. The first SMF_HEADER_SIZE bytes of a file are enough.
+const size_t SMF_HEADER_SIZE = 14; // The MThd chunk's type, length, format, track count and timing
+extern bool IsMinimizableSmf(const BYTE* pData, size_t size);
+
+// What to do with a MIDI file that SmfValidator finds fault with
+enum SmfValidation
+{
+	SMF_VALIDATE_NONE,
+	SMF_VALIDATE_WARN, // Report it and store it anyway
+	SMF_VALIDATE_REJECT, // Report it and fail the build
+};
+
+// Checks that a file is an SMF a player can read: an MThd header that makes sense, every chunk
+// within the file, as many MTrk chunks as the header says, and each track a run of well-formed
+// events ending in an End of Track. The data can be given in pieces of any size, in order, so
+// it's checked wherever it lands as it's read rather than by reading it again.
+class SmfValidator
+{
+public:
+	explicit SmfValidator(ULONGLONG fileSize) : m_fileSize(fileSize) {}
+
+	void Add(const BYTE* pData, size_t size);
+
+	// After the last of the data. Returns false, with what's wrong in problem, if it isn't valid.
+	bool Finish(std::wstring& problem) const;
+
+private:
+	enum State
+	{
+		STATE_HEADER, // The MThd chunk's type, length and fields
+		STATE_CHUNK_HEADER, // The type and length of the next chunk
+		STATE_SKIP, // The rest of a chunk that isn't a track
+		STATE_DELTA_TIME,
+		STATE_STATUS,
+		STATE_DATA, // Of a channel message
+		STATE_META_TYPE,
+		STATE_LENGTH, // Of a sysex or meta event
+		STATE_BODY, // Of a sysex or meta event
+		STATE_DONE, // Past the last track. Anything more is ignored, as players do.
+	};
+
+	void StartChunk();
+	void ReadVarLenByte(BYTE b, const wchar_t* tooLong);
+	void EndEvent();
+	void Fail(const wchar_t* problem);
+
+	ULONGLONG m_fileSize;
+	ULONGLONG m_offset = 0; // Of the next byte
+	State m_state = STATE_HEADER;
+	BYTE m_header[14]; // A chunk's type and length, and for MThd its fields
+	size_t m_headerBytes = 0;
+	DWORD m_trackCount = 0;
+	DWORD m_tracksRead = 0;
+	DWORD m_remaining = 0; // In the chunk
+	DWORD m_value = 0; // The variable length quantity being read, or sysex or meta bytes left
+	int m_valueBytes = 0;
+	int m_dataBytes = 0; // Left in a channel message
+	BYTE m_runningStatus = 0;
+	BYTE m_metaType = 0; // 0x80 for a sysex event
+	bool m_endOfTrack = false;
+	const wchar_t* m_problem = NULL;
+	ULONGLONG m_problemOffset = 0;
+};
+
+// Count a file that validator has checked and report it if it isn't valid, as policy says.
+// Returns false if it's rejected.
+extern bool CheckSmfVerdict(const SmfValidator& validator, const std::wstring& path, SmfValidation policy);
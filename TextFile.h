@@ -0,0 +1,5 @@
+#pragma once
+
+// Whole-file UTF-8 text I/O. A byte order mark is skipped on reading and never written.
+extern bool TextFileRead(std::wstring filename, std::wstring& text);
+extern bool TextFileWrite(std::wstring filename, const std::wstring& text, bool overwrite);
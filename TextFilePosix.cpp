@@ -0,0 +1,78 @@
+#if !defined(_WIN32)
+
+#include <iostream>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "TextFile.h"
+#include "BlockDevice.h"
+
+bool TextFileRead(std::wstring filename, std::wstring& wtext)
+{
+	int fd = open(ToUtf8(filename).c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		std::wcerr << L"Failed to open file: " << filename << L": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	std::string text;
+	char buffer[0x4000];
+	for (;;)
+	{
+		ssize_t count = read(fd, buffer, sizeof(buffer));
+		if (count < 0 && errno == EINTR) continue;
+		if (count < 0)
+		{
+			int error = errno;
+			close(fd);
+			std::wcerr << L"Failed to read file: " << filename << L": " << strerror(error) << std::endl;
+			return false;
+		}
+		if (count == 0) break;
+		text.append(buffer, (size_t)count);
+	}
+	close(fd);
+
+	// Skip the UTF-8 byte order mark, if any
+	size_t start = (text.compare(0, 3, "\xEF\xBB\xBF") == 0) ? 3 : 0;
+	wtext = FromUtf8(text.substr(start));
+	return true;
+}
+
+bool TextFileWrite(std::wstring filename, const std::wstring& wtext, bool overwrite)
+{
+	std::string text = ToUtf8(wtext);
+
+	int fd = open(ToUtf8(filename).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (overwrite ? O_TRUNC : O_EXCL), 0666);
+	if (fd < 0)
+	{
+		std::wcerr << L"Failed to open file: " << filename << L": " << strerror(errno) << std::endl;
+		return false;
+	}
+	size_t done = 0;
+	while (done < text.size())
+	{
+		ssize_t count = write(fd, text.data() + done, text.size() - done);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0)
+		{
+			int error = (count < 0) ? errno : EIO;
+			close(fd);
+			std::wcerr << L"Failed to write file: " << filename << L": " << strerror(error) << std::endl;
+			return false;
+		}
+		done += (size_t)count;
+	}
+	if (close(fd) != 0)
+	{
+		std::wcerr << L"Failed to write file: " << filename << L": " << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,84 @@
+#if defined(_WIN32)
+
+#include <iostream>
+#include <string>
+#include <windows.h>
+
+#include "TextFile.h"
+#include "WinHelp.h"
+
+bool TextFileRead(std::wstring filename, std::wstring& wtext)
+{
+	HANDLE hFile = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		std::wcerr << L"Failed to open file: " << filename << std::endl;
+		ReportError(GetLastError());
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(hFile, &fileSize))
+	{
+		DWORD hResult = GetLastError();
+		CloseHandle(hFile);
+		std::wcerr << L"Failed to get file size: " << filename << std::endl;
+		ReportError(hResult);
+		return false;
+	}
+
+	std::string text((size_t)fileSize.QuadPart, '\0');
+	DWORD bytesRead = 0;
+	if (!text.empty() && !ReadFile(hFile, &text[0], (DWORD)text.size(), &bytesRead, NULL))
+	{
+		DWORD hResult = GetLastError();
+		CloseHandle(hFile);
+		std::wcerr << L"Failed to read file: " << filename << std::endl;
+		ReportError(hResult);
+		return false;
+	}
+	CloseHandle(hFile);
+	text.resize(bytesRead);
+
+	// Skip the UTF-8 byte order mark, if any
+	size_t start = (text.compare(0, 3, "\xEF\xBB\xBF") == 0) ? 3 : 0;
+
+	// Convert to UTF-16
+	wtext.clear();
+	if (text.size() > start)
+	{
+		int len = MultiByteToWideChar(CP_UTF8, 0, text.c_str() + start, (int)(text.size() - start), NULL, 0);
+		wtext.resize(len);
+		MultiByteToWideChar(CP_UTF8, 0, text.c_str() + start, (int)(text.size() - start), &wtext[0], len);
+	}
+	return true;
+}
+
+bool TextFileWrite(std::wstring filename, const std::wstring& wtext, bool overwrite)
+{
+	// Convert to UTF-8
+	int len = WideCharToMultiByte(CP_UTF8, 0, wtext.c_str(), (int)wtext.length(), NULL, 0, NULL, NULL);
+	std::string text(len, '\0');
+	WideCharToMultiByte(CP_UTF8, 0, wtext.c_str(), (int)wtext.length(), &text[0], len, NULL, NULL);
+
+	HANDLE hFile = CreateFileW(filename.c_str(), GENERIC_WRITE, 0, NULL, overwrite ? CREATE_ALWAYS : CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		std::wcerr << L"Failed to open file: " << filename << std::endl;
+		ReportError(GetLastError());
+		return false;
+	}
+	DWORD bytesWritten;
+	if (!WriteFile(hFile, text.c_str(), (DWORD)text.size(), &bytesWritten, NULL) || bytesWritten != text.size())
+	{
+		DWORD hResult = GetLastError();
+		CloseHandle(hFile);
+		std::wcerr << L"Failed to write file: " << filename << std::endl;
+		ReportError(hResult);
+		return false;
+	}
+	CloseHandle(hFile);
+	return true;
+}
+
+#endif
@@ -1,66 +1,133 @@
 #include <iostream>
+#include <string>
 #include <windows.h>
 
-#include "ThumbDriveImage.h"
 #include "FloppyImage.h"
+#include "ThumbDriveImage.h"
+#include "BlockDevice.h"
+#include "FileCopy.h"
+#include "ZeroScan.h"
 #include "WinHelp.h"
 
-HANDLE OpenVolumeAndVerify(wchar_t driveLetter);
-bool HasFloppyImageHeader(LPBYTE pBuffer);
-bool HasFloppyImageHeader(HANDLE hVolume, int imageNum);
+// Delta writes compare and write in whole pages so that writes stay aligned for unbuffered I/O
+const size_t DELTA_CHUNK_SIZE = 0x1000;
+
+bool HasFloppyImageHeader(BlockDevice* pDrive, int imageNum);
+bool WriteBlocksSparse(BlockDevice* pDrive, int imageNum, LPBYTE pImage);
+template <class Geometry = Floppy1440K>
+ULONGLONG ImagePosition(int imageNum, size_t offset);
 
-bool ThumbDriveRead(wchar_t driveLetter, int imageNum, LPBYTE pImage)
+bool ThumbDriveRead(const std::wstring& drive, int imageNum, LPBYTE pImage)
 {
-	HANDLE hVolume = OpenVolumeAndVerify(driveLetter);
-	if (hVolume == INVALID_HANDLE_VALUE)
+	BlockDevice* pDrive = ThumbDriveOpen(drive, BLOCK_DEVICE_READ);
+	if (pDrive == NULL)
 	{
 		// Error has already been reported
 		return false;
 	}
 
-	bool result = true;
+	bool result = ThumbDriveReadImage(pDrive, imageNum, pImage);
+	if (!result)
+	{
+		std::wcerr << L"Drive " << drive << L": image " << imageNum << std::endl;
+	}
 
+	ThumbDriveClose(pDrive);
+	return result;
+}
+
+bool ThumbDriveReadImage(BlockDevice* pDrive, int imageNum, LPBYTE pImage)
+{
 	// Read the image
-	LARGE_INTEGER pos;
-	pos.QuadPart = FLOPPY_IMAGE_INTERVAL * imageNum;
-	if (!SetFilePointerEx(hVolume, pos, NULL, FILE_BEGIN))
+	if (!ThumbDriveReadBlocks(pDrive, imageNum, 0, FLOPPY_IMAGE_SIZE, pImage))
 	{
-		std::wcerr << L"Failed to set read position on volume." << std::endl;
-		ReportError(GetLastError());
-		result = false;
-		goto finally;
+		return false; // Error already reported
 	}
 
-	DWORD bytesRead;
-	if (!ReadFile(hVolume, pImage, FLOPPY_IMAGE_SIZE, &bytesRead, NULL))
+	// Check whether this is a 1.44 MB floppy boot sector
+	if (!HasFloppyImageHeader(pImage))
 	{
-		std::wcerr << L"Failed to read full image from volume." << std::endl;
-		ReportError(GetLastError());
-		result = false;
-		goto finally;
+		std::wcerr << L"Invalid header on floppy image." << std::endl;
+		return false;
 	}
 
-	if (bytesRead != FLOPPY_IMAGE_SIZE)
+	return true;
+}
+
+bool ThumbDriveReadBlocks(BlockDevice* pDrive, int imageNum, size_t offset, size_t length, LPBYTE pBuffer)
+{
+	return pDrive->Read(ImagePosition(imageNum, offset), length, pBuffer);
+}
+
+template <class Geometry>
+int ThumbDriveImageCount(BlockDevice* pDrive)
+{
+	// The last slot only needs room for the image, not the full interval
+	ULONGLONG length = pDrive->Size();
+	if (length < Geometry::IMAGE_SIZE) return 0;
+	return (int)((length - Geometry::IMAGE_SIZE) / Geometry::IMAGE_INTERVAL) + 1;
+}
+
+template int ThumbDriveImageCount<Floppy720K>(BlockDevice* pDrive);
+template int ThumbDriveImageCount<Floppy1200K>(BlockDevice* pDrive);
+template int ThumbDriveImageCount<Floppy1440K>(BlockDevice* pDrive);
+template int ThumbDriveImageCount<Floppy2880K>(BlockDevice* pDrive);
+
+bool ThumbDriveWrite(const std::wstring& drive, int imageNum, LPBYTE pImage, DeltaStats* pDeltaStats)
+{
+	// Image 0 holds the volume's boot sector so it must be written with the volume locked
+	BlockDevice* pDrive = ThumbDriveOpen(drive, (imageNum == 0) ? BLOCK_DEVICE_WRITE_EXCLUSIVE : BLOCK_DEVICE_WRITE);
+	if (pDrive == NULL)
 	{
-		std::wcerr << L"Failed to read full floppy image from thumb drive." << std::endl;
-		result = false;
-		goto finally;
+		// Error has already been reported
+		return false;
 	}
 
-	// Check whether this is a 1.44 MB floppy boot sector
-	if (!HasFloppyImageHeader(pImage))
+	bool result;
+	if (pDeltaStats != NULL)
 	{
-		std::wcerr << L"Invalid header on floppy image. Drive " << driveLetter << L": image " << imageNum << std::endl;
-		result = false;
-		goto finally;
+		LPBYTE pExisting = (LPBYTE)VirtualAlloc(NULL, FLOPPY_IMAGE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (pExisting == NULL)
+		{
+			std::wcerr << L"Failed to allocate buffer." << std::endl;
+			result = false;
+		}
+		else
+		{
+			result = ThumbDriveWriteImageDelta(pDrive, imageNum, pImage, pExisting, pDeltaStats);
+			VirtualFree(pExisting, 0, MEM_RELEASE);
+		}
+	}
+	else
+	{
+		result = ThumbDriveWriteImage(pDrive, imageNum, pImage);
 	}
 
-finally:
-	CloseHandle(hVolume);
+	ThumbDriveClose(pDrive);
 	return result;
 }
 
-bool ThumbDriveWrite(wchar_t driveLetter, int imageNum, LPBYTE pImage)
+BlockDevice* ThumbDriveOpen(const std::wstring& drive, BlockDeviceAccess access)
+{
+	// Writing image 0 requires that the volume be locked and force dismounted
+	BlockDevice* pDrive = BlockDeviceOpen(drive, access);
+	if (pDrive == NULL)
+	{
+		// Error has already been reported
+		return NULL;
+	}
+
+	if (!HasFloppyImageHeader(pDrive, 0))
+	{
+		std::wcerr << L"Drive: " << drive << L" is not a set of floppy images." << std::endl;
+		delete pDrive;
+		return NULL;
+	}
+
+	return pDrive;
+}
+
+bool ThumbDriveWriteImage(BlockDevice* pDrive, int imageNum, LPBYTE pImage)
 {
 	// Make sure this is a valid image being written
 	if (!HasFloppyImageHeader(pImage))
@@ -69,136 +136,233 @@ bool ThumbDriveWrite(wchar_t driveLetter, int imageNum, LPBYTE pImage)
 		return false;
 	}
 
-	HANDLE hVolume = OpenVolumeAndVerify(driveLetter);
-	if (hVolume == INVALID_HANDLE_VALUE)
+	// Check that there's a valid floppy image at the destination
+	// Image 0 was checked when the drive was opened
+	if (imageNum != 0 && !HasFloppyImageHeader(pDrive, imageNum))
 	{
-		// Error has already been reported
+		std::wcerr << L"Destination image number (" << imageNum << ") is not a valid floppy image." << std::endl;
 		return false;
 	}
 
-	bool result = true;
+	// Write the image
+	if (pDrive->IsSparse())
+	{
+		return WriteBlocksSparse(pDrive, imageNum, pImage);
+	}
+	return ThumbDriveWriteBlocks(pDrive, imageNum, 0, FLOPPY_IMAGE_SIZE, pImage);
+}
 
-	// If destination image is zero, lock the volume and force dismount
-	if (imageNum == 0)
+bool ThumbDriveWriteImageDelta(BlockDevice* pDrive, int imageNum, LPBYTE pImage, LPBYTE pExisting, DeltaStats* pStats)
+{
+	// Make sure this is a valid image being written
+	if (!HasFloppyImageHeader(pImage))
 	{
-		// Lock the volumne
-		DWORD bytesReturned;
-		if (!DeviceIoControl(hVolume, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &bytesReturned, NULL))
-		{
-			std::wcerr << L"Failed to lock volume." << std::endl;
-			ReportError(GetLastError());
-			result = false;
-			goto finally;
-		}
+		std::wcerr << L"Source image is not a valid floppy image." << std::endl;
+		return false;
+	}
 
-		// Force-Dismount the volume
-		if (!DeviceIoControl(hVolume, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &bytesReturned, NULL))
-		{
-			std::wcerr << L"Failed to dismount volume." << std::endl;
-			ReportError(GetLastError());
-			result = false;
-			goto finally;
-		}
+	// Read what's there now
+	if (!ThumbDriveReadBlocks(pDrive, imageNum, 0, FLOPPY_IMAGE_SIZE, pExisting))
+	{
+		return false; // Error already reported
 	}
 
 	// Check that there's a valid floppy image at the destination
-	// Image 0 has already been checked
-	if (imageNum != 0 && !HasFloppyImageHeader(hVolume, imageNum))
+	if (!HasFloppyImageHeader(pExisting))
 	{
 		std::wcerr << L"Destination image number (" << imageNum << ") is not a valid floppy image." << std::endl;
-		result = false;
-		goto finally;
+		return false;
 	}
 
-	// Write the image
-	LARGE_INTEGER pos;
-	pos.QuadPart = FLOPPY_IMAGE_INTERVAL * imageNum;
-	if (!SetFilePointerEx(hVolume, pos, NULL, FILE_BEGIN))
+	// Write each run of changed chunks with a single write
+	bool result = true;
+	size_t runStart = 0;
+	size_t runLength = 0;
+	for (size_t offset = 0; offset <= FLOPPY_IMAGE_SIZE; offset += DELTA_CHUNK_SIZE)
 	{
-		std::wcerr << L"Failed to set position on volume." << std::endl;
-		ReportError(GetLastError());
-		result = false;
-		goto finally;
+		if (offset < FLOPPY_IMAGE_SIZE && 0 != memcmp(pImage + offset, pExisting + offset, DELTA_CHUNK_SIZE))
+		{
+			if (runLength == 0) runStart = offset;
+			runLength += DELTA_CHUNK_SIZE;
+			continue;
+		}
+		if (runLength > 0)
+		{
+			if (!ThumbDriveWriteBlocks(pDrive, imageNum, runStart, runLength, pImage + runStart))
+			{
+				result = false;
+				break;
+			}
+			pStats->bytesWritten += runLength;
+			runLength = 0;
+		}
+		if (offset < FLOPPY_IMAGE_SIZE) pStats->bytesSkipped += DELTA_CHUNK_SIZE;
 	}
 
-	DWORD bytesWritten;
-	if (!WriteFile(hVolume, pImage, FLOPPY_IMAGE_SIZE, &bytesWritten, NULL))
-	{
-		std::wcerr << L"Failed to write image." << std::endl;
-		ReportError(GetLastError());
-		result = false;
-		goto finally;
-	}
+	return result;
+}
 
-	if (bytesWritten != FLOPPY_IMAGE_SIZE)
+bool ThumbDriveWriteBlocks(BlockDevice* pDrive, int imageNum, size_t offset, size_t length, LPBYTE pBuffer)
+{
+	if (!pDrive->Write(ImagePosition(imageNum, offset), length, pBuffer))
 	{
-		std::wcerr << L"Failed to write full floppy image to thumb drive." << std::endl;
-		result = false;
-		goto finally;
+		std::wcerr << L"Failed to write image " << imageNum << L"." << std::endl;
+		return false;
 	}
+	return true;
+}
 
-finally:
-	// If destination is image 0, unlock the volume
-	if (imageNum == 0)
+// Write runs of data and leave runs of zeros as holes. A mostly empty image then
+// takes up, and costs to write, little more than the files on it.
+bool WriteBlocksSparse(BlockDevice* pDrive, int imageNum, LPBYTE pImage)
+{
+	size_t runStart = 0;
+	bool runIsZero = IsAllZero(pImage, ZERO_CHUNK_SIZE);
+	for (size_t offset = ZERO_CHUNK_SIZE; offset <= FLOPPY_IMAGE_SIZE; offset += ZERO_CHUNK_SIZE)
 	{
-		DWORD bytesReturned;
-		if (!DeviceIoControl(hVolume, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &bytesReturned, NULL))
+		bool isZero = (offset < FLOPPY_IMAGE_SIZE) && IsAllZero(pImage + offset, ZERO_CHUNK_SIZE);
+		if (offset < FLOPPY_IMAGE_SIZE && isZero == runIsZero) continue;
+
+		// End of a run
+		if (runIsZero)
 		{
-			std::wcerr << L"Failed to unlock volume." << std::endl;
-			ReportError(GetLastError());
+			if (!pDrive->WriteZeros(ImagePosition(imageNum, runStart), offset - runStart))
+			{
+				std::wcerr << L"Failed to write image " << imageNum << L"." << std::endl;
+				return false;
+			}
 		}
+		else if (!ThumbDriveWriteBlocks(pDrive, imageNum, runStart, offset - runStart, pImage + runStart))
+		{
+			return false; // Error already reported
+		}
+		runStart = offset;
+		runIsZero = isZero;
 	}
+	return true;
+}
 
-	return result;
+bool ThumbDriveFlush(BlockDevice* pDrive)
+{
+	return pDrive->Flush();
+}
+
+bool ThumbDriveDropCache(BlockDevice* pDrive, int imageNum)
+{
+	return pDrive->DropCache(ImagePosition(imageNum, 0), FLOPPY_IMAGE_SIZE);
 }
 
+bool ThumbDriveCopyImageFile(const std::wstring& drive, int imageNum, const std::wstring& srcPath, bool* pCopied)
+{
+	*pCopied = false;
+
+	// Only a drive image file can be the target of a file copy, not a volume
+	if (drive.length() == 1) return true;
+
+	// Check the destination as ThumbDriveWriteImage would
+	BlockDevice* pDrive = ThumbDriveOpen(drive, BLOCK_DEVICE_READ);
+	if (pDrive == NULL)
+	{
+		return false; // Error already reported
+	}
+	bool valid = ThumbDriveImageCount(pDrive) > imageNum && HasFloppyImageHeader(pDrive, imageNum);
+	ThumbDriveClose(pDrive);
+	if (!valid)
+	{
+		std::wcerr << L"Destination image number (" << imageNum << ") is not a valid floppy image." << std::endl;
+		return false;
+	}
+
+	*pCopied = FileCopyRange(srcPath, drive, ImagePosition(imageNum, 0), FLOPPY_IMAGE_SIZE);
+	return true;
+}
+
+void ThumbDriveClose(BlockDevice* pDrive)
+{
+	// Unlocks the volume if it was locked
+	delete pDrive;
+}
+
+template <class Geometry>
+ULONGLONG ImagePosition(int imageNum, size_t offset)
+{
+	return (ULONGLONG)Geometry::IMAGE_INTERVAL * imageNum + offset;
+}
+
+template <class Geometry>
 bool HasFloppyImageHeader(LPBYTE pBuffer)
 {
 	// Magic number at the end of the sector
 	if (FLOPPY_MAGIC_NUMBER != *(WORD*)(pBuffer + 0x01FE)) return false;
 
 	// Number of bytes per block
-	if (FLOPPY_BLOCK_SIZE != *(WORD*)(pBuffer + 0x0b)) return false;
+	if (Geometry::BLOCK_SIZE != *(WORD*)(pBuffer + BPB_BLOCK_SIZE_OFFSET)) return false;
+
+	// Blocks per allocation unit
+	if (Geometry::BLOCKS_PER_AU != *(pBuffer + BPB_BLOCKS_PER_AU_OFFSET)) return false;
 
-	// One block per allocation unit
-	if (FLOPPY_BLOCKS_PER_AU != *(pBuffer + 0x0D)) return false;
+	// Blocks on the disk (2880 for a 1.44 MB floppy)
+	if (Geometry::BLOCKS_PER_DISK != *(WORD*)(pBuffer + BPB_BLOCKS_PER_DISK_OFFSET)) return false;
 
-	// 2880 blocks on the disk (1.4MB floppy)
-	if (FLOPPY_BLOCKS_PER_DISK != *(WORD*)(pBuffer + 0x13)) return false;
+	// Everything else the layout depends on
+	if (1 != *(WORD*)(pBuffer + BPB_RESERVED_BLOCKS_OFFSET)) return false;
+	if (2 != *(pBuffer + BPB_FAT_COUNT_OFFSET)) return false;
+	if (Geometry::ROOT_DIR_ENTRIES != *(WORD*)(pBuffer + BPB_ROOT_DIR_ENTRIES_OFFSET)) return false;
+	if (Geometry::BLOCKS_PER_FAT != *(WORD*)(pBuffer + BPB_BLOCKS_PER_FAT_OFFSET)) return false;
 
 	return true;
 }
 
-bool HasFloppyImageHeader(HANDLE hVolume, int imageNum)
+template bool HasFloppyImageHeader<Floppy720K>(LPBYTE pBuffer);
+template bool HasFloppyImageHeader<Floppy1200K>(LPBYTE pBuffer);
+template bool HasFloppyImageHeader<Floppy1440K>(LPBYTE pBuffer);
+template bool HasFloppyImageHeader<Floppy2880K>(LPBYTE pBuffer);
+
+FloppyFormat GetFloppyFormat(LPBYTE pBootSector)
 {
-	// Allocate a page-aligned buffer for reading and writing
-	LPBYTE pBuffer = (LPBYTE)VirtualAlloc(NULL, FLOPPY_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-	if (pBuffer == NULL)
+	if (HasFloppyImageHeader<Floppy1440K>(pBootSector)) return FLOPPY_FORMAT_1440K;
+	if (HasFloppyImageHeader<Floppy720K>(pBootSector)) return FLOPPY_FORMAT_720K;
+	if (HasFloppyImageHeader<Floppy1200K>(pBootSector)) return FLOPPY_FORMAT_1200K;
+	if (HasFloppyImageHeader<Floppy2880K>(pBootSector)) return FLOPPY_FORMAT_2880K;
+	return FLOPPY_FORMAT_UNKNOWN;
+}
+
+size_t GetFloppyImageSize(FloppyFormat format)
+{
+	switch (format)
 	{
-		std::wcerr << L"Failed to allocate buffer." << std::endl;
-		return false;
+	case FLOPPY_FORMAT_720K: return Floppy720K::IMAGE_SIZE;
+	case FLOPPY_FORMAT_1200K: return Floppy1200K::IMAGE_SIZE;
+	case FLOPPY_FORMAT_1440K: return Floppy1440K::IMAGE_SIZE;
+	case FLOPPY_FORMAT_2880K: return Floppy2880K::IMAGE_SIZE;
+	default: return 0;
 	}
+}
 
-	LARGE_INTEGER pos;
-	pos.QuadPart = FLOPPY_IMAGE_INTERVAL * imageNum;
-	if (!SetFilePointerEx(hVolume, pos, NULL, FILE_BEGIN))
+const wchar_t* GetFloppyFormatName(FloppyFormat format)
+{
+	switch (format)
 	{
-		ReportError(GetLastError());
-		VirtualFree(pBuffer, 0, MEM_RELEASE);
-		return false;
+	case FLOPPY_FORMAT_720K: return L"720K";
+	case FLOPPY_FORMAT_1200K: return L"1.2M";
+	case FLOPPY_FORMAT_1440K: return L"1.44M";
+	case FLOPPY_FORMAT_2880K: return L"2.88M";
+	default: return L"unknown";
 	}
+}
 
-	DWORD bytesRead;
-	if (!ReadFile(hVolume, pBuffer, FLOPPY_BLOCK_SIZE, &bytesRead, NULL))
+bool HasFloppyImageHeader(BlockDevice* pDrive, int imageNum)
+{
+	// Allocate a page-aligned buffer for reading and writing
+	LPBYTE pBuffer = (LPBYTE)VirtualAlloc(NULL, FLOPPY_BLOCK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (pBuffer == NULL)
 	{
-		ReportError(GetLastError());
-		VirtualFree(pBuffer, 0, MEM_RELEASE);
+		std::wcerr << L"Failed to allocate buffer." << std::endl;
 		return false;
 	}
 
-	if (bytesRead != FLOPPY_BLOCK_SIZE)
+	if (!ThumbDriveReadBlocks(pDrive, imageNum, 0, FLOPPY_BLOCK_SIZE, pBuffer))
 	{
-		std::wcerr << L"Failed to read full first block from floppy image." << std::endl;
 		VirtualFree(pBuffer, 0, MEM_RELEASE);
 		return false;
 	}
@@ -209,38 +373,3 @@ bool HasFloppyImageHeader(HANDLE hVolume, int imageNum)
 	VirtualFree(pBuffer, 0, MEM_RELEASE);
 	return result;
 }
-
-HANDLE OpenVolumeAndVerify(wchar_t driveLetter)
-{
-	// Open the designated volume
-	WCHAR volname[] = L"\\\\.\\X:";
-	volname[4] = driveLetter;
-	HANDLE hVolume = CreateFile(volname, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
-	if (hVolume == INVALID_HANDLE_VALUE)
-	{
-		std::wcerr << L"Failed to open source drive: " << driveLetter << L":" << std::endl;
-		ReportError(GetLastError());
-		return INVALID_HANDLE_VALUE;
-	}
-
-	// Allow reading and writing beyond the first virtual floppy
-	{
-		DWORD bytesReturned;
-		if (!DeviceIoControl(hVolume, FSCTL_ALLOW_EXTENDED_DASD_IO, NULL, 0, NULL, 0, &bytesReturned, NULL))
-		{
-			std::wcerr << L"Failed to set extended access on drive: " << driveLetter << L":" << std::endl;
-			ReportError(GetLastError());
-			CloseHandle(hVolume);
-			return INVALID_HANDLE_VALUE;
-		}
-	}
-
-	if (!HasFloppyImageHeader(hVolume, 0))
-	{
-		std::wcerr << L"Drive: " << driveLetter << L": is not a set of floppy images." << std::endl;
-		CloseHandle(hVolume);
-		return INVALID_HANDLE_VALUE;
-	}
-
-	return hVolume;
-}
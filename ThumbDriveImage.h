@@ -1,4 +1,42 @@
 #pragma once
 
-extern bool ThumbDriveRead(wchar_t driveLetter, int imageNum, LPBYTE pImage);
-extern bool ThumbDriveWrite(wchar_t driveLetter, int imageNum, LPBYTE pImage);
+#include "BlockDevice.h"
+
+// Running totals for delta writes
+struct DeltaStats
+{
+	ULONGLONG bytesWritten;
+	ULONGLONG bytesSkipped;
+};
+
+// A drive is named by a drive letter alone (e.g. F), or by the path of a device or of a
+// whole-drive image file. See BlockDeviceOpen.
+extern bool ThumbDriveRead(const std::wstring& drive, int imageNum, LPBYTE pImage);
+// With pDeltaStats, only the parts of the image that differ from what's on the drive are written
+extern bool ThumbDriveWrite(const std::wstring& drive, int imageNum, LPBYTE pImage, DeltaStats* pDeltaStats = NULL);
+
+// Multi-image access: Open the drive once, read or write any number of images, then close.
+// Open for BLOCK_DEVICE_WRITE_EXCLUSIVE when image 0 is among those to be written.
+extern BlockDevice* ThumbDriveOpen(const std::wstring& drive, BlockDeviceAccess access);
+extern bool ThumbDriveReadImage(BlockDevice* pDrive, int imageNum, LPBYTE pImage);
+extern bool ThumbDriveWriteImage(BlockDevice* pDrive, int imageNum, LPBYTE pImage);
+// pBuffer takes what's on the drive now: FLOPPY_IMAGE_SIZE bytes, page aligned
+extern bool ThumbDriveWriteImageDelta(BlockDevice* pDrive, int imageNum, LPBYTE pImage, LPBYTE pBuffer, DeltaStats* pStats);
+extern bool ThumbDriveFlush(BlockDevice* pDrive);
+// Before reading back an image to check it: see BlockDevice::DropCache
+extern bool ThumbDriveDropCache(BlockDevice* pDrive, int imageNum);
+extern void ThumbDriveClose(BlockDevice* pDrive);
+
+// Read or write part of an image. Offset and length must be multiples of FLOPPY_BLOCK_SIZE
+// and the buffer page aligned since the drive is opened without buffering.
+extern bool ThumbDriveReadBlocks(BlockDevice* pDrive, int imageNum, size_t offset, size_t length, LPBYTE pBuffer);
+extern bool ThumbDriveWriteBlocks(BlockDevice* pDrive, int imageNum, size_t offset, size_t length, LPBYTE pBuffer);
+
+// Copy a checked image file into a slot of a drive image file without reading it into memory.
+// Returns false on error. Otherwise *pCopied says whether it was done; if not (a volume, or
+// a file system that can't copy within the kernel) write the image the ordinary way.
+extern bool ThumbDriveCopyImageFile(const std::wstring& drive, int imageNum, const std::wstring& srcPath, bool* pCopied);
+
+// Number of whole image slots of a format (1.44 MB unless specified) that fit on the drive
+template <class Geometry = Floppy1440K>
+int ThumbDriveImageCount(BlockDevice* pDrive);
@@ -0,0 +1,16 @@
+#pragma once
+
+// The Windows integer types that the image code is written in. Modules that also build
+// without Windows (those of the kernel benchmark, see CMakeLists.txt) include this in
+// place of windows.h.
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <cstdint>
+typedef uint8_t BYTE;
+typedef BYTE* LPBYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// A blocking queue for handing work between threads. With a capacity, Push waits
+// while the queue is full so that a fast producer can't run ahead of its consumers.
+template <typename T>
+class WorkQueue
+{
+public:
+	explicit WorkQueue(size_t capacity = 0) : m_capacity(capacity) {}
+
+	// Returns false, without queueing, if the queue has been closed.
+	bool Push(T item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_notFull.wait(lock, [this] { return m_closed || m_capacity == 0 || m_items.size() < m_capacity; });
+		if (m_closed) return false;
+		m_items.push_back(std::move(item));
+		m_notEmpty.notify_one();
+		return true;
+	}
+
+	// Returns false once the queue has been closed and everything in it taken.
+	bool Pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_notEmpty.wait(lock, [this] { return m_closed || !m_items.empty(); });
+		if (m_items.empty()) return false;
+		item = std::move(m_items.front());
+		m_items.pop_front();
+		m_notFull.notify_one();
+		return true;
+	}
+
+	// No more items will be pushed. Waiting consumers drain what's left and then stop.
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = true;
+		m_notEmpty.notify_all();
+		m_notFull.notify_all();
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_notEmpty;
+	std::condition_variable m_notFull;
+	std::deque<T> m_items;
+	size_t m_capacity;
+	bool m_closed = false;
+};
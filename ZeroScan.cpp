@@ -0,0 +1,104 @@
+#include <cstring>
+#include <cstdint>
+
+#include "ZeroScan.h"
+#include "CpuFeatures.h"
+
+#if defined(CPU_X86)
+#include <immintrin.h>
+#elif defined(CPU_ARM64)
+#include <arm_neon.h>
+#endif
+
+typedef bool(*ZeroScanKernel)(const unsigned char* pData, size_t length);
+
+static ZeroScanKernel SelectZeroScanKernel();
+
+bool IsAllZero(const void* pData, size_t length)
+{
+	static const ZeroScanKernel kernel = SelectZeroScanKernel();
+	return kernel((const unsigned char*)pData, length);
+}
+
+// === Zero scan kernels ===
+// Each ORs a block of data together and tests the result, so that a buffer of zeros
+// (the common case) costs one test per block rather than one per byte.
+
+static bool IsAllZeroScalar(const unsigned char* pData, size_t length)
+{
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32)
+	{
+		uint64_t words[4];
+		memcpy(words, pData + i, sizeof(words));
+		if (words[0] | words[1] | words[2] | words[3]) return false;
+	}
+	for (; i < length; ++i)
+		if (pData[i]) return false;
+	return true;
+}
+
+#if defined(CPU_X86)
+// SSE2 is part of x64 and of every x86 CPU Windows supports
+static bool IsAllZeroSse2(const unsigned char* pData, size_t length)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 64 <= length; i += 64)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(pData + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(pData + i + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(pData + i + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*)(pData + i + 48));
+		__m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xFFFF) return false;
+	}
+	return IsAllZeroScalar(pData + i, length - i);
+}
+
+CPU_TARGET("avx2")
+static bool IsAllZeroAvx2(const unsigned char* pData, size_t length)
+{
+	size_t i = 0;
+	for (; i + 128 <= length; i += 128)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(pData + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(pData + i + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(pData + i + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(pData + i + 96));
+		__m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+		if (!_mm256_testz_si256(any, any)) return false;
+	}
+	return IsAllZeroScalar(pData + i, length - i);
+}
+#endif
+
+#if defined(CPU_ARM64)
+// NEON is part of ARMv8
+static bool IsAllZeroNeon(const unsigned char* pData, size_t length)
+{
+	size_t i = 0;
+	for (; i + 64 <= length; i += 64)
+	{
+		uint8x16_t a = vld1q_u8(pData + i);
+		uint8x16_t b = vld1q_u8(pData + i + 16);
+		uint8x16_t c = vld1q_u8(pData + i + 32);
+		uint8x16_t d = vld1q_u8(pData + i + 48);
+		uint8x16_t any = vorrq_u8(vorrq_u8(a, b), vorrq_u8(c, d));
+		if (vmaxvq_u8(any) != 0) return false;
+	}
+	return IsAllZeroScalar(pData + i, length - i);
+}
+#endif
+
+static ZeroScanKernel SelectZeroScanKernel()
+{
+#if defined(CPU_X86)
+	if (CpuHasAvx2()) return IsAllZeroAvx2;
+	return IsAllZeroSse2;
+#elif defined(CPU_ARM64)
+	return IsAllZeroNeon;
+#else
+	return IsAllZeroScalar;
+#endif
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+
+// Whether a buffer holds nothing but zero bytes, using the widest vectors available.
+// Used to leave runs of zeros as holes in sparse files rather than write them.
+extern bool IsAllZero(const void* pData, size_t length);
+
+// Granularity of zero-run detection when writing. Matches the allocation unit of most
+// file systems, so a zero chunk can become a hole.
+const size_t ZERO_CHUNK_SIZE = 0x1000;